@@ -0,0 +1,107 @@
+/**
+  * \file include/batchloader.h
+  * \brief Contains the definition of the BatchLoader class
+  */
+#ifndef BATCHLOADER_H
+#define BATCHLOADER_H
+
+#include "image.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+  * \enum BatchOrder
+  * \brief Order in which a BatchLoader hands out its results.
+  */
+enum class BatchOrder {
+    /** Same order as the input file list */
+    Input,
+    /** As soon as each file is decoded */
+    Completion
+};
+
+/**
+  * \struct LoadResult
+  * \brief Outcome of loading one file of a batch.
+  */
+template <class I>
+struct LoadResult {
+    /** Index of the file in the input list */
+    size_t index;
+    std::string filename;
+    /** Loaded image, null if loading failed */
+    std::unique_ptr<I> image;
+    /** Error message if loading failed */
+    std::string error;
+};
+
+/**
+  * \class BatchLoader
+  * \brief Decode a list of image files on a pool of worker threads.
+  *
+  * I is any image class with a static load(std::string const&) function.
+  * Decoding starts as soon as the loader is constructed. At most maxInFlight
+  * images are decoded ahead of the consumer, which bounds memory use. Errors
+  * are reported per file and do not stop the batch.
+  */
+template <class I>
+class BatchLoader {
+    public:
+        /**
+          * \brief Start loading a list of files.
+          * \param filenames Files to load
+          * \param order Order in which results are returned by next()
+          * \param threads Number of worker threads, 0 means one per
+          * hardware thread.
+          * \param maxInFlight Maximum number of images decoded but not yet
+          * returned by next(), 0 means twice the number of threads.
+          */
+        BatchLoader(std::vector<std::string> filenames,
+                    BatchOrder order = BatchOrder::Input,
+                    int threads = 0, int maxInFlight = 0);
+
+        /**
+          * \brief Destructor. Pending files are not decoded.
+          */
+        ~BatchLoader();
+
+        BatchLoader(BatchLoader const& other) = delete;
+        BatchLoader& operator=(BatchLoader const& other) = delete;
+
+        /**
+          * \brief Wait for the next result.
+          * \return false once every file has been returned.
+          */
+        bool next(LoadResult<I>& result);
+
+        /**
+          * \brief Return the number of files in the batch.
+          */
+        size_t size() const;
+
+    private:
+        void work();
+
+        std::vector<std::string> m_filenames;
+        BatchOrder m_order;
+        size_t m_maxInFlight;
+        size_t m_started;
+        size_t m_delivered;
+        bool m_stop;
+        /* Decoded results not handed out yet, by input index */
+        std::map<size_t, LoadResult<I>> m_done;
+        std::mutex m_mutex;
+        std::condition_variable m_ready;
+        std::condition_variable m_room;
+        std::vector<std::thread> m_workers;
+};
+
+#include "batchloader.inl"
+
+#endif
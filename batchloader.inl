@@ -0,0 +1,101 @@
+#ifndef BATCHLOADER_H
+#include "batchloader.h"
+#endif
+
+#include <algorithm>
+#include <exception>
+
+template <class I>
+BatchLoader<I>::BatchLoader(std::vector<std::string> filenames, BatchOrder order,
+                            int threads, int maxInFlight) :
+    m_filenames(std::move(filenames)),
+    m_order(order),
+    m_maxInFlight(0),
+    m_started(0),
+    m_delivered(0),
+    m_stop(false)
+{
+    initFreeImage();
+    if(threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<int>(std::min<size_t>(threads, m_filenames.size()));
+    m_maxInFlight = (maxInFlight > 0) ? maxInFlight : 2 * std::max(threads, 1);
+    m_workers.reserve(threads);
+    for(int i = 0 ; i != threads ; ++i) {
+        m_workers.emplace_back(&BatchLoader::work, this);
+    }
+}
+
+template <class I>
+BatchLoader<I>::~BatchLoader() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_room.notify_all();
+    for(auto& w : m_workers) {
+        w.join();
+    }
+}
+
+template <class I>
+bool BatchLoader<I>::next(LoadResult<I>& result) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(m_delivered == m_filenames.size()) {
+        return false;
+    }
+    m_ready.wait(lock, [this]() {
+        return !m_done.empty() &&
+               (m_order == BatchOrder::Completion || m_done.begin()->first == m_delivered);
+    });
+    auto it = m_done.begin();
+    result = std::move(it->second);
+    m_done.erase(it);
+    ++m_delivered;
+    lock.unlock();
+    m_room.notify_all();
+    return true;
+}
+
+template <class I>
+size_t BatchLoader<I>::size() const {
+    return m_filenames.size();
+}
+
+template <class I>
+void BatchLoader<I>::work() {
+    for(;;) {
+        size_t index;
+        {
+            /* Only start a file if it keeps the number of results waiting
+             * for the consumer under the limit. In input order, this also
+             * guarantees the next expected file has been started. */
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_room.wait(lock, [this]() {
+                return m_stop || m_started == m_filenames.size() ||
+                       m_started < m_delivered + m_maxInFlight;
+            });
+            if(m_stop || m_started == m_filenames.size()) {
+                return;
+            }
+            index = m_started++;
+        }
+
+        LoadResult<I> result;
+        result.index = index;
+        result.filename = m_filenames[index];
+        try {
+            result.image.reset(new I(I::load(result.filename)));
+        }
+        catch(std::exception const& e) {
+            result.error = e.what();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done.emplace(index, std::move(result));
+        }
+        m_ready.notify_all();
+    }
+}
@@ -0,0 +1,436 @@
+/**
+  * \file bench/main.cpp
+  * \brief Microbenchmarks of the Image operations.
+  *
+  * Every operation is run on square 1bpp, 8bpp and 24bpp images, the side
+  * being every power of 4 between --min-size and --max-size. Each benchmark
+  * is repeated until --min-time seconds have been spent in it, and the best
+  * iteration is reported along with the throughput in Mpixel/s.
+  *
+  * Usage: image_bench [--format csv|json] [--output file]
+  *                    [--min-size N] [--max-size N] [--min-time seconds]
+  *                    [--filter operation] [--type 1bpp|8bpp|24bpp]
+  */
+#include "image.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct Options {
+    std::string format = "csv";
+    std::string output;
+    int minSize = 64;
+    int maxSize = 4096;
+    double minTime = 0.2;
+    std::string filter;
+    std::string type;
+};
+
+struct Result {
+    std::string operation;
+    std::string type;
+    int width;
+    int height;
+    int iterations;
+    double bestSeconds;
+    double meanSeconds;
+    double mpixelsPerSecond;
+};
+
+/* Results of the benchmarked operations are accumulated here so that the
+ * compiler cannot optimize them away. */
+static volatile unsigned long long g_sink;
+
+static unsigned long long checksum(bool p) { return p; }
+static unsigned long long checksum(byte p) { return p; }
+static unsigned long long checksum(RGBTriple p) {
+    return p.rgbtRed + p.rgbtGreen + p.rgbtBlue;
+}
+
+class Bench {
+    public:
+        explicit Bench(Options const& options) :
+            m_options(options)
+        { }
+
+        /**
+          * \brief Time op, calling setup before each iteration.
+          * \param pixels Number of pixels processed by one call to op
+          */
+        template <class Setup, class Op>
+        void run(std::string const& operation, std::string const& type, int size,
+                 double pixels, Setup setup, Op op) {
+            if(!m_options.filter.empty() && operation.find(m_options.filter) == std::string::npos)
+                return;
+            using clock = std::chrono::steady_clock;
+            double total = 0, best = 0;
+            int iterations = 0;
+            while(iterations == 0 || total < m_options.minTime) {
+                setup();
+                auto start = clock::now();
+                op();
+                double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+                best = (iterations == 0 || elapsed < best) ? elapsed : best;
+                total += elapsed;
+                ++iterations;
+            }
+            m_results.push_back({operation, type, size, size, iterations, best,
+                                 total / iterations, pixels / best / 1e6});
+        }
+
+        template <class Op>
+        void run(std::string const& operation, std::string const& type, int size, Op op) {
+            run(operation, type, size, static_cast<double>(size) * size, []() { }, op);
+        }
+
+        std::vector<Result> const& results() const {
+            return m_results;
+        }
+
+    private:
+        Options m_options;
+        std::vector<Result> m_results;
+};
+
+/* Test pattern of each image class: a disc for binary images, gradients for
+ * the others. */
+template <class I>
+struct Format;
+
+template <>
+struct Format<BinaryImage> {
+    static const char* name() { return "1bpp"; }
+    static bool background() { return false; }
+    static bool pixel(int x, int y, int size) {
+        long long dx = x - size / 2, dy = y - size / 2;
+        return dx * dx + dy * dy < static_cast<long long>(size) * size / 16;
+    }
+};
+
+template <>
+struct Format<GreyscaleImage> {
+    static const char* name() { return "8bpp"; }
+    static byte background() { return 0; }
+    static byte pixel(int x, int y, int) { return static_cast<byte>(x ^ y); }
+};
+
+template <>
+struct Format<RGBImage> {
+    static const char* name() { return "24bpp"; }
+    static RGBTriple background() { return {0, 0, 0}; }
+    static RGBTriple pixel(int x, int y, int) {
+        return {static_cast<byte>(x), static_cast<byte>(y), static_cast<byte>(x + y)};
+    }
+};
+
+/* Filters of 8 bit images, the box and Gaussian ones at several radii */
+template <class I>
+void benchFilters(Bench& bench, I const& img, const char* type, int size) {
+    const std::vector<float> smooth = {0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f};
+    bench.run("convolve-5", type, size, [&]() {
+        g_sink += img.convolve(smooth, smooth).width();
+    });
+    bench.run("convolve-5-pool", type, size, [&]() {
+        g_sink += img.convolve(smooth, smooth, BorderMode::Clamp, 0.f, {Execution::ThreadPool}).width();
+    });
+    bench.run("convolve2D-3x3", type, size, [&]() {
+        g_sink += img.convolve2D({0.f, -1.f, 0.f, -1.f, 5.f, -1.f, 0.f, -1.f, 0.f}, 3).width();
+    });
+    for(int radius : {2, 16}) {
+        bench.run("boxFilter-" + std::to_string(radius), type, size, [&]() {
+            g_sink += img.boxFilter(radius).width();
+        });
+    }
+    for(float sigma : {1.f, 3.f, 8.f, 16.f}) {
+        bench.run("gaussianBlur-" + std::to_string(static_cast<int>(sigma)), type, size, [&]() {
+            g_sink += img.gaussianBlur(sigma).width();
+        });
+    }
+}
+
+/* Operations only available on some image classes */
+template <class I>
+void benchSpecific(Bench&, I const&, int) { }
+
+/* Downsampling by 4, the output pixels being counted */
+template <class I>
+void benchResize(Bench& bench, I const& img, const char* type, int size) {
+    const double pixels = static_cast<double>(size / 4) * (size / 4);
+    bench.run("resize-bilinear", type, size, pixels, []() { }, [&]() {
+        g_sink += img.resize(size / 4, size / 4, ResizeFilter::Bilinear).width();
+    });
+    bench.run("resize-lanczos3", type, size, pixels, []() { }, [&]() {
+        g_sink += img.resize(size / 4, size / 4, ResizeFilter::Lanczos3).width();
+    });
+    bench.run("resize-lanczos3-pool", type, size, pixels, []() { }, [&]() {
+        g_sink += img.resize(size / 4, size / 4, ResizeFilter::Lanczos3, {Execution::ThreadPool}).width();
+    });
+}
+
+void benchSpecific(Bench& bench, GreyscaleImage const& img, int size) {
+    bench.run("pyramid", "8bpp", size, [&]() {
+        g_sink += ImagePyramid<byte>(img.view()).levels();
+    });
+    benchResize(bench, img, "8bpp", size);
+    bench.run("integralImage", "8bpp", size, [&]() {
+        g_sink += IntegralImage(img).sum({0, 0, size, size});
+    });
+    bench.run("integralImage-squares", "8bpp", size, [&]() {
+        g_sink += IntegralImage(img, true).sumOfSquares({0, 0, size, size});
+    });
+    bench.run("integralImage-pool", "8bpp", size, [&]() {
+        g_sink += IntegralImage(img, true, {Execution::ThreadPool}).sum({0, 0, size, size});
+    });
+    // Update after a change of the scanlines of the middle sixteenth
+    IntegralImage table(img, true);
+    bench.run("integralImage-update", "8bpp", size, [&]() {
+        table.update(img, size / 2, size / 2 + size / 16);
+    });
+    bench.run("threshold", "8bpp", size, [&]() {
+        g_sink += threshold(img, 128).getPixel(0, 0);
+    });
+    benchFilters(bench, img, "8bpp", size);
+    bench.run("threshold-otsu", "8bpp", size, [&]() {
+        g_sink += threshold(img, otsuThreshold(histogram(img))).getPixel(0, 0);
+    });
+}
+
+void benchSpecific(Bench& bench, RGBImage const& img, int size) {
+    benchResize(bench, img, "24bpp", size);
+    bench.run("toGreyscale", "24bpp", size, [&]() {
+        g_sink += toGreyscale(img).getPixel(0, 0);
+    });
+    bench.run("toGreyscale-pool", "24bpp", size, [&]() {
+        g_sink += toGreyscale(img, {Execution::ThreadPool}).getPixel(0, 0);
+    });
+    bench.run("threshold", "24bpp", size, [&]() {
+        g_sink += threshold(img, 128).getPixel(0, 0);
+    });
+    benchFilters(bench, img, "24bpp", size);
+}
+
+void benchSpecific(Bench& bench, BinaryImage const& img, int size) {
+    bench.run("pyramid", "1bpp", size, [&]() {
+        g_sink += ImagePyramid<bool>(img.view()).levels();
+    });
+    bench.run("toGreyscale", "1bpp", size, [&]() {
+        g_sink += toGreyscale(img).getPixel(0, 0);
+    });
+    bench.run("deadReckoning3x3", "1bpp", size, [&]() {
+        g_sink += img.deadReckoning3x3(true).getPixel(0, 0);
+    });
+    bench.run("distanceTransform", "1bpp", size, [&]() {
+        g_sink += img.distanceTransform(true).getPixel(0, 0);
+    });
+    for(int radius : {2, 16, 64}) {
+        const std::string suffix = "-" + std::to_string(radius);
+        bench.run("erode-square" + suffix, "1bpp", size, [&]() {
+            g_sink += img.erode(radius, StructuringElement::Square).getPixel(0, 0);
+        });
+        bench.run("erode-disc" + suffix, "1bpp", size, [&]() {
+            g_sink += img.erode(radius, StructuringElement::Disc).getPixel(0, 0);
+        });
+        bench.run("dilate-disc-pool" + suffix, "1bpp", size, [&]() {
+            g_sink += img.dilate(radius, StructuringElement::Disc, {Execution::ThreadPool}).getPixel(0, 0);
+        });
+    }
+    // Blobs of 4x4 pixels set at random, about one component per 50 pixels
+    BinaryImage blobs(size, size);
+    for(int y = 0 ; y != size ; ++y) {
+        for(int x = 0 ; x != size ; ++x) {
+            unsigned h = static_cast<unsigned>(x / 4) * 2654435761u ^ static_cast<unsigned>(y / 4) * 40503u;
+            blobs.setPixel(x, y, (h * 2246822519u >> 29) < 3);
+        }
+    }
+    bench.run("labelComponents", "1bpp", size, [&]() {
+        g_sink += labelComponents<uint32_t>(blobs).stats.size();
+    });
+    bench.run("labelComponents-pool", "1bpp", size, [&]() {
+        g_sink += labelComponents<uint32_t>(blobs, Connectivity::Eight, {Execution::ThreadPool}).stats.size();
+    });
+    // Tiles of 64x64 pixels packed as glyphs in an atlas of the same width
+    std::vector<ImageView<bool>> glyphs;
+    for(int y = 0 ; y + 64 <= size ; y += 64) {
+        for(int x = 0 ; x + 64 <= size ; x += 64) {
+            glyphs.push_back(img.view({x, y, 64, 64}));
+        }
+    }
+    AtlasOptions options;
+    options.width = size + 64;
+    bench.run("glyphAtlas", "1bpp", size, [&]() {
+        g_sink += buildGlyphAtlas(glyphs, options).image.height();
+    });
+}
+
+template <class I>
+void benchImage(Bench& bench, int size) {
+    using F = Format<I>;
+    using T = decltype(F::background());
+    const std::string type = F::name();
+    const double pixels = static_cast<double>(size) * size;
+
+    std::vector<T> raw(static_cast<size_t>(size) * size);
+    for(int y = 0 ; y != size ; ++y) {
+        for(int x = 0 ; x != size ; ++x) {
+            raw[static_cast<size_t>(size) * y + x] = F::pixel(x, y, size);
+        }
+    }
+    I img = I::fromRawData(raw, size, size);
+    I copy(img);
+    I work(img);
+
+    bench.run("getPixel", type, size, [&]() {
+        unsigned long long acc = 0;
+        for(int y = 0 ; y != size ; ++y) {
+            for(int x = 0 ; x != size ; ++x) {
+                acc += checksum(img.getPixel(x, y));
+            }
+        }
+        g_sink += acc;
+    });
+    bench.run("setPixel", type, size, [&]() {
+        T p = F::pixel(1, 2, size);
+        for(int y = 0 ; y != size ; ++y) {
+            for(int x = 0 ; x != size ; ++x) {
+                work.setPixel(x, y, p);
+            }
+        }
+    });
+    bench.run("flipX", type, size, [&]() { work.flipX(); });
+    bench.run("flipY", type, size, [&]() { work.flipY(); });
+    bench.run("blit", type, size, [&]() {
+        work.blit({0, 0}, {0, 0, size, size}, img);
+    });
+    bench.run("crop", type, size, pixels / 4, [&]() { work = img; }, [&]() {
+        work.crop({size / 4, size / 4, size / 2, size / 2});
+    });
+    bench.run("getAABB", type, size, [&]() {
+        g_sink += img.getAABB(F::background()).width;
+    });
+    bench.run("operator==", type, size, [&]() { g_sink += (img == copy); });
+    bench.run("hash", type, size, [&]() { g_sink += img.hash(); });
+    bench.run("diff", type, size, 2 * pixels, []() { }, [&]() {
+        g_sink += img.diff(copy).size();
+    });
+    const T fill = F::pixel(1, 2, size);
+    // crop() left work at a quarter of the size, restored to a full size
+    // image of its own outside of the timings
+    auto restore = [&]() {
+        work = img;
+        work.detach();
+    };
+    bench.run("transform", type, size, pixels, restore, [&]() {
+        work.transform([fill](T) { return fill; });
+    });
+    bench.run("transform-pool", type, size, pixels, restore, [&]() {
+        work.transform([fill](T) { return fill; }, {Execution::ThreadPool});
+    });
+    bench.run("reduce-stealing", type, size, [&]() {
+        g_sink += img.reduce(0ULL, [](unsigned long long acc, T p) { return acc + checksum(p); },
+                             [](unsigned long long a, unsigned long long b) { return a + b; },
+                             {Execution::WorkStealing});
+    });
+    bench.run("fromRawData", type, size, [&]() {
+        g_sink += I::fromRawData(raw, size, size).width();
+    });
+
+    std::vector<byte> encoded;
+    bench.run("save", type, size, [&]() { img.save(encoded, ImageFormat::Bmp); });
+    bench.run("load", type, size, [&]() {
+        g_sink += I::load(encoded.data(), encoded.size()).width();
+    });
+
+    benchSpecific(bench, img, size);
+}
+
+static void writeCsv(std::ostream& out, std::vector<Result> const& results) {
+    out << "operation,type,width,height,iterations,best_seconds,mean_seconds,mpixels_per_second\n";
+    for(auto const& r : results) {
+        out << r.operation << ',' << r.type << ',' << r.width << ',' << r.height << ','
+            << r.iterations << ',' << r.bestSeconds << ',' << r.meanSeconds << ','
+            << r.mpixelsPerSecond << '\n';
+    }
+}
+
+static void writeJson(std::ostream& out, std::vector<Result> const& results) {
+    out << "{\n  \"benchmarks\": [";
+    for(size_t i = 0 ; i != results.size() ; ++i) {
+        auto const& r = results[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"operation\": \"" << r.operation << "\", \"type\": \"" << r.type
+            << "\", \"width\": " << r.width << ", \"height\": " << r.height
+            << ", \"iterations\": " << r.iterations << ", \"best_seconds\": " << r.bestSeconds
+            << ", \"mean_seconds\": " << r.meanSeconds
+            << ", \"mpixels_per_second\": " << r.mpixelsPerSecond << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static Options parseOptions(int argc, char** argv) {
+    Options options;
+    for(int i = 1 ; i < argc ; ++i) {
+        std::string arg = argv[i];
+        if(i + 1 == argc) {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if(arg == "--format")
+            options.format = value;
+        else if(arg == "--output")
+            options.output = value;
+        else if(arg == "--min-size")
+            options.minSize = std::atoi(value.c_str());
+        else if(arg == "--max-size")
+            options.maxSize = std::atoi(value.c_str());
+        else if(arg == "--min-time")
+            options.minTime = std::atof(value.c_str());
+        else if(arg == "--filter")
+            options.filter = value;
+        else if(arg == "--type")
+            options.type = value;
+        else
+            throw std::runtime_error("Unknown option " + arg);
+    }
+    if(options.format != "csv" && options.format != "json") {
+        throw std::runtime_error("Unknown format " + options.format);
+    }
+    return options;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    try {
+        options = parseOptions(argc, argv);
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    initFreeImage();
+    Bench bench(options);
+    for(int size = options.minSize ; size <= options.maxSize ; size *= 4) {
+        if(options.type.empty() || options.type == "1bpp")
+            benchImage<BinaryImage>(bench, size);
+        if(options.type.empty() || options.type == "8bpp")
+            benchImage<GreyscaleImage>(bench, size);
+        if(options.type.empty() || options.type == "24bpp")
+            benchImage<RGBImage>(bench, size);
+    }
+
+    std::ofstream file;
+    if(!options.output.empty()) {
+        file.open(options.output);
+    }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+    if(options.format == "json")
+        writeJson(out, bench.results());
+    else
+        writeCsv(out, bench.results());
+    return 0;
+}
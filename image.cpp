@@ -2,24 +2,37 @@
 #include <stdexcept>
 #include <fstream>
 #include <limits>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <tuple>
+#include <chrono>
 
 using namespace std;
 
-bool Rect::operator==(Rect const& other) {
+bool Rect::operator==(Rect const& other) const {
     return (x == other.x) && (y == other.y) &&
            (width == other.width) && (height == other.height);
 }
 
-bool Rect::isIn(Rect const& other) {
+bool Rect::isIn(Rect const& other) const {
     ImageCoords p1({x, y}), p2({x + width, y + height});
     return p1.isIn(other) && p2.isIn(other);
 }
 
-bool ImageCoords::operator==(ImageCoords const& other) {
+bool ImageCoords::operator==(ImageCoords const& other) const {
     return (x == other.x) && (y == other.y);
 }
 
-bool ImageCoords::isIn(Rect const& r) {
+bool ImageCoords::isIn(Rect const& r) const {
     return (x >= r.x) && (x < (r.x + r.width)) &&
            (y >= r.y) && (y < (r.y + r.height));
 }
@@ -34,14 +47,2831 @@ ostream& operator<<(ostream& s, Rect const& r) {
     return s;
 }
 
+static void deinitFreeImage() {
+    FreeImage_DeInitialise();
+}
+
+void initFreeImage() {
+    static once_flag initialized;
+    call_once(initialized, []() {
+        FreeImage_Initialise();
+        atexit(deinitFreeImage);
+    });
+}
+
+/* Split [0, count) in contiguous chunks and run f(begin, end) on each of them
+ * on its own thread. The calling thread processes the first chunk, and the
+ * first exception thrown by a chunk is rethrown once all of them are done. */
+static void parallelFor(int count, int threads, function<void(int, int)> const& f) {
+    if(threads <= 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    threads = max(1, min(threads, count));
+    exception_ptr error;
+    mutex errorMutex;
+    auto run = [&](int begin, int end) {
+        try {
+            f(begin, end);
+        }
+        catch(...) {
+            lock_guard<mutex> lock(errorMutex);
+            if(!error) {
+                error = current_exception();
+            }
+        }
+    };
+    vector<thread> workers;
+    workers.reserve(threads - 1);
+    for(int i = 1 ; i < threads ; ++i) {
+        const int begin = static_cast<int>(static_cast<long long>(count) * i / threads);
+        const int end = static_cast<int>(static_cast<long long>(count) * (i + 1) / threads);
+        try {
+            workers.emplace_back(run, begin, end);
+        }
+        catch(system_error const&) {
+            // No more threads, the chunk runs on the calling thread
+            run(begin, end);
+        }
+    }
+    run(0, count / threads);
+    for(auto& w : workers) {
+        w.join();
+    }
+    if(error) {
+        rethrow_exception(error);
+    }
+}
+
+/* Process-wide pool of worker threads behind forEachBand(). The calling
+ * thread takes part in its own jobs, and only waits at the end for the
+ * workers that joined it, so jobs always complete even when every worker is
+ * busy, for instance when forEachBand() is called from a band. Workers are
+ * started on demand and never stopped, like the image pool. */
+class WorkerPool {
+    public:
+        static WorkerPool& instance() {
+            static WorkerPool* pool = new WorkerPool();
+            return *pool;
+        }
+
+        /* Run work(participant) on the calling thread, participant 0, and on
+         * up to helpers workers, participants 1 to helpers. */
+        void run(int helpers, function<void(int)> const& work) {
+            Job job{&work, helpers, 1, 0};
+            {
+                lock_guard<mutex> lock(m_mutex);
+                for( ; m_threads < helpers ; ++m_threads) {
+                    thread([this]() { loop(); }).detach();
+                }
+                m_jobs.push_back(&job);
+            }
+            m_wake.notify_all();
+            work(0);
+            unique_lock<mutex> lock(m_mutex);
+            auto it = find(m_jobs.begin(), m_jobs.end(), &job);
+            if(it != m_jobs.end()) {
+                m_jobs.erase(it);
+            }
+            m_done.wait(lock, [&job]() { return job.running == 0; });
+        }
+
+    private:
+        struct Job {
+            function<void(int)> const* work;
+            int helpers;
+            int next;
+            int running;
+        };
+
+        void loop() {
+            unique_lock<mutex> lock(m_mutex);
+            for(;;) {
+                m_wake.wait(lock, [this]() { return !m_jobs.empty(); });
+                Job* job = m_jobs.front();
+                int participant = job->next++;
+                if(job->next > job->helpers) {
+                    m_jobs.pop_front();
+                }
+                ++job->running;
+                lock.unlock();
+                (*job->work)(participant);
+                lock.lock();
+                if(--job->running == 0) {
+                    m_done.notify_all();
+                }
+            }
+        }
+
+        mutex m_mutex;
+        condition_variable m_wake;
+        condition_variable m_done;
+        deque<Job*> m_jobs;
+        int m_threads = 0;
+};
+
+/* Bands of a participant of the work-stealing mode, begin << 32 | end, so
+ * that the owner taking bands from the front and thieves taking the back
+ * half update them with a single compare-and-swap. Padded to a cache line. */
+struct BandQueue {
+    atomic<uint64_t> bands;
+    char padding[64 - sizeof(atomic<uint64_t>)];
+
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return static_cast<uint64_t>(begin) << 32 | end;
+    }
+
+    bool pop(uint32_t& band) {
+        uint64_t r = bands.load();
+        for(;;) {
+            uint32_t begin = r >> 32, end = static_cast<uint32_t>(r);
+            if(begin >= end) {
+                return false;
+            }
+            if(bands.compare_exchange_weak(r, pack(begin + 1, end))) {
+                band = begin;
+                return true;
+            }
+        }
+    }
+
+    bool stealHalf(uint32_t& begin, uint32_t& end) {
+        uint64_t r = bands.load();
+        for(;;) {
+            uint32_t b = r >> 32, e = static_cast<uint32_t>(r);
+            if(b >= e) {
+                return false;
+            }
+            uint32_t middle = b + (e - b) / 2;
+            if(bands.compare_exchange_weak(r, pack(b, middle))) {
+                begin = middle;
+                end = e;
+                return true;
+            }
+        }
+    }
+};
+
+/* Scanlines per band of forEachBand(), and the number of threads working
+ * on them. A single band covers the image when it runs on one thread. */
+static int bandLayout(int height, int pitch, ExecutionPolicy const& policy, int& threads) {
+    threads = policy.threads;
+    if(threads <= 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    // Scanlines starting on the same offset within a cache line as the first
+    // one. Only the pitch is known, not the address of the first scanline
+    int lineSize = 64, alignment = 1;
+    if(pitch > 0) {
+        int a = pitch % lineSize, b = lineSize;
+        while(a) {
+            int t = b % a;
+            b = a;
+            a = t;
+        }
+        alignment = lineSize / b;
+    }
+    int bandHeight;
+    if(policy.mode == Execution::WorkStealing) {
+        bandHeight = policy.bandHeight > 0 ? policy.bandHeight : max(1, 32768 / max(1, pitch));
+    }
+    else {
+        bandHeight = (height + threads - 1) / threads;
+    }
+    bandHeight = (bandHeight + alignment - 1) / alignment * alignment;
+    threads = min(threads, (height + bandHeight - 1) / bandHeight);
+    if(policy.mode == Execution::Sequential || threads == 1) {
+        threads = 1;
+        return height;
+    }
+    return bandHeight;
+}
+
+void forEachBand(int height, int pitch, ExecutionPolicy const& policy,
+                 function<void(int, int)> const& f) {
+    if(height <= 0) {
+        return;
+    }
+    int threads;
+    const int bandHeight = bandLayout(height, pitch, policy, threads);
+    const int bandCount = (height + bandHeight - 1) / bandHeight;
+    if(threads == 1) {
+        f(0, height);
+        return;
+    }
+
+    atomic<bool> failed(false);
+    exception_ptr error;
+    mutex errorMutex;
+    auto runBand = [&](uint32_t band) {
+        if(failed.load(memory_order_relaxed)) {
+            return;
+        }
+        int yBegin = band * bandHeight;
+        try {
+            f(yBegin, min(height, yBegin + bandHeight));
+        }
+        catch(...) {
+            lock_guard<mutex> lock(errorMutex);
+            if(!error) {
+                error = current_exception();
+            }
+            failed = true;
+        }
+    };
+
+    if(policy.mode == Execution::ThreadPool) {
+        atomic<int> next(0);
+        WorkerPool::instance().run(threads - 1, [&](int) {
+            for(int band = next++ ; band < bandCount ; band = next++) {
+                runBand(band);
+            }
+        });
+    }
+    else {
+        // Each participant starts with a contiguous share of the bands
+        unique_ptr<BandQueue[]> queues(new BandQueue[threads]);
+        for(int i = 0 ; i != threads ; ++i) {
+            queues[i].bands = BandQueue::pack(static_cast<uint32_t>(static_cast<long long>(bandCount) * i / threads),
+                                              static_cast<uint32_t>(static_cast<long long>(bandCount) * (i + 1) / threads));
+        }
+        WorkerPool::instance().run(threads - 1, [&](int participant) {
+            BandQueue& own = queues[participant];
+            for(;;) {
+                uint32_t band;
+                while(own.pop(band)) {
+                    runBand(band);
+                }
+                // Steal the back half of the largest queue
+                int victim = -1;
+                uint32_t largest = 0;
+                for(int i = 0 ; i != threads ; ++i) {
+                    uint64_t r = queues[i].bands.load(memory_order_relaxed);
+                    uint32_t size = (r >> 32) < static_cast<uint32_t>(r) ?
+                                    static_cast<uint32_t>(r) - static_cast<uint32_t>(r >> 32) : 0;
+                    if(size > largest) {
+                        largest = size;
+                        victim = i;
+                    }
+                }
+                uint32_t begin, end;
+                if(victim < 0) {
+                    return;
+                }
+                if(queues[victim].stealHalf(begin, end)) {
+                    own.bands = BandQueue::pack(begin, end);
+                }
+            }
+        });
+    }
+    if(error) {
+        rethrow_exception(error);
+    }
+}
+
+bool ImagePool::Shape::operator<(Shape const& other) const {
+    return tie(type, width, height, bpp, masks[0], masks[1], masks[2]) <
+           tie(other.type, other.width, other.height, other.bpp,
+               other.masks[0], other.masks[1], other.masks[2]);
+}
+
+static size_t bitmapBytes(FIBITMAP* bitmap) {
+    return static_cast<size_t>(FreeImage_GetPitch(bitmap)) * FreeImage_GetHeight(bitmap);
+}
+
+ImagePool::ImagePool() :
+    m_enabled(false),
+    m_capacity(numeric_limits<size_t>::max()),
+    m_stats(),
+    m_ownedCount(0)
+{ }
+
+/* The pool is never destroyed, so that images with static storage duration
+ * can still give their bitmap back at exit */
+ImagePool& ImagePool::instance() {
+    static ImagePool* pool = new ImagePool();
+    return *pool;
+}
+
+void ImagePool::setEnabled(bool enabled) {
+    m_enabled = enabled;
+}
+
+bool ImagePool::enabled() const {
+    return m_enabled;
+}
+
+void ImagePool::setCapacity(size_t bytes) {
+    lock_guard<mutex> lock(m_mutex);
+    m_capacity = bytes;
+    trimLocked(bytes);
+}
+
+ImagePool::Stats ImagePool::stats() const {
+    lock_guard<mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void ImagePool::resetStats() {
+    lock_guard<mutex> lock(m_mutex);
+    m_stats.hits = m_stats.misses = m_stats.scratchHits = m_stats.scratchMisses = 0;
+}
+
+void ImagePool::trim(size_t bytes) {
+    lock_guard<mutex> lock(m_mutex);
+    trimLocked(bytes);
+}
+
+void ImagePool::trimLocked(size_t bytes) {
+    while(m_stats.idleBytes > bytes && !m_idleScratch.empty()) {
+        auto it = prev(m_idleScratch.end());
+        m_stats.idleBytes -= it->first;
+        --m_stats.idle;
+        ::operator delete(it->second);
+        m_idleScratch.erase(it);
+    }
+    while(m_stats.idleBytes > bytes && !m_idleBitmaps.empty()) {
+        auto it = prev(m_idleBitmaps.end());
+        m_stats.idleBytes -= bitmapBytes(it->second);
+        --m_stats.idle;
+        m_owned.erase(it->second);
+        --m_ownedCount;
+        FreeImage_Unload(it->second);
+        m_idleBitmaps.erase(it);
+    }
+}
+
+FIBITMAP* ImagePool::acquire(Shape const& shape, bool clear) {
+    FIBITMAP* recycled = nullptr;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_idleBitmaps.find(shape);
+        if(it != m_idleBitmaps.end()) {
+            recycled = it->second;
+            m_idleBitmaps.erase(it);
+            ++m_stats.hits;
+            --m_stats.idle;
+            m_stats.idleBytes -= bitmapBytes(recycled);
+        }
+        else {
+            ++m_stats.misses;
+        }
+    }
+    // No longer in the free list, cleared without holding the lock
+    if(recycled) {
+        if(clear) {
+            memset(FreeImage_GetBits(recycled), 0, bitmapBytes(recycled));
+        }
+        return recycled;
+    }
+    FIBITMAP* bitmap = FreeImage_AllocateT(static_cast<FREE_IMAGE_TYPE>(shape.type), shape.width,
+                                           shape.height, shape.bpp, shape.masks[0],
+                                           shape.masks[1], shape.masks[2]);
+    IMAGE_COUNT_BITMAP(bitmap);
+    if(bitmap) {
+        lock_guard<mutex> lock(m_mutex);
+        m_owned.insert(bitmap);
+        ++m_ownedCount;
+    }
+    return bitmap;
+}
+
+FIBITMAP* ImagePool::allocate(ImageType t, int width, int height, int bpp, unsigned int rMask,
+                              unsigned int gMask, unsigned int bMask) {
+    if(!m_enabled) {
+        FIBITMAP* bitmap = FreeImage_AllocateT(static_cast<FREE_IMAGE_TYPE>(t), width, height, bpp,
+                                               rMask, gMask, bMask);
+        IMAGE_COUNT_BITMAP(bitmap);
+        return bitmap;
+    }
+    return acquire({static_cast<int>(t), width, height, bpp, {rMask, gMask, bMask}}, true);
+}
+
+FIBITMAP* ImagePool::clone(FIBITMAP* bitmap) {
+    if(!bitmap) {
+        return nullptr;
+    }
+    IMAGE_COUNT_CLONE();
+    if(!m_enabled) {
+        FIBITMAP* copy = FreeImage_Clone(bitmap);
+        IMAGE_COUNT_BITMAP(copy);
+        return copy;
+    }
+    const int height = FreeImage_GetHeight(bitmap);
+    FIBITMAP* copy = acquire({FreeImage_GetImageType(bitmap), static_cast<int>(FreeImage_GetWidth(bitmap)),
+                              height, static_cast<int>(FreeImage_GetBPP(bitmap)),
+                              {FreeImage_GetRedMask(bitmap), FreeImage_GetGreenMask(bitmap),
+                               FreeImage_GetBlueMask(bitmap)}}, false);
+    if(!copy) {
+        return nullptr;
+    }
+    if(FreeImage_GetPitch(bitmap) == FreeImage_GetPitch(copy)) {
+        memcpy(FreeImage_GetBits(copy), FreeImage_GetBits(bitmap), bitmapBytes(copy));
+    }
+    else {
+        // External pixel memory with a different stride
+        for(int y = 0 ; y != height ; ++y) {
+            memcpy(FreeImage_GetScanLine(copy, y), FreeImage_GetScanLine(bitmap, y),
+                   FreeImage_GetLine(bitmap));
+        }
+    }
+    if(FreeImage_GetPalette(bitmap)) {
+        memcpy(FreeImage_GetPalette(copy), FreeImage_GetPalette(bitmap),
+               FreeImage_GetColorsUsed(bitmap) * sizeof(RGBQUAD));
+    }
+    FreeImage_SetDotsPerMeterX(copy, FreeImage_GetDotsPerMeterX(bitmap));
+    FreeImage_SetDotsPerMeterY(copy, FreeImage_GetDotsPerMeterY(bitmap));
+    return copy;
+}
+
+void ImagePool::unload(FIBITMAP* bitmap) {
+    if(!bitmap) {
+        return;
+    }
+    if(m_ownedCount) {
+        lock_guard<mutex> lock(m_mutex);
+        if(m_owned.count(bitmap)) {
+            size_t bytes = bitmapBytes(bitmap);
+            if(m_enabled && m_stats.idleBytes + bytes <= m_capacity) {
+                FREE_IMAGE_TYPE type = FreeImage_GetImageType(bitmap);
+                m_idleBitmaps.insert({{type, static_cast<int>(FreeImage_GetWidth(bitmap)),
+                                       static_cast<int>(FreeImage_GetHeight(bitmap)),
+                                       static_cast<int>(FreeImage_GetBPP(bitmap)),
+                                       {FreeImage_GetRedMask(bitmap), FreeImage_GetGreenMask(bitmap),
+                                        FreeImage_GetBlueMask(bitmap)}}, bitmap});
+                ++m_stats.idle;
+                m_stats.idleBytes += bytes;
+                return;
+            }
+            m_owned.erase(bitmap);
+            --m_ownedCount;
+        }
+    }
+    FreeImage_Unload(bitmap);
+}
+
+void* ImagePool::allocateScratch(size_t bytes) {
+    if(m_enabled) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_idleScratch.find(bytes);
+        if(it != m_idleScratch.end()) {
+            void* buffer = it->second;
+            m_idleScratch.erase(it);
+            ++m_stats.scratchHits;
+            --m_stats.idle;
+            m_stats.idleBytes -= bytes;
+            return buffer;
+        }
+        ++m_stats.scratchMisses;
+    }
+    IMAGE_COUNT_SCRATCH(bytes);
+    return ::operator new(bytes);
+}
+
+void ImagePool::releaseScratch(void* buffer, size_t bytes) {
+    if(m_enabled) {
+        lock_guard<mutex> lock(m_mutex);
+        if(m_stats.idleBytes + bytes <= m_capacity) {
+            m_idleScratch.insert({bytes, buffer});
+            ++m_stats.idle;
+            m_stats.idleBytes += bytes;
+            return;
+        }
+    }
+    ::operator delete(buffer);
+}
+
+/* Bytes allocated by the calling thread so far, scopes record the difference
+ * between their end and their start */
+static thread_local uint64_t threadAllocatedBytes = 0;
+
+/* Threads are numbered in the order of their first event */
+static int traceThread() {
+    static atomic<int> next(0);
+    static thread_local int thread = next++;
+    return thread;
+}
+
+Instrumentation::Scope::Scope(const char* operation, Counters& counters, uint64_t pixels) :
+    m_operation(operation),
+    m_counters(counters),
+    m_pixels(pixels),
+    m_start(Instrumentation::instance().now()),
+    m_bytes(threadAllocatedBytes)
+{
+    Instrumentation& instrumentation = Instrumentation::instance();
+    if(instrumentation.m_hasSink) {
+        {
+            lock_guard<mutex> lock(instrumentation.m_mutex);
+            m_sink = instrumentation.m_sink;
+        }
+        if(m_sink) {
+            m_sink->begin(m_operation, traceThread(), m_start);
+        }
+    }
+}
+
+Instrumentation::Scope::~Scope() {
+    const uint64_t end = Instrumentation::instance().now();
+    m_counters.calls.fetch_add(1, memory_order_relaxed);
+    m_counters.nanoseconds.fetch_add(end - m_start, memory_order_relaxed);
+    m_counters.pixels.fetch_add(m_pixels, memory_order_relaxed);
+    m_counters.bytes.fetch_add(threadAllocatedBytes - m_bytes, memory_order_relaxed);
+    if(m_sink) {
+        m_sink->end(m_operation, traceThread(), end, m_pixels);
+    }
+}
+
+void Instrumentation::Scope::setPixels(uint64_t pixels) {
+    m_pixels = pixels;
+}
+
+Instrumentation::Instrumentation() :
+    m_epoch(0),
+    m_bitmapAllocations(0),
+    m_bitmapClones(0),
+    m_bytes(0),
+    m_hasSink(false)
+{
+    m_epoch = now();
+}
+
+/* Never destroyed, like the pool, so that static images can still be
+ * counted at exit */
+Instrumentation& Instrumentation::instance() {
+    static Instrumentation* instrumentation = new Instrumentation();
+    return *instrumentation;
+}
+
+uint64_t Instrumentation::now() const {
+    auto time = chrono::steady_clock::now().time_since_epoch();
+    return chrono::duration_cast<chrono::nanoseconds>(time).count() - m_epoch;
+}
+
+Instrumentation::Snapshot Instrumentation::snapshot() const {
+    Snapshot snapshot{{}, m_bitmapAllocations, m_bitmapClones, m_bytes};
+    lock_guard<mutex> lock(m_mutex);
+    for(auto const& entry : m_counters) {
+        Counters const& c = entry.second;
+        if(c.calls) {
+            snapshot.operations[entry.first] = {c.calls, c.nanoseconds, c.pixels, c.bytes};
+        }
+    }
+    return snapshot;
+}
+
+void Instrumentation::reset() {
+    lock_guard<mutex> lock(m_mutex);
+    for(auto& entry : m_counters) {
+        Counters& c = entry.second;
+        c.calls = c.nanoseconds = c.pixels = c.bytes = 0;
+    }
+    m_bitmapAllocations = m_bitmapClones = m_bytes = 0;
+}
+
+void Instrumentation::setSink(shared_ptr<TraceSink> sink) {
+    lock_guard<mutex> lock(m_mutex);
+    m_hasSink = static_cast<bool>(sink);
+    m_sink = move(sink);
+}
+
+Instrumentation::Counters& Instrumentation::counters(const char* operation) {
+    lock_guard<mutex> lock(m_mutex);
+    return m_counters[operation];
+}
+
+void Instrumentation::countBitmap(FIBITMAP* bitmap) {
+    if(bitmap) {
+        ++m_bitmapAllocations;
+        countBytes(static_cast<size_t>(FreeImage_GetPitch(bitmap)) * FreeImage_GetHeight(bitmap));
+    }
+}
+
+void Instrumentation::countClone() {
+    ++m_bitmapClones;
+}
+
+void Instrumentation::countScratch(size_t bytes) {
+    countBytes(bytes);
+}
+
+void Instrumentation::countBytes(size_t bytes) {
+    m_bytes += bytes;
+    threadAllocatedBytes += bytes;
+}
+
+ChromeTraceWriter::ChromeTraceWriter(ostream& out) :
+    m_out(out),
+    m_first(true)
+{
+    m_out << "[";
+}
+
+ChromeTraceWriter::~ChromeTraceWriter() {
+    m_out << "\n]\n";
+    m_out.flush();
+}
+
+void ChromeTraceWriter::begin(const char* operation, int thread, uint64_t nanoseconds) {
+    lock_guard<mutex> lock(m_mutex);
+    write(operation, 'B', thread, nanoseconds);
+    m_out << "}";
+}
+
+void ChromeTraceWriter::end(const char* operation, int thread, uint64_t nanoseconds, uint64_t pixels) {
+    lock_guard<mutex> lock(m_mutex);
+    write(operation, 'E', thread, nanoseconds);
+    m_out << ",\"args\":{\"pixels\":" << pixels << "}}";
+}
+
+/* Write an event up to its closing brace, timestamps are in microseconds */
+void ChromeTraceWriter::write(const char* operation, char phase, int thread, uint64_t nanoseconds) {
+    m_out << (m_first ? "\n" : ",\n") << "{\"name\":\"";
+    m_first = false;
+    for(const char* c = operation ; *c ; ++c) {
+        if(*c == '"' || *c == '\\') {
+            m_out << '\\';
+        }
+        m_out << *c;
+    }
+    m_out << "\",\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":" << thread << ",\"ts\":"
+          << nanoseconds / 1000 << '.' << static_cast<char>('0' + nanoseconds / 100 % 10)
+          << static_cast<char>('0' + nanoseconds / 10 % 10) << static_cast<char>('0' + nanoseconds % 10);
+}
+
+/* Load a bitmap from a file. The format is guessed from the file content,
+ * then from its name. */
+static FIBITMAP* loadBitmap(string const& filename) {
+    IMAGE_SCOPE("load", 0);
+    FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str());
+    if(fif == FIF_UNKNOWN) {
+        fif = FreeImage_GetFIFFromFilename(filename.c_str());
+        if(fif == FIF_UNKNOWN)
+            throw runtime_error("Cannot open image");
+    }
+    auto fi = FreeImage_Load(fif, filename.c_str());
+    if(!fi) {
+        throw runtime_error("Cannot open image");
+    }
+    IMAGE_COUNT_BITMAP(fi);
+    IMAGE_SCOPE_PIXELS(static_cast<uint64_t>(FreeImage_GetWidth(fi)) * FreeImage_GetHeight(fi));
+    return fi;
+}
+
+/* Load a bitmap from an encoded file in memory. The buffer is read in place. */
+static FIBITMAP* loadBitmap(const byte* data, size_t size) {
+    IMAGE_SCOPE("load", 0);
+    if(size > numeric_limits<DWORD>::max()) {
+        throw runtime_error("Cannot open image");
+    }
+    FIMEMORY* stream = FreeImage_OpenMemory(const_cast<BYTE*>(data), static_cast<DWORD>(size));
+    if(!stream) {
+        throw runtime_error("Cannot open image");
+    }
+    FREE_IMAGE_FORMAT fif = FreeImage_GetFileTypeFromMemory(stream);
+    auto fi = (fif == FIF_UNKNOWN) ? nullptr : FreeImage_LoadFromMemory(fif, stream);
+    FreeImage_CloseMemory(stream);
+    if(!fi) {
+        throw runtime_error("Cannot open image");
+    }
+    IMAGE_COUNT_BITMAP(fi);
+    IMAGE_SCOPE_PIXELS(static_cast<uint64_t>(FreeImage_GetWidth(fi)) * FreeImage_GetHeight(fi));
+    return fi;
+}
+
+/* Convert a freshly loaded bitmap to the format of T if needed, so that the
+ * pixels can be accessed directly. The input bitmap is released in any case. */
+template <class T, class Convert>
+static FIBITMAP* convertBitmap(FIBITMAP* fi, Convert convert) {
+    // Palettized bitmaps are kept only when their palette is the grey ramp
+    if(FreeImage_GetImageType(fi) == static_cast<FREE_IMAGE_TYPE>(PixelTraits<T>::type) &&
+       static_cast<int>(FreeImage_GetBPP(fi)) == PixelTraits<T>::bpp &&
+       (PixelTraits<T>::bpp > 8 || FreeImage_GetColorType(fi) == FIC_MINISBLACK)) {
+        return fi;
+    }
+    IMAGE_SCOPE("convert", static_cast<uint64_t>(FreeImage_GetWidth(fi)) * FreeImage_GetHeight(fi));
+    auto converted = convert(fi);
+    FreeImage_Unload(fi);
+    if(!converted) {
+        throw runtime_error("Cannot convert image");
+    }
+    IMAGE_COUNT_BITMAP(converted);
+    return converted;
+}
+
+/* Packed 1bpp kernels
+ * Binary scanlines are processed 64 pixels at a time. Word i of a scanline
+ * holds pixels [64i, 64i + 64), pixel 64i being the most significant bit,
+ * which is the FreeImage layout read as big-endian words.
+ */
+static int popcount64(uint64_t v) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(v);
+#else
+    int n = 0;
+    for( ; v ; v &= v - 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/* Number of leading (most significant) zero bits, v must not be 0 */
+static int clz64(uint64_t v) {
+#if defined(__GNUC__)
+    return __builtin_clzll(v);
+#else
+    int n = 0;
+    for( ; !(v >> 63) ; v <<= 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/* Number of trailing (least significant) zero bits, v must not be 0 */
+static int ctz64(uint64_t v) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    for( ; !(v & 1) ; v >>= 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+static uint64_t reverseBits64(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+#if defined(__GNUC__)
+    return __builtin_bswap64(v);
+#else
+    v = ((v >> 8) & 0x00FF00FF00FF00FFull) | ((v & 0x00FF00FF00FF00FFull) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFull) | ((v & 0x0000FFFF0000FFFFull) << 16);
+    return (v >> 32) | (v << 32);
+#endif
+}
+
+static int wordCount(int width) {
+    return (width + 63) / 64;
+}
+
+/* Mask of the bits of the last word of a scanline which are inside the image */
+static uint64_t tailMask(int width) {
+    int remainder = width % 64;
+    return remainder ? ~uint64_t(0) << (64 - remainder) : ~uint64_t(0);
+}
+
+/* Load a packed scanline of the given width into words. The bits past the
+ * end of the line are set to the corresponding bits of fill. */
+static void loadWords(const byte* row, int width, uint64_t fill, uint64_t* words) {
+    int lineBytes = (width + 7) / 8, n = wordCount(width);
+    for(int i = 0 ; i != n ; ++i) {
+        int first = 8 * i;
+        uint64_t w = 0;
+        if(first + 8 <= lineBytes) {
+            // Compilers turn this into a single byte-swapping load
+            for(int b = 0 ; b != 8 ; ++b) {
+                w = (w << 8) | row[first + b];
+            }
+        }
+        else {
+            for(int b = first ; b != first + 8 ; ++b) {
+                w = (w << 8) | ((b < lineBytes) ? row[b] : 0);
+            }
+        }
+        words[i] = w;
+    }
+    uint64_t mask = tailMask(width);
+    words[n - 1] = (words[n - 1] & mask) | (fill & ~mask);
+}
+
+/* Store words into a packed scanline of the given width. Bits past the end of
+ * the line are cleared. */
+static void storeWords(uint64_t const* words, int width, byte* row) {
+    int lineBytes = (width + 7) / 8, n = wordCount(width);
+    for(int i = 0 ; i != n ; ++i) {
+        uint64_t w = (i == n - 1) ? words[i] & tailMask(width) : words[i];
+        for(int b = 0 ; b != 8 && 8 * i + b < lineBytes ; ++b) {
+            row[8 * i + b] = static_cast<byte>(w >> (56 - 8 * b));
+        }
+    }
+}
+
+/* OR the immediate interior (or exterior) of a scanline into out, given the
+ * words of the scanline and of its vertical neighbours. Everything outside of
+ * the image, including the bits past the end of the lines, must be set for
+ * the interior and cleared for the exterior. */
+static void boundaryWords(uint64_t const* up, uint64_t const* center, uint64_t const* down,
+                          int n, bool interior, uint64_t* out) {
+    uint64_t fill = interior ? ~uint64_t(0) : 0;
+    for(int i = 0 ; i != n ; ++i) {
+        uint64_t c = center[i];
+        uint64_t prev = (i == 0) ? fill : center[i - 1];
+        uint64_t next = (i == n - 1) ? fill : center[i + 1];
+        uint64_t left = (c >> 1) | (prev << 63);
+        uint64_t right = (c << 1) | (next >> 63);
+        out[i] |= interior ? c & ~(up[i] & down[i] & left & right) :
+                             ~c & (up[i] | down[i] | left | right);
+    }
+}
+
+/* Compute the words of the immediate interior and/or exterior of scanline y.
+ * scratch must have room for 3 scanlines of words. */
+static void boundaryRow(ImageView<bool> const& img, int y, bool interior, bool exterior,
+                        uint64_t* scratch, uint64_t* out) {
+    const int width = img.width(), height = img.height(), n = wordCount(width);
+    uint64_t *up = scratch, *center = scratch + n, *down = scratch + 2 * n;
+    auto load = [&](int row, uint64_t fill, uint64_t* words) {
+        if(row < 0 || row >= height) {
+            fill_n(words, n, fill);
+        }
+        else {
+            loadWords(img.rowUnchecked(row).data(), width, fill, words);
+        }
+    };
+    fill_n(out, n, 0);
+    if(interior) {
+        load(y - 1, ~uint64_t(0), up);
+        load(y, ~uint64_t(0), center);
+        load(y + 1, ~uint64_t(0), down);
+        boundaryWords(up, center, down, n, true, out);
+    }
+    if(exterior) {
+        load(y - 1, 0, up);
+        load(y, 0, center);
+        load(y + 1, 0, down);
+        boundaryWords(up, center, down, n, false, out);
+    }
+    out[n - 1] &= tailMask(width);
+}
+
+/* Return the value of pixel x in a scanline of words */
+static bool testBit(uint64_t const* words, int x) {
+    return (words[x >> 6] << (x & 63)) >> 63;
+}
+
+/* First pixel of a packed scanline in [0, limit) that differs from the
+ * background, or limit */
+static int firstBitMismatch(const byte* row, int limit, PixelPattern const& pattern) {
+    size_t bytes = (limit + 7) / 8;
+    const byte background = pattern.bytes[0];
+    size_t i = findFirstMismatch(row, 0, bytes, pattern);
+    if(i == bytes) {
+        return limit;
+    }
+    return min(limit, static_cast<int>(8 * i) + clz64(uint64_t(row[i] ^ background) << 56));
+}
+
+/* Last pixel of a packed scanline in [from, width) that differs from the
+ * background, or from - 1. The padding bits of the last byte are ignored. */
+static int lastBitMismatch(const byte* row, int from, int width, PixelPattern const& pattern) {
+    const int full = width / 8;
+    const byte background = pattern.bytes[0];
+    if(width % 8) {
+        byte diff = (row[full] ^ background) & static_cast<byte>(0xFF00 >> (width % 8));
+        if(diff) {
+            return max(from - 1, 8 * full + 7 - ctz64(diff));
+        }
+    }
+    size_t first = from / 8;
+    if(static_cast<int>(first) >= full) {
+        return from - 1;
+    }
+    size_t end = findLastMismatch(row, first, full, pattern);
+    if(end == first) {
+        return from - 1;
+    }
+    return max(from - 1, static_cast<int>(8 * end) - 1 - ctz64(row[end - 1] ^ background));
+}
+
+template <>
+bool ImageView<bool>::getAABB(bool backgroundColor, Rect& aabb) const {
+    const byte backgroundByte = backgroundColor ? 0xFF : 0;
+    const PixelPattern background(&backgroundByte, 1);
+    auto isBackground = [&](int y) {
+        return lastBitMismatch(rowUnchecked(y).data(), 0, m_width, background) < 0;
+    };
+    int yMin = 0, yMax = m_height - 1;
+    while(yMin != m_height && isBackground(yMin)) {
+        ++yMin;
+    }
+    if(yMin == m_height) {
+        return false;
+    }
+    while(isBackground(yMax)) {
+        --yMax;
+    }
+    int xMin = m_width, xMax = -1;
+    for(int y = yMin ; y <= yMax && (xMin != 0 || xMax != m_width - 1) ; ++y) {
+        const byte* row = rowUnchecked(y).data();
+        xMin = firstBitMismatch(row, xMin, background);
+        xMax = lastBitMismatch(row, xMax + 1, m_width, background);
+    }
+    aabb = {xMin, yMin, xMax - xMin, yMax - yMin};
+    return true;
+}
+
+template <>
+void Image<bool>::flipX() {
+    IMAGE_SCOPE("flipX", static_cast<uint64_t>(m_width) * m_height);
+    detach();
+    const int n = wordCount(m_width);
+    const int shift = 64 * n - m_width;
+    vector<uint64_t> words(n), reversed(n);
+    for(int y = 0 ; y != m_height ; ++y) {
+        auto row = writableRow(y);
+        loadWords(row.data(), m_width, 0, words.data());
+        for(int i = 0 ; i != n ; ++i) {
+            reversed[i] = reverseBits64(words[n - 1 - i]);
+        }
+        // The padding bits are now at the start of the line, drop them
+        if(shift) {
+            for(int i = 0 ; i != n ; ++i) {
+                uint64_t next = (i == n - 1) ? 0 : reversed[i + 1];
+                reversed[i] = (reversed[i] << shift) | (next >> (64 - shift));
+            }
+        }
+        storeWords(reversed.data(), m_width, row.data());
+    }
+}
+
+/* Copy count pixels of a packed scanline starting at pixel srcX to dstX,
+ * both offsets having the same position within their byte. Whole bytes are
+ * moved at once, only the first and last bytes need masking. */
+static void blitAlignedBits(const byte* src, int srcX, byte* dst, int dstX, int count) {
+    const int shift = srcX % 8;
+    const int bytes = (shift + count + 7) / 8;
+    const byte* s = src + srcX / 8;
+    byte* d = dst + dstX / 8;
+    byte headMask = static_cast<byte>(0xFF >> shift);
+    int tailBits = (shift + count) % 8;
+    byte tailMask = tailBits ? static_cast<byte>(0xFF << (8 - tailBits)) : 0xFF;
+    if(bytes == 1) {
+        byte mask = headMask & tailMask;
+        *d = (*d & ~mask) | (*s & mask);
+        return;
+    }
+    // Read the edges first, the source and destination may overlap
+    byte head = s[0], tail = s[bytes - 1];
+    memmove(d + 1, s + 1, bytes - 2);
+    d[0] = (d[0] & ~headMask) | (head & headMask);
+    d[bytes - 1] = (d[bytes - 1] & ~tailMask) | (tail & tailMask);
+}
+
+template <>
+void Image<bool>::blitRegion(ImageCoords c, Rect r, ImageView<bool> const& source) {
+    // Overlapping scanlines are copied bottom up, and from right to left
+    // within a scanline when the destination starts after the source. Views
+    // start on whole bytes, so bit positions are compared from the addresses
+    // of their scanlines.
+    less<const void*> before;
+    bool backwards = before(source.rowUnchecked(r.y).data(), writableRow(c.y).data());
+    bool aligned = (c.x % 8) == (r.x % 8);
+    for(int i = 0 ; i != r.height ; ++i) {
+        int iy = backwards ? r.height - i - 1 : i;
+        auto src = source.rowUnchecked(r.y + iy);
+        auto dst = writableRow(c.y + iy);
+        const intptr_t bytes = static_cast<intptr_t>(reinterpret_cast<uintptr_t>(dst.data()) -
+                                                     reinterpret_cast<uintptr_t>(src.data()));
+        if(aligned) {
+            blitAlignedBits(src.data(), r.x, dst.data(), c.x, r.width);
+        }
+        else if(static_cast<long long>(bytes) * 8 + c.x > r.x) {
+            for(int ix = r.width - 1 ; ix >= 0 ; --ix) {
+                dst[c.x + ix] = src[r.x + ix];
+            }
+        }
+        else {
+            for(int ix = 0 ; ix != r.width ; ++ix) {
+                dst[c.x + ix] = src[r.x + ix];
+            }
+        }
+    }
+}
+
+/* Vectorized kernels
+ * The SIMD variants are compiled with per-function target attributes and
+ * selected at runtime, so that the library still runs on CPUs without them.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static SimdLevel detectSimdLevel() {
+#ifdef IMAGE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return SimdLevel::Avx2;
+    if(__builtin_cpu_supports("ssse3"))
+        return SimdLevel::Ssse3;
+    if(__builtin_cpu_supports("sse2"))
+        return SimdLevel::Sse2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+static SimdLevel supportedSimdLevel() {
+    static const SimdLevel supported = detectSimdLevel();
+    return supported;
+}
+
+static atomic<int> g_simdLevel(static_cast<int>(supportedSimdLevel()));
+
+SimdLevel simdLevel() {
+    return static_cast<SimdLevel>(g_simdLevel.load(memory_order_relaxed));
+}
+
+void setSimdLevel(SimdLevel level) {
+    g_simdLevel = min(static_cast<int>(level), static_cast<int>(supportedSimdLevel()));
+}
+
+/* Reverse the order of the count bytes of row, working inward from both ends.
+ * The SIMD variants reverse whole registers and leave the middle of the row
+ * to the scalar loop. */
+static void reverseBytesScalar(byte* row, int begin, int end) {
+    reverse(row + begin, row + end);
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2")))
+static __m128i reverse128(__m128i v) {
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+__attribute__((target("sse2")))
+static void reverseBytesSse2(byte* row, int begin, int end) {
+    for( ; end - begin >= 32 ; begin += 16, end -= 16) {
+        __m128i left = _mm_loadu_si128(reinterpret_cast<__m128i*>(row + begin));
+        __m128i right = _mm_loadu_si128(reinterpret_cast<__m128i*>(row + end - 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + begin), reverse128(right));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + end - 16), reverse128(left));
+    }
+    reverseBytesScalar(row, begin, end);
+}
+
+__attribute__((target("avx2")))
+static __m256i reverse256(__m256i v) {
+    const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    v = _mm256_shuffle_epi8(v, mask);
+    return _mm256_permute2x128_si256(v, v, 1);
+}
+
+__attribute__((target("avx2")))
+static void reverseBytesAvx2(byte* row, int begin, int end) {
+    for( ; end - begin >= 64 ; begin += 32, end -= 32) {
+        __m256i left = _mm256_loadu_si256(reinterpret_cast<__m256i*>(row + begin));
+        __m256i right = _mm256_loadu_si256(reinterpret_cast<__m256i*>(row + end - 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + begin), reverse256(right));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + end - 32), reverse256(left));
+    }
+    reverseBytesSse2(row, begin, end);
+}
+
+/* Reverse 24 bit pixels 5 at a time: a 16 byte register holds 5 pixels plus
+ * one byte of the next pixel, which is kept in place. The loads of both ends
+ * happen before the stores, and at least one untouched pixel is left between
+ * them, so the extra byte of each store is written back unchanged. */
+__attribute__((target("ssse3")))
+static void reverseTriplesSsse3(RGBTriple* row, int begin, int end) {
+    byte* bytes = reinterpret_cast<byte*>(row);
+    /* Left register: pixels [begin, begin + 5) in bytes 0-14, byte 15 is
+     * kept. Right register starts one byte before pixel end - 5: byte 0 is
+     * kept, pixels [end - 5, end) are in bytes 1-15. */
+    const __m128i toLeft = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0);
+    const __m128i toRight = _mm_setr_epi8(0, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+    const __m128i leftKeep = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+    const __m128i rightKeep = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for( ; end - begin >= 11 ; begin += 5, end -= 5) {
+        byte* l = bytes + 3 * begin;
+        byte* r = bytes + 3 * (end - 5) - 1;
+        __m128i left = _mm_loadu_si128(reinterpret_cast<__m128i*>(l));
+        __m128i right = _mm_loadu_si128(reinterpret_cast<__m128i*>(r));
+        // Each side gets the reversed pixels of the other one
+        __m128i newLeft = _mm_or_si128(_mm_and_si128(leftKeep, left),
+                                       _mm_andnot_si128(leftKeep, _mm_shuffle_epi8(right, toLeft)));
+        __m128i newRight = _mm_or_si128(_mm_and_si128(rightKeep, right),
+                                        _mm_andnot_si128(rightKeep, _mm_shuffle_epi8(left, toRight)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(l), newLeft);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(r), newRight);
+    }
+    reverse(row + begin, row + end);
+}
+#endif
+
+template <>
+void Image<byte>::flipX() {
+    IMAGE_SCOPE("flipX", static_cast<uint64_t>(m_width) * m_height);
+    detach();
+    auto reverseBytes = reverseBytesScalar;
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        reverseBytes = reverseBytesAvx2;
+    else if(simdLevel() >= SimdLevel::Sse2)
+        reverseBytes = reverseBytesSse2;
+#endif
+    for(int y = 0 ; y != m_height ; ++y) {
+        reverseBytes(writableRow(y).data(), 0, m_width);
+    }
+}
+
+template <>
+void Image<RGBTriple>::flipX() {
+    IMAGE_SCOPE("flipX", static_cast<uint64_t>(m_width) * m_height);
+    detach();
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Ssse3) {
+        for(int y = 0 ; y != m_height ; ++y) {
+            reverseTriplesSsse3(writableRow(y).data(), 0, m_width);
+        }
+        return;
+    }
+#endif
+    for(int y = 0 ; y != m_height ; ++y) {
+        auto row = writableRow(y);
+        reverse(row.begin(), row.end());
+    }
+}
+
+/* Box filter of greyscale pyramids: columns 2x and 2x + 1 of scanlines a and
+ * b are averaged, rounding to nearest, into out[x] for x in [begin, end). The
+ * SIMD variants handle 16 or 32 outputs at a time and leave the rest to the
+ * scalar loop. */
+static void boxPairsScalar(const byte* a, const byte* b, int begin, int end, byte* out) {
+    for(int x = begin ; x < end ; ++x) {
+        out[x] = static_cast<byte>((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+/* Sums of the pairs of bytes of a and b, as 16 bit values */
+__attribute__((target("sse2")))
+static __m128i pairSums128(__m128i a, __m128i b) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)),
+                         _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8)));
+}
+
+__attribute__((target("sse2")))
+static void boxPairsSse2(const byte* a, const byte* b, int begin, int end, byte* out) {
+    const __m128i two = _mm_set1_epi16(2);
+    for( ; end - begin >= 16 ; begin += 16) {
+        const __m128i* pa = reinterpret_cast<const __m128i*>(a + 2 * begin);
+        const __m128i* pb = reinterpret_cast<const __m128i*>(b + 2 * begin);
+        __m128i low = pairSums128(_mm_loadu_si128(pa), _mm_loadu_si128(pb));
+        __m128i high = pairSums128(_mm_loadu_si128(pa + 1), _mm_loadu_si128(pb + 1));
+        low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+        high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin), _mm_packus_epi16(low, high));
+    }
+    boxPairsScalar(a, b, begin, end, out);
+}
+
+__attribute__((target("avx2")))
+static __m256i pairSums256(__m256i a, __m256i b) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, low), _mm256_srli_epi16(a, 8)),
+                            _mm256_add_epi16(_mm256_and_si256(b, low), _mm256_srli_epi16(b, 8)));
+}
+
+__attribute__((target("avx2")))
+static void boxPairsAvx2(const byte* a, const byte* b, int begin, int end, byte* out) {
+    const __m256i two = _mm256_set1_epi16(2);
+    for( ; end - begin >= 32 ; begin += 32) {
+        const __m256i* pa = reinterpret_cast<const __m256i*>(a + 2 * begin);
+        const __m256i* pb = reinterpret_cast<const __m256i*>(b + 2 * begin);
+        __m256i low = pairSums256(_mm256_loadu_si256(pa), _mm256_loadu_si256(pb));
+        __m256i high = pairSums256(_mm256_loadu_si256(pa + 1), _mm256_loadu_si256(pb + 1));
+        low = _mm256_srli_epi16(_mm256_add_epi16(low, two), 2);
+        high = _mm256_srli_epi16(_mm256_add_epi16(high, two), 2);
+        // Packing works within 128 bit lanes, restore the order of the quarters
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + begin), packed);
+    }
+    boxPairsSse2(a, b, begin, end, out);
+}
+#endif
+
+template <>
+void ImagePyramid<byte>::reduceRow(int k, int y) {
+    ImageView<byte> const& src = m_levels[k - 1];
+    if(m_filter == PyramidFilter::Binomial) {
+        binomialReduceRow(src, y, m_levels[k].width(), levelRow(k, y));
+        return;
+    }
+    auto boxPairs = boxPairsScalar;
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        boxPairs = boxPairsAvx2;
+    else if(simdLevel() >= SimdLevel::Sse2)
+        boxPairs = boxPairsSse2;
+#endif
+    const int width = src.width(), height = src.height();
+    const byte* a = src.rowUnchecked(min(2 * y, height - 1)).data();
+    const byte* b = src.rowUnchecked(min(2 * y + 1, height - 1)).data();
+    byte* out = levelRow(k, y);
+    boxPairs(a, b, 0, width / 2, out);
+    if(width % 2) {
+        out[width / 2] = static_cast<byte>((a[width - 1] + b[width - 1] + 1) >> 1);
+    }
+}
+
+/* Gather the bits of even index of x in its low half, bit 2i going to bit i */
+static uint64_t packEvenBits(uint64_t x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+    return (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+}
+
+/* A pixel of a binary pyramid is set when at least two pixels of its 2x2
+ * block are. Each word of the two source scanlines gives 32 pixels, the
+ * pixels of a pair being aligned on the bits of even index. */
+template <>
+void ImagePyramid<bool>::reduceRow(int k, int y) {
+    ImageView<bool> const& src = m_levels[k - 1];
+    const int width = src.width(), height = src.height(), n = wordCount(width);
+    const int outWidth = m_levels[k].width();
+    vector<uint64_t> a(n), b(n), out(wordCount(outWidth), 0);
+    loadWords(src.rowUnchecked(min(2 * y, height - 1)).data(), width, 0, a.data());
+    loadWords(src.rowUnchecked(min(2 * y + 1, height - 1)).data(), width, 0, b.data());
+    if(width % 2) {
+        // The last pixel is its own pair, it is next to it in the same word
+        uint64_t bit = uint64_t(1) << (63 - width % 64);
+        a[width / 64] |= (a[width / 64] >> 1) & bit;
+        b[width / 64] |= (b[width / 64] >> 1) & bit;
+    }
+    const uint64_t odd = 0x5555555555555555ULL;
+    for(int i = 0 ; i != n ; ++i) {
+        uint64_t ae = (a[i] >> 1) & odd, ao = a[i] & odd;
+        uint64_t be = (b[i] >> 1) & odd, bo = b[i] & odd;
+        uint64_t set = ((ae | ao) & (be | bo)) | (ae & ao) | (be & bo);
+        uint64_t half = packEvenBits(set);
+        out[i / 2] |= (i % 2) ? half : half << 32;
+    }
+    storeWords(out.data(), outWidth, levelRow(k, y));
+}
+
+/* Resampling filters of resize(), as functions of the distance to the center
+ * of the output pixel in source pixels, and their radius */
+static double resizeKernel(ResizeFilter filter, double x) {
+    x = fabs(x);
+    if(filter == ResizeFilter::Bilinear) {
+        return x < 1 ? 1 - x : 0;
+    }
+    if(x < 1e-8) {
+        return 1;
+    }
+    if(x >= 3) {
+        return 0;
+    }
+    const double pi = 3.14159265358979323846;
+    return 3 * sin(pi * x) * sin(pi * x / 3) / (pi * pi * x * x);
+}
+
+static double resizeRadius(ResizeFilter filter) {
+    return filter == ResizeFilter::Bilinear ? 1 : 3;
+}
+
+/* When downsampling, the filter is stretched by the scale factor so that it
+ * covers every source pixel */
+ResizeAxis::ResizeAxis(int inSize, int outSize, ResizeFilter filter) {
+    const double scale = static_cast<double>(inSize) / outSize;
+    const double filterScale = max(scale, 1.0);
+    const double support = resizeRadius(filter) * filterScale;
+    taps = (2 * static_cast<int>(ceil(support)) + 1 + 3) / 4 * 4;
+    starts.resize(outSize);
+    counts.resize(outSize);
+    weights.assign(static_cast<size_t>(outSize) * taps, 0.f);
+    vector<double> w(taps);
+    for(int i = 0 ; i != outSize ; ++i) {
+        double center = (i + 0.5) * scale;
+        int first = max(0, static_cast<int>(floor(center - support + 0.5)));
+        int last = min(inSize, static_cast<int>(floor(center + support + 0.5)));
+        double total = 0;
+        for(int k = 0 ; k != last - first ; ++k) {
+            w[k] = resizeKernel(filter, (first + k + 0.5 - center) / filterScale);
+            total += w[k];
+        }
+        for(int k = 0 ; k != last - first ; ++k) {
+            weights[static_cast<size_t>(i) * taps + k] = static_cast<float>(total ? w[k] / total : 0);
+        }
+        starts[i] = first;
+        counts[i] = last - first;
+    }
+}
+
+/* The horizontal pass reads the taps pixels of every output pixel, zero
+ * weights included, so that the SIMD variants handle them 4 or 8 at a time.
+ * The vertical pass accumulates whole scanlines. Both keep the order of the
+ * additions of the scalar loops but the horizontal sums of registers. */
+static void resizeRowScalar(const float* in, ResizeAxis const& axis, int width, float* out) {
+    const int taps = axis.taps;
+    for(int x = 0 ; x != width ; ++x) {
+        const float* p = in + axis.starts[x];
+        const float* w = axis.weights.data() + static_cast<size_t>(x) * taps;
+        float sum = 0;
+        for(int k = 0 ; k != taps ; ++k) {
+            sum += p[k] * w[k];
+        }
+        out[x] = sum;
+    }
+}
+
+static void resizeColumnScalar(const float* const* rows, const float* weights, int count,
+                               int begin, int width, float* out) {
+    for(int x = begin ; x != width ; ++x) {
+        float sum = 0;
+        for(int k = 0 ; k != count ; ++k) {
+            sum += rows[k][x] * weights[k];
+        }
+        out[x] = sum;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2")))
+static float horizontalSum(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static void resizeRowSse2(const float* in, ResizeAxis const& axis, int width, float* out) {
+    const int taps = axis.taps;
+    for(int x = 0 ; x != width ; ++x) {
+        const float* p = in + axis.starts[x];
+        const float* w = axis.weights.data() + static_cast<size_t>(x) * taps;
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0 ; k != taps ; k += 4) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(p + k), _mm_loadu_ps(w + k)));
+        }
+        out[x] = horizontalSum(sum);
+    }
+}
+
+__attribute__((target("avx2")))
+static void resizeRowAvx2(const float* in, ResizeAxis const& axis, int width, float* out) {
+    const int taps = axis.taps;
+    for(int x = 0 ; x != width ; ++x) {
+        const float* p = in + axis.starts[x];
+        const float* w = axis.weights.data() + static_cast<size_t>(x) * taps;
+        __m256 sum8 = _mm256_setzero_ps();
+        int k = 0;
+        for( ; k + 8 <= taps ; k += 8) {
+            sum8 = _mm256_add_ps(sum8, _mm256_mul_ps(_mm256_loadu_ps(p + k), _mm256_loadu_ps(w + k)));
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+        if(k != taps) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(p + k), _mm_loadu_ps(w + k)));
+        }
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        out[x] = _mm_cvtss_f32(sum);
+    }
+}
+
+__attribute__((target("sse2")))
+static void resizeColumnSse2(const float* const* rows, const float* weights, int count,
+                             int begin, int width, float* out) {
+    for( ; width - begin >= 4 ; begin += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0 ; k != count ; ++k) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(rows[k] + begin), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(out + begin, sum);
+    }
+    resizeColumnScalar(rows, weights, count, begin, width, out);
+}
+
+__attribute__((target("avx2")))
+static void resizeColumnAvx2(const float* const* rows, const float* weights, int count,
+                             int begin, int width, float* out) {
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for(int k = 0 ; k != count ; ++k) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + begin),
+                                                   _mm256_set1_ps(weights[k])));
+        }
+        _mm256_storeu_ps(out + begin, sum);
+    }
+    resizeColumnSse2(rows, weights, count, begin, width, out);
+}
+#endif
+
+void resizeRow(const float* in, ResizeAxis const& axis, int width, float* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return resizeRowAvx2(in, axis, width, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return resizeRowSse2(in, axis, width, out);
+#endif
+    resizeRowScalar(in, axis, width, out);
+}
+
+void resizeColumn(const float* const* rows, const float* weights, int count, int width, float* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return resizeColumnAvx2(rows, weights, count, 0, width, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return resizeColumnSse2(rows, weights, count, 0, width, out);
+#endif
+    resizeColumnScalar(rows, weights, count, 0, width, out);
+}
+
+/* Convolution
+ * The 8 bit passes multiply pairs of 16 bit pixels by pairs of weights and
+ * sum them in 32 bits, so that every variant computes the exact same
+ * result. The float passes keep the order of the additions of the scalar
+ * loops. */
+vector<int16_t> quantizeKernel(vector<float> const& kernel) {
+    double gain = 0, sum = 0;
+    for(float w : kernel) {
+        gain += fabs(w);
+        sum += w;
+    }
+    if(gain > 2) {
+        return vector<int16_t>();
+    }
+    vector<int16_t> weights(kernel.size());
+    long total = 0;
+    for(size_t i = 0 ; i != kernel.size() ; ++i) {
+        weights[i] = static_cast<int16_t>(lround(kernel[i] * 16384.));
+        total += weights[i];
+    }
+    // The rounding errors go to the center weight, so that flat areas keep
+    // their value
+    const long center = weights[kernel.size() / 2] + lround(sum * 16384.) - total;
+    if(center < -32767 || center > 32767) {
+        return vector<int16_t>();
+    }
+    weights[kernel.size() / 2] = static_cast<int16_t>(center);
+    return weights;
+}
+
+static void convolveRowFixedScalar(const byte* line, const int16_t* weights, int taps, int begin, int width,
+                                   int16_t* out) {
+    for(int x = begin ; x != width ; ++x) {
+        int sum = 128;
+        for(int k = 0 ; k != taps ; ++k) {
+            sum += weights[k] * line[x + k];
+        }
+        out[x] = static_cast<int16_t>(sum >> 8);
+    }
+}
+
+static void convolveColumnFixedScalar(const int16_t* const* rows, const int16_t* weights, int taps, int begin,
+                                      int width, byte* out) {
+    for(int x = begin ; x != width ; ++x) {
+        int sum = 1 << 19;
+        for(int k = 0 ; k != taps ; ++k) {
+            sum += weights[k] * rows[k][x];
+        }
+        out[x] = static_cast<byte>(min(255, max(0, sum >> 20)));
+    }
+}
+
+static void convolveRowScalar(const float* line, const float* weights, int taps, int begin, int width,
+                              float* out) {
+    for(int x = begin ; x != width ; ++x) {
+        float sum = 0;
+        for(int k = 0 ; k != taps ; ++k) {
+            sum += line[x + k] * weights[k];
+        }
+        out[x] = sum;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+/* Weights k and k + 1 in each 32 bit lane, the last weight of an odd
+ * kernel being paired with 0 */
+static int weightPair(const int16_t* weights, int k, int taps) {
+    const uint32_t high = k + 1 < taps ? static_cast<uint16_t>(weights[k + 1]) : 0;
+    return static_cast<int>(static_cast<uint16_t>(weights[k]) | high << 16);
+}
+
+__attribute__((target("sse2")))
+static void convolveRowFixedSse2(const byte* line, const int16_t* weights, int taps, int begin, int width,
+                                 int16_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m128i low = _mm_set1_epi32(128), high = low;
+        for(int k = 0 ; k < taps ; k += 2) {
+            const __m128i w = _mm_set1_epi32(weightPair(weights, k, taps));
+            const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(line + begin + k)), zero);
+            // The pixel paired with a zero weight may be past the line
+            const __m128i b = k + 1 < taps ? _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(line + begin + k + 1)), zero) : zero;
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin),
+                         _mm_packs_epi32(_mm_srai_epi32(low, 8), _mm_srai_epi32(high, 8)));
+    }
+    convolveRowFixedScalar(line, weights, taps, begin, width, out);
+}
+
+__attribute__((target("avx2")))
+static void convolveRowFixedAvx2(const byte* line, const int16_t* weights, int taps, int begin, int width,
+                                 int16_t* out) {
+    for( ; width - begin >= 16 ; begin += 16) {
+        __m256i low = _mm256_set1_epi32(128), high = low;
+        for(int k = 0 ; k < taps ; k += 2) {
+            const __m256i w = _mm256_set1_epi32(weightPair(weights, k, taps));
+            const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(line + begin + k)));
+            const __m256i b = k + 1 < taps ? _mm256_cvtepu8_epi16(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + begin + k + 1))) : _mm256_setzero_si256();
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        // Both unpack and pack work within 128 bit lanes, which keeps the
+        // pixels in order
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + begin),
+                            _mm256_packs_epi32(_mm256_srai_epi32(low, 8), _mm256_srai_epi32(high, 8)));
+    }
+    convolveRowFixedSse2(line, weights, taps, begin, width, out);
+}
+
+__attribute__((target("sse2")))
+static void convolveColumnFixedSse2(const int16_t* const* rows, const int16_t* weights, int taps, int begin,
+                                    int width, byte* out) {
+    const __m128i zero = _mm_setzero_si128();
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m128i low = _mm_set1_epi32(1 << 19), high = low;
+        for(int k = 0 ; k < taps ; k += 2) {
+            const __m128i w = _mm_set1_epi32(weightPair(weights, k, taps));
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + begin));
+            const __m128i b = k + 1 < taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + begin)) : zero;
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        const __m128i v = _mm_packs_epi32(_mm_srai_epi32(low, 20), _mm_srai_epi32(high, 20));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + begin), _mm_packus_epi16(v, v));
+    }
+    convolveColumnFixedScalar(rows, weights, taps, begin, width, out);
+}
+
+__attribute__((target("avx2")))
+static void convolveColumnFixedAvx2(const int16_t* const* rows, const int16_t* weights, int taps, int begin,
+                                    int width, byte* out) {
+    for( ; width - begin >= 16 ; begin += 16) {
+        __m256i low = _mm256_set1_epi32(1 << 19), high = low;
+        for(int k = 0 ; k < taps ; k += 2) {
+            const __m256i w = _mm256_set1_epi32(weightPair(weights, k, taps));
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + begin));
+            const __m256i b = k + 1 < taps ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + begin))
+                                           : _mm256_setzero_si256();
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(low, 20), _mm256_srai_epi32(high, 20));
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin), _mm256_castsi256_si128(v));
+    }
+    convolveColumnFixedSse2(rows, weights, taps, begin, width, out);
+}
+
+__attribute__((target("sse2")))
+static void convolveRowSse2(const float* line, const float* weights, int taps, int begin, int width,
+                            float* out) {
+    for( ; width - begin >= 4 ; begin += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0 ; k != taps ; ++k) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(line + begin + k), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(out + begin, sum);
+    }
+    convolveRowScalar(line, weights, taps, begin, width, out);
+}
+
+__attribute__((target("avx2")))
+static void convolveRowAvx2(const float* line, const float* weights, int taps, int begin, int width,
+                            float* out) {
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for(int k = 0 ; k != taps ; ++k) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(line + begin + k), _mm256_set1_ps(weights[k])));
+        }
+        _mm256_storeu_ps(out + begin, sum);
+    }
+    convolveRowSse2(line, weights, taps, begin, width, out);
+}
+#endif
+
+void convolveRowFixed(const byte* line, const int16_t* weights, int taps, int width, int16_t* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return convolveRowFixedAvx2(line, weights, taps, 0, width, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return convolveRowFixedSse2(line, weights, taps, 0, width, out);
+#endif
+    convolveRowFixedScalar(line, weights, taps, 0, width, out);
+}
+
+void convolveColumnFixed(const int16_t* const* rows, const int16_t* weights, int taps, int width, byte* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return convolveColumnFixedAvx2(rows, weights, taps, 0, width, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return convolveColumnFixedSse2(rows, weights, taps, 0, width, out);
+#endif
+    convolveColumnFixedScalar(rows, weights, taps, 0, width, out);
+}
+
+void convolveRow(const float* line, const float* weights, int taps, int width, float* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return convolveRowAvx2(line, weights, taps, 0, width, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return convolveRowSse2(line, weights, taps, 0, width, out);
+#endif
+    convolveRowScalar(line, weights, taps, 0, width, out);
+}
+
+vector<float> gaussianKernel(float sigma) {
+    if(!(sigma > 0)) {
+        throw runtime_error("Invalid sigma");
+    }
+    const int radius = static_cast<int>(ceil(3 * sigma));
+    vector<double> weights(2 * radius + 1);
+    double sum = 0;
+    for(int i = -radius ; i <= radius ; ++i) {
+        weights[i + radius] = exp(-i * i / (2. * sigma * sigma));
+        sum += weights[i + radius];
+    }
+    vector<float> kernel(weights.size());
+    for(size_t i = 0 ; i != weights.size() ; ++i) {
+        kernel[i] = static_cast<float>(weights[i] / sum);
+    }
+    return kernel;
+}
+
+/* Running-sum box filters
+ * Sums are kept in double precision, which is exact for integer pixels and
+ * does not drift along long lines. A box of width w has a variance of
+ * (w^2 - 1) / 12, so Gaussians are approximated by three passes of two odd
+ * widths whose variances add up to sigma^2. */
+vector<int> gaussianBoxRadii(float sigma) {
+    if(!(sigma > 0)) {
+        throw runtime_error("Invalid sigma");
+    }
+    const int passes = 3;
+    const double variance = static_cast<double>(sigma) * sigma;
+    int low = static_cast<int>(floor(sqrt(12 * variance / passes + 1)));
+    if(low % 2 == 0) {
+        --low;
+    }
+    const long lowPasses = lround((12 * variance - passes * low * low - 4. * passes * low - 3 * passes) /
+                                  (-4. * low - 4));
+    vector<int> radii(passes);
+    for(int i = 0 ; i != passes ; ++i) {
+        radii[i] = (i < lowPasses ? low : low + 2) / 2;
+    }
+    return radii;
+}
+
+/* Each running sum depends on the previous one, so Lines scanlines are
+ * filtered together for their additions to overlap */
+template <int Lines>
+static void boxLines(float* const* rows, int width, int radius, BorderMode border, float constant, float* pad) {
+    const size_t padStride = width + 2 * static_cast<size_t>(radius);
+    double sums[Lines];
+    const float* pads[Lines];
+    for(int i = 0 ; i != Lines ; ++i) {
+        pads[i] = pad + padStride * i;
+        padLine(rows[i], width, radius, border, constant, pad + padStride * i);
+        sums[i] = 0;
+        for(int k = 0 ; k != 2 * radius + 1 ; ++k) {
+            sums[i] += pads[i][k];
+        }
+    }
+    const double scale = 1. / (2 * radius + 1);
+    for(int x = 0 ; x != width - 1 ; ++x) {
+        for(int i = 0 ; i != Lines ; ++i) {
+            rows[i][x] = static_cast<float>(sums[i] * scale);
+            sums[i] += static_cast<double>(pads[i][x + 2 * radius + 1]) - pads[i][x];
+        }
+    }
+    for(int i = 0 ; i != Lines ; ++i) {
+        rows[i][width - 1] = static_cast<float>(sums[i] * scale);
+    }
+}
+
+void boxRows(float* const* rows, int count, int width, vector<int> const& radii, BorderMode border, float constant,
+             float* pad) {
+    for(int radius : radii) {
+        int i = 0;
+        for( ; count - i >= BOX_LINES ; i += BOX_LINES) {
+            boxLines<BOX_LINES>(rows + i, width, radius, border, constant, pad);
+        }
+        for( ; i != count ; ++i) {
+            boxLines<1>(rows + i, width, radius, border, constant, pad);
+        }
+    }
+}
+
+/* Output the sums of a box of scanlines and slide it by one scanline */
+static void boxStepScalar(double* sums, const float* add, const float* sub, double scale, int begin, int count,
+                          float* out) {
+    for(int k = begin ; k != count ; ++k) {
+        sums[k] += add[k];
+        out[k] = static_cast<float>(sums[k] * scale);
+        sums[k] -= sub[k];
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2")))
+static void boxStepSse2(double* sums, const float* add, const float* sub, double scale, int begin, int count,
+                        float* out) {
+    const __m128d s = _mm_set1_pd(scale);
+    for( ; count - begin >= 2 ; begin += 2) {
+        __m128d sum = _mm_add_pd(_mm_loadu_pd(sums + begin),
+                                 _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(add + begin)))));
+        _mm_storel_pd(reinterpret_cast<double*>(out + begin), _mm_castps_pd(_mm_cvtpd_ps(_mm_mul_pd(sum, s))));
+        sum = _mm_sub_pd(sum, _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(sub + begin)))));
+        _mm_storeu_pd(sums + begin, sum);
+    }
+    boxStepScalar(sums, add, sub, scale, begin, count, out);
+}
+
+__attribute__((target("avx2")))
+static void boxStepAvx2(double* sums, const float* add, const float* sub, double scale, int begin, int count,
+                        float* out) {
+    const __m256d s = _mm256_set1_pd(scale);
+    for( ; count - begin >= 4 ; begin += 4) {
+        __m256d sum = _mm256_add_pd(_mm256_loadu_pd(sums + begin), _mm256_cvtps_pd(_mm_loadu_ps(add + begin)));
+        _mm_storeu_ps(out + begin, _mm256_cvtpd_ps(_mm256_mul_pd(sum, s)));
+        sum = _mm256_sub_pd(sum, _mm256_cvtps_pd(_mm_loadu_ps(sub + begin)));
+        _mm256_storeu_pd(sums + begin, sum);
+    }
+    boxStepSse2(sums, add, sub, scale, begin, count, out);
+}
+#endif
+
+void boxStep(double* sums, const float* add, const float* sub, double scale, int count, float* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return boxStepAvx2(sums, add, sub, scale, 0, count, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return boxStepSse2(sums, add, sub, scale, 0, count, out);
+#endif
+    boxStepScalar(sums, add, sub, scale, 0, count, out);
+}
+
+/* Summed-area tables
+ * Row y + 1 of a table is row y plus the running sum of scanline y, the
+ * first entry of every row being 0. The kernels resume the running sum of
+ * the entries before begin. */
+static void integralRowScalar(const byte* row, int begin, int width, uint64_t const* above, uint64_t* out) {
+    uint64_t sum = out[begin] - above[begin];
+    for(int x = begin ; x != width ; ++x) {
+        sum += row[x];
+        out[x + 1] = above[x + 1] + sum;
+    }
+}
+
+static void integralSquaresRowScalar(const byte* row, int begin, int width, uint64_t const* above,
+                                     uint64_t* out) {
+    uint64_t sum = out[begin] - above[begin];
+    for(int x = begin ; x != width ; ++x) {
+        sum += static_cast<unsigned>(row[x]) * row[x];
+        out[x + 1] = above[x + 1] + sum;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+/* Running sums of 8 pixels computed in 16 or 32 bit lanes, then widened */
+__attribute__((target("sse2")))
+static void storeRunningSums(__m128i low, __m128i high, uint64_t sum, uint64_t const* above, uint64_t* out) {
+    const __m128i zero = _mm_setzero_si128(), base = _mm_set1_epi64x(static_cast<long long>(sum));
+    const __m128i quads[4] = {_mm_unpacklo_epi32(low, zero), _mm_unpackhi_epi32(low, zero),
+                              _mm_unpacklo_epi32(high, zero), _mm_unpackhi_epi32(high, zero)};
+    for(int i = 0 ; i != 4 ; ++i) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), _mm_add_epi64(_mm_add_epi64(a, base), quads[i]));
+    }
+}
+
+__attribute__((target("sse2")))
+static void integralRowSse2(const byte* row, int begin, int width, uint64_t const* above, uint64_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = out[begin] - above[begin];
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + begin)), zero);
+        w = _mm_add_epi16(w, _mm_slli_si128(w, 2));
+        w = _mm_add_epi16(w, _mm_slli_si128(w, 4));
+        w = _mm_add_epi16(w, _mm_slli_si128(w, 8));
+        storeRunningSums(_mm_unpacklo_epi16(w, zero), _mm_unpackhi_epi16(w, zero), sum,
+                         above + begin + 1, out + begin + 1);
+        sum += static_cast<unsigned>(_mm_extract_epi16(w, 7));
+    }
+    integralRowScalar(row, begin, width, above, out);
+}
+
+__attribute__((target("sse2")))
+static void integralSquaresRowSse2(const byte* row, int begin, int width, uint64_t const* above,
+                                   uint64_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = out[begin] - above[begin];
+    for( ; width - begin >= 8 ; begin += 8) {
+        __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + begin)), zero);
+        w = _mm_mullo_epi16(w, w);
+        __m128i low = _mm_unpacklo_epi16(w, zero), high = _mm_unpackhi_epi16(w, zero);
+        low = _mm_add_epi32(low, _mm_slli_si128(low, 4));
+        low = _mm_add_epi32(low, _mm_slli_si128(low, 8));
+        high = _mm_add_epi32(high, _mm_slli_si128(high, 4));
+        high = _mm_add_epi32(high, _mm_slli_si128(high, 8));
+        high = _mm_add_epi32(high, _mm_shuffle_epi32(low, 0xFF));
+        storeRunningSums(low, high, sum, above + begin + 1, out + begin + 1);
+        sum += static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_shuffle_epi32(high, 0xFF)));
+    }
+    integralSquaresRowScalar(row, begin, width, above, out);
+}
+
+__attribute__((target("avx2")))
+static void integralRowAvx2(const byte* row, int begin, int width, uint64_t const* above, uint64_t* out) {
+    uint64_t sum = out[begin] - above[begin];
+    for( ; width - begin >= 16 ; begin += 16) {
+        __m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + begin)));
+        w = _mm256_add_epi16(w, _mm256_slli_si256(w, 2));
+        w = _mm256_add_epi16(w, _mm256_slli_si256(w, 4));
+        w = _mm256_add_epi16(w, _mm256_slli_si256(w, 8));
+        // Each half holds the running sums of its own 8 pixels
+        const __m128i low = _mm256_castsi256_si128(w), high = _mm256_extracti128_si256(w, 1);
+        const uint64_t lowTotal = static_cast<unsigned>(_mm_extract_epi16(low, 7));
+        const __m256i lowBase = _mm256_set1_epi64x(static_cast<long long>(sum));
+        const __m256i highBase = _mm256_set1_epi64x(static_cast<long long>(sum + lowTotal));
+        const __m256i quads[4] = {_mm256_add_epi64(lowBase, _mm256_cvtepu16_epi64(low)),
+                                  _mm256_add_epi64(lowBase, _mm256_cvtepu16_epi64(_mm_srli_si128(low, 8))),
+                                  _mm256_add_epi64(highBase, _mm256_cvtepu16_epi64(high)),
+                                  _mm256_add_epi64(highBase, _mm256_cvtepu16_epi64(_mm_srli_si128(high, 8)))};
+        for(int i = 0 ; i != 4 ; ++i) {
+            const int x = begin + 1 + 4 * i;
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(above + x));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_add_epi64(a, quads[i]));
+        }
+        sum += lowTotal + static_cast<unsigned>(_mm_extract_epi16(high, 7));
+    }
+    integralRowSse2(row, begin, width, above, out);
+}
+#endif
+
+static void integralRow(const byte* row, int width, uint64_t const* above, uint64_t* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return integralRowAvx2(row, 0, width, above, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return integralRowSse2(row, 0, width, above, out);
+#endif
+    integralRowScalar(row, 0, width, above, out);
+}
+
+static void integralSquaresRow(const byte* row, int width, uint64_t const* above, uint64_t* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Sse2)
+        return integralSquaresRowSse2(row, 0, width, above, out);
+#endif
+    integralSquaresRowScalar(row, 0, width, above, out);
+}
+
+IntegralImage::IntegralImage(ImageView<byte> const& image, bool squares, ExecutionPolicy const& policy) :
+    m_width(image.width()),
+    m_height(image.height()),
+    m_sums(new ScratchBuffer<uint64_t>((static_cast<size_t>(m_width) + 1) * (m_height + 1))),
+    m_squares(squares ? new ScratchBuffer<uint64_t>((static_cast<size_t>(m_width) + 1) * (m_height + 1)) : nullptr)
+{
+    IMAGE_SCOPE("integralImage", static_cast<uint64_t>(m_width) * m_height);
+    fill_n(m_sums->data(), m_width + 1, 0);
+    if(m_squares) {
+        fill_n(m_squares->data(), m_width + 1, 0);
+    }
+    accumulate(image, 0, m_height, policy);
+}
+
+int IntegralImage::width() const {
+    return m_width;
+}
+
+int IntegralImage::height() const {
+    return m_height;
+}
+
+bool IntegralImage::hasSquares() const {
+    return m_squares != nullptr;
+}
+
+/* Minimum height of the bands of accumulate() */
+static const int INTEGRAL_BAND_ROWS = 64;
+
+void IntegralImage::accumulate(ImageView<byte> const& image, int yBegin, int yEnd, ExecutionPolicy const& policy) {
+    const size_t stride = static_cast<size_t>(m_width) + 1;
+    uint64_t* const tables[2] = {m_sums->data(), m_squares ? m_squares->data() : nullptr};
+    const int tableCount = m_squares ? 2 : 1;
+    const int pitch = static_cast<int>(min<size_t>(stride * sizeof(uint64_t), numeric_limits<int>::max()));
+
+    /* The first band starts from row yBegin, the others from 0 (row 0 of
+     * the tables) and are offset once the bands above them are known. Bands
+     * are high enough for the serial carry below to be a small part of the
+     * work. */
+    ExecutionPolicy bands = policy;
+    bands.bandHeight = max(policy.bandHeight, INTEGRAL_BAND_ROWS);
+    vector<int> bandStarts;
+    mutex bandsMutex;
+    forEachBand(yEnd - yBegin, pitch, bands, [&](int begin, int end) {
+        for(int t = 0 ; t != tableCount ; ++t) {
+            for(int y = yBegin + begin ; y != yBegin + end ; ++y) {
+                uint64_t* out = tables[t] + stride * (y + 1);
+                uint64_t const* above = (begin != 0 && y == yBegin + begin) ? tables[t] : out - stride;
+                out[0] = 0;
+                if(t == 0)
+                    integralRow(image.rowUnchecked(y).data(), m_width, above, out);
+                else
+                    integralSquaresRow(image.rowUnchecked(y).data(), m_width, above, out);
+            }
+        }
+        if(begin != 0) {
+            lock_guard<mutex> lock(bandsMutex);
+            bandStarts.push_back(yBegin + begin);
+        }
+    });
+    if(bandStarts.empty()) {
+        return;
+    }
+    sort(bandStarts.begin(), bandStarts.end());
+
+    /* Table row bandStarts[k] is the last row of the band above band k. The
+     * last rows are offset in order, each by the one above it, then the
+     * other rows of every band by the last row of the band above. */
+    const size_t bandCount = bandStarts.size();
+    for(size_t k = 0 ; k != bandCount ; ++k) {
+        const int last = (k + 1 != bandCount) ? bandStarts[k + 1] : yEnd;
+        for(int t = 0 ; t != tableCount ; ++t) {
+            uint64_t* out = tables[t] + stride * last;
+            uint64_t const* offset = tables[t] + stride * bandStarts[k];
+            for(size_t x = 0 ; x != stride ; ++x) {
+                out[x] += offset[x];
+            }
+        }
+    }
+    const int first = bandStarts[0];
+    forEachBand(yEnd - first, pitch, policy, [&](int begin, int end) {
+        for(int y = first + begin ; y != first + end ; ++y) {
+            auto band = upper_bound(bandStarts.begin(), bandStarts.end(), y);
+            const int last = (band != bandStarts.end()) ? *band : yEnd;
+            if(y + 1 == last) {
+                continue;
+            }
+            for(int t = 0 ; t != tableCount ; ++t) {
+                uint64_t* out = tables[t] + stride * (y + 1);
+                uint64_t const* offset = tables[t] + stride * band[-1];
+                for(size_t x = 0 ; x != stride ; ++x) {
+                    out[x] += offset[x];
+                }
+            }
+        }
+    });
+}
+
+void IntegralImage::update(ImageView<byte> const& image, int yBegin, int yEnd, ExecutionPolicy const& policy) {
+    if(image.width() != m_width || image.height() != m_height) {
+        throw runtime_error("Images have different sizes");
+    }
+    if(yBegin < 0 || yEnd > m_height || yBegin > yEnd) {
+        throw runtime_error("Scanline out of range");
+    }
+    const size_t stride = static_cast<size_t>(m_width) + 1;
+    uint64_t* const tables[2] = {m_sums->data(), m_squares ? m_squares->data() : nullptr};
+    const int tableCount = m_squares ? 2 : 1;
+    vector<uint64_t> delta(tableCount * stride);
+    for(int t = 0 ; t != tableCount ; ++t) {
+        copy_n(tables[t] + stride * yEnd, stride, &delta[t * stride]);
+    }
+    accumulate(image, yBegin, yEnd, policy);
+
+    // Difference the changed scanlines make to the rows below them
+    bool changed = false;
+    for(int t = 0 ; t != tableCount ; ++t) {
+        uint64_t const* last = tables[t] + stride * yEnd;
+        for(size_t x = 0 ; x != stride ; ++x) {
+            delta[t * stride + x] = last[x] - delta[t * stride + x];
+            changed = changed || delta[t * stride + x];
+        }
+    }
+    if(!changed) {
+        return;
+    }
+    const int pitch = static_cast<int>(min<size_t>(stride * sizeof(uint64_t), numeric_limits<int>::max()));
+    forEachBand(m_height - yEnd, pitch, policy, [&](int begin, int end) {
+        for(int t = 0 ; t != tableCount ; ++t) {
+            for(int y = yEnd + begin ; y != yEnd + end ; ++y) {
+                uint64_t* out = tables[t] + stride * (y + 1);
+                for(size_t x = 0 ; x != stride ; ++x) {
+                    out[x] += delta[t * stride + x];
+                }
+            }
+        }
+    });
+}
+
+uint64_t IntegralImage::corners(uint64_t const* table, Rect const& r) const {
+    if(r.x < 0 || r.y < 0 || r.width < 0 || r.height < 0 ||
+       r.x + r.width > m_width || r.y + r.height > m_height) {
+        throw runtime_error("Rect out of image bounds");
+    }
+    const size_t stride = static_cast<size_t>(m_width) + 1;
+    uint64_t const* top = table + stride * r.y;
+    uint64_t const* bottom = table + stride * (r.y + r.height);
+    return bottom[r.x + r.width] - bottom[r.x] - top[r.x + r.width] + top[r.x];
+}
+
+uint64_t IntegralImage::sum(Rect const& r) const {
+    return corners(m_sums->data(), r);
+}
+
+uint64_t IntegralImage::sumOfSquares(Rect const& r) const {
+    if(!m_squares) {
+        throw runtime_error("Integral image built without squares");
+    }
+    return corners(m_squares->data(), r);
+}
+
+double IntegralImage::mean(Rect const& r) const {
+    const uint64_t s = sum(r);
+    const double count = static_cast<double>(r.width) * r.height;
+    return count ? s / count : numeric_limits<double>::quiet_NaN();
+}
+
+double IntegralImage::variance(Rect const& r) const {
+    const uint64_t squares = sumOfSquares(r);
+    const double count = static_cast<double>(r.width) * r.height;
+    if(!count) {
+        return numeric_limits<double>::quiet_NaN();
+    }
+    const double m = sum(r) / count;
+    return max(0., squares / count - m * m);
+}
+
+/* Pixel format conversions
+ * Luma uses the Rec. 709 weights of FreeImage_ConvertToGreyscale() in 15 bit
+ * fixed point, so that every variant gives the same result. Color pixels are
+ * 3 or 4 bytes in FreeImage order, the alpha byte being ignored. The
+ * threshold kernels write whole bytes of 1bpp scanlines, unused bits of the
+ * last byte being 0.
+ */
+static const int LUMA_RED = 6966, LUMA_GREEN = 23436, LUMA_BLUE = 2366, LUMA_SHIFT = 15;
+
+static void lumaRowScalar(const byte* pixels, int pixelBytes, int begin, int width, byte* out) {
+    for(int x = begin ; x != width ; ++x) {
+        const byte* p = pixels + static_cast<size_t>(pixelBytes) * x;
+        out[x] = static_cast<byte>((LUMA_RED * p[FI_RGBA_RED] + LUMA_GREEN * p[FI_RGBA_GREEN] +
+                                    LUMA_BLUE * p[FI_RGBA_BLUE] + (1 << (LUMA_SHIFT - 1))) >> LUMA_SHIFT);
+    }
+}
+
+/* Bit 7 - k of out[x / 8] is set when in[x + k] >= level, level being in
+ * [1, 255] */
+static void thresholdRowScalar(const byte* in, int begin, int width, int level, byte* out) {
+    for(int x = begin ; x < width ; x += 8) {
+        const int n = min(8, width - x);
+        int bits = 0;
+        for(int k = 0 ; k != n ; ++k) {
+            bits |= (in[x + k] >= level) << (7 - k);
+        }
+        out[x / 8] = static_cast<byte>(bits);
+    }
+}
+
+static void expandRowScalar(const byte* bits, int begin, int width, byte unset, byte set, byte* out) {
+    for(int x = begin ; x != width ; ++x) {
+        out[x] = (bits[x / 8] >> (7 - x % 8)) & 1 ? set : unset;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+/* Luma of 8 pixels whose channels are given in 16 bit lanes, as 16 bit
+ * lanes. The rounding term rides along the blue weight. */
+__attribute__((target("sse2")))
+static __m128i luma128(__m128i red, __m128i green, __m128i blue) {
+    const __m128i redGreen = _mm_set1_epi32(LUMA_GREEN << 16 | LUMA_RED);
+    const __m128i blueRound = _mm_set1_epi32(1 << (LUMA_SHIFT - 1) << 16 | LUMA_BLUE);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(red, green), redGreen),
+                                _mm_madd_epi16(_mm_unpacklo_epi16(blue, one), blueRound));
+    __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(red, green), redGreen),
+                                 _mm_madd_epi16(_mm_unpackhi_epi16(blue, one), blueRound));
+    return _mm_packs_epi32(_mm_srli_epi32(low, LUMA_SHIFT), _mm_srli_epi32(high, LUMA_SHIFT));
+}
+
+/* 16 pixels of 3 bytes are loaded in 3 registers, each channel being
+ * gathered from the three of them */
+__attribute__((target("ssse3")))
+static void lumaTriplesSsse3(const byte* pixels, int begin, int width, byte* out) {
+    const __m128i blue0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i blue1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i blue2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i green0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i green1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i green2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i red0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i red1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i red2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i zero = _mm_setzero_si128();
+    for( ; width - begin >= 16 ; begin += 16) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(pixels + 3 * static_cast<size_t>(begin));
+        const __m128i a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1), c = _mm_loadu_si128(p + 2);
+        const __m128i blue = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, blue0), _mm_shuffle_epi8(b, blue1)),
+                                          _mm_shuffle_epi8(c, blue2));
+        const __m128i green = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, green0), _mm_shuffle_epi8(b, green1)),
+                                           _mm_shuffle_epi8(c, green2));
+        const __m128i red = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, red0), _mm_shuffle_epi8(b, red1)),
+                                         _mm_shuffle_epi8(c, red2));
+        __m128i low = luma128(_mm_unpacklo_epi8(red, zero), _mm_unpacklo_epi8(green, zero),
+                              _mm_unpacklo_epi8(blue, zero));
+        __m128i high = luma128(_mm_unpackhi_epi8(red, zero), _mm_unpackhi_epi8(green, zero),
+                               _mm_unpackhi_epi8(blue, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin), _mm_packus_epi16(low, high));
+    }
+    lumaRowScalar(pixels, 3, begin, width, out);
+}
+
+/* Luma of 4 pixels of 4 bytes, as 32 bit lanes: blue and red are weighted
+ * in place, green is shifted down next to the rounding term */
+__attribute__((target("sse2")))
+static __m128i lumaQuad128(__m128i v) {
+    const __m128i blueRed = _mm_set1_epi32(LUMA_RED << 16 | LUMA_BLUE);
+    const __m128i greenRound = _mm_set1_epi32(1 << (LUMA_SHIFT - 1) << 16 | LUMA_GREEN);
+    const __m128i green = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xFF)),
+                                       _mm_set1_epi32(1 << 16));
+    const __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(v, _mm_set1_epi32(0x00FF00FF)), blueRed),
+                                      _mm_madd_epi16(green, greenRound));
+    return _mm_srli_epi32(sum, LUMA_SHIFT);
+}
+
+__attribute__((target("sse2")))
+static void lumaQuadsSse2(const byte* pixels, int begin, int width, byte* out) {
+    for( ; width - begin >= 16 ; begin += 16) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(pixels + 4 * static_cast<size_t>(begin));
+        __m128i low = _mm_packs_epi32(lumaQuad128(_mm_loadu_si128(p)), lumaQuad128(_mm_loadu_si128(p + 1)));
+        __m128i high = _mm_packs_epi32(lumaQuad128(_mm_loadu_si128(p + 2)), lumaQuad128(_mm_loadu_si128(p + 3)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin), _mm_packus_epi16(low, high));
+    }
+    lumaRowScalar(pixels, 4, begin, width, out);
+}
+
+/* The pixels of each half are reversed before the comparison, so that the
+ * byte mask puts the first pixel of a byte in its most significant bit */
+__attribute__((target("sse2")))
+static void thresholdRowSse2(const byte* in, int begin, int width, int level, byte* out) {
+    const __m128i t = _mm_set1_epi8(static_cast<char>(level));
+    for( ; width - begin >= 16 ; begin += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + begin));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+        out[begin / 8] = static_cast<byte>(mask);
+        out[begin / 8 + 1] = static_cast<byte>(mask >> 8);
+    }
+    thresholdRowScalar(in, begin, width, level, out);
+}
+
+__attribute__((target("avx2")))
+static void thresholdRowAvx2(const byte* in, int begin, int width, int level, byte* out) {
+    const __m256i groups = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(level));
+    for( ; width - begin >= 32 ; begin += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + begin));
+        v = _mm256_shuffle_epi8(v, groups);
+        const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v)));
+        memcpy(out + begin / 8, &mask, sizeof(mask));
+    }
+    thresholdRowSse2(in, begin, width, level, out);
+}
+
+/* Each byte of bits is spread over 8 lanes, which keep their own bit */
+__attribute__((target("sse2")))
+static void expandRowSse2(const byte* bits, int begin, int width, byte unset, byte set, byte* out) {
+    const __m128i select = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i on = _mm_set1_epi8(static_cast<char>(set)), off = _mm_set1_epi8(static_cast<char>(unset));
+    for( ; width - begin >= 16 ; begin += 16) {
+        __m128i v = _mm_cvtsi32_si128(bits[begin / 8] | bits[begin / 8 + 1] << 8);
+        v = _mm_unpacklo_epi8(v, v);
+        v = _mm_unpacklo_epi16(v, v);
+        v = _mm_unpacklo_epi32(v, v);
+        const __m128i m = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + begin),
+                         _mm_or_si128(_mm_and_si128(m, on), _mm_andnot_si128(m, off)));
+    }
+    expandRowScalar(bits, begin, width, unset, set, out);
+}
+
+__attribute__((target("avx2")))
+static void expandRowAvx2(const byte* bits, int begin, int width, byte unset, byte set, byte* out) {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1,
+                                            -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i on = _mm256_set1_epi8(static_cast<char>(set)), off = _mm256_set1_epi8(static_cast<char>(unset));
+    for( ; width - begin >= 32 ; begin += 32) {
+        int32_t word;
+        memcpy(&word, bits + begin / 8, sizeof(word));
+        const __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        const __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(v, select), select);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + begin), _mm256_blendv_epi8(off, on, m));
+    }
+    expandRowSse2(bits, begin, width, unset, set, out);
+}
+#endif
+
+static void lumaRow(const byte* pixels, int pixelBytes, int width, byte* out) {
+#ifdef IMAGE_X86_SIMD
+    if(pixelBytes == 3 && simdLevel() >= SimdLevel::Ssse3)
+        return lumaTriplesSsse3(pixels, 0, width, out);
+    if(pixelBytes == 4 && simdLevel() >= SimdLevel::Sse2)
+        return lumaQuadsSse2(pixels, 0, width, out);
+#endif
+    lumaRowScalar(pixels, pixelBytes, 0, width, out);
+}
+
+static void thresholdRow(const byte* in, int width, int level, byte* out) {
+    if(level <= 0 || level > 255) {
+        const int bytes = (width + 7) / 8;
+        fill_n(out, bytes, level <= 0 ? 0xFF : 0);
+        if(level <= 0 && width % 8) {
+            out[bytes - 1] = static_cast<byte>(0xFF00 >> (width % 8));
+        }
+        return;
+    }
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return thresholdRowAvx2(in, 0, width, level, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return thresholdRowSse2(in, 0, width, level, out);
+#endif
+    thresholdRowScalar(in, 0, width, level, out);
+}
+
+static void expandRow(const byte* bits, int width, byte unset, byte set, byte* out) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return expandRowAvx2(bits, 0, width, unset, set, out);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return expandRowSse2(bits, 0, width, unset, set, out);
+#endif
+    expandRowScalar(bits, 0, width, unset, set, out);
+}
+
+GreyscaleImage toGreyscale(ImageView<RGBTriple> const& image, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("toGreyscale", static_cast<uint64_t>(image.width()) * image.height());
+    GreyscaleImage out(image.width(), image.height());
+    out.detach();
+    forEachBand(out.height(), out.pitch(), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            lumaRow(reinterpret_cast<const byte*>(image.rowUnchecked(y).data()), 3, out.width(),
+                    out.writableRow(y).data());
+        }
+    });
+    return out;
+}
+
+GreyscaleImage toGreyscale(ImageView<bool> const& image, byte unset, byte set, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("toGreyscale", static_cast<uint64_t>(image.width()) * image.height());
+    GreyscaleImage out(image.width(), image.height());
+    out.detach();
+    forEachBand(out.height(), out.pitch(), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            expandRow(image.rowUnchecked(y).data(), out.width(), unset, set, out.writableRow(y).data());
+        }
+    });
+    return out;
+}
+
+BinaryImage threshold(ImageView<byte> const& image, int level, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("threshold", static_cast<uint64_t>(image.width()) * image.height());
+    BinaryImage out(image.width(), image.height());
+    out.detach();
+    forEachBand(out.height(), out.pitch(), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            thresholdRow(image.rowUnchecked(y).data(), out.width(), level, out.writableRow(y).data());
+        }
+    });
+    return out;
+}
+
+BinaryImage threshold(ImageView<RGBTriple> const& image, int level, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("threshold", static_cast<uint64_t>(image.width()) * image.height());
+    BinaryImage out(image.width(), image.height());
+    out.detach();
+    forEachBand(out.height(), out.pitch(), policy, [&](int yBegin, int yEnd) {
+        // The luma of a scanline stays in cache until it is thresholded
+        ScratchBuffer<byte> line(max(1, out.width()));
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            lumaRow(reinterpret_cast<const byte*>(image.rowUnchecked(y).data()), 3, out.width(), line.data());
+            thresholdRow(line.data(), out.width(), level, out.writableRow(y).data());
+        }
+    });
+    return out;
+}
+
+array<uint64_t, 256> histogram(ImageView<byte> const& image, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("histogram", static_cast<uint64_t>(image.width()) * image.height());
+    array<uint64_t, 256> total = {};
+    mutex totalMutex;
+    forEachBand(image.height(), image.stride(), policy, [&](int yBegin, int yEnd) {
+        // Four interleaved tables, so that runs of equal pixels do not wait
+        // on the increments of each other
+        vector<uint64_t> counts(4 * 256, 0);
+        const int width = image.width();
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            const byte* row = image.rowUnchecked(y).data();
+            int x = 0;
+            for( ; width - x >= 4 ; x += 4) {
+                ++counts[row[x]];
+                ++counts[256 + row[x + 1]];
+                ++counts[512 + row[x + 2]];
+                ++counts[768 + row[x + 3]];
+            }
+            for( ; x != width ; ++x) {
+                ++counts[row[x]];
+            }
+        }
+        lock_guard<mutex> lock(totalMutex);
+        for(int i = 0 ; i != 256 ; ++i) {
+            total[i] += counts[i] + counts[256 + i] + counts[512 + i] + counts[768 + i];
+        }
+    });
+    return total;
+}
+
+int otsuThreshold(array<uint64_t, 256> const& histogram) {
+    double count = 0, sum = 0;
+    for(int i = 0 ; i != 256 ; ++i) {
+        count += histogram[i];
+        sum += static_cast<double>(i) * histogram[i];
+    }
+    // Pixels below level k + 1 form the low class
+    int level = 1;
+    double best = 0, lowCount = 0, lowSum = 0;
+    for(int k = 0 ; k != 255 ; ++k) {
+        lowCount += histogram[k];
+        lowSum += static_cast<double>(k) * histogram[k];
+        const double highCount = count - lowCount;
+        if(!lowCount) {
+            continue;
+        }
+        if(!highCount) {
+            break;
+        }
+        const double d = lowSum / lowCount - (sum - lowSum) / highCount;
+        const double between = lowCount * highCount * d * d;
+        if(between > best) {
+            best = between;
+            level = k + 1;
+        }
+    }
+    return level;
+}
+
+/* Conversions of freshly loaded bitmaps, see convertBitmap(). Color and
+ * greyscale bitmaps are converted scanline by scanline with the kernels
+ * above, other formats go through FreeImage first. */
+static int bitmapPixelBytes(FIBITMAP* fi) {
+    if(FreeImage_GetImageType(fi) != FIT_BITMAP) {
+        return 0;
+    }
+    switch(FreeImage_GetBPP(fi)) {
+        case 8:
+            return FreeImage_GetColorType(fi) == FIC_MINISBLACK ? 1 : 0;
+        case 24:
+            return 3;
+        case 32:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static FIBITMAP* greyscaleBitmap(FIBITMAP* fi) {
+    const int pixelBytes = bitmapPixelBytes(fi);
+    const int width = FreeImage_GetWidth(fi), height = FreeImage_GetHeight(fi);
+    if(!pixelBytes && FreeImage_GetImageType(fi) == FIT_BITMAP && FreeImage_GetBPP(fi) == 8) {
+        // Colour palette, looked up through the luma of its entries
+        byte grey[256];
+        lumaRow(reinterpret_cast<const byte*>(FreeImage_GetPalette(fi)), 4, 256, grey);
+        FIBITMAP* out = FreeImage_Allocate(width, height, 8);
+        if(out) {
+            for(int y = 0 ; y != height ; ++y) {
+                const byte* in = FreeImage_GetScanLine(fi, y);
+                byte* o = FreeImage_GetScanLine(out, y);
+                for(int x = 0 ; x != width ; ++x) {
+                    o[x] = grey[in[x]];
+                }
+            }
+        }
+        return out;
+    }
+    if(pixelBytes < 3) {
+        return FreeImage_ConvertToGreyscale(fi);
+    }
+    FIBITMAP* out = FreeImage_Allocate(width, height, 8);
+    if(out) {
+        for(int y = 0 ; y != height ; ++y) {
+            lumaRow(FreeImage_GetScanLine(fi, y), pixelBytes, width, FreeImage_GetScanLine(out, y));
+        }
+    }
+    return out;
+}
+
+static FIBITMAP* thresholdBitmap(FIBITMAP* fi, int level) {
+    int pixelBytes = bitmapPixelBytes(fi);
+    FIBITMAP* grey = nullptr;
+    if(!pixelBytes) {
+        grey = greyscaleBitmap(fi);
+        if(!grey) {
+            return nullptr;
+        }
+        IMAGE_COUNT_BITMAP(grey);
+        fi = grey;
+        pixelBytes = 1;
+    }
+    const int width = FreeImage_GetWidth(fi), height = FreeImage_GetHeight(fi);
+    FIBITMAP* out = FreeImage_Allocate(width, height, 1);
+    if(out) {
+        vector<byte> line(pixelBytes == 1 ? 0 : width);
+        for(int y = 0 ; y != height ; ++y) {
+            const byte* in = FreeImage_GetScanLine(fi, y);
+            if(pixelBytes != 1) {
+                lumaRow(in, pixelBytes, width, line.data());
+                in = line.data();
+            }
+            thresholdRow(in, width, level, FreeImage_GetScanLine(out, y));
+        }
+    }
+    if(grey) {
+        FreeImage_Unload(grey);
+    }
+    return out;
+}
+
+/* Background search of getAABB() */
+static const size_t PATTERN_PERIOD = 48;
+
+PixelPattern::PixelPattern(const void* pixel, size_t pixelSize) {
+    memcpy(bytes, pixel, pixelSize);
+    for(size_t i = pixelSize ; i != sizeof(bytes) ; ++i) {
+        bytes[i] = bytes[i - pixelSize];
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t findFirstMismatchSse2(const byte* row, size_t begin, size_t end, const byte* pattern) {
+    for( ; end - begin >= 16 ; begin += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + begin));
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + begin % PATTERN_PERIOD));
+        unsigned mismatch = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) & 0xFFFF;
+        if(mismatch) {
+            return begin + ctz64(mismatch);
+        }
+    }
+    return begin;
+}
+
+__attribute__((target("sse2")))
+static size_t findLastMismatchSse2(const byte* row, size_t begin, size_t end, const byte* pattern) {
+    for( ; end - begin >= 16 ; end -= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + end - 16));
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + (end - 16) % PATTERN_PERIOD));
+        unsigned mismatch = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) & 0xFFFF;
+        if(mismatch) {
+            return end - 16 + 64 - clz64(mismatch);
+        }
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+static size_t findFirstMismatchAvx2(const byte* row, size_t begin, size_t end, const byte* pattern) {
+    for( ; end - begin >= 32 ; begin += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + begin));
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern + begin % PATTERN_PERIOD));
+        uint32_t mismatch = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, p)));
+        if(mismatch) {
+            return begin + ctz64(mismatch);
+        }
+    }
+    return begin;
+}
+
+__attribute__((target("avx2")))
+static size_t findLastMismatchAvx2(const byte* row, size_t begin, size_t end, const byte* pattern) {
+    for( ; end - begin >= 32 ; end -= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + end - 32));
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern + (end - 32) % PATTERN_PERIOD));
+        uint32_t mismatch = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, p)));
+        if(mismatch) {
+            return end - 32 + 64 - clz64(mismatch);
+        }
+    }
+    return end;
+}
+#endif
+
+size_t findFirstMismatch(const byte* row, size_t begin, size_t end, PixelPattern const& pixel) {
+    if(begin >= end) {
+        return end;
+    }
+    const byte* pattern = pixel.bytes;
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        begin = findFirstMismatchAvx2(row, begin, end, pattern);
+    if(simdLevel() >= SimdLevel::Sse2)
+        begin = findFirstMismatchSse2(row, begin, end, pattern);
+#endif
+    while(begin != end && row[begin] == pattern[begin % PATTERN_PERIOD]) {
+        ++begin;
+    }
+    return begin;
+}
+
+size_t findLastMismatch(const byte* row, size_t begin, size_t end, PixelPattern const& pixel) {
+    if(begin >= end) {
+        return begin;
+    }
+    const byte* pattern = pixel.bytes;
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        end = findLastMismatchAvx2(row, begin, end, pattern);
+    if(simdLevel() >= SimdLevel::Sse2)
+        end = findLastMismatchSse2(row, begin, end, pattern);
+#endif
+    while(end != begin && row[end - 1] == pattern[(end - 1) % PATTERN_PERIOD]) {
+        --end;
+    }
+    return end;
+}
+
+/* Content hashing
+ * Each 64 byte stripe is mixed into 8 64-bit accumulators, with a key that
+ * rotates over a block of 16 stripes, after which the accumulators are
+ * scrambled. Every lane only needs a 32x32->64 bit multiply, which SSE2 and
+ * AVX2 provide, and all the variants compute the same value.
+ */
+static const int HASH_BLOCK_STRIPES = 16;
+
+/* Pseudo-random key, generated with splitmix64 from a fixed seed */
+static uint64_t const* hashSecret() {
+    static const vector<uint64_t> secret = []() {
+        vector<uint64_t> words(64);
+        uint64_t state = 0x2545F4914F6CDD1DULL;
+        for(auto& w : words) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            w = z ^ (z >> 31);
+        }
+        return words;
+    }();
+    return secret.data();
+}
+
+/* Offsets of the parts of the secret used by the scrambling and the merges */
+static const int HASH_SCRAMBLE_KEY = 24;
+static const int HASH_MERGE_LOW_KEY = 32;
+static const int HASH_MERGE_HIGH_KEY = 40;
+
+static uint64_t readLittleEndian64(const byte* p) {
+    uint64_t v = 0;
+    for(int i = 7 ; i >= 0 ; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Mix stripes consecutive stripes, key[j] being the first key word of
+ * stripe j */
+static void accumulateScalar(uint64_t* acc, const byte* data, size_t stripes, uint64_t const* key) {
+    for(size_t j = 0 ; j != stripes ; ++j, data += 64, ++key) {
+        for(int i = 0 ; i != 8 ; ++i) {
+            uint64_t d = readLittleEndian64(data + 8 * i);
+            uint64_t dk = d ^ key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+        }
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2")))
+static void accumulateSse2(uint64_t* acc, const byte* data, size_t stripes, uint64_t const* key) {
+    __m128i a[4];
+    for(int i = 0 ; i != 4 ; ++i)
+        a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+    for(size_t j = 0 ; j != stripes ; ++j, data += 64, ++key) {
+        for(int i = 0 ; i != 4 ; ++i) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+            __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 2 * i));
+            __m128i dk = _mm_xor_si128(d, k);
+            __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(3, 3, 1, 1)));
+            __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+        }
+    }
+    for(int i = 0 ; i != 4 ; ++i)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i, a[i]);
+}
+
+__attribute__((target("avx2")))
+static void accumulateAvx2(uint64_t* acc, const byte* data, size_t stripes, uint64_t const* key) {
+    __m256i a[2];
+    for(int i = 0 ; i != 2 ; ++i)
+        a[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc) + i);
+    for(size_t j = 0 ; j != stripes ; ++j, data += 64, ++key) {
+        for(int i = 0 ; i != 2 ; ++i) {
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data) + i);
+            __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + 4 * i));
+            __m256i dk = _mm256_xor_si256(d, k);
+            __m256i product = _mm256_mul_epu32(dk, _mm256_shuffle_epi32(dk, _MM_SHUFFLE(3, 3, 1, 1)));
+            __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+        }
+    }
+    for(int i = 0 ; i != 2 ; ++i)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + i, a[i]);
+}
+#endif
+
+static void accumulate(uint64_t* acc, const byte* data, size_t stripes, uint64_t const* key) {
+#ifdef IMAGE_X86_SIMD
+    if(simdLevel() >= SimdLevel::Avx2)
+        return accumulateAvx2(acc, data, stripes, key);
+    if(simdLevel() >= SimdLevel::Sse2)
+        return accumulateSse2(acc, data, stripes, key);
+#endif
+    accumulateScalar(acc, data, stripes, key);
+}
+
+static void scramble(uint64_t* acc) {
+    uint64_t const* key = hashSecret() + HASH_SCRAMBLE_KEY;
+    for(int i = 0 ; i != 8 ; ++i) {
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ key[i]) * 0x9E3779B1ULL;
+    }
+}
+
+/* Fold the 128-bit product of a and b to 64 bits */
+static uint64_t multiplyFold64(uint64_t a, uint64_t b) {
+    const uint64_t mask = 0xFFFFFFFF;
+    uint64_t lowLow = (a & mask) * (b & mask);
+    uint64_t highLow = (a >> 32) * (b & mask);
+    uint64_t lowHigh = (a & mask) * (b >> 32);
+    uint64_t highHigh = (a >> 32) * (b >> 32);
+    uint64_t cross = (lowLow >> 32) + (highLow & mask) + lowHigh;
+    uint64_t upper = (highLow >> 32) + (cross >> 32) + highHigh;
+    uint64_t lower = (cross << 32) | (lowLow & mask);
+    return lower ^ upper;
+}
+
+static uint64_t mergeAccumulators(uint64_t const* acc, int keyOffset, uint64_t seed) {
+    uint64_t const* key = hashSecret() + keyOffset;
+    uint64_t h = seed;
+    for(int i = 0 ; i != 8 ; i += 2) {
+        h += multiplyFold64(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+    }
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+bool Hash128::operator==(Hash128 const& other) const {
+    return low == other.low && high == other.high;
+}
+
+bool Hash128::operator!=(Hash128 const& other) const {
+    return !(*this == other);
+}
+
+ContentHasher::ContentHasher() :
+    m_acc{0x00000000C2B2AE3DULL, 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL,
+          0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL, 0x0000000085EBCA77ULL,
+          0x27D4EB2F165667C5ULL, 0x000000009E3779B1ULL},
+    m_buffered(0),
+    m_length(0),
+    m_stripes(0)
+{ }
+
+void ContentHasher::consume(const byte* data, size_t stripes) {
+    while(stripes) {
+        int position = m_stripes % HASH_BLOCK_STRIPES;
+        size_t run = min(stripes, static_cast<size_t>(HASH_BLOCK_STRIPES - position));
+        accumulate(m_acc, data, run, hashSecret() + position);
+        m_stripes += run;
+        data += 64 * run;
+        stripes -= run;
+        if(m_stripes % HASH_BLOCK_STRIPES == 0) {
+            scramble(m_acc);
+        }
+    }
+}
+
+void ContentHasher::update(const void* data, size_t size) {
+    const byte* bytes = static_cast<const byte*>(data);
+    m_length += size;
+    if(m_buffered) {
+        size_t n = min(size, sizeof(m_buffer) - m_buffered);
+        memcpy(m_buffer + m_buffered, bytes, n);
+        m_buffered += n;
+        bytes += n;
+        size -= n;
+        if(m_buffered != sizeof(m_buffer)) {
+            return;
+        }
+        consume(m_buffer, 1);
+        m_buffered = 0;
+    }
+    consume(bytes, size / 64);
+    m_buffered = size % 64;
+    if(m_buffered) {
+        memcpy(m_buffer, bytes + size - m_buffered, m_buffered);
+    }
+}
+
+/* The trailing partial stripe is zero-padded, the length being mixed in by
+ * the merge */
+void ContentHasher::finalize(uint64_t* acc) const {
+    copy(m_acc, m_acc + 8, acc);
+    if(m_buffered) {
+        byte last[64] = {};
+        memcpy(last, m_buffer, m_buffered);
+        accumulate(acc, last, 1, hashSecret() + m_stripes % HASH_BLOCK_STRIPES);
+    }
+}
+
+uint64_t ContentHasher::digest() const {
+    return digest128().low;
+}
+
+Hash128 ContentHasher::digest128() const {
+    uint64_t acc[8];
+    finalize(acc);
+    return {mergeAccumulators(acc, HASH_MERGE_LOW_KEY, m_length * 0x9E3779B185EBCA87ULL),
+            mergeAccumulators(acc, HASH_MERGE_HIGH_KEY, ~m_length * 0xC2B2AE3D27D4EB4FULL)};
+}
+
+vector<Rect> diffTiles(TileHashes const& before, TileHashes const& after) {
+    if(before.width != after.width || before.height != after.height ||
+       before.tileSize != after.tileSize) {
+        return {{0, 0, max(before.width, after.width), max(before.height, after.height)}};
+    }
+    vector<Rect> regions;
+    const int size = before.tileSize;
+    for(int ty = 0 ; ty != before.rows ; ++ty) {
+        int y = ty * size;
+        int height = min(size, before.height - y);
+        int tx = 0;
+        while(tx != before.columns) {
+            size_t i = static_cast<size_t>(ty) * before.columns + tx;
+            if(before.hashes[i] == after.hashes[i]) {
+                ++tx;
+                continue;
+            }
+            int first = tx;
+            while(tx != before.columns && before.hashes[i] != after.hashes[i]) {
+                ++tx;
+                ++i;
+            }
+            int x = first * size;
+            regions.push_back({x, y, min(tx * size, before.width) - x, height});
+        }
+    }
+    return regions;
+}
+
+/* Map a signed distance to the [0, 255] range used by the 8-bit distance
+ * transforms: [-128, 127] maps to [0, 255], values out of range are clamped. */
+static byte toSignedByte(float distance) {
+    return 128 + lround(clamp(-128.f, 127.f, distance));
+}
+
 GreyscaleImage::GreyscaleImage(int width, int height) :
-    Image<byte>(width, height, ImageType::Bitmap, 8, 0xFF, 0xFF, 0xFF)
+    Image<byte>(width, height)
 {
     buildPalette();
 }
 
-GreyscaleImage::GreyscaleImage(FIBITMAP* fi) :
-    Image<byte>(fi)
+GreyscaleImage::GreyscaleImage(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<byte>(fi, move(storage))
 {
     buildPalette();
 }
@@ -50,58 +2880,58 @@ GreyscaleImage::~GreyscaleImage() { }
 
 GreyscaleImage::GreyscaleImage(GreyscaleImage const& other) :
     Image<byte>(other)
-{
-    buildPalette();
-}
+{ }
 
 GreyscaleImage& GreyscaleImage::operator=(GreyscaleImage const& other) {
     *static_cast<Image<byte>*>(this) = other;
     return *this;
 }
 
-byte GreyscaleImage::getPixel(int x, int y) const {
-    byte pixel;
-    if(!FreeImage_GetPixelIndex(m_image, x, y, &pixel)) {
-        throw runtime_error("Cannot read pixel");
-    }
-    return pixel;
-}
+GreyscaleImage::GreyscaleImage(GreyscaleImage&& other) :
+    Image<byte>(std::move(other))
+{ }
 
-void GreyscaleImage::setPixel(int x, int y, byte pixel) {
-    if(!FreeImage_SetPixelIndex(m_image, x, y, &pixel)) {
-        throw runtime_error("Cannot set pixel value");
-    }
+GreyscaleImage& GreyscaleImage::operator=(GreyscaleImage&& other) {
+    *static_cast<Image<byte>*>(this) = std::move(other);
+    return *this;
 }
 
-GreyscaleImage GreyscaleImage::fromRawData(vector<byte> vec, int width, int height, bool flip) {
+GreyscaleImage GreyscaleImage::fromRawData(vector<byte> const& vec, int width, int height, bool flip) {
     if(vec.size() != static_cast<size_t>(width * height)) {
         throw runtime_error("Input vector has wrong size");
     }
     GreyscaleImage img(width, height);
     for(int y = 0 ; y != height ; ++y) {
-        int scanlineOffset = width * y;
-        for(int x = 0 ; x != width ; ++x) {
-            byte pixel = vec[x + scanlineOffset];
-            img.setPixel(x, flip? height-y : y, pixel);
-        }
+        auto first = vec.begin() + width * y;
+        copy(first, first + width, img.rowUnchecked(flip ? height - y - 1 : y).begin());
     }
 
     return img;
 }
 
-GreyscaleImage GreyscaleImage::load(string const& filename)
-{
-    FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str());
-    if(fif == FIF_UNKNOWN) {
-        fif = FreeImage_GetFIFFromFilename(filename.c_str());
-        if(fif == FIF_UNKNOWN)
-            throw runtime_error("Cannot open image");
+GreyscaleImage GreyscaleImage::fromRawData(vector<byte>&& vec, int width, int height, bool flip) {
+    if(flip) {
+        return fromRawData(vec, width, height, true);
     }
-    auto fi = FreeImage_Load(fif, filename.c_str());
-    if(!fi) {
-        throw runtime_error("Cannot open image");
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
     }
-    return GreyscaleImage(fi);
+    auto storage = make_shared<vector<byte>>(move(vec));
+    return GreyscaleImage(wrapBits(storage->data(), width, height, width * sizeof(byte)), storage);
+}
+
+GreyscaleImage GreyscaleImage::fromRawData(byte* data, int width, int height, int stride) {
+    return GreyscaleImage(wrapBits(data, width, height, stride));
+}
+
+GreyscaleImage GreyscaleImage::load(string const& filename)
+{
+    return GreyscaleImage(convertBitmap<byte>(loadBitmap(filename), greyscaleBitmap));
+}
+
+GreyscaleImage GreyscaleImage::load(const byte* data, size_t size)
+{
+    return GreyscaleImage(convertBitmap<byte>(loadBitmap(data, size), greyscaleBitmap));
 }
 
 void GreyscaleImage::buildPalette() {
@@ -114,11 +2944,11 @@ void GreyscaleImage::buildPalette() {
 }
 
 RGBImage::RGBImage(int width, int height) :
-    Image<RGBTriple>(width, height, ImageType::Bitmap, 24, 0x0000FF, 0x00FF00, 0xFF0000)
+    Image<RGBTriple>(width, height)
 { }
 
-RGBImage::RGBImage(FIBITMAP* fi) :
-    Image<RGBTriple>(fi)
+RGBImage::RGBImage(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<RGBTriple>(fi, move(storage))
 {  }
 
 RGBImage::~RGBImage() { }
@@ -132,60 +2962,263 @@ RGBImage& RGBImage::operator=(RGBImage const& other) {
     return *this;
 }
 
-RGBTriple RGBImage::getPixel(int x, int y) const {
-    RGBQUAD quad;
-    if(!FreeImage_GetPixelColor(m_image, x, y, &quad)) {
-        throw runtime_error("Cannot read pixel");
+RGBImage::RGBImage(RGBImage&& other) :
+    Image<RGBTriple>(std::move(other))
+{ }
+
+RGBImage& RGBImage::operator=(RGBImage&& other) {
+    *static_cast<Image<RGBTriple>*>(this) = std::move(other);
+    return *this;
+}
+
+RGBImage RGBImage::fromRawData(vector<RGBTriple> const& vec, int width, int height, bool flip) {
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
+    }
+    RGBImage img(width, height);
+    for(int y = 0 ; y != height ; ++y) {
+        auto first = vec.begin() + width * y;
+        copy(first, first + width, img.rowUnchecked(flip ? height - y - 1 : y).begin());
     }
-    return {quad.rgbRed, quad.rgbGreen, quad.rgbBlue};
+
+    return img;
 }
 
-void RGBImage::setPixel(int x, int y, RGBTriple pixel) {
-    RGBQUAD quad = {pixel.rgbtRed, pixel.rgbtGreen, pixel.rgbtBlue, 0};
-    if(!FreeImage_SetPixelColor(m_image, x, y, &quad)) {
-        throw runtime_error("Cannot set pixel value");
+RGBImage RGBImage::fromRawData(vector<RGBTriple>&& vec, int width, int height, bool flip) {
+    if(flip) {
+        return fromRawData(vec, width, height, true);
+    }
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
     }
+    auto storage = make_shared<vector<RGBTriple>>(move(vec));
+    return RGBImage(wrapBits(storage->data(), width, height, width * sizeof(RGBTriple)), storage);
+}
+
+RGBImage RGBImage::fromRawData(RGBTriple* data, int width, int height, int stride) {
+    return RGBImage(wrapBits(data, width, height, stride));
+}
+
+RGBImage RGBImage::load(string const& filename)
+{
+    return RGBImage(convertBitmap<RGBTriple>(loadBitmap(filename), FreeImage_ConvertTo24Bits));
+}
+
+RGBImage RGBImage::load(const byte* data, size_t size)
+{
+    return RGBImage(convertBitmap<RGBTriple>(loadBitmap(data, size), FreeImage_ConvertTo24Bits));
+}
+
+Grey16Image::Grey16Image(int width, int height) :
+    Image<uint16_t>(width, height)
+{ }
+
+Grey16Image::Grey16Image(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<uint16_t>(fi, move(storage))
+{ }
+
+Grey16Image::~Grey16Image() { }
+
+Grey16Image::Grey16Image(Grey16Image const& other) :
+    Image<uint16_t>(other)
+{ }
+
+Grey16Image& Grey16Image::operator=(Grey16Image const& other) {
+    *static_cast<Image<uint16_t>*>(this) = other;
+    return *this;
+}
+
+Grey16Image::Grey16Image(Grey16Image&& other) :
+    Image<uint16_t>(std::move(other))
+{ }
+
+Grey16Image& Grey16Image::operator=(Grey16Image&& other) {
+    *static_cast<Image<uint16_t>*>(this) = std::move(other);
+    return *this;
 }
 
-RGBImage RGBImage::fromRawData(vector<RGBTriple> vec, int width, int height, bool flip) {
+Grey16Image Grey16Image::fromRawData(vector<uint16_t> const& vec, int width, int height, bool flip) {
     if(vec.size() != static_cast<size_t>(width * height)) {
         throw runtime_error("Input vector has wrong size");
     }
-    RGBImage img(width, height);
+    Grey16Image img(width, height);
     for(int y = 0 ; y != height ; ++y) {
-        int scanlineOffset = width * y;
-        for(int x = 0 ; x != width ; ++x) {
-            RGBTriple pixel = vec[x + scanlineOffset];
-            img.setPixel(x, flip? height-y : y, pixel);
-        }
+        auto first = vec.begin() + width * y;
+        copy(first, first + width, img.rowUnchecked(flip ? height - y - 1 : y).begin());
     }
 
     return img;
 }
 
-RGBImage RGBImage::load(string const& filename)
+Grey16Image Grey16Image::fromRawData(vector<uint16_t>&& vec, int width, int height, bool flip) {
+    if(flip) {
+        return fromRawData(vec, width, height, true);
+    }
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
+    }
+    auto storage = make_shared<vector<uint16_t>>(move(vec));
+    return Grey16Image(wrapBits(storage->data(), width, height, width * sizeof(uint16_t)), storage);
+}
+
+Grey16Image Grey16Image::fromRawData(uint16_t* data, int width, int height, int stride) {
+    return Grey16Image(wrapBits(data, width, height, stride));
+}
+
+Grey16Image Grey16Image::load(string const& filename)
 {
-    FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str());
-    if(fif == FIF_UNKNOWN) {
-        fif = FreeImage_GetFIFFromFilename(filename.c_str());
-        if(fif == FIF_UNKNOWN)
-            throw runtime_error("Cannot open image");
+    return Grey16Image(convertBitmap<uint16_t>(loadBitmap(filename), FreeImage_ConvertToUINT16));
+}
+
+Grey16Image Grey16Image::load(const byte* data, size_t size)
+{
+    return Grey16Image(convertBitmap<uint16_t>(loadBitmap(data, size), FreeImage_ConvertToUINT16));
+}
+
+static FIBITMAP* DLL_CALLCONV convertToUint32(FIBITMAP* fi) {
+    return FreeImage_ConvertToType(fi, FIT_UINT32, TRUE);
+}
+
+Grey32Image::Grey32Image(int width, int height) :
+    Image<uint32_t>(width, height)
+{ }
+
+Grey32Image::Grey32Image(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<uint32_t>(fi, move(storage))
+{ }
+
+Grey32Image::~Grey32Image() { }
+
+Grey32Image::Grey32Image(Grey32Image const& other) :
+    Image<uint32_t>(other)
+{ }
+
+Grey32Image& Grey32Image::operator=(Grey32Image const& other) {
+    *static_cast<Image<uint32_t>*>(this) = other;
+    return *this;
+}
+
+Grey32Image::Grey32Image(Grey32Image&& other) :
+    Image<uint32_t>(std::move(other))
+{ }
+
+Grey32Image& Grey32Image::operator=(Grey32Image&& other) {
+    *static_cast<Image<uint32_t>*>(this) = std::move(other);
+    return *this;
+}
+
+Grey32Image Grey32Image::fromRawData(vector<uint32_t> const& vec, int width, int height, bool flip) {
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
     }
-    auto fi = FreeImage_Load(fif, filename.c_str());
-    if(!fi) {
-        throw runtime_error("Cannot open image");
+    Grey32Image img(width, height);
+    for(int y = 0 ; y != height ; ++y) {
+        auto first = vec.begin() + width * y;
+        copy(first, first + width, img.rowUnchecked(flip ? height - y - 1 : y).begin());
+    }
+
+    return img;
+}
+
+Grey32Image Grey32Image::fromRawData(vector<uint32_t>&& vec, int width, int height, bool flip) {
+    if(flip) {
+        return fromRawData(vec, width, height, true);
+    }
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
+    }
+    auto storage = make_shared<vector<uint32_t>>(move(vec));
+    return Grey32Image(wrapBits(storage->data(), width, height, width * sizeof(uint32_t)), storage);
+}
+
+Grey32Image Grey32Image::fromRawData(uint32_t* data, int width, int height, int stride) {
+    return Grey32Image(wrapBits(data, width, height, stride));
+}
+
+Grey32Image Grey32Image::load(string const& filename)
+{
+    return Grey32Image(convertBitmap<uint32_t>(loadBitmap(filename), convertToUint32));
+}
+
+Grey32Image Grey32Image::load(const byte* data, size_t size)
+{
+    return Grey32Image(convertBitmap<uint32_t>(loadBitmap(data, size), convertToUint32));
+}
+
+FloatImage::FloatImage(int width, int height) :
+    Image<float>(width, height)
+{ }
+
+FloatImage::FloatImage(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<float>(fi, move(storage))
+{ }
+
+FloatImage::~FloatImage() { }
+
+FloatImage::FloatImage(FloatImage const& other) :
+    Image<float>(other)
+{ }
+
+FloatImage& FloatImage::operator=(FloatImage const& other) {
+    *static_cast<Image<float>*>(this) = other;
+    return *this;
+}
+
+FloatImage::FloatImage(FloatImage&& other) :
+    Image<float>(std::move(other))
+{ }
+
+FloatImage& FloatImage::operator=(FloatImage&& other) {
+    *static_cast<Image<float>*>(this) = std::move(other);
+    return *this;
+}
+
+FloatImage FloatImage::fromRawData(vector<float> const& vec, int width, int height, bool flip) {
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
+    }
+    FloatImage img(width, height);
+    for(int y = 0 ; y != height ; ++y) {
+        auto first = vec.begin() + width * y;
+        copy(first, first + width, img.rowUnchecked(flip ? height - y - 1 : y).begin());
+    }
+
+    return img;
+}
+
+FloatImage FloatImage::fromRawData(vector<float>&& vec, int width, int height, bool flip) {
+    if(flip) {
+        return fromRawData(vec, width, height, true);
+    }
+    if(vec.size() != static_cast<size_t>(width * height)) {
+        throw runtime_error("Input vector has wrong size");
     }
-    return RGBImage(fi);
+    auto storage = make_shared<vector<float>>(move(vec));
+    return FloatImage(wrapBits(storage->data(), width, height, width * sizeof(float)), storage);
+}
+
+FloatImage FloatImage::fromRawData(float* data, int width, int height, int stride) {
+    return FloatImage(wrapBits(data, width, height, stride));
+}
+
+FloatImage FloatImage::load(string const& filename)
+{
+    return FloatImage(convertBitmap<float>(loadBitmap(filename), FreeImage_ConvertToFloat));
+}
+
+FloatImage FloatImage::load(const byte* data, size_t size)
+{
+    return FloatImage(convertBitmap<float>(loadBitmap(data, size), FreeImage_ConvertToFloat));
 }
 
 BinaryImage::BinaryImage(int width, int height) :
-    Image<bool>(width, height, ImageType::Bitmap, 1, 0xFF, 0xFF, 0xFF)
+    Image<bool>(width, height)
 {
     buildPalette();
 }
 
-BinaryImage::BinaryImage(FIBITMAP* fi) :
-    Image<bool>(fi)
+BinaryImage::BinaryImage(FIBITMAP* fi, shared_ptr<void> storage) :
+    Image<bool>(fi, move(storage))
 {
     buildPalette();
 }
@@ -194,30 +3227,30 @@ BinaryImage::~BinaryImage() { }
 
 BinaryImage::BinaryImage(BinaryImage const& other) :
     Image<bool>(other)
-{
-    buildPalette();
-}
+{ }
 
 BinaryImage& BinaryImage::operator=(BinaryImage const& other) {
     *static_cast<Image<bool>*>(this) = other;
     return *this;
 }
 
-bool BinaryImage::getPixel(int x, int y) const {
-    byte b;
-    if(!FreeImage_GetPixelIndex(m_image, x, y, &b)) {
-        throw runtime_error("Cannot read pixel");
-    }
-    return b;
+BinaryImage::BinaryImage(BinaryImage&& other) :
+    Image<bool>(std::move(other))
+{ }
+
+BinaryImage& BinaryImage::operator=(BinaryImage&& other) {
+    *static_cast<Image<bool>*>(this) = std::move(other);
+    return *this;
 }
 
 bool BinaryImage::isImmediateInterior(int x, int y) const {
-    if(getPixel(x, y)) {
+    auto row = this->row(y);
+    if(row.at(x)) {
         bool top, left, bottom, right;
-        top = (y == 0) ? true : getPixel(x, y - 1);
-        left = (x == 0) ? true : getPixel(x - 1, y);
-        bottom = (y == (m_height - 1)) ? true : getPixel(x, y + 1);
-        right = (x == (m_width - 1)) ? true : getPixel(x + 1, y);
+        top = (y == 0) ? true : rowUnchecked(y - 1)[x];
+        left = (x == 0) ? true : row[x - 1];
+        bottom = (y == (m_height - 1)) ? true : rowUnchecked(y + 1)[x];
+        right = (x == (m_width - 1)) ? true : row[x + 1];
 
         return !(top && left && bottom && right);
     }
@@ -225,47 +3258,91 @@ bool BinaryImage::isImmediateInterior(int x, int y) const {
 }
 
 bool BinaryImage::isImmediateExterior(int x, int y) const {
-    if(!getPixel(x, y)) {
+    auto row = this->row(y);
+    if(!row.at(x)) {
         bool top, left, bottom, right;
-        top = (y == 0) ? false : getPixel(x, y - 1);
-        left = (x == 0) ? false : getPixel(x - 1, y);
-        bottom = (y == (m_height - 1)) ? false : getPixel(x, y + 1);
-        right = (x == (m_width - 1)) ? false : getPixel(x + 1, y);
+        top = (y == 0) ? false : rowUnchecked(y - 1)[x];
+        left = (x == 0) ? false : row[x - 1];
+        bottom = (y == (m_height - 1)) ? false : rowUnchecked(y + 1)[x];
+        right = (x == (m_width - 1)) ? false : row[x + 1];
 
         return top || left || bottom || right;
     }
     return false;
 }
 
-void BinaryImage::setPixel(int x, int y, bool pixel) {
-    byte b = pixel ? 1 : 0;
-    if(!FreeImage_SetPixelIndex(m_image, x, y, &b)) {
-        throw runtime_error("Cannot set pixel value");
+BinaryImage BinaryImage::immediateInterior() const {
+    BinaryImage out(m_width, m_height);
+    const int n = wordCount(m_width);
+    vector<uint64_t> scratch(3 * n), words(n);
+    for(int y = 0 ; y != m_height ; ++y) {
+        boundaryRow(*this, y, true, false, scratch.data(), words.data());
+        storeWords(words.data(), m_width, out.rowUnchecked(y).data());
     }
+    return out;
 }
-GreyscaleImage BinaryImage::deadReckoning3x3(bool symmetry) const {
-    std::vector<std::vector<ImageCoords>> p;
-    p.reserve(m_height);
-    GreyscaleImage out(m_width, m_height);
+
+BinaryImage BinaryImage::immediateExterior() const {
+    BinaryImage out(m_width, m_height);
+    const int n = wordCount(m_width);
+    vector<uint64_t> scratch(3 * n), words(n);
+    for(int y = 0 ; y != m_height ; ++y) {
+        boundaryRow(*this, y, false, true, scratch.data(), words.data());
+        storeWords(words.data(), m_width, out.rowUnchecked(y).data());
+    }
+    return out;
+}
+
+long long BinaryImage::count() const {
+    vector<uint64_t> words(wordCount(m_width));
+    long long total = 0;
+    for(int y = 0 ; y != m_height ; ++y) {
+        loadWords(rowUnchecked(y).data(), m_width, 0, words.data());
+        for(uint64_t w : words) {
+            total += popcount64(w);
+        }
+    }
+    return total;
+}
+
+/* "Dead Reckoning" signed distance transform of img. distances(y) points to
+ * the output of scanline y, p holds the nearest seed of each pixel. */
+template <class Rows>
+static void deadReckoning(ImageView<bool> const& img, bool symmetry, ImageCoords* p, Rows distances) {
+    const int width = img.width(), height = img.height();
+    const float infinity = numeric_limits<float>::infinity();
+    auto nearest = [width, p](int x, int y) -> ImageCoords& {
+        return p[static_cast<size_t>(width) * y + x];
+    };
 
     /* Initialization
      * Set the immediate interior and immediate exterior to 0 and the rest
      * to the "infinity"
      */
-    for(int x = 0 ; x != m_height ; ++x) {
-        p.emplace_back(m_width);
-        for(int y = 0 ; y != m_width ; ++y) {
-            if(isImmediateInterior(x, y) || (symmetry && isImmediateExterior(x, y))) {
-                p[x][y] = {x, y};
-                out.setPixel(x, y, 0);
+    const int n = wordCount(width);
+    vector<uint64_t> scratch(3 * n), seeds(n);
+    for(int y = 0 ; y != height ; ++y) {
+        float* outRow = distances(y);
+        boundaryRow(img, y, true, symmetry, scratch.data(), seeds.data());
+        for(int x = 0 ; x != width ; ++x) {
+            if(testBit(seeds.data(), x)) {
+                nearest(x, y) = {x, y};
+                outRow[x] = 0;
             }
             else {
-                p[x][y] = {-1, -1};
-                out.setPixel(x, y, 255);
+                nearest(x, y) = {-1, -1};
+                outRow[x] = infinity;
             }
         }
     }
 
+    // Distance from (x, y) to its current nearest point
+    auto distance = [&nearest](int x, int y) {
+        ImageCoords const& c = nearest(x, y);
+        int i1 = x - c.x, i2 = y - c.y;
+        return sqrt(static_cast<float>(i1*i1 + i2*i2));
+    };
+
     float d1 = 1.f, d2 = sqrt(2.f);
     /* Forward pass
      * Since we use a different coordinate system than the authors of the
@@ -274,102 +3351,1073 @@ GreyscaleImage BinaryImage::deadReckoning3x3(bool symmetry) const {
      *             1     C    -                     -     C     1
      *          sqrt(2)  1  sqrt(2)                 -     -     -
      */
-    for(int y = 1 ; y != m_height ; ++y) {
-        for(int x = 1 ; x != m_width - 1 ; ++x) {
-            int i1, i2;
-            if(out.getPixel(x-1, y-1) + d2 < out.getPixel(x, y)) {
-                p[x][y] = p[x-1][y-1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+    for(int y = 1 ; y != height ; ++y) {
+        float* o = distances(y);
+        const float* oPrev = distances(y - 1);
+        for(int x = 1 ; x < width - 1 ; ++x) {
+            if(oPrev[x-1] + d2 < o[x]) {
+                nearest(x, y) = nearest(x-1, y-1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x, y-1) + d1 < out.getPixel(x, y)) {
-                p[x][y] = p[x][y-1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(oPrev[x] + d1 < o[x]) {
+                nearest(x, y) = nearest(x, y-1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x+1, y-1) + d2 < out.getPixel(x, y)) {
-                p[x][y] = p[x+1][y-1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(oPrev[x+1] + d2 < o[x]) {
+                nearest(x, y) = nearest(x+1, y-1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x-1, y) + d1 < out.getPixel(x, y)) {
-                p[x][y] = p[x-1][y];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(o[x-1] + d1 < o[x]) {
+                nearest(x, y) = nearest(x-1, y);
+                o[x] = distance(x, y);
             }
         }
     }
 
     // Backward pass
-    for(int y = m_height- 2 ; y >= 0 ; --y) {
-        for(int x = m_width - 2 ; x != 0 ; --x) {
-            int i1, i2;
-            if(out.getPixel(x+1, y+1) + d2 < out.getPixel(x, y)) {
-                p[x][y] = p[x+1][y+1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+    for(int y = height - 2 ; y >= 0 ; --y) {
+        float* o = distances(y);
+        const float* oNext = distances(y + 1);
+        for(int x = width - 2 ; x > 0 ; --x) {
+            if(oNext[x+1] + d2 < o[x]) {
+                nearest(x, y) = nearest(x+1, y+1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x, y+1) + d1 < out.getPixel(x, y)) {
-                p[x][y] = p[x][y+1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(oNext[x] + d1 < o[x]) {
+                nearest(x, y) = nearest(x, y+1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x-1, y+1) + d2 < out.getPixel(x, y)) {
-                p[x][y] = p[x-1][y+1];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(oNext[x-1] + d2 < o[x]) {
+                nearest(x, y) = nearest(x-1, y+1);
+                o[x] = distance(x, y);
             }
-            if(out.getPixel(x+1, y) + d1 < out.getPixel(x, y)) {
-                p[x][y] = p[x+1][y];
-                i1 = x - p[x][y].x, i2 = y - p[x][y].y;
-                out.setPixel(x, y, sqrt(i1*i1 + i2*i2));
+            if(o[x+1] + d1 < o[x]) {
+                nearest(x, y) = nearest(x+1, y);
+                o[x] = distance(x, y);
             }
         }
     }
 
-    // Final pass: mark the inside/outside and map to the correct output range
-    for(int y = 0 ; y != m_height ; ++y) {
-        for(int x = 0 ; x != m_width ; ++x) {
-            byte outPixel = out.getPixel(x, y);
-            char dist = getPixel(x, y) ? clamp<byte>(0, 127, outPixel) :
-                                        -clamp<byte>(0, 128, outPixel);
-            out.setPixel(x, y, dist >= 0 ? static_cast<byte>(dist) + 128 :
-                                           128 - static_cast<byte>(-dist));
+    // Final pass: mark the inside/outside
+    for(int y = 0 ; y != height ; ++y) {
+        auto in = img.rowUnchecked(y);
+        float* o = distances(y);
+        for(int x = 0 ; x != width ; ++x) {
+            if(!in[x]) {
+                o[x] = -o[x];
+            }
+        }
+    }
+}
+
+GreyscaleImage deadReckoning3x3(ImageView<bool> const& image, bool symmetry) {
+    const int width = image.width(), height = image.height();
+    IMAGE_SCOPE("deadReckoning3x3", static_cast<uint64_t>(width) * height);
+    FloatImage distances(width, height);
+    deadReckoning3x3(image, distances, symmetry);
+    GreyscaleImage out(width, height);
+    for(int y = 0 ; y != height ; ++y) {
+        auto in = distances.rowUnchecked(y);
+        auto o = out.rowUnchecked(y);
+        for(int x = 0 ; x != width ; ++x) {
+            o[x] = toSignedByte(in[x]);
+        }
+    }
+    return out;
+}
+
+void deadReckoning3x3(ImageView<bool> const& image, FloatImage& out, bool symmetry) {
+    IMAGE_SCOPE("deadReckoning3x3", static_cast<uint64_t>(image.width()) * image.height());
+    if(out.width() != image.width() || out.height() != image.height()) {
+        throw runtime_error("Output image has wrong size");
+    }
+    ScratchBuffer<ImageCoords> nearest(static_cast<size_t>(image.width()) * image.height());
+    deadReckoning(image, symmetry, nearest.data(), [&out](int y) {
+        return out.rowUnchecked(y).data();
+    });
+}
+
+GreyscaleImage BinaryImage::deadReckoning3x3(bool symmetry) const {
+    return ::deadReckoning3x3(view(), symmetry);
+}
+
+void BinaryImage::deadReckoning3x3(FloatImage& out, bool symmetry) const {
+    ::deadReckoning3x3(view(), out, symmetry);
+}
+
+/* Squared distance of the pixels of an image without seed pixels */
+static const long long NO_SEED = numeric_limits<long long>::max();
+
+static float seedDistance(long long squared) {
+    return squared == NO_SEED ? numeric_limits<float>::infinity() : sqrt(static_cast<float>(squared));
+}
+
+/* Exact Euclidean distance to the nearest seed pixel, where seeds are the
+ * immediate interior and/or exterior of the image. Uses the lower envelope
+ * of parabolas method of Felzenszwalb and Huttenlocher: the row pass computes
+ * the horizontal distance to the nearest seed of each row, the column pass
+ * combines them. emit(y, xBegin, xEnd, d2) is called once per scanline of
+ * every block of 64 columns, d2[x - xBegin] being the squared distance of
+ * pixel x, or NO_SEED. Blocks do not share bytes of packed scanlines, and are
+ * emitted concurrently: outputs are detached beforehand and written through
+ * writableRow(). */
+template <class Emit>
+static void exactDistance(ImageView<bool> const& img, bool interior, bool exterior, int threads,
+                          Emit emit) {
+    const int width = img.width(), height = img.height();
+    const int infinity = numeric_limits<int>::max();
+    ScratchBuffer<int> f(static_cast<size_t>(width) * height);
+
+    // Row pass
+    parallelFor(height, threads, [&](int yBegin, int yEnd) {
+        const int n = wordCount(width);
+        vector<uint64_t> scratch(3 * n), seeds(n);
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            int* fRow = f.data() + static_cast<size_t>(width) * y;
+            boundaryRow(img, y, interior, exterior, scratch.data(), seeds.data());
+            int last = -1;
+            for(int i = 0 ; i != n ; ++i) {
+                int x = 64 * i, xEnd = min(width, x + 64);
+                if(!seeds[i]) {
+                    // No seed in this word, only the distances increase
+                    for( ; x != xEnd ; ++x) {
+                        fRow[x] = (last < 0) ? infinity : x - last;
+                    }
+                    continue;
+                }
+                for( ; x != xEnd ; ++x) {
+                    if(testBit(seeds.data(), x)) {
+                        last = x;
+                    }
+                    fRow[x] = (last < 0) ? infinity : x - last;
+                }
+            }
+            last = -1;
+            for(int x = width - 1 ; x >= 0 ; --x) {
+                if(fRow[x] == 0) {
+                    last = x;
+                }
+                else if(last >= 0 && last - x < fRow[x]) {
+                    fRow[x] = last - x;
+                }
+            }
+        }
+    });
+
+    // Column pass. The columns of a block are transposed so that the
+    // envelopes are built from contiguous memory, and the distances are
+    // emitted by scanlines.
+    parallelFor(wordCount(width), threads, [&](int blockBegin, int blockEnd) {
+        vector<int> columns(static_cast<size_t>(64) * height);
+        vector<long long> distances(static_cast<size_t>(64) * height), line(64);
+        vector<long long> h(height);
+        vector<int> v(height);
+        vector<double> z(height + 1);
+        for(int block = blockBegin ; block != blockEnd ; ++block) {
+            const int xBegin = 64 * block, n = min(width, xBegin + 64) - xBegin;
+            for(int q = 0 ; q != height ; ++q) {
+                const int* fRow = f.data() + static_cast<size_t>(width) * q + xBegin;
+                for(int i = 0 ; i != n ; ++i) {
+                    columns[static_cast<size_t>(height) * i + q] = fRow[i];
+                }
+            }
+            for(int i = 0 ; i != n ; ++i) {
+                const int* column = columns.data() + static_cast<size_t>(height) * i;
+                long long* d = distances.data() + static_cast<size_t>(height) * i;
+                // Lower envelope of the parabolas (y - q)^2 + h(q)
+                int k = -1;
+                for(int q = 0 ; q != height ; ++q) {
+                    int fq = column[q];
+                    if(fq == infinity) {
+                        continue;
+                    }
+                    h[q] = static_cast<long long>(fq) * fq;
+                    double s = -numeric_limits<double>::infinity();
+                    while(k >= 0) {
+                        int p = v[k];
+                        s = (static_cast<double>(h[q] + static_cast<long long>(q) * q) -
+                             static_cast<double>(h[p] + static_cast<long long>(p) * p)) / (2. * (q - p));
+                        if(s > z[k]) {
+                            break;
+                        }
+                        --k;
+                    }
+                    ++k;
+                    v[k] = q;
+                    z[k] = (k == 0) ? -numeric_limits<double>::infinity() : s;
+                    z[k + 1] = numeric_limits<double>::infinity();
+                }
+
+                if(k < 0) {
+                    fill(d, d + height, NO_SEED);
+                    continue;
+                }
+                for(int y = 0, j = 0 ; y != height ; ++y) {
+                    while(z[j + 1] < y) {
+                        ++j;
+                    }
+                    long long dy = y - v[j];
+                    d[y] = dy * dy + h[v[j]];
+                }
+            }
+            for(int y = 0 ; y != height ; ++y) {
+                for(int i = 0 ; i != n ; ++i) {
+                    line[i] = distances[static_cast<size_t>(height) * i + y];
+                }
+                emit(y, xBegin, xBegin + n, line.data());
+            }
+        }
+    });
+}
+
+GreyscaleImage distanceTransform(ImageView<bool> const& image, bool symmetry, int threads) {
+    IMAGE_SCOPE("distanceTransform", static_cast<uint64_t>(image.width()) * image.height());
+    GreyscaleImage out(image.width(), image.height());
+    out.detach();
+    exactDistance(image, true, symmetry, threads,
+                  [&image, &out](int y, int xBegin, int xEnd, const long long* d2) {
+        auto in = image.rowUnchecked(y);
+        auto o = out.writableRow(y);
+        for(int x = xBegin ; x != xEnd ; ++x) {
+            float d = seedDistance(d2[x - xBegin]);
+            o[x] = toSignedByte(in[x] ? d : -d);
+        }
+    });
+    return out;
+}
+
+void distanceTransform(ImageView<bool> const& image, FloatImage& out, bool symmetry, int threads) {
+    IMAGE_SCOPE("distanceTransform", static_cast<uint64_t>(image.width()) * image.height());
+    if(out.width() != image.width() || out.height() != image.height()) {
+        throw runtime_error("Output image has wrong size");
+    }
+    // out may share its pixels with a copy, the emitters must not detach it
+    out.detach();
+    exactDistance(image, true, symmetry, threads,
+                  [&image, &out](int y, int xBegin, int xEnd, const long long* d2) {
+        auto in = image.rowUnchecked(y);
+        auto o = out.writableRow(y);
+        for(int x = xBegin ; x != xEnd ; ++x) {
+            float d = seedDistance(d2[x - xBegin]);
+            o[x] = in[x] ? d : -d;
+        }
+    });
+}
+
+GreyscaleImage BinaryImage::distanceTransform(bool symmetry, int threads) const {
+    return ::distanceTransform(view(), symmetry, threads);
+}
+
+void BinaryImage::distanceTransform(FloatImage& out, bool symmetry, int threads) const {
+    ::distanceTransform(view(), out, symmetry, threads);
+}
+
+/* Morphology
+ * Erosion is computed as the dilation of the complement: AND replaces OR,
+ * and pixels outside of the image are set instead of unset. */
+
+/* Largest disc computed with the packed kernels, larger ones threshold the
+ * exact distance transform */
+static const int DISC_WORD_RADIUS = 32;
+
+/* dst[x] = dst[x] op src[x + k] for every pixel x of a line of n words, the
+ * pixels out of the line being the identity of op. src and dst may be the
+ * same line. */
+template <bool Erode>
+static void combineShifted(uint64_t const* src, uint64_t* dst, int n, int k) {
+    const uint64_t fill = Erode ? ~uint64_t(0) : 0;
+    auto word = [src, n, fill](int i) {
+        return (i < 0 || i >= n) ? fill : src[i];
+    };
+    const int q = abs(k) >> 6, s = abs(k) & 63;
+    if(k >= 0) {
+        for(int i = 0 ; i != n ; ++i) {
+            uint64_t w = s ? (word(i + q) << s) | (word(i + q + 1) >> (64 - s)) : word(i + q);
+            dst[i] = Erode ? dst[i] & w : dst[i] | w;
+        }
+    }
+    else {
+        for(int i = n - 1 ; i >= 0 ; --i) {
+            uint64_t w = s ? (word(i - q) >> s) | (word(i - q - 1) << (64 - s)) : word(i - q);
+            dst[i] = Erode ? dst[i] & w : dst[i] | w;
+        }
+    }
+}
+
+/* Combine the pixels [x - radius, x + radius] of a line into pixel x, by
+ * doubling the window. The windows stay inside the final one, so the line
+ * needs radius pixels of padding for its ends to be exact. */
+template <bool Erode>
+static void windowRow(uint64_t const* line, int n, int radius, uint64_t* out) {
+    fill_n(out, n, Erode ? ~uint64_t(0) : 0);
+    combineShifted<Erode>(line, out, n, -radius);
+    const int length = 2 * radius + 1;
+    int covered = 1;
+    for( ; 2 * covered <= length ; covered *= 2) {
+        combineShifted<Erode>(out, out, n, covered);
+    }
+    if(covered < length) {
+        combineShifted<Erode>(out, out, n, length - covered);
+    }
+}
+
+/* Square element: rows windowed horizontally, then columns windowed the same
+ * way over the rows of the band and its margins. The margins stop at the
+ * image bounds; the windows of the scanlines closer than radius to the top
+ * or bottom of the image are accumulated directly, before the doubling. */
+template <bool Erode>
+static void squareBand(ImageView<bool> const& img, int radius, int yBegin, int yEnd, BinaryImage& out) {
+    const uint64_t fill = Erode ? ~uint64_t(0) : 0;
+    const int width = img.width(), height = img.height(), n = wordCount(width);
+    const int padding = (radius + 63) / 64, lineWords = n + 2 * padding;
+    const int first = max(0, yBegin - radius), rows = min(height, yEnd + radius) - first;
+    vector<uint64_t> line(lineWords, fill), windowed(lineWords);
+    ScratchBuffer<uint64_t> band(static_cast<size_t>(rows) * n);
+    auto bandRow = [&band, n, first](int y) {
+        return band.data() + static_cast<size_t>(n) * (y - first);
+    };
+    for(int y = first ; y != first + rows ; ++y) {
+        loadWords(img.rowUnchecked(y).data(), width, fill, line.data() + padding);
+        windowRow<Erode>(line.data(), lineWords, radius, windowed.data());
+        copy_n(windowed.data() + padding, n, bandRow(y));
+    }
+    auto combine = [n](uint64_t* dst, uint64_t const* src) {
+        for(int j = 0 ; j != n ; ++j) {
+            dst[j] = Erode ? dst[j] & src[j] : dst[j] | src[j];
+        }
+    };
+    // Clipped windows: [0, y + radius] at the top, [y - radius, height) at
+    // the bottom, grown one scanline at a time
+    vector<uint64_t> acc(n);
+    const int topEnd = min(yEnd, radius);
+    if(yBegin < topEnd) {
+        fill_n(acc.data(), n, fill);
+        for(int y = 0 ; y != min(height, yBegin + radius) ; ++y) {
+            combine(acc.data(), bandRow(y));
+        }
+        for(int y = yBegin ; y != topEnd ; ++y) {
+            if(y + radius < height) {
+                combine(acc.data(), bandRow(y + radius));
+            }
+            storeWords(acc.data(), width, out.writableRow(y).data());
+        }
+    }
+    const int bottomBegin = max(topEnd, max(yBegin, height - radius));
+    if(bottomBegin < yEnd) {
+        fill_n(acc.data(), n, fill);
+        for(int y = height - 1 ; y > yEnd - 1 - radius ; --y) {
+            combine(acc.data(), bandRow(y));
+        }
+        for(int y = yEnd - 1 ; y >= bottomBegin ; --y) {
+            combine(acc.data(), bandRow(y - radius));
+            storeWords(acc.data(), width, out.writableRow(y).data());
+        }
+    }
+    // Whole windows, by doubling in place
+    const int length = 2 * radius + 1;
+    auto combineRows = [&](int offset) {
+        for(int y = first ; y + offset < first + rows ; ++y) {
+            combine(bandRow(y), bandRow(y + offset));
+        }
+    };
+    int covered = 1;
+    for( ; 2 * covered <= length ; covered *= 2) {
+        combineRows(covered);
+    }
+    if(covered < length) {
+        combineRows(length - covered);
+    }
+    for(int y = max(yBegin, topEnd) ; y < min(yEnd, bottomBegin) ; ++y) {
+        storeWords(bandRow(y - radius), width, out.writableRow(y).data());
+    }
+}
+
+/* Square element larger than the bands: the Chebyshev distance of every
+ * pixel to the nearest pixel that changes it, computed with one horizontal
+ * and two vertical sweeps whatever the radius, then thresholded. */
+static void squareChebyshev(ImageView<bool> const& img, int radius, bool erode, ExecutionPolicy const& policy,
+                            BinaryImage& out) {
+    const int width = img.width(), height = img.height();
+    const int infinity = numeric_limits<int>::max();
+    ScratchBuffer<int> f(static_cast<size_t>(width) * height);
+
+    // Horizontal distance to the nearest pixel of the other value
+    forEachBand(height, width * static_cast<int>(sizeof(int)), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            auto in = img.rowUnchecked(y);
+            int* fRow = f.data() + static_cast<size_t>(width) * y;
+            int last = -1;
+            for(int x = 0 ; x != width ; ++x) {
+                if(in[x] != erode) {
+                    last = x;
+                }
+                fRow[x] = (last < 0) ? infinity : x - last;
+            }
+            last = -1;
+            for(int x = width - 1 ; x >= 0 ; --x) {
+                if(fRow[x] == 0) {
+                    last = x;
+                }
+                else if(last >= 0 && last - x < fRow[x]) {
+                    fRow[x] = last - x;
+                }
+            }
+        }
+    });
+
+    // Vertical distance to the nearest scanline within radius horizontally,
+    // by scanlines over blocks of 64 columns. The upward sweep replaces f by
+    // the distance to the nearest such scanline below, the downward one
+    // combines it with the nearest above.
+    const int threads = policy.mode == Execution::Sequential ? 1 : policy.threads;
+    parallelFor(wordCount(width), threads, [&](int blockBegin, int blockEnd) {
+        const int xBegin = 64 * blockBegin, xEnd = min(width, 64 * blockEnd);
+        vector<int> nearest(xEnd - xBegin, -1);
+        for(int y = height - 1 ; y >= 0 ; --y) {
+            int* fRow = f.data() + static_cast<size_t>(width) * y;
+            for(int x = xBegin ; x != xEnd ; ++x) {
+                int& below = nearest[x - xBegin];
+                if(fRow[x] <= radius) {
+                    below = y;
+                }
+                fRow[x] = (below < 0) ? infinity : below - y;
+            }
+        }
+        fill(nearest.begin(), nearest.end(), -1);
+        for(int y = 0 ; y != height ; ++y) {
+            const int* fRow = f.data() + static_cast<size_t>(width) * y;
+            auto o = out.writableRow(y);
+            for(int x = xBegin ; x != xEnd ; ++x) {
+                int& above = nearest[x - xBegin];
+                if(fRow[x] == 0) {
+                    above = y;
+                }
+                bool near = fRow[x] <= radius || (above >= 0 && y - above <= radius);
+                o[x] = near != erode;
+            }
+        }
+    });
+}
+
+/* Disc element: the union of the rows dy of the disc, of half width h(dy).
+ * Every source scanline is windowed once with each half width, in a ring of
+ * the 2 * radius + 1 scanlines an output scanline depends on. */
+template <bool Erode>
+static void discBand(ImageView<bool> const& img, int radius, int yBegin, int yEnd, BinaryImage& out) {
+    const uint64_t fill = Erode ? ~uint64_t(0) : 0;
+    const int width = img.width(), height = img.height(), n = wordCount(width);
+    const int ringSize = 2 * radius + 1;
+    vector<int> halfWidth(radius + 1);
+    for(int dy = 0, h = radius ; dy <= radius ; ++dy) {
+        while(h * h + dy * dy > radius * radius) {
+            --h;
+        }
+        halfWidth[dy] = h;
+    }
+    ScratchBuffer<uint64_t> ring(static_cast<size_t>(ringSize) * (radius + 1) * n);
+    auto windowed = [&](int y, int h) {
+        return ring.data() + (static_cast<size_t>(y % ringSize) * (radius + 1) + h) * n;
+    };
+    vector<uint64_t> line(n), acc(n);
+    int next = max(0, yBegin - radius);
+    for(int y = yBegin ; y != yEnd ; ++y) {
+        for( ; next <= min(height - 1, y + radius) ; ++next) {
+            loadWords(img.rowUnchecked(next).data(), width, fill, line.data());
+            copy_n(line.data(), n, windowed(next, 0));
+            for(int h = 1 ; h <= radius ; ++h) {
+                uint64_t* w = windowed(next, h);
+                copy_n(windowed(next, h - 1), n, w);
+                combineShifted<Erode>(line.data(), w, n, h);
+                combineShifted<Erode>(line.data(), w, n, -h);
+            }
+        }
+        fill_n(acc.data(), n, fill);
+        for(int sy = max(0, y - radius) ; sy <= min(height - 1, y + radius) ; ++sy) {
+            uint64_t const* w = windowed(sy, halfWidth[abs(sy - y)]);
+            for(int j = 0 ; j != n ; ++j) {
+                acc[j] = Erode ? acc[j] & w[j] : acc[j] | w[j];
+            }
         }
+        storeWords(acc.data(), width, out.writableRow(y).data());
     }
+}
 
+static BinaryImage morphology(ImageView<bool> const& img, int radius, StructuringElement element,
+                              bool erode, ExecutionPolicy const& policy) {
+    if(radius < 0) {
+        throw runtime_error("Invalid radius");
+    }
+    BinaryImage out(img.width(), img.height());
+    // Written from several threads, by scanlines or blocks of columns
+    out.detach();
+    if(element == StructuringElement::Disc && radius > DISC_WORD_RADIUS) {
+        /* The nearest unset pixel of a set pixel is in the immediate
+         * exterior, and the nearest set pixel of an unset one in the
+         * immediate interior */
+        const long long r2 = static_cast<long long>(radius) * radius;
+        const int threads = policy.mode == Execution::Sequential ? 1 : policy.threads;
+        exactDistance(img, !erode, erode, threads, [&](int y, int xBegin, int xEnd, const long long* d2) {
+            auto in = img.rowUnchecked(y);
+            auto o = out.writableRow(y);
+            for(int x = xBegin ; x != xEnd ; ++x) {
+                bool p = in[x];
+                o[x] = erode ? p && d2[x - xBegin] > r2 : p || d2[x - xBegin] <= r2;
+            }
+        });
+        return out;
+    }
+    const bool disc = element == StructuringElement::Disc;
+    const int stride = ImageView<bool>(out).stride();
+    int threads;
+    if(!disc && radius > bandLayout(img.height(), stride, policy, threads)) {
+        // The margins of the bands would outweigh the bands themselves
+        squareChebyshev(img, radius, erode, policy, out);
+        return out;
+    }
+    forEachBand(img.height(), stride, policy, [&](int yBegin, int yEnd) {
+        if(disc && erode)
+            discBand<true>(img, radius, yBegin, yEnd, out);
+        else if(disc)
+            discBand<false>(img, radius, yBegin, yEnd, out);
+        else if(erode)
+            squareBand<true>(img, radius, yBegin, yEnd, out);
+        else
+            squareBand<false>(img, radius, yBegin, yEnd, out);
+    });
     return out;
 }
 
-BinaryImage BinaryImage::fromRawData(vector<bool> vec, int width, int height, bool flip) {
+BinaryImage BinaryImage::erode(int radius, StructuringElement element, ExecutionPolicy const& policy) const {
+    IMAGE_SCOPE("erode", static_cast<uint64_t>(m_width) * m_height);
+    return morphology(view(), radius, element, true, policy);
+}
+
+BinaryImage BinaryImage::dilate(int radius, StructuringElement element, ExecutionPolicy const& policy) const {
+    IMAGE_SCOPE("dilate", static_cast<uint64_t>(m_width) * m_height);
+    return morphology(view(), radius, element, false, policy);
+}
+
+BinaryImage BinaryImage::open(int radius, StructuringElement element, ExecutionPolicy const& policy) const {
+    IMAGE_SCOPE("open", static_cast<uint64_t>(m_width) * m_height);
+    return morphology(erode(radius, element, policy).view(), radius, element, false, policy);
+}
+
+BinaryImage BinaryImage::close(int radius, StructuringElement element, ExecutionPolicy const& policy) const {
+    IMAGE_SCOPE("close", static_cast<uint64_t>(m_width) * m_height);
+    return morphology(dilate(radius, element, policy).view(), radius, element, true, policy);
+}
+
+/* Connected component labelling
+ * Runs of set pixels are found in bands of scanlines, in parallel, and the
+ * runs of consecutive scanlines of a band which touch are merged with
+ * union-find. The root of a set is always its run with the lowest index,
+ * that is its first run in scanline order. The bands are then stitched,
+ * which only involves the runs of their first scanlines and of the
+ * scanlines above them. */
+struct PixelRun {
+    int x;
+    /* Past the last pixel */
+    int end;
+    int y;
+};
+
+struct RunBand {
+    int yBegin;
+    vector<PixelRun> runs;
+    /* Index of the first run of each scanline, and past the last one */
+    vector<int> rowStarts;
+    vector<int> parents;
+};
+
+/* First pixel in [x, width) of a scanline of words which is equal to value,
+ * or width */
+static int findBit(uint64_t const* words, int width, int x, bool value) {
+    const int n = wordCount(width);
+    for(int i = x >> 6 ; i < n ; ++i) {
+        uint64_t w = value ? words[i] : ~words[i];
+        if(i == x >> 6) {
+            w &= ~uint64_t(0) >> (x & 63);
+        }
+        if(w) {
+            return min(width, 64 * i + clz64(w));
+        }
+    }
+    return width;
+}
+
+static int findRoot(int* parents, int i) {
+    while(parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+/* Merge the sets of the runs [a, aEnd) of a scanline and [b, bEnd) of the
+ * next one which touch, reach being 1 if diagonal neighbours touch */
+static void uniteRows(PixelRun const* runs, int* parents, int a, int aEnd, int b, int bEnd, int reach) {
+    while(a != aEnd && b != bEnd) {
+        if(runs[a].x < runs[b].end + reach && runs[b].x < runs[a].end + reach) {
+            int ra = findRoot(parents, a), rb = findRoot(parents, b);
+            if(ra < rb)
+                parents[rb] = ra;
+            else
+                parents[ra] = rb;
+        }
+        if(runs[a].end < runs[b].end)
+            ++a;
+        else
+            ++b;
+    }
+}
+
+template <class L>
+static Components<L> labelRuns(ImageView<bool> const& image, Connectivity connectivity,
+                               ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("labelComponents", static_cast<uint64_t>(image.width()) * image.height());
+    const int width = image.width(), height = image.height();
+    const int reach = (connectivity == Connectivity::Eight) ? 1 : 0;
+
+    vector<RunBand> bands;
+    mutex bandsMutex;
+    forEachBand(height, image.stride(), policy, [&](int yBegin, int yEnd) {
+        RunBand band;
+        band.yBegin = yBegin;
+        vector<uint64_t> words(wordCount(width));
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            band.rowStarts.push_back(static_cast<int>(band.runs.size()));
+            if(!width) {
+                continue;
+            }
+            loadWords(image.rowUnchecked(y).data(), width, 0, words.data());
+            for(int x = findBit(words.data(), width, 0, true) ; x != width ;
+                x = findBit(words.data(), width, band.runs.back().end, true)) {
+                band.parents.push_back(static_cast<int>(band.runs.size()));
+                band.runs.push_back({x, findBit(words.data(), width, x, false), y});
+            }
+            if(y != yBegin) {
+                const int i = y - yBegin;
+                uniteRows(band.runs.data(), band.parents.data(), band.rowStarts[i - 1], band.rowStarts[i],
+                          band.rowStarts[i], static_cast<int>(band.runs.size()), reach);
+            }
+        }
+        band.rowStarts.push_back(static_cast<int>(band.runs.size()));
+        lock_guard<mutex> lock(bandsMutex);
+        bands.push_back(move(band));
+    });
+    sort(bands.begin(), bands.end(), [](RunBand const& a, RunBand const& b) {
+        return a.yBegin < b.yBegin;
+    });
+
+    size_t total = 0;
+    for(auto const& band : bands) {
+        total += band.runs.size();
+    }
+    if(total > static_cast<size_t>(numeric_limits<int>::max())) {
+        throw runtime_error("Too many runs of pixels");
+    }
+    vector<PixelRun> runs;
+    vector<int> parents, rowStarts(height + 1);
+    runs.reserve(total);
+    parents.reserve(total);
+    for(auto const& band : bands) {
+        const int offset = static_cast<int>(runs.size());
+        for(size_t i = 0 ; i + 1 < band.rowStarts.size() ; ++i) {
+            rowStarts[band.yBegin + i] = offset + band.rowStarts[i];
+        }
+        runs.insert(runs.end(), band.runs.begin(), band.runs.end());
+        for(int p : band.parents) {
+            parents.push_back(offset + p);
+        }
+        if(band.yBegin != 0) {
+            const int y = band.yBegin;
+            uniteRows(runs.data(), parents.data(), rowStarts[y - 1], rowStarts[y],
+                      rowStarts[y], offset + band.rowStarts[1], reach);
+        }
+    }
+    rowStarts[height] = static_cast<int>(total);
+
+    // Roots come first, so every run finds the label of its root assigned
+    struct Extent {
+        int x0, y0, x1, y1;
+        long long count, sumX, sumY;
+    };
+    vector<Extent> extents;
+    vector<L> runLabels(total);
+    for(size_t i = 0 ; i != total ; ++i) {
+        PixelRun const& r = runs[i];
+        const int root = findRoot(parents.data(), static_cast<int>(i));
+        if(root == static_cast<int>(i)) {
+            if(extents.size() == numeric_limits<L>::max()) {
+                throw runtime_error("Too many components for the label type");
+            }
+            extents.push_back({r.x, r.y, r.end, r.y + 1, 0, 0, 0});
+            runLabels[i] = static_cast<L>(extents.size());
+        }
+        else {
+            runLabels[i] = runLabels[root];
+        }
+        Extent& e = extents[runLabels[i] - 1];
+        const long long length = r.end - r.x;
+        e.x0 = min(e.x0, r.x);
+        e.x1 = max(e.x1, r.end);
+        e.y1 = r.y + 1;
+        e.count += length;
+        e.sumX += length * (r.x + r.end - 1) / 2;
+        e.sumY += length * r.y;
+    }
+
+    Components<L> components{typename PixelTraits<L>::image_type(width, height), {}};
+    components.stats.reserve(extents.size());
+    for(Extent const& e : extents) {
+        components.stats.push_back({{e.x0, e.y0, e.x1 - e.x0, e.y1 - e.y0}, e.count,
+                                    static_cast<double>(e.sumX) / e.count,
+                                    static_cast<double>(e.sumY) / e.count});
+    }
+    auto& labels = components.labels;
+    labels.detach();
+    forEachBand(height, ImageView<L>(labels).stride(), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            L* row = labels.writableRow(y).data();
+            for(int i = rowStarts[y] ; i != rowStarts[y + 1] ; ++i) {
+                fill(row + runs[i].x, row + runs[i].end, runLabels[i]);
+            }
+        }
+    });
+    return components;
+}
+
+template <>
+Components<uint16_t> labelComponents<uint16_t>(ImageView<bool> const& image, Connectivity connectivity,
+                                               ExecutionPolicy const& policy) {
+    return labelRuns<uint16_t>(image, connectivity, policy);
+}
+
+template <>
+Components<uint32_t> labelComponents<uint32_t>(ImageView<bool> const& image, Connectivity connectivity,
+                                               ExecutionPolicy const& policy) {
+    return labelRuns<uint32_t>(image, connectivity, policy);
+}
+
+/* Top of the rectangles placed by packRects() over [x, x + width) */
+struct SkylineSegment {
+    int x;
+    int y;
+    int width;
+};
+
+int packRects(vector<Rect>& rects, int width, int padding) {
+    if(width <= 0 || padding < 0) {
+        throw runtime_error("Invalid atlas size");
+    }
+    for(Rect const& r : rects) {
+        if(r.width < 0 || r.height < 0) {
+            throw runtime_error("Invalid rectangle size");
+        }
+        if(r.width > width) {
+            throw runtime_error("Rectangle wider than the atlas");
+        }
+    }
+    vector<size_t> order(rects.size());
+    for(size_t i = 0 ; i != order.size() ; ++i) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&rects](size_t a, size_t b) {
+        return tie(rects[b].height, rects[b].width) < tie(rects[a].height, rects[a].width);
+    });
+
+    /* Rectangles are padded on their right and top, and so is the strip, so
+     * that the padding of the last column and row is not wasted */
+    const int stripWidth = width + padding;
+    vector<SkylineSegment> skyline{{0, 0, stripWidth}};
+    int height = 0;
+    for(size_t i : order) {
+        Rect& r = rects[i];
+        r.x = r.y = 0;
+        if(!r.width || !r.height) {
+            continue;
+        }
+        const int w = r.width + padding;
+        // Lowest, then leftmost position, resting on the highest segment below
+        size_t best = 0;
+        int bestY = 0, bestTop = numeric_limits<int>::max();
+        for(size_t s = 0 ; s != skyline.size() && skyline[s].x + w <= stripWidth ; ++s) {
+            int y = 0;
+            for(size_t t = s ; t != skyline.size() && skyline[t].x < skyline[s].x + w ; ++t) {
+                y = max(y, skyline[t].y);
+            }
+            if(y + r.height < bestTop) {
+                best = s;
+                bestY = y;
+                bestTop = y + r.height;
+            }
+        }
+        r.x = skyline[best].x;
+        r.y = bestY;
+        height = max(height, bestTop);
+
+        // Replace the segments covered by the rectangle with its top
+        const int right = r.x + w;
+        size_t end = best;
+        while(end != skyline.size() && skyline[end].x + skyline[end].width <= right) {
+            ++end;
+        }
+        if(end != skyline.size() && skyline[end].x < right) {
+            skyline[end].width -= right - skyline[end].x;
+            skyline[end].x = right;
+        }
+        skyline.erase(skyline.begin() + best, skyline.begin() + end);
+        skyline.insert(skyline.begin() + best, {r.x, bestTop + padding, w});
+        if(best + 1 != skyline.size() && skyline[best + 1].y == skyline[best].y) {
+            skyline[best].width += skyline[best + 1].width;
+            skyline.erase(skyline.begin() + best + 1);
+        }
+        if(best != 0 && skyline[best - 1].y == skyline[best].y) {
+            skyline[best - 1].width += skyline[best].width;
+            skyline.erase(skyline.begin() + best);
+        }
+    }
+    return height;
+}
+
+GlyphAtlas buildGlyphAtlas(vector<ImageView<bool>> const& glyphs, AtlasOptions const& options) {
+    vector<Rect> placements;
+    placements.reserve(glyphs.size());
+    for(auto const& glyph : glyphs) {
+        placements.push_back({0, 0, glyph.width(), glyph.height()});
+    }
+    const int height = packRects(placements, options.width, options.padding);
+    GlyphAtlas atlas{GreyscaleImage(options.width, max(1, height)), move(placements)};
+
+    // Largest glyphs first, so that the bands left to steal are the cheapest
+    vector<size_t> order(glyphs.size());
+    for(size_t i = 0 ; i != order.size() ; ++i) {
+        order[i] = i;
+    }
+    auto area = [&glyphs](size_t i) {
+        return static_cast<long long>(glyphs[i].width()) * glyphs[i].height();
+    };
+    stable_sort(order.begin(), order.end(), [&area](size_t a, size_t b) {
+        return area(a) > area(b);
+    });
+
+    GreyscaleImage& image = atlas.image;
+    image.detach();
+    forEachBand(static_cast<int>(order.size()), 0, options.policy, [&](int begin, int end) {
+        for(int i = begin ; i != end ; ++i) {
+            Rect const& r = atlas.placements[order[i]];
+            const size_t size = static_cast<size_t>(r.width) * r.height;
+            if(!size) {
+                continue;
+            }
+            ScratchBuffer<float> distances(size);
+            ScratchBuffer<ImageCoords> nearest(size);
+            auto row = [&distances, &r](int y) {
+                return distances.data() + static_cast<size_t>(r.width) * y;
+            };
+            deadReckoning(glyphs[order[i]], options.symmetry, nearest.data(), row);
+            for(int y = 0 ; y != r.height ; ++y) {
+                const float* in = row(y);
+                byte* out = image.writableRow(r.y + y).data() + r.x;
+                for(int x = 0 ; x != r.width ; ++x) {
+                    out[x] = toSignedByte(in[x]);
+                }
+            }
+        }
+    });
+    return atlas;
+}
+
+/* Tiled distance transform
+ * FreeImage can only load and save whole bitmaps, so the scanlines of the
+ * input and output BMP files are accessed directly. Scanline y of a bottom-up
+ * BMP file is scanline y of the FreeImage bitmap.
+ */
+
+/* Seeds further than 128 pixels from a tile cannot change its clamped
+ * output; one more pixel is needed to find the seeds on the border of the
+ * margin, and another one as the pixels of the border of the margin are not
+ * classified correctly. */
+static const int TILE_MARGIN = 130;
+static const int BMP_HEADER_SIZE = 14 + 40;
+
+static uint32_t readLittleEndian32(const byte* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void writeLittleEndian32(byte* p, uint32_t v) {
+    for(int i = 0 ; i != 4 ; ++i) {
+        p[i] = static_cast<byte>(v >> (8 * i));
+    }
+}
+
+struct BmpLayout {
+    int width;
+    int height;
+    /* Offset of the pixel data and size of a scanline in the file */
+    streamoff offset;
+    streamoff pitch;
+    bool topDown;
+
+    streamoff scanlineOffset(int y) const {
+        return offset + pitch * (topDown ? height - 1 - y : y);
+    }
+};
+
+static BmpLayout readBinaryBmpHeader(string const& filename) {
+    ifstream file(filename, ios::binary);
+    byte header[BMP_HEADER_SIZE];
+    if(!file.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+       header[0] != 'B' || header[1] != 'M') {
+        throw runtime_error("Cannot read BMP file " + filename);
+    }
+    int32_t height = static_cast<int32_t>(readLittleEndian32(header + 22));
+    int bpp = header[28] | (header[29] << 8);
+    uint32_t compression = readLittleEndian32(header + 30);
+    if(bpp != 1 || compression != 0) {
+        throw runtime_error("Not an uncompressed 1bpp BMP file: " + filename);
+    }
+    BmpLayout layout;
+    layout.width = static_cast<int32_t>(readLittleEndian32(header + 18));
+    layout.height = abs(height);
+    layout.offset = readLittleEndian32(header + 10);
+    layout.pitch = (static_cast<streamoff>(layout.width) + 31) / 32 * 4;
+    layout.topDown = height < 0;
+    return layout;
+}
+
+/* Write the headers and the grey palette of an 8bpp bottom-up BMP file, and
+ * extend it to its final size */
+static BmpLayout createGreyscaleBmp(string const& filename, int width, int height) {
+    BmpLayout layout;
+    layout.width = width;
+    layout.height = height;
+    layout.offset = BMP_HEADER_SIZE + 256 * 4;
+    layout.pitch = (static_cast<streamoff>(width) + 3) / 4 * 4;
+    layout.topDown = false;
+    streamoff size = layout.offset + layout.pitch * height;
+
+    vector<byte> header(layout.offset, 0);
+    header[0] = 'B';
+    header[1] = 'M';
+    // Sizes that do not fit are left to 0, readers use the dimensions
+    writeLittleEndian32(&header[2], size <= 0xFFFFFFFF ? static_cast<uint32_t>(size) : 0);
+    writeLittleEndian32(&header[10], static_cast<uint32_t>(layout.offset));
+    writeLittleEndian32(&header[14], 40);
+    writeLittleEndian32(&header[18], width);
+    writeLittleEndian32(&header[22], height);
+    header[26] = 1;
+    header[28] = 8;
+    writeLittleEndian32(&header[46], 256);
+    for(int i = 0 ; i != 256 ; ++i) {
+        byte* entry = &header[BMP_HEADER_SIZE + 4 * i];
+        entry[0] = entry[1] = entry[2] = static_cast<byte>(i);
+    }
+    ofstream file(filename, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    if(size > layout.offset) {
+        file.seekp(size - 1);
+        file.put(0);
+    }
+    if(!file) {
+        throw runtime_error("Cannot write BMP file " + filename);
+    }
+    return layout;
+}
+
+void BinaryImage::distanceTransformFile(string const& input, string const& output,
+                                        bool symmetry, int tileSize, int threads) {
+    if(tileSize <= 0) {
+        throw runtime_error("Invalid tile size");
+    }
+    const BmpLayout in = readBinaryBmpHeader(input);
+    const BmpLayout out = createGreyscaleBmp(output, in.width, in.height);
+    // Tiles start on whole words so that the margins start on whole bytes
+    tileSize = (tileSize + 63) / 64 * 64;
+    const int columns = (in.width + tileSize - 1) / tileSize;
+    const int rows = (in.height + tileSize - 1) / tileSize;
+
+    atomic<bool> failed(false);
+    parallelFor(columns * rows, threads, [&](int begin, int end) {
+        ifstream inFile(input, ios::binary);
+        fstream outFile(output, ios::binary | ios::in | ios::out);
+        vector<byte> tile;
+        for(int t = begin ; t != end && !failed ; ++t) {
+            const int x0 = (t % columns) * tileSize, y0 = (t / columns) * tileSize;
+            const int x1 = min(in.width, x0 + tileSize), y1 = min(in.height, y0 + tileSize);
+            const int wx0 = max(0, x0 - TILE_MARGIN) / 8 * 8, wy0 = max(0, y0 - TILE_MARGIN);
+            const int wx1 = min(in.width, x1 + TILE_MARGIN), wy1 = min(in.height, y1 + TILE_MARGIN);
+            const int ww = wx1 - wx0, wh = wy1 - wy0, tw = x1 - x0;
+
+            BinaryImage window(ww, wh);
+            const int rowBytes = (ww + 7) / 8;
+            for(int y = 0 ; y != wh ; ++y) {
+                byte* row = window.rowUnchecked(y).data();
+                inFile.seekg(in.scanlineOffset(wy0 + y) + wx0 / 8);
+                inFile.read(reinterpret_cast<char*>(row), rowBytes);
+                if(ww % 8) {
+                    row[rowBytes - 1] &= static_cast<byte>(0xFF00 >> (ww % 8));
+                }
+            }
+            tile.assign(static_cast<size_t>(tw) * (y1 - y0), 0);
+            const ImageView<bool> source = window.view();
+            exactDistance(source, true, symmetry, 1, [&](int y, int xBegin, int xEnd, const long long* d2) {
+                const int ty = wy0 + y - y0;
+                if(ty < 0 || ty >= y1 - y0) {
+                    return;
+                }
+                auto pixels = source.rowUnchecked(y);
+                for(int x = max(xBegin, x0 - wx0) ; x < min(xEnd, x1 - wx0) ; ++x) {
+                    float d = seedDistance(d2[x - xBegin]);
+                    tile[static_cast<size_t>(tw) * ty + wx0 + x - x0] = toSignedByte(pixels[x] ? d : -d);
+                }
+            });
+            for(int y = y0 ; y != y1 ; ++y) {
+                outFile.seekp(out.scanlineOffset(y) + x0);
+                outFile.write(reinterpret_cast<const char*>(&tile[static_cast<size_t>(tw) * (y - y0)]), tw);
+            }
+            if(!inFile || !outFile) {
+                failed = true;
+            }
+        }
+    });
+    if(failed) {
+        throw runtime_error("I/O error while transforming " + input + " into " + output);
+    }
+}
+
+BinaryImage BinaryImage::fromRawData(vector<bool> const& vec, int width, int height, bool flip) {
     if(vec.size() != static_cast<size_t>(width * height)) {
         throw runtime_error("Input vector has wrong size");
     }
     BinaryImage img(width, height);
     for(int y = 0 ; y != height ; ++y) {
         int scanlineOffset = width * y;
+        auto row = img.rowUnchecked(flip ? height - y - 1 : y);
         for(int x = 0 ; x != width ; ++x) {
-            bool pixel = vec[x + scanlineOffset];
-            img.setPixel(x, flip? height-y : y, pixel);
+            row[x] = vec[x + scanlineOffset];
         }
     }
 
     return img;
 }
 
-BinaryImage BinaryImage::load(string const& filename)
+BinaryImage BinaryImage::fromRawData(byte* data, int width, int height, int stride) {
+    return BinaryImage(wrapBits(data, width, height, stride));
+}
+
+BinaryImage BinaryImage::load(string const& filename, int level)
 {
-    FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str());
-    if(fif == FIF_UNKNOWN) {
-        fif = FreeImage_GetFIFFromFilename(filename.c_str());
-        if(fif == FIF_UNKNOWN)
-            throw runtime_error("Cannot open image");
-    }
-    auto fi = FreeImage_Load(fif, filename.c_str());
-    if(!fi) {
-        throw runtime_error("Cannot open image");
-    }
-    return BinaryImage(fi);
+    return BinaryImage(convertBitmap<bool>(loadBitmap(filename), [=](FIBITMAP* fi) {
+        return thresholdBitmap(fi, level);
+    }));
+}
+
+BinaryImage BinaryImage::load(const byte* data, size_t size, int level)
+{
+    return BinaryImage(convertBitmap<bool>(loadBitmap(data, size), [=](FIBITMAP* fi) {
+        return thresholdBitmap(fi, level);
+    }));
 }
 
 void BinaryImage::buildPalette() {
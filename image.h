@@ -8,9 +8,20 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <FreeImage.h>
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <type_traits>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <unordered_set>
+#include <limits>
+#include <functional>
+#include <array>
 
 using byte = unsigned char;
 using RGBTriple= RGBTRIPLE;
@@ -22,23 +33,59 @@ struct Rect {
     int width;
     int height;
 
-    bool operator==(Rect const& other);
+    bool operator==(Rect const& other) const;
 
-    bool isIn(Rect const& other);
+    bool isIn(Rect const& other) const;
 };
 
 struct ImageCoords {
     int x;
     int y;
 
-    bool isIn(Rect const& r);
+    bool isIn(Rect const& r) const;
 
-    bool operator==(ImageCoords const& other);
+    bool operator==(ImageCoords const& other) const;
 };
 
 std::ostream& operator<<(std::ostream& s, ImageCoords const& c);
 std::ostream& operator<<(std::ostream& s, Rect const& r);
 
+/**
+  * \enum SimdLevel
+  * \brief Instruction sets used by the vectorized code paths.
+  */
+enum class SimdLevel {
+    /** Portable code only */
+    Scalar,
+    Sse2,
+    Ssse3,
+    Avx2
+};
+
+/**
+  * \brief Return the instruction set level used by the library.
+  *
+  * It defaults to the best level supported by the CPU.
+  */
+SimdLevel simdLevel();
+
+/**
+  * \brief Restrict the instruction sets used by the library.
+  *
+  * Levels above what the CPU supports are lowered to the supported level.
+  * This is mostly useful to test and benchmark the fallback code paths.
+  */
+void setSimdLevel(SimdLevel level);
+
+/**
+  * \brief Initialize the FreeImage library.
+  *
+  * The library is initialized once per process and deinitialized at exit.
+  * This function is thread-safe and must be called before FreeImage is used
+  * from several threads.
+  */
+void initFreeImage();
+
 template <class T>
 T clamp(T a, T b, T f) {
     return std::max(std::min(f, b), a);
@@ -65,199 +112,1617 @@ enum class ImageType : typename std::underlying_type<FREE_IMAGE_TYPE>::type {
 };
 
 /**
-  * \enum ImageFormat
-  * \brief Represent the supported image file formats.
+  * \enum ImageFormat
+  * \brief Represent the supported image file formats.
+  */
+enum class ImageFormat : typename std::underlying_type<FREE_IMAGE_FORMAT>::type {
+    /** Bitmap format */
+    Bmp = FIF_BMP,
+    /** Bitmap format, with run length encoding. Only available for 4-8 bpp
+     * bitmaps. */
+    BmpRle,
+    /** PNG format */
+    Png = FIF_PNG,
+    /** TIFF format. Supports 16 bit and floating point images. */
+    Tiff = FIF_TIFF,
+    /** Portable float map format. Only available for floating point images. */
+    Pfm = FIF_PFM
+};
+
+/**
+  * \struct Hash128
+  * \brief 128-bit content hash.
+  */
+struct Hash128 {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(Hash128 const& other) const;
+    bool operator!=(Hash128 const& other) const;
+};
+
+/**
+  * \class ContentHasher
+  * \brief Streaming non-cryptographic hash of a byte sequence.
+  *
+  * The hash only depends on the bytes fed to the hasher, not on how they are
+  * split between calls to update(), nor on the instruction sets in use, so it
+  * is suitable as a persistent cache key. It consumes 64 byte stripes in 8
+  * independent 64-bit lanes, which are vectorized when SIMD is available.
+  */
+class ContentHasher {
+    public:
+        ContentHasher();
+
+        /**
+          * \brief Append bytes to the hashed sequence.
+          */
+        void update(const void* data, size_t size);
+
+        /**
+          * \brief Return the 64-bit hash of the bytes fed so far.
+          */
+        uint64_t digest() const;
+
+        /**
+          * \brief Return the 128-bit hash of the bytes fed so far.
+          */
+        Hash128 digest128() const;
+
+    private:
+        void consume(const byte* data, size_t stripes);
+        void finalize(uint64_t* acc) const;
+
+        uint64_t m_acc[8];
+        byte m_buffer[64];
+        size_t m_buffered;
+        uint64_t m_length;
+        uint64_t m_stripes;
+};
+
+/**
+  * \struct TileHashes
+  * \brief Content hashes of the square tiles of an image.
+  *
+  * Comparing two sets of tile hashes with diffTiles() finds the regions that
+  * changed between two images without reading their pixels again.
+  */
+struct TileHashes {
+    int width;
+    int height;
+    int tileSize;
+    /** Number of tiles per row */
+    int columns;
+    /** Number of rows of tiles */
+    int rows;
+    /** Tile hashes, row by row */
+    std::vector<uint64_t> hashes;
+};
+
+/**
+  * \brief Return the regions covered by tiles whose hashes differ.
+  *
+  * Consecutive differing tiles of a row of tiles are merged in a single
+  * rectangle. If the images or tiles do not have the same size, the whole
+  * image is reported as changed.
+  */
+std::vector<Rect> diffTiles(TileHashes const& before, TileHashes const& after);
+
+/**
+  * \class ImagePool
+  * \brief Process-wide pool recycling the bitmaps and scratch buffers of
+  * same-shape images.
+  *
+  * The pool is disabled by default. Once enabled, the bitmaps of new images
+  * and of copies are taken from the pool when an idle bitmap of the same type,
+  * size and format is available, and destroyed images give their bitmap back
+  * to the pool instead of freeing it. The distance transforms take their
+  * scratch buffers, and integral images their tables, from the pool in the
+  * same way.
+  */
+class ImagePool {
+    public:
+        struct Stats {
+            /** Bitmap requests served by an idle bitmap */
+            uint64_t hits;
+            /** Bitmap requests that needed an allocation */
+            uint64_t misses;
+            /** Scratch buffer requests served by an idle buffer */
+            uint64_t scratchHits;
+            /** Scratch buffer requests that needed an allocation */
+            uint64_t scratchMisses;
+            /** Number of idle bitmaps and scratch buffers */
+            size_t idle;
+            /** Total size in bytes of the idle bitmaps and scratch buffers */
+            size_t idleBytes;
+        };
+
+        static ImagePool& instance();
+
+        void setEnabled(bool enabled);
+        bool enabled() const;
+
+        /**
+          * \brief Set the maximum total size of the idle bitmaps and scratch
+          * buffers, beyond which released ones are freed.
+          */
+        void setCapacity(size_t bytes);
+
+        Stats stats() const;
+        void resetStats();
+
+        /**
+          * \brief Free idle bitmaps and scratch buffers until their total
+          * size is at most bytes.
+          */
+        void trim(size_t bytes = 0);
+
+        /**
+          * \brief Same as FreeImage_AllocateT(), pixels are cleared.
+          */
+        FIBITMAP* allocate(ImageType t, int width, int height, int bpp, unsigned int rMask,
+                           unsigned int gMask, unsigned int bMask);
+
+        /**
+          * \brief Same as FreeImage_Clone(). Bitmaps taken from the pool only
+          * get the pixels, palette and resolution of the original.
+          */
+        FIBITMAP* clone(FIBITMAP* bitmap);
+
+        /**
+          * \brief Give a bitmap back to the pool, or unload it if it was not
+          * allocated by the pool.
+          */
+        void unload(FIBITMAP* bitmap);
+
+        /**
+          * \brief Return an uninitialized buffer of the given size.
+          */
+        void* allocateScratch(size_t bytes);
+
+        /**
+          * \brief Give back a buffer returned by allocateScratch().
+          */
+        void releaseScratch(void* buffer, size_t bytes);
+
+    private:
+        struct Shape {
+            int type;
+            int width;
+            int height;
+            int bpp;
+            unsigned int masks[3];
+
+            bool operator<(Shape const& other) const;
+        };
+
+        ImagePool();
+        ImagePool(ImagePool const&) = delete;
+        ImagePool& operator=(ImagePool const&) = delete;
+
+        FIBITMAP* acquire(Shape const& shape, bool clear);
+        void trimLocked(size_t bytes);
+
+        mutable std::mutex m_mutex;
+        std::atomic<bool> m_enabled;
+        size_t m_capacity;
+        Stats m_stats;
+        std::multimap<Shape, FIBITMAP*> m_idleBitmaps;
+        std::multimap<size_t, void*> m_idleScratch;
+        /* Bitmaps allocated by the pool, in use or idle */
+        std::unordered_set<FIBITMAP*> m_owned;
+        std::atomic<size_t> m_ownedCount;
+};
+
+/**
+  * \class ScratchBuffer
+  * \brief Uninitialized array of trivial values taken from the image pool.
+  */
+template <class U>
+class ScratchBuffer {
+    static_assert(std::is_trivial<U>::value, "Scratch buffers hold trivial types");
+
+    public:
+        explicit ScratchBuffer(size_t count);
+        ~ScratchBuffer();
+        ScratchBuffer(ScratchBuffer const&) = delete;
+        ScratchBuffer& operator=(ScratchBuffer const&) = delete;
+
+        U* data();
+        U& operator[](size_t i);
+        U const& operator[](size_t i) const;
+
+    private:
+        U* m_data;
+        size_t m_count;
+};
+
+/**
+  * \class TraceSink
+  * \brief Receiver of the begin and end events of the instrumented
+  * operations, see Instrumentation::setSink().
+  *
+  * Events are sent by the threads running the operations, concurrently if
+  * several threads work on images.
+  */
+class TraceSink {
+    public:
+        virtual ~TraceSink() = default;
+
+        /**
+          * \param operation Name of the operation
+          * \param thread Small number identifying the calling thread
+          * \param nanoseconds Time elapsed since the instrumentation started
+          */
+        virtual void begin(const char* operation, int thread, uint64_t nanoseconds) = 0;
+
+        /**
+          * \brief Same as begin(), at the end of the operation.
+          * \param pixels Number of pixels processed by the operation
+          */
+        virtual void end(const char* operation, int thread, uint64_t nanoseconds, uint64_t pixels) = 0;
+};
+
+/**
+  * \class ChromeTraceWriter
+  * \brief TraceSink writing the events in the JSON trace event format of
+  * chrome://tracing and Perfetto, which show them as a timeline per thread.
+  *
+  * The JSON array is closed when the writer is destroyed.
+  */
+class ChromeTraceWriter : public TraceSink {
+    public:
+        explicit ChromeTraceWriter(std::ostream& out);
+        ~ChromeTraceWriter();
+        ChromeTraceWriter(ChromeTraceWriter const&) = delete;
+        ChromeTraceWriter& operator=(ChromeTraceWriter const&) = delete;
+
+        void begin(const char* operation, int thread, uint64_t nanoseconds) override;
+        void end(const char* operation, int thread, uint64_t nanoseconds, uint64_t pixels) override;
+
+    private:
+        void write(const char* operation, char phase, int thread, uint64_t nanoseconds);
+
+        std::mutex m_mutex;
+        std::ostream& m_out;
+        bool m_first;
+};
+
+/**
+  * \class Instrumentation
+  * \brief Process-wide timings and counters of the operations on images.
+  *
+  * Instrumentation is compiled in only when IMAGE_INSTRUMENTATION is defined,
+  * which the IMAGE_INSTRUMENTATION CMake option does. Otherwise nothing is
+  * recorded, snapshots are empty and the sink never gets any event.
+  *
+  * Every call to an instrumented operation adds to its call count, wall time,
+  * pixels processed and bytes of bitmaps and scratch buffers allocated by the
+  * calling thread. Operations calling other instrumented ones include their
+  * time, pixels and bytes. Bitmaps allocated by FreeImage and copies of
+  * bitmaps are counted separately. IMAGE_SCOPE() instruments code outside
+  * this library in the same way.
+  */
+class Instrumentation {
+    public:
+        struct OperationStats {
+            /** Number of calls */
+            uint64_t calls;
+            /** Total wall time in nanoseconds */
+            uint64_t nanoseconds;
+            /** Pixels processed */
+            uint64_t pixels;
+            /** Bytes of bitmaps and scratch buffers allocated */
+            uint64_t bytes;
+        };
+
+        struct Snapshot {
+            /** Operations called since the last reset, by name */
+            std::map<std::string, OperationStats> operations;
+            /** Bitmaps whose pixels FreeImage allocated, loaded ones included */
+            uint64_t bitmapAllocations;
+            /** Bitmaps copied, by copy-on-write or by the pool */
+            uint64_t bitmapClones;
+            /** Bytes of bitmaps and scratch buffers allocated */
+            uint64_t bytes;
+        };
+
+        /* Counters of an operation, shared by all the scopes of its name */
+        struct Counters {
+            std::atomic<uint64_t> calls{0};
+            std::atomic<uint64_t> nanoseconds{0};
+            std::atomic<uint64_t> pixels{0};
+            std::atomic<uint64_t> bytes{0};
+        };
+
+        /**
+          * \class Scope
+          * \brief Records a call to an operation from its construction to
+          * its destruction, see IMAGE_SCOPE().
+          */
+        class Scope {
+            public:
+                Scope(const char* operation, Counters& counters, uint64_t pixels);
+                ~Scope();
+                Scope(Scope const&) = delete;
+                Scope& operator=(Scope const&) = delete;
+
+                /**
+                  * \brief Set the number of pixels processed, when it is only
+                  * known once the operation has started.
+                  */
+                void setPixels(uint64_t pixels);
+
+            private:
+                const char* m_operation;
+                Counters& m_counters;
+                uint64_t m_pixels;
+                uint64_t m_start;
+                uint64_t m_bytes;
+                std::shared_ptr<TraceSink> m_sink;
+        };
+
+        static Instrumentation& instance();
+
+        /**
+          * \brief Return the counters accumulated since the last reset.
+          */
+        Snapshot snapshot() const;
+
+        /**
+          * \brief Clear all the counters.
+          */
+        void reset();
+
+        /**
+          * \brief Send the begin and end events of the operations to sink, or
+          * to no sink if it is null.
+          */
+        void setSink(std::shared_ptr<TraceSink> sink);
+
+        /**
+          * \brief Return the counters of an operation, created on first use.
+          * The reference stays valid for the lifetime of the process.
+          */
+        Counters& counters(const char* operation);
+
+        /**
+          * \brief Count a bitmap whose pixels FreeImage has just allocated.
+          */
+        void countBitmap(FIBITMAP* bitmap);
+
+        /**
+          * \brief Count a copy of a bitmap.
+          */
+        void countClone();
+
+        /**
+          * \brief Count a scratch buffer that has just been allocated.
+          */
+        void countScratch(size_t bytes);
+
+    private:
+        Instrumentation();
+        Instrumentation(Instrumentation const&) = delete;
+        Instrumentation& operator=(Instrumentation const&) = delete;
+
+        uint64_t now() const;
+        void countBytes(size_t bytes);
+
+        /* Steady clock time of the construction, in nanoseconds */
+        uint64_t m_epoch;
+        mutable std::mutex m_mutex;
+        /* Nodes of the map are never moved, so that counters can be kept */
+        std::map<std::string, Counters> m_counters;
+        std::atomic<uint64_t> m_bitmapAllocations;
+        std::atomic<uint64_t> m_bitmapClones;
+        std::atomic<uint64_t> m_bytes;
+        std::shared_ptr<TraceSink> m_sink;
+        std::atomic<bool> m_hasSink;
+};
+
+/**
+  * \def IMAGE_SCOPE(operation, pixels)
+  * \brief Record the rest of the enclosing block as a call to operation,
+  * a string literal, processing the given number of pixels.
+  *
+  * Expands to nothing unless IMAGE_INSTRUMENTATION is defined, in which case
+  * pixels is evaluated once. IMAGE_SCOPE_PIXELS() changes the number of
+  * pixels later in the same block.
+  */
+#ifdef IMAGE_INSTRUMENTATION
+#define IMAGE_SCOPE(operation, pixels) \
+    static Instrumentation::Counters& imageScopeCounters = Instrumentation::instance().counters(operation); \
+    Instrumentation::Scope imageScope(operation, imageScopeCounters, pixels)
+#define IMAGE_SCOPE_PIXELS(pixels) imageScope.setPixels(pixels)
+#define IMAGE_COUNT_BITMAP(bitmap) Instrumentation::instance().countBitmap(bitmap)
+#define IMAGE_COUNT_CLONE() Instrumentation::instance().countClone()
+#define IMAGE_COUNT_SCRATCH(bytes) Instrumentation::instance().countScratch(bytes)
+#else
+#define IMAGE_SCOPE(operation, pixels) ((void)0)
+#define IMAGE_SCOPE_PIXELS(pixels) ((void)0)
+#define IMAGE_COUNT_BITMAP(bitmap) ((void)0)
+#define IMAGE_COUNT_CLONE() ((void)0)
+#define IMAGE_COUNT_SCRATCH(bytes) ((void)0)
+#endif
+
+/**
+  * \brief How the per-pixel algorithms of Image spread their work.
+  *
+  * Images are processed in bands of whole scanlines. Sequential runs on the
+  * calling thread. ThreadPool gives one band to each thread of a process-wide
+  * pool of worker threads, which suits uniform per-pixel costs. WorkStealing
+  * cuts the image in smaller bands, shared between the threads, and lets the
+  * threads that run out of work steal bands from the others, which suits
+  * uneven costs.
+  */
+enum class Execution {
+    Sequential,
+    ThreadPool,
+    WorkStealing
+};
+
+/**
+  * \struct ExecutionPolicy
+  * \brief Execution mode of the per-pixel algorithms, see Execution.
+  */
+struct ExecutionPolicy {
+    Execution mode = Execution::Sequential;
+    /** Number of threads, the calling one included, 0 means one per
+      * hardware thread */
+    int threads = 0;
+    /** Scanlines per band of the work-stealing mode, 0 picks bands of about
+      * 32 KiB */
+    int bandHeight = 0;
+};
+
+/**
+  * \brief Run f(yBegin, yEnd) on bands of scanlines covering [0, height),
+  * according to policy.
+  *
+  * Band heights are rounded up so that every band starts at the same offset
+  * within a cache line as the first scanline. Only the pitch is known, not
+  * where the pixels start, so the last scanline of a band may still share a
+  * cache line with the first scanline of the next one.
+  *
+  * The calling thread takes part in the work, so f may itself call
+  * forEachBand(). Exceptions thrown by f are rethrown once every band has
+  * been processed or abandoned.
+  */
+void forEachBand(int height, int pitch, ExecutionPolicy const& policy,
+                 std::function<void(int, int)> const& f);
+
+/**
+  * \class RowSpan
+  * \brief Non-owning view over the pixels of a single scanline.
+  *
+  * T may be const-qualified to obtain a read-only view. Element access
+  * through operator[] is unchecked, at() throws on out of range accesses.
+  * A span is invalidated by any operation that reallocates the image it
+  * was obtained from (assignment, crop...).
+  */
+template <class T>
+class RowSpan {
+    public:
+        using value_type = typename std::remove_const<T>::type;
+        using pointer = T*;
+
+        RowSpan(T* data, int width);
+
+        /* Conversion from a mutable to a read-only span */
+        template <class U, class = typename std::enable_if<
+                               std::is_same<T, U const>::value>::type>
+        RowSpan(RowSpan<U> const& other) :
+            RowSpan(other.data(), other.size())
+        { }
+
+        T& operator[](int x) const;
+
+        /**
+          * \brief Bounds checked pixel access.
+          */
+        T& at(int x) const;
+
+        /**
+          * \brief Compare the pixels of two spans, ignoring scanline padding.
+          */
+        bool operator==(RowSpan<const value_type> const& other) const;
+
+        T* data() const;
+        int size() const;
+        T* begin() const;
+        T* end() const;
+
+    private:
+        T* m_data;
+        int m_width;
+};
+
+/**
+  * \class BitReference
+  * \brief Proxy reference to a single pixel of a 1bpp scanline.
+  */
+class BitReference {
+    public:
+        BitReference(byte* b, byte mask);
+
+        operator bool() const;
+        BitReference& operator=(bool value);
+        BitReference& operator=(BitReference const& other);
+
+    private:
+        byte* m_byte;
+        byte m_mask;
+};
+
+/**
+  * \class BitRowSpan
+  * \brief Common implementation of the 1bpp scanline views.
+  *
+  * Pixels are packed 8 per byte, most significant bit first, like FreeImage
+  * does. Byte is either byte or const byte.
+  */
+template <class Byte>
+class BitRowSpan {
+    public:
+        using reference = typename std::conditional<std::is_const<Byte>::value,
+                                                    bool, BitReference>::type;
+        using pointer = Byte*;
+
+        BitRowSpan(Byte* data, int width);
+
+        reference operator[](int x) const;
+
+        /**
+          * \brief Bounds checked pixel access.
+          */
+        reference at(int x) const;
+
+        /**
+          * \brief Compare the pixels of two spans, ignoring scanline padding.
+          */
+        bool operator==(BitRowSpan<const byte> const& other) const;
+
+        /**
+          * \brief Return the packed scanline bytes.
+          */
+        Byte* data() const;
+
+        /**
+          * \brief Return the number of pixels in the scanline.
+          */
+        int size() const;
+
+    private:
+        Byte* m_data;
+        int m_width;
+};
+
+/**
+  * \brief Scanline view of a BinaryImage.
+  */
+template <>
+class RowSpan<bool> : public BitRowSpan<byte> {
+    public:
+        using value_type = bool;
+        using BitRowSpan<byte>::BitRowSpan;
+};
+
+/**
+  * \brief Read-only scanline view of a BinaryImage.
+  */
+template <>
+class RowSpan<const bool> : public BitRowSpan<const byte> {
+    public:
+        using value_type = bool;
+        using BitRowSpan<const byte>::BitRowSpan;
+
+        RowSpan(RowSpan<bool> const& other) :
+            BitRowSpan<const byte>(other.data(), other.size())
+        { }
+};
+
+template <class T>
+class Image;
+
+/**
+  * \class ImageView
+  * \brief Non-owning read-only view over a rectangular region of an image,
+  * or of external pixel memory.
+  *
+  * A view is a pointer to its first scanline, a size and the distance in
+  * bytes between scanlines, and is as cheap to copy. It is invalidated like
+  * the scanline spans of the image it was obtained from. Views of binary
+  * images must start on a multiple of 8 pixels.
+  */
+template <class T>
+class ImageView {
+    public:
+        using ConstRow = RowSpan<const T>;
+        using pointer = typename ConstRow::pointer;
+
+        /* View of a whole image */
+        ImageView(Image<T> const& image);
+
+        /**
+          * \brief View of the region r of an image.
+          * \throw std::runtime_error if r is not inside the image.
+          */
+        ImageView(Image<T> const& image, Rect r);
+
+        /**
+          * \brief View of external pixels, with the layout of FreeImage
+          * bitmaps, scanlines being stride bytes apart.
+          */
+        ImageView(pointer bits, int width, int height, int stride);
+
+        int width() const;
+        int height() const;
+        int stride() const;
+
+        ConstRow row(int y) const;
+        ConstRow rowUnchecked(int y) const;
+
+        /**
+          * \brief Return the view of the region r of this view.
+          */
+        ImageView view(Rect r) const;
+
+        /**
+          * \brief Compare the pixels of two views.
+          */
+        bool operator==(ImageView const& other) const;
+
+        /**
+          * \brief Same as Image::getAABB(), coordinates are relative to the
+          * view.
+          */
+        Rect getAABB(T backgroundColor) const;
+        bool getAABB(T backgroundColor, Rect& aabb) const;
+
+        /**
+          * \brief Save the region to a file, without copying its pixels.
+          */
+        void save(std::string const& filename, ImageFormat f) const;
+        void save(std::vector<byte>& buffer, ImageFormat f) const;
+
+    private:
+        pointer m_bits;
+        int m_width;
+        int m_height;
+        int m_stride;
+};
+
+/**
+  * \brief Filter reducing a level of an image pyramid to the next one.
+  *
+  * Box averages blocks of 2x2 pixels. Binomial weights blocks of 4x4 pixels
+  * with the separable kernel [1 3 3 1] / 8, which aliases less. Binary
+  * pyramids always use the box filter, a pixel being set when at least two
+  * of its 2x2 block are.
+  */
+enum class PyramidFilter {
+    Box,
+    Binomial
+};
+
+/**
+  * \brief Resampling filter of resize().
+  *
+  * Nearest picks the source pixel under the center of each output pixel.
+  * Bilinear and Lanczos3 weight the source pixels with a triangle or a
+  * 3-lobed Lanczos window, widened when downsampling so that every source
+  * pixel contributes.
+  */
+enum class ResizeFilter {
+    Nearest,
+    Bilinear,
+    Lanczos3
+};
+
+/**
+  * \brief Structuring element of the morphological operations of binary
+  * images, of radius r.
+  *
+  * Square is the square of side 2r + 1, Disc the pixels at a Euclidean
+  * distance of at most r from its center.
+  */
+enum class StructuringElement {
+    Square,
+    Disc
+};
+
+/**
+  * \brief How convolutions read pixels outside of the image.
+  *
+  * Clamp repeats the edge pixels, Wrap tiles the image, Mirror reflects it
+  * about the edge pixels, which are not repeated, and Constant reads a
+  * given value.
+  */
+enum class BorderMode {
+    Clamp,
+    Wrap,
+    Mirror,
+    Constant
+};
+
+/**
+  * \class ImagePyramid
+  * \brief Mip chain of an image: every level halves the size of the
+  * previous one, rounding up, down to a single pixel.
+  *
+  * Level 0 is the source itself, the other levels are stored in a single
+  * allocation. They are built in one pass over the source: each level
+  * scanline is produced as soon as the scanlines it depends on are, while
+  * they are still in cache. Supports greyscale, 16 bit, float and binary
+  * pixels.
+  */
+template <class T>
+class ImagePyramid {
+    public:
+        /**
+          * \brief Build the pyramid of an image region.
+          * \param owner Kept alive with the pyramid, when it owns the memory
+          * of the source
+          */
+        explicit ImagePyramid(ImageView<T> const& source, PyramidFilter filter = PyramidFilter::Box,
+                              std::shared_ptr<void> owner = nullptr);
+        ImagePyramid(ImagePyramid const&) = delete;
+        ImagePyramid& operator=(ImagePyramid const&) = delete;
+
+        /**
+          * \brief Return the number of levels, the source included.
+          */
+        int levels() const;
+
+        /**
+          * \brief Return level i, 0 being the source.
+          * \throw std::runtime_error if the level does not exist.
+          */
+        ImageView<T> level(int i) const;
+
+        PyramidFilter filter() const;
+
+    private:
+        /* Size in bytes of the levels below the source */
+        static size_t storageSize(int width, int height);
+        /* Compute scanline y of level k from level k - 1 */
+        void reduceRow(int k, int y);
+        /* Produce the scanlines of the levels below k made computable by
+         * scanline y of level k */
+        void cascade(int k, int y);
+        typename RowSpan<T>::pointer levelRow(int k, int y);
+
+        std::shared_ptr<void> m_owner;
+        PyramidFilter m_filter;
+        ScratchBuffer<byte> m_pixels;
+        std::vector<ImageView<T>> m_levels;
+        /* Number of scanlines of each level already produced */
+        std::vector<int> m_produced;
+};
+
+/**
+  * \class IntegralImage
+  * \brief Summed-area table of a greyscale image, answering sums over
+  * rectangles in constant time.
+  *
+  * Entry (x, y) of the table is the sum of the pixels of the scanlines
+  * before y and of the columns before x, accumulated in 64 bits, so the sum
+  * over a Rect only reads its four corners. The table of squared pixels is
+  * optional, it is only needed by variance(). Like in getPixel(), the y of
+  * a Rect is the scanline index.
+  */
+class IntegralImage {
+    public:
+        /**
+          * \brief Build the table of an image or of a region of it.
+          *
+          * Scanlines are accumulated with SIMD instructions, in bands spread
+          * over threads according to policy. The bands are summed
+          * independently, then offset by the last scanline of the bands
+          * above them.
+          * \param squares Whether to also build the table of the squared
+          * pixels.
+          */
+        explicit IntegralImage(ImageView<byte> const& image, bool squares = false,
+                               ExecutionPolicy const& policy = ExecutionPolicy());
+        IntegralImage(IntegralImage&&) = default;
+        IntegralImage& operator=(IntegralImage&&) = default;
+
+        int width() const;
+        int height() const;
+        bool hasSquares() const;
+
+        /**
+          * \brief Update the table after scanlines [yBegin, yEnd) of the
+          * image have changed.
+          *
+          * The changed scanlines are accumulated again, and the difference
+          * they make is added to the scanlines below them; the scanlines
+          * above are not touched.
+          * \param image Changed image, of the same size as the table.
+          * \throw std::runtime_error if the sizes differ or the scanlines
+          * are out of range.
+          */
+        void update(ImageView<byte> const& image, int yBegin, int yEnd,
+                    ExecutionPolicy const& policy = ExecutionPolicy());
+
+        /**
+          * \brief Return the sum of the pixels of r.
+          * \throw std::runtime_error if r is not inside the image.
+          */
+        uint64_t sum(Rect const& r) const;
+
+        /**
+          * \brief Return the sum of the squared pixels of r.
+          * \throw std::runtime_error if r is not inside the image or the
+          * table of squares was not built.
+          */
+        uint64_t sumOfSquares(Rect const& r) const;
+
+        /**
+          * \brief Return the mean of the pixels of r, NaN if r is empty.
+          */
+        double mean(Rect const& r) const;
+
+        /**
+          * \brief Return the variance of the pixels of r, NaN if r is empty.
+          * \throw std::runtime_error if the table of squares was not built.
+          */
+        double variance(Rect const& r) const;
+
+    private:
+        /* Accumulate scanlines [yBegin, yEnd) into the rows yBegin + 1 to
+         * yEnd of the tables, row yBegin being up to date */
+        void accumulate(ImageView<byte> const& image, int yBegin, int yEnd, ExecutionPolicy const& policy);
+        /* Sum of a table over r, which must be inside the image */
+        uint64_t corners(uint64_t const* table, Rect const& r) const;
+
+        int m_width;
+        int m_height;
+        /* Rows of width + 1 entries, row 0 and column 0 being 0, taken from
+         * the image pool */
+        std::unique_ptr<ScratchBuffer<uint64_t>> m_sums;
+        std::unique_ptr<ScratchBuffer<uint64_t>> m_squares;
+};
+
+class GreyscaleImage;
+class RGBImage;
+class Grey16Image;
+class Grey32Image;
+class FloatImage;
+class BinaryImage;
+
+/**
+  * \struct PixelTraits
+  * \brief Compile-time description of a pixel type.
+  *
+  * Gives the image class of the pixel type and the FreeImage format of its
+  * bitmaps: image type, bits per pixel, color masks, number of channels and
+  * number of pixels packed in a byte (0 when a pixel spans whole bytes).
+  * Pixel access and the scanline algorithms of Image are resolved from it at
+  * compile time.
+  */
+template <class T>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<byte> {
+    using image_type = GreyscaleImage;
+    static constexpr ImageType type = ImageType::Bitmap;
+    static constexpr int bpp = 8;
+    static constexpr unsigned int redMask = 0xFF;
+    static constexpr unsigned int greenMask = 0xFF;
+    static constexpr unsigned int blueMask = 0xFF;
+    static constexpr int channels = 1;
+    static constexpr int pixelsPerByte = 0;
+};
+
+template <>
+struct PixelTraits<RGBTriple> {
+    using image_type = RGBImage;
+    static constexpr ImageType type = ImageType::Bitmap;
+    static constexpr int bpp = 24;
+    static constexpr unsigned int redMask = 0x0000FF;
+    static constexpr unsigned int greenMask = 0x00FF00;
+    static constexpr unsigned int blueMask = 0xFF0000;
+    static constexpr int channels = 3;
+    static constexpr int pixelsPerByte = 0;
+};
+
+template <>
+struct PixelTraits<uint16_t> {
+    using image_type = Grey16Image;
+    static constexpr ImageType type = ImageType::Uint16;
+    static constexpr int bpp = 16;
+    static constexpr unsigned int redMask = 0;
+    static constexpr unsigned int greenMask = 0;
+    static constexpr unsigned int blueMask = 0;
+    static constexpr int channels = 1;
+    static constexpr int pixelsPerByte = 0;
+};
+
+template <>
+struct PixelTraits<uint32_t> {
+    using image_type = Grey32Image;
+    static constexpr ImageType type = ImageType::Uint32;
+    static constexpr int bpp = 32;
+    static constexpr unsigned int redMask = 0;
+    static constexpr unsigned int greenMask = 0;
+    static constexpr unsigned int blueMask = 0;
+    static constexpr int channels = 1;
+    static constexpr int pixelsPerByte = 0;
+};
+
+template <>
+struct PixelTraits<float> {
+    using image_type = FloatImage;
+    static constexpr ImageType type = ImageType::Float;
+    static constexpr int bpp = 32;
+    static constexpr unsigned int redMask = 0;
+    static constexpr unsigned int greenMask = 0;
+    static constexpr unsigned int blueMask = 0;
+    static constexpr int channels = 1;
+    static constexpr int pixelsPerByte = 0;
+};
+
+template <>
+struct PixelTraits<bool> {
+    using image_type = BinaryImage;
+    static constexpr ImageType type = ImageType::Bitmap;
+    static constexpr int bpp = 1;
+    static constexpr unsigned int redMask = 0xFF;
+    static constexpr unsigned int greenMask = 0xFF;
+    static constexpr unsigned int blueMask = 0xFF;
+    static constexpr int channels = 1;
+    static constexpr int pixelsPerByte = 8;
+};
+
+template <class T>
+class Image {
+    public:
+        using Row = RowSpan<T>;
+        using ConstRow = RowSpan<const T>;
+
+        virtual ~Image();
+
+        /* Copies share the pixels of the original until one of them is
+         * modified, through a non-const member function, and gets its own
+         * copy of the pixels. Sharing images between threads is safe as long
+         * as each Image object is only modified by one thread. Scanline spans
+         * obtained before a copy still point to the shared pixels. */
+
+        /* Copy constructor */
+        Image(Image const& other);
+        /* Move constructor, the source is left empty */
+        Image(Image&& other);
+        /* Assignment operator */
+        Image& operator=(Image const& other);
+        /* Move-assignment operator, the source is left empty */
+        Image& operator=(Image&& other);
+
+        /**
+         * @brief Compare two images.
+         *
+         * @param other Image to compare with.
+         *
+         * @return true if the images are identical, false otherwise
+         */
+        bool operator==(Image const& other) const;
+
+        /**
+         * \brief Return a 64-bit hash of the image size and pixels.
+         *
+         * Scanline padding is ignored, so equal images have equal hashes.
+         */
+        uint64_t hash() const;
+
+        /**
+         * \brief Return a 128-bit hash of the image size and pixels.
+         */
+        Hash128 hash128() const;
+
+        /**
+         * \brief Hash the square tiles of the image.
+         *
+         * Tiles on the right and top edges may be smaller. For binary images,
+         * the tile size is rounded up to a multiple of 8.
+         */
+        TileHashes tileHashes(int tileSize = 64) const;
+
+        /**
+         * \brief Return the regions where two images differ, at tile
+         * granularity.
+         */
+        std::vector<Rect> diff(Image const& other, int tileSize = 64) const;
+
+        /**
+          * \brief Replace every pixel p of the image by f(p).
+          *
+          * f is called concurrently from several threads unless the policy
+          * is sequential.
+          */
+        template <class F>
+        void transform(F f, ExecutionPolicy const& policy = ExecutionPolicy());
+
+        /**
+          * \brief Replace every pixel p of the image by f(p, q), q being the
+          * pixel of other at the same coordinates.
+          * \throw std::runtime_error if the images do not have the same size.
+          */
+        template <class U, class F>
+        void zip(Image<U> const& other, F f, ExecutionPolicy const& policy = ExecutionPolicy());
+
+        /**
+          * \brief Fold the pixels of the image with acc = op(acc, p).
+          *
+          * Every band of scanlines starts from init, and the results of the
+          * bands are then folded in order with combine(acc, band), so init
+          * must be neutral for combine, like 0 for a sum. The result does not
+          * depend on the scheduling of the bands.
+          */
+        template <class U, class Op, class Combine>
+        U reduce(U init, Op op, Combine combine,
+                 ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the mip chain of the image.
+          *
+          * The pyramid is built on first use and cached with the image until
+          * the image is modified or a pyramid with another filter is asked.
+          * A pyramid obtained before a modification keeps the previous
+          * pixels.
+          */
+        std::shared_ptr<const ImagePyramid<T>> pyramid(PyramidFilter filter = PyramidFilter::Box) const;
+
+        /**
+          * \brief Return the image resampled to the given size.
+          * \see ::resize()
+          */
+        typename PixelTraits<T>::image_type resize(int width, int height,
+                                                   ResizeFilter filter = ResizeFilter::Bilinear,
+                                                   ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the image convolved with a separable kernel.
+          * \see ::convolve()
+          */
+        typename PixelTraits<T>::image_type convolve(std::vector<float> const& horizontal,
+                                                     std::vector<float> const& vertical,
+                                                     BorderMode border = BorderMode::Clamp, float constant = 0.f,
+                                                     ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the image convolved with a non-separable kernel.
+          * \see ::convolve2D()
+          */
+        typename PixelTraits<T>::image_type convolve2D(std::vector<float> const& kernel, int kernelWidth,
+                                                       BorderMode border = BorderMode::Clamp, float constant = 0.f,
+                                                       ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the image averaged over squares of side
+          * 2 * radius + 1.
+          * \see ::boxFilter()
+          */
+        typename PixelTraits<T>::image_type boxFilter(int radius, BorderMode border = BorderMode::Clamp,
+                                                      float constant = 0.f,
+                                                      ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the image blurred with a Gaussian of standard
+          * deviation sigma.
+          * \see ::gaussianBlur()
+          */
+        typename PixelTraits<T>::image_type gaussianBlur(float sigma, BorderMode border = BorderMode::Clamp,
+                                                         float constant = 0.f,
+                                                         ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the width of the image.
+          */
+        int width() const;
+
+        /**
+          * \brief Return the height of the image.
+          */
+        int height() const;
+
+        /**
+          * \brief Return the color of the specified pixel.
+          * \throw std::runtime_error if the pixel is outside of the image.
+          */
+        T getPixel(int x, int y) const;
+
+        /**
+          * \brief Set the color of the specified pixel.
+          * \throw std::runtime_error if the pixel is outside of the image.
+          */
+        void setPixel(int x, int y, T pixel);
+
+        const T* getBits() const;
+        const T* getScanline(int scanline) const;
+
+        /**
+          * \brief Return a view of the specified scanline.
+          *
+          * Throws if the scanline does not exist. Scanlines are indexed
+          * like the y coordinate of getPixel.
+          */
+        Row row(int y);
+        ConstRow row(int y) const;
+
+        /**
+          * \brief Same as row(), without the bounds check.
+          */
+        Row rowUnchecked(int y);
+        ConstRow rowUnchecked(int y) const;
+
+        /**
+          * \brief Give this image its own copy of the pixels, if they are
+          * shared with other images.
+          *
+          * The non-const accessors detach on every call, which is not safe
+          * from several threads at once. Writers that spread scanlines over
+          * threads detach once beforehand, then use writableRow().
+          */
+        void detach();
+
+        /**
+          * \brief Same as rowUnchecked(), without detaching the pixels.
+          *
+          * The pixels must have been detached, and not shared since.
+          */
+        Row writableRow(int y);
+
+        /**
+          * \brief Return the size in bytes of a scanline, including padding.
+          */
+        int pitch() const;
+
+        /**
+          * \brief Return the bounding box of the pixels that differ from
+          * backgroundColor.
+          *
+          * Width and height are the differences between the extreme
+          * coordinates. If the image only contains background, the size of
+          * the returned box is negative, see the overload below.
+          */
+        Rect getAABB(T backgroundColor) const;
+
+        /**
+          * \brief Compute the bounding box of the pixels that differ from
+          * backgroundColor.
+          *
+          * Scanlines are searched inward from the four edges of the image, so
+          * that only the margins around the content are read.
+          * \return false, leaving aabb unchanged, if the image only contains
+          * background.
+          */
+        bool getAABB(T backgroundColor, Rect& aabb) const;
+
+        void flipX();
+        void flipY();
+
+        void blit(ImageCoords c, Rect r, Image<T> const& other);
+
+        /**
+          * \brief Copy the pixels of a view to c, clipped to the image.
+          */
+        void blit(ImageCoords c, ImageView<T> const& source);
+
+        /**
+          * \brief Replace the image with its region r.
+          *
+          * The region is copied to a new bitmap. Unlike the other functions,
+          * r.y is counted from the top of the image, that is from the last
+          * scanline: view({r.x, height() - r.y - r.height, r.width,
+          * r.height}) gives access to the same region without copying.
+          */
+        void crop(Rect r);
+
+        /**
+          * \brief Return a view of the whole image.
+          */
+        ImageView<T> view() const;
+
+        /**
+          * \brief Return a view of the region r of the image, y being the
+          * scanline index like in getPixel().
+          */
+        ImageView<T> view(Rect r) const;
+
+        /**
+          * \brief Save an image to the disk.
+          * \param filename File name
+          * \param f Image format
+          */
+        void save(std::string const& filename, ImageFormat f) const;
+
+        /**
+          * \brief Encode an image to a memory buffer.
+          * \param buffer Buffer receiving the encoded file
+          * \param f Image format
+          */
+        void save(std::vector<byte>& buffer, ImageFormat f) const;
+
+    protected:
+        /* Default constructor, in the format given by PixelTraits<T> */
+        Image(int width, int height);
+
+        /* Create a bitmap header around external pixel memory, scanlines
+         * being stride bytes apart. */
+        static FIBITMAP* wrapBits(void* bits, int width, int height, int stride);
+
+        /* Take ownership of a bitmap. storage is kept alive with the bitmap,
+         * when it wraps pixel memory not allocated by FreeImage. */
+        static std::shared_ptr<FIBITMAP> share(FIBITMAP* fi, std::shared_ptr<void> storage);
+
+        /* Refresh m_bits and m_pitch after m_image changed */
+        void updateLayout();
+
+        /* Copy the region r of source to c, both already clipped */
+        void blitRegion(ImageCoords c, Rect r, ImageView<T> const& source);
+
+        FIBITMAP* m_image;
+        int m_width;
+        int m_height;
+        /* Owner of m_image, shared between copies */
+        std::shared_ptr<FIBITMAP> m_bitmap;
+        /* First scanline and pitch of m_image, cached so that pixel access
+         * does not call into FreeImage */
+        byte* m_bits;
+        int m_pitch;
+        /* Cached mip chain, accessed atomically by the const members */
+        mutable std::shared_ptr<const ImagePyramid<T>> m_pyramid;
+        explicit Image(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
+};
+
+/**
+  * \class GreyscaleImage
+  * \brief Represents an 8-bit greyscale image.
+  */
+class GreyscaleImage : public Image<byte> {
+    public:
+        /**
+          * \brief Construct an empty image of specified dimensions and bit depth.
+          * \param width Image width
+          * \param height Image height
+          */
+        GreyscaleImage(int width, int height);
+
+        /* Destructor */
+        virtual ~GreyscaleImage();
+
+        /**
+          * \brief Copy constructor.
+          */
+        GreyscaleImage(GreyscaleImage const& other);
+
+        /**
+          * \brief Assignment operator.
+          */
+        GreyscaleImage& operator=(GreyscaleImage const& other);
+
+        /**
+          * \brief Move constructor.
+          */
+        GreyscaleImage(GreyscaleImage&& other);
+
+        /**
+          * \brief Move-assignment operator.
+          */
+        GreyscaleImage& operator=(GreyscaleImage&& other);
+
+        /**
+          * \brief Construct an image from a file.
+          * In theory, any format supported by the FreeImage library should work.
+          */
+        static GreyscaleImage load(std::string const& filename);
+
+        /**
+          * \brief Construct an image from an encoded file in memory.
+          */
+        static GreyscaleImage load(const byte* data, size_t size);
+
+        static GreyscaleImage fromRawData(std::vector<byte> const& vec, int width, int height, bool flip = false);
+
+        /**
+          * \brief Construct an image taking ownership of the pixel vector.
+          *
+          * Unless flip is set, the pixels are not copied and the image uses
+          * the vector memory as its pixel storage.
+          */
+        static GreyscaleImage fromRawData(std::vector<byte>&& vec, int width, int height, bool flip = false);
+
+        /**
+          * \brief Construct an image wrapping external pixel memory.
+          *
+          * No copy is made: the memory must outlive the image and its
+          * scanlines (stride bytes apart) are the image scanlines.
+          */
+        static GreyscaleImage fromRawData(byte* data, int width, int height, int stride);
+
+    private:
+        explicit GreyscaleImage(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
+        void buildPalette();
+};
+
+/**
+  * \class RGBImage
+  * \brief Represents a 24-bit RGB image.
+  */
+class RGBImage : public Image<RGBTriple> {
+    public:
+        /**
+          * \brief Construct an empty image of specified dimensions and bit depth.
+          * \param width Image width
+          * \param height Image height
+          */
+        RGBImage(int width, int height);
+
+        /* Destructor */
+        virtual ~RGBImage();
+
+        /**
+          * \brief Copy constructor.
+          */
+        RGBImage(RGBImage const& other);
+
+        /**
+          * \brief Assignment operator.
+          */
+        RGBImage& operator=(RGBImage const& other);
+
+        /**
+          * \brief Move constructor.
+          */
+        RGBImage(RGBImage&& other);
+
+        /**
+          * \brief Move-assignment operator.
+          */
+        RGBImage& operator=(RGBImage&& other);
+
+        /**
+          * \brief Construct an image from a file.
+          * In theory, any format supported by the FreeImage library should work.
+          */
+        static RGBImage load(std::string const& filename);
+
+        /**
+          * \brief Construct an image from an encoded file in memory.
+          */
+        static RGBImage load(const byte* data, size_t size);
+
+        static RGBImage fromRawData(std::vector<RGBTriple> const& vec, int width, int height, bool flip = false);
+
+        /**
+          * \brief Construct an image taking ownership of the pixel vector.
+          *
+          * Unless flip is set, the pixels are not copied and the image uses
+          * the vector memory as its pixel storage.
+          */
+        static RGBImage fromRawData(std::vector<RGBTriple>&& vec, int width, int height, bool flip = false);
+
+        /**
+          * \brief Construct an image wrapping external pixel memory.
+          *
+          * No copy is made: the memory must outlive the image and its
+          * scanlines (stride bytes apart) are the image scanlines.
+          */
+        static RGBImage fromRawData(RGBTriple* data, int width, int height, int stride);
+
+    private:
+        explicit RGBImage(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
+};
+
+/**
+  * \class Grey16Image
+  * \brief Represents a 16-bit greyscale image.
   */
-enum class ImageFormat : typename std::underlying_type<FREE_IMAGE_FORMAT>::type {
-    /** Bitmap format */
-    Bmp = FIF_BMP,
-    /** Bitmap format, with run length encoding. Only available for 4-8 bpp
-     * bitmaps. */
-    BmpRle,
-    /** PNG format */
-    Png = FIF_PNG
-};
-
-template <class T>
-class Image {
+class Grey16Image : public Image<uint16_t> {
     public:
-        virtual ~Image();
+        /**
+          * \brief Construct an empty image of specified dimensions.
+          * \param width Image width
+          * \param height Image height
+          */
+        Grey16Image(int width, int height);
 
-        /* Copy constructor */
-        Image(Image const& other);
-        /* Move constructor */
-        Image(Image&& other);
-        /* Assignment operator */
-        Image& operator=(Image const& other);
-        /* Move-assignment operator */
-        Image& operator=(Image&& other);
+        /* Destructor */
+        virtual ~Grey16Image();
 
         /**
-         * @brief Compare two images.
-         *
-         * @param other Image to compare with.
-         *
-         * @return true if the images are identical, false otherwise
-         */
-        bool operator==(Image const& other);
+          * \brief Copy constructor.
+          */
+        Grey16Image(Grey16Image const& other);
 
         /**
-          * \brief Return the width of the image.
+          * \brief Assignment operator.
           */
-        int width() const;
+        Grey16Image& operator=(Grey16Image const& other);
 
         /**
-          * \brief Return the height of the image.
+          * \brief Move constructor.
           */
-        int height() const;
-
-        virtual T getPixel(int x, int y) const = 0;
-        virtual void setPixel(int x, int y, T pixel) = 0;
+        Grey16Image(Grey16Image&& other);
 
-        virtual const T* getBits() const;
-        virtual const T* getScanline(int scanline) const;
+        /**
+          * \brief Move-assignment operator.
+          */
+        Grey16Image& operator=(Grey16Image&& other);
 
-        Rect getAABB(T backgroundColor) const;
+        /**
+          * \brief Construct an image from a file.
+          * Images which are not 16-bit greyscale are converted on load.
+          */
+        static Grey16Image load(std::string const& filename);
 
-        void flipX();
-        void flipY();
+        /**
+          * \brief Construct an image from an encoded file in memory.
+          */
+        static Grey16Image load(const byte* data, size_t size);
 
-        void blit(ImageCoords c, Rect r, Image<T> const& other);
-        void crop(Rect r);
+        static Grey16Image fromRawData(std::vector<uint16_t> const& vec, int width, int height, bool flip = false);
 
         /**
-          * \brief Save an image to the disk.
-          * \param filename File name
-          * \param f Image format
+          * \brief Construct an image taking ownership of the pixel vector.
+          *
+          * Unless flip is set, the pixels are not copied and the image uses
+          * the vector memory as its pixel storage.
           */
-        void save(std::string const& filename, ImageFormat f) const;
+        static Grey16Image fromRawData(std::vector<uint16_t>&& vec, int width, int height, bool flip = false);
 
-    protected:
-        /* Default constructor */
-        Image(int width, int height, ImageType t, int bpp, unsigned int rMask,
-                unsigned int gMask, unsigned int bMask);
+        /**
+          * \brief Construct an image wrapping external pixel memory.
+          *
+          * No copy is made: the memory must outlive the image and its
+          * scanlines (stride bytes apart) are the image scanlines.
+          */
+        static Grey16Image fromRawData(uint16_t* data, int width, int height, int stride);
 
-        FIBITMAP* m_image;
-        int m_width;
-        int m_height;
-        explicit Image(FIBITMAP* fi);
+    private:
+        explicit Grey16Image(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
 };
 
 /**
-  * \class GreyscaleImage
-  * \brief Represents an 8-bit greyscale image.
+  * \class Grey32Image
+  * \brief Represents a 32-bit unsigned single channel image, such as the
+  * labels of labelComponents().
   */
-class GreyscaleImage : public Image<byte> {
+class Grey32Image : public Image<uint32_t> {
     public:
         /**
-          * \brief Construct an empty image of specified dimensions and bit depth.
+          * \brief Construct an empty image of specified dimensions.
           * \param width Image width
           * \param height Image height
           */
-        GreyscaleImage(int width, int height);
+        Grey32Image(int width, int height);
 
         /* Destructor */
-        virtual ~GreyscaleImage();
+        virtual ~Grey32Image();
 
         /**
           * \brief Copy constructor.
           */
-        GreyscaleImage(GreyscaleImage const& other);
+        Grey32Image(Grey32Image const& other);
 
         /**
           * \brief Assignment operator.
           */
-        GreyscaleImage& operator=(GreyscaleImage const& other);
+        Grey32Image& operator=(Grey32Image const& other);
 
         /**
           * \brief Move constructor.
           */
-        GreyscaleImage(GreyscaleImage&& other);
+        Grey32Image(Grey32Image&& other);
 
         /**
           * \brief Move-assignment operator.
           */
-        GreyscaleImage& operator=(GreyscaleImage&& other);
+        Grey32Image& operator=(Grey32Image&& other);
 
         /**
-          * \brief Return the color of the specified pixel.
+          * \brief Construct an image from a file.
+          * Images of other types are converted on load.
           */
-        byte getPixel(int x, int y) const override;
+        static Grey32Image load(std::string const& filename);
 
         /**
-          * \brief Set the color of the specified pixel.
+          * \brief Construct an image from an encoded file in memory.
           */
-        void setPixel(int x, int y, byte pixel) override;
+        static Grey32Image load(const byte* data, size_t size);
+
+        static Grey32Image fromRawData(std::vector<uint32_t> const& vec, int width, int height, bool flip = false);
 
         /**
-          * \brief Construct an image from a file.
-          * In theory, any format supported by the FreeImage library should work.
+          * \brief Construct an image taking ownership of the pixel vector.
+          *
+          * Unless flip is set, the pixels are not copied and the image uses
+          * the vector memory as its pixel storage.
           */
-        static GreyscaleImage load(std::string const& filename);
+        static Grey32Image fromRawData(std::vector<uint32_t>&& vec, int width, int height, bool flip = false);
 
-        static GreyscaleImage fromRawData(std::vector<byte> vec, int width, int height, bool flip = false);
+        /**
+          * \brief Construct an image wrapping external pixel memory.
+          *
+          * No copy is made: the memory must outlive the image and its
+          * scanlines (stride bytes apart) are the image scanlines.
+          */
+        static Grey32Image fromRawData(uint32_t* data, int width, int height, int stride);
 
     private:
-        explicit GreyscaleImage(FIBITMAP* fi);
-        void buildPalette();
+        explicit Grey32Image(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
 };
 
 /**
-  * \class RGBImage
-  * \brief Represents a 24-bit RGB image.
+  * \class FloatImage
+  * \brief Represents a single channel, 32-bit floating point image.
   */
-class RGBImage : public Image<RGBTriple> {
+class FloatImage : public Image<float> {
     public:
         /**
-          * \brief Construct an empty image of specified dimensions and bit depth.
+          * \brief Construct an empty image of specified dimensions.
           * \param width Image width
           * \param height Image height
           */
-        RGBImage(int width, int height);
+        FloatImage(int width, int height);
 
         /* Destructor */
-        virtual ~RGBImage();
+        virtual ~FloatImage();
 
         /**
           * \brief Copy constructor.
           */
-        RGBImage(RGBImage const& other);
+        FloatImage(FloatImage const& other);
 
         /**
           * \brief Assignment operator.
           */
-        RGBImage& operator=(RGBImage const& other);
+        FloatImage& operator=(FloatImage const& other);
 
         /**
           * \brief Move constructor.
           */
-        RGBImage(RGBImage&& other);
+        FloatImage(FloatImage&& other);
 
         /**
           * \brief Move-assignment operator.
           */
-        RGBImage& operator=(RGBImage&& other);
+        FloatImage& operator=(FloatImage&& other);
 
         /**
-          * \brief Return the color of the specified pixel.
+          * \brief Construct an image from a file.
+          * Images which are not floating point are converted on load.
           */
-        RGBTriple getPixel(int x, int y) const override;
+        static FloatImage load(std::string const& filename);
 
         /**
-          * \brief Set the color of the specified pixel.
+          * \brief Construct an image from an encoded file in memory.
           */
-        void setPixel(int x, int y, RGBTriple pixel) override;
+        static FloatImage load(const byte* data, size_t size);
+
+        static FloatImage fromRawData(std::vector<float> const& vec, int width, int height, bool flip = false);
 
         /**
-          * \brief Construct an image from a file.
-          * In theory, any format supported by the FreeImage library should work.
+          * \brief Construct an image taking ownership of the pixel vector.
+          *
+          * Unless flip is set, the pixels are not copied and the image uses
+          * the vector memory as its pixel storage.
           */
-        static RGBImage load(std::string const& filename);
+        static FloatImage fromRawData(std::vector<float>&& vec, int width, int height, bool flip = false);
 
-        static RGBImage fromRawData(std::vector<RGBTriple> vec, int width, int height, bool flip = false);
+        /**
+          * \brief Construct an image wrapping external pixel memory.
+          *
+          * No copy is made: the memory must outlive the image and its
+          * scanlines (stride bytes apart) are the image scanlines.
+          */
+        static FloatImage fromRawData(float* data, int width, int height, int stride);
 
     private:
-        explicit RGBImage(FIBITMAP* fi);
+        explicit FloatImage(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
 };
 
 /**
@@ -296,18 +1761,71 @@ class BinaryImage : public Image<bool> {
           */
         BinaryImage& operator=(BinaryImage&& other);
 
+        bool isImmediateInterior(int x, int y) const;
+        bool isImmediateExterior(int x, int y) const;
+
         /**
-          * \brief Return the color of the specified pixel.
+          * \brief Return the mask of the immediate interior of the image.
+          *
+          * The immediate interior is the set of pixels which are set and have
+          * at least one unset 4-neighbour, pixels outside of the image being
+          * considered set.
           */
-        bool getPixel(int x, int y) const override;
+        BinaryImage immediateInterior() const;
 
         /**
-          * \brief Set the color of the specified pixel.
+          * \brief Return the mask of the immediate exterior of the image.
+          *
+          * The immediate exterior is the set of pixels which are unset and
+          * have at least one set 4-neighbour, pixels outside of the image
+          * being considered unset.
           */
-        void setPixel(int x, int y, bool pixel) override;
+        BinaryImage immediateExterior() const;
 
-        bool isImmediateInterior(int x, int y) const;
-        bool isImmediateExterior(int x, int y) const;
+        /**
+          * \brief Return the number of set pixels.
+          */
+        long long count() const;
+
+        /**
+          * \brief Return the erosion of the image: the pixels whose
+          * structuring element, centered on them, only covers set pixels.
+          *
+          * Pixels outside of the image are considered set, so that erosion
+          * is the complement of the dilation of the complement. Scanlines
+          * are processed 64 pixels at a time, in bands spread over threads
+          * according to policy. Squares are separable and cost
+          * O(log(radius)) per word. Discs cost O(radius) per word, so large
+          * discs are computed by thresholding the exact distance
+          * transform instead, which costs the same whatever the radius.
+          * \throw std::runtime_error if radius is negative.
+          */
+        BinaryImage erode(int radius, StructuringElement element = StructuringElement::Disc,
+                          ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the dilation of the image: the pixels whose
+          * structuring element, centered on them, covers a set pixel.
+          *
+          * Pixels outside of the image are considered unset, see erode().
+          */
+        BinaryImage dilate(int radius, StructuringElement element = StructuringElement::Disc,
+                           ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the opening of the image, its erosion dilated, which
+          * removes the parts the structuring element does not fit in.
+          */
+        BinaryImage open(int radius, StructuringElement element = StructuringElement::Disc,
+                         ExecutionPolicy const& policy = ExecutionPolicy()) const;
+
+        /**
+          * \brief Return the closing of the image, its dilation eroded,
+          * which fills the holes and gaps the structuring element does not
+          * fit in.
+          */
+        BinaryImage close(int radius, StructuringElement element = StructuringElement::Disc,
+                          ExecutionPolicy const& policy = ExecutionPolicy()) const;
 
         /**
          * \brief Return the signed distance transform of the image, using
@@ -323,18 +1841,377 @@ class BinaryImage : public Image<bool> {
          */
         GreyscaleImage deadReckoning3x3(bool symmetry = false) const;
 
+        /**
+         * \brief Compute the signed distance transform of the image, using
+         * the "Dead Reckoning" algorithm, in floating point precision.
+         *
+         * Distances are positive inside the shape and negative outside, and
+         * are not clamped. Pixels the propagation does not reach are set to
+         * plus or minus infinity.
+         *
+         * \param out Output image, must have the same size as this image.
+         * \param symmetry If set to true, the transform will be symmetrical
+         * under complement.
+         */
+        void deadReckoning3x3(FloatImage& out, bool symmetry = false) const;
+
+        /**
+         * \brief Return the exact signed Euclidean distance transform of the
+         * image.
+         *
+         * The output convention is the same as deadReckoning3x3, but
+         * distances are exact, rounded to the nearest integer. The transform
+         * is separable: a pass over the rows is followed by a pass over the
+         * columns, both spread over a pool of threads.
+         *
+         * \param symmetry If set to true, the transform will be symmetrical
+         * under complement.
+         * \param threads Number of worker threads, 0 means one per hardware
+         * thread.
+         * \return Signed distance transform greyscale image
+         */
+        GreyscaleImage distanceTransform(bool symmetry = false, int threads = 0) const;
+
+        /**
+         * \brief Compute the exact signed Euclidean distance transform of the
+         * image in floating point precision.
+         *
+         * Distances are positive inside the shape and negative outside, and
+         * are neither rounded nor clamped. If the image has no seed pixel,
+         * the output is plus or minus infinity.
+         *
+         * \param out Output image, must have the same size as this image.
+         * \param symmetry If set to true, the transform will be symmetrical
+         * under complement.
+         * \param threads Number of worker threads, 0 means one per hardware
+         * thread.
+         */
+        void distanceTransform(FloatImage& out, bool symmetry = false, int threads = 0) const;
+
+        /**
+         * \brief Compute the exact signed distance transform of an image file
+         * too large to be loaded in memory.
+         *
+         * The output is the same as loading the image and saving the result
+         * of distanceTransform(symmetry). The input must be an uncompressed
+         * 1bpp BMP file, and the output is written as an 8bpp BMP file.
+         *
+         * The image is processed in square tiles, in parallel. Each tile is
+         * read with a margin large enough for the clamped output range, and
+         * its result is written before the next tile is read, so that peak
+         * memory is about 5 bytes per pixel of a tile and its margin, per
+         * thread, whatever the size of the image.
+         *
+         * \param tileSize Side of the tiles, rounded up to a multiple of 64.
+         * \param threads Number of worker threads, 0 means one per hardware
+         * thread.
+         */
+        static void distanceTransformFile(std::string const& input, std::string const& output,
+                                          bool symmetry = false, int tileSize = 1024, int threads = 0);
+
         /**
           * \brief Construct an image from a file.
           * In theory, any format supported by the FreeImage library should work.
+          * Images which are not binary are thresholded on load at level, see
+          * threshold(), RGB and greyscale scanlines being converted directly
+          * into the binary image.
+          */
+        static BinaryImage load(std::string const& filename, int level = 128);
+
+        /**
+          * \brief Construct an image from an encoded file in memory.
           */
-        static BinaryImage load(std::string const& filename);
+        static BinaryImage load(const byte* data, size_t size, int level = 128);
+
+        static BinaryImage fromRawData(std::vector<bool> const& vec, int width, int height, bool flip = false);
 
-        static BinaryImage fromRawData(std::vector<bool> vec, int width, int height, bool flip = false);
+        /**
+          * \brief Construct an image wrapping packed 1bpp pixel memory.
+          *
+          * Pixels are packed 8 per byte, most significant bit first. No copy
+          * is made: the memory must outlive the image and its scanlines
+          * (stride bytes apart) are the image scanlines.
+          */
+        static BinaryImage fromRawData(byte* data, int width, int height, int stride);
 
     private:
-        explicit BinaryImage(FIBITMAP* fi);
+        explicit BinaryImage(FIBITMAP* fi, std::shared_ptr<void> storage = nullptr);
         void buildPalette();
 };
+
+/**
+  * \brief Return an image or a region of it resampled to the given size.
+  *
+  * The filter is applied separably, horizontally then vertically, with
+  * weights computed once per call. Output scanlines are processed in tiles,
+  * so that the intermediate buffer only holds the horizontally resampled
+  * source scanlines of a tile, and the tiles are spread over threads
+  * according to policy. Greyscale, 16 bit and RGB pixels are resampled in
+  * floating point and rounded, float pixels are not clamped. Binary images
+  * only support the nearest filter.
+  * \throw std::runtime_error if a size is not positive, or the filter is
+  * not supported.
+  */
+template <class T>
+typename PixelTraits<T>::image_type resize(ImageView<T> const& image, int width, int height,
+                                           ResizeFilter filter = ResizeFilter::Bilinear,
+                                           ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return an image or a region of it convolved with a separable
+  * kernel.
+  *
+  * Both kernels have an odd size and are centered, the horizontal one being
+  * applied first. Bands of output scanlines are spread over threads
+  * according to policy, each one keeping the horizontally filtered source
+  * scanlines under the vertical kernel in a ring, so that every source
+  * scanline is filtered horizontally once per band. Greyscale and RGB pixels are
+  * convolved in 14 bit fixed point when the sum of the absolute weights of
+  * each kernel is at most 2, in floating point otherwise, like 16 bit and
+  * float pixels. Results are rounded and clamped to the pixel range, float
+  * pixels are not clamped.
+  * \param constant Value of the pixels outside of the image, for every
+  * channel, with BorderMode::Constant.
+  * \throw std::runtime_error if a kernel size is not odd.
+  */
+template <class T>
+typename PixelTraits<T>::image_type convolve(ImageView<T> const& image, std::vector<float> const& horizontal,
+                                             std::vector<float> const& vertical,
+                                             BorderMode border = BorderMode::Clamp, float constant = 0.f,
+                                             ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return an image or a region of it convolved with a small
+  * non-separable kernel, in floating point.
+  *
+  * The kernel is stored by rows of kernelWidth weights, the first row
+  * applying to the scanline of lowest index.
+  * \throw std::runtime_error if the kernel width or height is not odd.
+  */
+template <class T>
+typename PixelTraits<T>::image_type convolve2D(ImageView<T> const& image, std::vector<float> const& kernel,
+                                               int kernelWidth, BorderMode border = BorderMode::Clamp,
+                                               float constant = 0.f, ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return an image or a region of it averaged over squares of side
+  * 2 * radius + 1.
+  *
+  * The averages are computed in floating point with running sums, along
+  * the scanlines then down bands of scanlines spread over threads according
+  * to policy, so that their cost does not depend on the radius.
+  * \throw std::runtime_error if radius is negative.
+  */
+template <class T>
+typename PixelTraits<T>::image_type boxFilter(ImageView<T> const& image, int radius,
+                                              BorderMode border = BorderMode::Clamp, float constant = 0.f,
+                                              ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return an image or a region of it blurred with a Gaussian of
+  * standard deviation sigma.
+  *
+  * Small deviations convolve with gaussianKernel(sigma). Larger ones chain
+  * three running-sum box filters whose widths give the same variance,
+  * which costs the same whatever sigma.
+  * \throw std::runtime_error if sigma is not positive.
+  */
+template <class T>
+typename PixelTraits<T>::image_type gaussianBlur(ImageView<T> const& image, float sigma,
+                                                 BorderMode border = BorderMode::Clamp, float constant = 0.f,
+                                                 ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return the normalized Gaussian kernel of standard deviation
+  * sigma, of radius ceil(3 * sigma).
+  * \throw std::runtime_error if sigma is not positive.
+  */
+std::vector<float> gaussianKernel(float sigma);
+
+/**
+  * \brief Return the exact signed distance transform of a binary image or
+  * of a region of it.
+  * \see BinaryImage::distanceTransform()
+  */
+GreyscaleImage distanceTransform(ImageView<bool> const& image, bool symmetry = false, int threads = 0);
+
+/**
+  * \brief Compute the exact signed distance transform of a binary image or
+  * of a region of it, in floating point precision.
+  * \see BinaryImage::distanceTransform()
+  */
+void distanceTransform(ImageView<bool> const& image, FloatImage& out, bool symmetry = false,
+                       int threads = 0);
+
+/**
+  * \brief Return the "Dead Reckoning" signed distance transform of a binary
+  * image or of a region of it.
+  * \see BinaryImage::deadReckoning3x3()
+  */
+GreyscaleImage deadReckoning3x3(ImageView<bool> const& image, bool symmetry = false);
+
+/**
+  * \brief Compute the "Dead Reckoning" signed distance transform of a binary
+  * image or of a region of it, in floating point precision.
+  * \see BinaryImage::deadReckoning3x3()
+  */
+void deadReckoning3x3(ImageView<bool> const& image, FloatImage& out, bool symmetry = false);
+
+/**
+  * \brief Place rectangles side by side, without overlap, in a strip of the
+  * given width.
+  *
+  * Only the sizes of the rectangles are read, their position is set to
+  * their place in the strip. Rectangles are placed from the tallest, each
+  * one with the bottom-left skyline heuristic: where its top is the lowest,
+  * then the leftmost.
+  * \param padding Minimum distance between two rectangles.
+  * \return Height of the part of the strip used.
+  * \throw std::runtime_error if a rectangle is wider than the strip or has
+  * a negative size.
+  */
+int packRects(std::vector<Rect>& rects, int width, int padding = 0);
+
+/**
+  * \struct AtlasOptions
+  * \brief Parameters of buildGlyphAtlas().
+  */
+struct AtlasOptions {
+    /** Width of the atlas */
+    int width = 1024;
+    /** Minimum distance between two glyphs, so that filtered lookups do not
+      * bleed into the neighbours */
+    int padding = 1;
+    /** Symmetry of the distance transforms, see
+      * BinaryImage::deadReckoning3x3() */
+    bool symmetry = false;
+    /** How the glyphs are spread over threads. The default work-stealing
+      * bands of one glyph suit glyphs of uneven sizes. */
+    ExecutionPolicy policy = {Execution::WorkStealing, 0, 1};
+};
+
+/**
+  * \struct GlyphAtlas
+  * \brief Distance fields of a set of glyphs packed in a single image.
+  */
+struct GlyphAtlas {
+    GreyscaleImage image;
+    /** Region of the image holding each glyph, in input order. Like in
+      * ImageView, y is the scanline index. */
+    std::vector<Rect> placements;
+};
+
+/**
+  * \brief Pack glyphs in an atlas and compute their signed distance
+  * transforms into it.
+  *
+  * The glyphs are packed with packRects(), then the transform of each glyph,
+  * the same as BinaryImage::deadReckoning3x3(), is written directly into its
+  * region of the atlas, the glyphs being processed concurrently from the
+  * largest. The atlas is as high as the packing, pixels outside of the
+  * glyphs are 0.
+  * \throw std::runtime_error if a glyph is wider than the atlas.
+  */
+GlyphAtlas buildGlyphAtlas(std::vector<ImageView<bool>> const& glyphs,
+                           AtlasOptions const& options = AtlasOptions());
+
+/**
+  * \brief Neighbours a pixel is connected to in labelComponents(): Four are
+  * the horizontal and vertical ones, Eight adds the diagonal ones.
+  */
+enum class Connectivity {
+    Four,
+    Eight
+};
+
+/**
+  * \struct ComponentStats
+  * \brief Statistics of a connected component of a binary image.
+  */
+struct ComponentStats {
+    /** Bounding box, y being the scanline index like in getPixel() */
+    Rect box;
+    /** Number of pixels */
+    long long count;
+    /** Mean coordinates of the pixels */
+    double centroidX;
+    double centroidY;
+};
+
+/**
+  * \struct Components
+  * \brief Connected components of a binary image, see labelComponents().
+  */
+template <class L>
+struct Components {
+    /** Label of each pixel, 0 for unset pixels */
+    typename PixelTraits<L>::image_type labels;
+    /** stats[i] describes the component labelled i + 1 */
+    std::vector<ComponentStats> stats;
+};
+
+/**
+  * \brief Label the connected components of the set pixels of a binary
+  * image or of a region of it.
+  *
+  * Components are numbered from 1 in the order of their first pixel, by
+  * scanline then x, and L is uint16_t or uint32_t. The image is cut in bands
+  * of scanlines processed concurrently according to policy: the runs of set
+  * pixels of each band are read from packed words, and the runs of
+  * consecutive scanlines which touch are merged with union-find. The bands
+  * are then stitched together, and the labels written concurrently.
+  * \throw std::runtime_error if there are more components than labels of L.
+  */
+template <class L>
+Components<L> labelComponents(ImageView<bool> const& image, Connectivity connectivity = Connectivity::Eight,
+                              ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return the luma of an RGB image or of a region of it.
+  *
+  * Pixels are weighted like FreeImage_ConvertToGreyscale(), with the
+  * Rec. 709 coefficients, in 15 bit fixed point. Scanlines are converted
+  * 16 pixels at a time and spread over threads according to policy.
+  */
+GreyscaleImage toGreyscale(ImageView<RGBTriple> const& image,
+                           ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return a greyscale image where the set pixels of a binary image
+  * are set and the others are unset.
+  */
+GreyscaleImage toGreyscale(ImageView<bool> const& image, byte unset = 0, byte set = 255,
+                           ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return the binary image of the pixels greater than or equal to
+  * level.
+  *
+  * The comparisons are packed directly into 1bpp scanlines, 16 or 32
+  * pixels at a time. RGB pixels are compared by their luma, see
+  * toGreyscale(), without building the greyscale image.
+  */
+BinaryImage threshold(ImageView<byte> const& image, int level,
+                      ExecutionPolicy const& policy = ExecutionPolicy());
+BinaryImage threshold(ImageView<RGBTriple> const& image, int level,
+                      ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Count the pixels of each grey level of an image or of a region
+  * of it.
+  */
+std::array<uint64_t, 256> histogram(ImageView<byte> const& image,
+                                    ExecutionPolicy const& policy = ExecutionPolicy());
+
+/**
+  * \brief Return the level of threshold() which best separates the pixels
+  * of a histogram in two classes, with Otsu's method.
+  *
+  * The level maximizes the variance between the classes, the lowest one on
+  * ties. If the pixels are all of the same grey level, 1 is returned.
+  */
+int otsuThreshold(std::array<uint64_t, 256> const& histogram);
+
 #include "image.inl"
 
 #endif
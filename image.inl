@@ -3,86 +3,407 @@
 #endif
 
 #include <stdexcept>
+#include <cstring>
 
 template <class T>
-Image<T>::Image(int width, int height, ImageType t, int bpp, unsigned int rMask,
-                unsigned int gMask, unsigned int bMask) :
-    m_image(FreeImage_AllocateT(static_cast<FREE_IMAGE_TYPE>(t), width, height, bpp, rMask, gMask, bMask)),
+RowSpan<T>::RowSpan(T* data, int width) :
+    m_data(data),
+    m_width(width)
+{ }
+
+template <class T>
+T& RowSpan<T>::operator[](int x) const {
+    return m_data[x];
+}
+
+template <class T>
+T& RowSpan<T>::at(int x) const {
+    if(x < 0 || x >= m_width) {
+        throw std::runtime_error("Pixel out of range");
+    }
+    return m_data[x];
+}
+
+template <class T>
+bool RowSpan<T>::operator==(RowSpan<const value_type> const& other) const {
+    return m_width == other.size() &&
+           !std::memcmp(m_data, other.data(), m_width * sizeof(value_type));
+}
+
+template <class T>
+T* RowSpan<T>::data() const {
+    return m_data;
+}
+
+template <class T>
+int RowSpan<T>::size() const {
+    return m_width;
+}
+
+template <class T>
+T* RowSpan<T>::begin() const {
+    return m_data;
+}
+
+template <class T>
+T* RowSpan<T>::end() const {
+    return m_data + m_width;
+}
+
+inline BitReference::BitReference(byte* b, byte mask) :
+    m_byte(b),
+    m_mask(mask)
+{ }
+
+inline BitReference::operator bool() const {
+    return *m_byte & m_mask;
+}
+
+inline BitReference& BitReference::operator=(bool value) {
+    *m_byte = value ? (*m_byte | m_mask) : (*m_byte & ~m_mask);
+    return *this;
+}
+
+inline BitReference& BitReference::operator=(BitReference const& other) {
+    return *this = static_cast<bool>(other);
+}
+
+template <class Byte>
+BitRowSpan<Byte>::BitRowSpan(Byte* data, int width) :
+    m_data(data),
+    m_width(width)
+{ }
+
+template <class Byte>
+typename BitRowSpan<Byte>::reference BitRowSpan<Byte>::operator[](int x) const {
+    return reference(m_data + (x >> 3), 0x80 >> (x & 7));
+}
+
+template <>
+inline bool BitRowSpan<const byte>::operator[](int x) const {
+    return m_data[x >> 3] & (0x80 >> (x & 7));
+}
+
+template <class Byte>
+typename BitRowSpan<Byte>::reference BitRowSpan<Byte>::at(int x) const {
+    if(x < 0 || x >= m_width) {
+        throw std::runtime_error("Pixel out of range");
+    }
+    return (*this)[x];
+}
+
+template <class Byte>
+bool BitRowSpan<Byte>::operator==(BitRowSpan<const byte> const& other) const {
+    if(m_width != other.size())
+        return false;
+    int fullBytes = m_width / 8;
+    if(std::memcmp(m_data, other.data(), fullBytes))
+        return false;
+    int remainder = m_width % 8;
+    if(remainder) {
+        byte mask = static_cast<byte>(0xFF00 >> remainder);
+        return !((m_data[fullBytes] ^ other.data()[fullBytes]) & mask);
+    }
+    return true;
+}
+
+template <class Byte>
+Byte* BitRowSpan<Byte>::data() const {
+    return m_data;
+}
+
+template <class Byte>
+int BitRowSpan<Byte>::size() const {
+    return m_width;
+}
+
+/* Compare two pixel values. Pixel types are plain structs without
+ * comparison operators (RGBTRIPLE...), so compare their representation. */
+template <class T>
+bool pixelEquals(T const& a, T const& b) {
+    return !std::memcmp(&a, &b, sizeof(T));
+}
+
+inline bool pixelEquals(bool a, bool b) {
+    return a == b;
+}
+
+/* Pixel value repeated over 96 bytes, so that the value expected at any
+ * offset of a scanline is found at bytes + offset % 48 whatever the pixel size
+ * (1, 2, 3 or 4 bytes) and the width of the SIMD registers. */
+struct PixelPattern {
+    PixelPattern(const void* pixel, size_t pixelSize);
+
+    byte bytes[96];
+};
+
+/* Search the bytes [begin, end) of a scanline for a byte that differs from
+ * the pattern. Return the offset of the first such byte, or end. Vectorized,
+ * defined in image.cpp. */
+size_t findFirstMismatch(const byte* row, size_t begin, size_t end, PixelPattern const& pattern);
+
+/* Same as findFirstMismatch(), searching backwards. Return one past the
+ * offset of the last differing byte, or begin. */
+size_t findLastMismatch(const byte* row, size_t begin, size_t end, PixelPattern const& pattern);
+
+template <class U>
+ScratchBuffer<U>::ScratchBuffer(size_t count) :
+    m_data(static_cast<U*>(ImagePool::instance().allocateScratch(count * sizeof(U)))),
+    m_count(count)
+{ }
+
+template <class U>
+ScratchBuffer<U>::~ScratchBuffer() {
+    ImagePool::instance().releaseScratch(m_data, m_count * sizeof(U));
+}
+
+template <class U>
+U* ScratchBuffer<U>::data() {
+    return m_data;
+}
+
+template <class U>
+U& ScratchBuffer<U>::operator[](size_t i) {
+    return m_data[i];
+}
+
+template <class U>
+U const& ScratchBuffer<U>::operator[](size_t i) const {
+    return m_data[i];
+}
+
+template <class T>
+std::shared_ptr<FIBITMAP> Image<T>::share(FIBITMAP* fi, std::shared_ptr<void> storage) {
+    return std::shared_ptr<FIBITMAP>(fi, [storage](FIBITMAP* bitmap) {
+        ImagePool::instance().unload(bitmap);
+    });
+}
+
+template <class T>
+Image<T>::Image(int width, int height) :
+    m_image(ImagePool::instance().allocate(PixelTraits<T>::type, width, height,
+                                           PixelTraits<T>::bpp, PixelTraits<T>::redMask,
+                                           PixelTraits<T>::greenMask, PixelTraits<T>::blueMask)),
     m_width(width),
-    m_height(height)
+    m_height(height),
+    m_bitmap(share(m_image, nullptr))
 {
     if(!m_image) {
         throw std::runtime_error("Cannot allocate image");
     }
+    updateLayout();
 }
 
 template <class T>
-Image<T>::Image(FIBITMAP* fi) :
+Image<T>::Image(FIBITMAP* fi, std::shared_ptr<void> storage) :
     m_image(fi),
     m_width(FreeImage_GetWidth(fi)),
-    m_height(FreeImage_GetHeight(fi))
-{ }
+    m_height(FreeImage_GetHeight(fi)),
+    m_bitmap(share(fi, std::move(storage)))
+{
+    updateLayout();
+}
 
 template <class T>
-Image<T>::Image(Image const& other) :
-    m_image(FreeImage_Clone(other.m_image)),
-    m_width(other.m_width),
-    m_height(other.m_height)
-{
-    if(!m_image) {
+FIBITMAP* Image<T>::wrapBits(void* bits, int width, int height, int stride) {
+    using Traits = PixelTraits<T>;
+    FIBITMAP* fi = FreeImage_ConvertFromRawBitsEx(FALSE, static_cast<BYTE*>(bits),
+                                                  static_cast<FREE_IMAGE_TYPE>(Traits::type),
+                                                  width, height, stride, Traits::bpp,
+                                                  Traits::redMask, Traits::greenMask,
+                                                  Traits::blueMask, FALSE);
+    if(!fi) {
         throw std::runtime_error("Cannot allocate image");
     }
+    return fi;
 }
 
+template <class T>
+Image<T>::Image(Image const& other) :
+    m_image(other.m_image),
+    m_width(other.m_width),
+    m_height(other.m_height),
+    m_bitmap(other.m_bitmap),
+    m_bits(other.m_bits),
+    m_pitch(other.m_pitch),
+    m_pyramid(std::atomic_load(&other.m_pyramid))
+{ }
+
 template <class T>
 Image<T>::Image(Image&& other) :
     m_image(other.m_image),
     m_width(other.m_width),
-    m_height(other.m_height)
+    m_height(other.m_height),
+    m_bitmap(std::move(other.m_bitmap)),
+    m_bits(other.m_bits),
+    m_pitch(other.m_pitch),
+    m_pyramid(std::move(other.m_pyramid))
 {
     other.m_image = nullptr;
+    other.m_width = other.m_height = 0;
+    other.m_bits = nullptr;
+    other.m_pitch = 0;
 }
 
 template <class T>
 Image<T>& Image<T>::operator=(Image<T> const& other) {
-    FIBITMAP* temp = FreeImage_Clone(other.m_image);
-    if(!temp) {
-        throw std::runtime_error("Cannot allocate image");
-    }
-    FreeImage_Unload(m_image);
-    m_image = temp;
+    m_bitmap = other.m_bitmap;
+    m_image = other.m_image;
     m_width = other.m_width;
     m_height = other.m_height;
+    m_bits = other.m_bits;
+    m_pitch = other.m_pitch;
+    m_pyramid = std::atomic_load(&other.m_pyramid);
     return *this;
 }
 
 template <class T>
 Image<T>& Image<T>::operator=(Image<T>&& other) {
-    FreeImage_Unload(m_image);
-    m_image = other.m_image;
-    m_width = other.m_width;
-    m_height = other.m_height;
+    if(this != &other) {
+        m_bitmap = std::move(other.m_bitmap);
+        m_image = other.m_image;
+        m_width = other.m_width;
+        m_height = other.m_height;
+        m_bits = other.m_bits;
+        m_pitch = other.m_pitch;
+        m_pyramid = std::move(other.m_pyramid);
+        other.m_image = nullptr;
+        other.m_width = other.m_height = 0;
+        other.m_bits = nullptr;
+        other.m_pitch = 0;
+    }
     return *this;
 }
 
+/* The use count can only drop concurrently, when copies are destroyed by
+ * other threads, in which case the pixels are copied for nothing. The cached
+ * pyramid is dropped first, as it holds a reference on the pixels. Modifying
+ * members are never concurrent with the const ones, so it is not accessed
+ * atomically here. */
 template <class T>
-bool Image<T>::operator==(Image const& other) {
-    if(m_width != other.m_width || m_height != other.m_height)
-        return false;
+void Image<T>::detach() {
+    if(m_pyramid) {
+        m_pyramid.reset();
+    }
+    if(m_bitmap.use_count() > 1) {
+        FIBITMAP* copy = ImagePool::instance().clone(m_image);
+        if(!copy) {
+            throw std::runtime_error("Cannot allocate image");
+        }
+        m_bitmap = share(copy, nullptr);
+        m_image = copy;
+        updateLayout();
+    }
+}
+
+template <class T>
+void Image<T>::updateLayout() {
+    m_bits = FreeImage_GetBits(m_image);
+    m_pitch = FreeImage_GetPitch(m_image);
+}
+
+template <class T>
+bool Image<T>::operator==(Image const& other) const {
+    return view() == other.view();
+}
+
+/* Concurrent first calls may each build a pyramid, the last one stays cached */
+template <class T>
+std::shared_ptr<const ImagePyramid<T>> Image<T>::pyramid(PyramidFilter filter) const {
+    auto cached = std::atomic_load(&m_pyramid);
+    if(cached && cached->filter() == filter) {
+        return cached;
+    }
+    cached = std::make_shared<const ImagePyramid<T>>(view(), filter, m_bitmap);
+    std::atomic_store(&m_pyramid, cached);
+    return cached;
+}
+
+/* Feed count pixels of a scanline starting at x to a hasher */
+template <class T>
+void hashPixels(ContentHasher& hasher, RowSpan<const T> const& row, int x, int count) {
+    hasher.update(row.data() + x, count * sizeof(T));
+}
+
+/* Binary scanlines are hashed as packed bytes, x must be a multiple of 8.
+ * The bits past the last pixel are masked out. */
+inline void hashPixels(ContentHasher& hasher, RowSpan<const bool> const& row, int x, int count) {
+    const byte* first = row.data() + x / 8;
+    int fullBytes = count / 8, remainder = count % 8;
+    hasher.update(first, fullBytes);
+    if(remainder) {
+        byte last = first[fullBytes] & static_cast<byte>(0xFF00 >> remainder);
+        hasher.update(&last, 1);
+    }
+}
+
+template <class T>
+Hash128 Image<T>::hash128() const {
+    IMAGE_SCOPE("hash", static_cast<uint64_t>(m_width) * m_height);
+    ContentHasher hasher;
+    // Little-endian header, so that the hash does not depend on the platform
+    uint32_t header[4] = {static_cast<uint32_t>(m_width), static_cast<uint32_t>(m_height),
+                          static_cast<uint32_t>(PixelTraits<T>::bpp),
+                          static_cast<uint32_t>(PixelTraits<T>::type)};
+    for(uint32_t v : header) {
+        byte bytes[4] = {static_cast<byte>(v), static_cast<byte>(v >> 8),
+                         static_cast<byte>(v >> 16), static_cast<byte>(v >> 24)};
+        hasher.update(bytes, 4);
+    }
     for(int y = 0 ; y != m_height ; ++y) {
-        for(int x = 0 ; x != m_width ; ++x) {
-            if(getPixel(x, y) != other.getPixel(x, y))
-                return false;
+        hashPixels(hasher, rowUnchecked(y), 0, m_width);
+    }
+    return hasher.digest128();
+}
+
+template <class T>
+uint64_t Image<T>::hash() const {
+    return hash128().low;
+}
+
+template <class T>
+TileHashes Image<T>::tileHashes(int tileSize) const {
+    IMAGE_SCOPE("tileHashes", static_cast<uint64_t>(m_width) * m_height);
+    if(tileSize <= 0) {
+        throw std::runtime_error("Invalid tile size");
+    }
+    const int pixelsPerByte = PixelTraits<T>::pixelsPerByte;
+    if(pixelsPerByte > 1) {
+        tileSize = (tileSize + pixelsPerByte - 1) / pixelsPerByte * pixelsPerByte;
+    }
+    TileHashes tiles;
+    tiles.width = m_width;
+    tiles.height = m_height;
+    tiles.tileSize = tileSize;
+    tiles.columns = (m_width + tileSize - 1) / tileSize;
+    tiles.rows = (m_height + tileSize - 1) / tileSize;
+    tiles.hashes.reserve(static_cast<size_t>(tiles.columns) * tiles.rows);
+    std::vector<ContentHasher> hashers(tiles.columns);
+    for(int ty = 0 ; ty != tiles.rows ; ++ty) {
+        std::fill(hashers.begin(), hashers.end(), ContentHasher());
+        int yEnd = std::min(m_height, (ty + 1) * tileSize);
+        for(int y = ty * tileSize ; y != yEnd ; ++y) {
+            auto row = rowUnchecked(y);
+            for(int tx = 0 ; tx != tiles.columns ; ++tx) {
+                int x = tx * tileSize;
+                hashPixels(hashers[tx], row, x, std::min(tileSize, m_width - x));
+            }
+        }
+        for(auto const& hasher : hashers) {
+            tiles.hashes.push_back(hasher.digest());
         }
     }
-    return true;
+    return tiles;
 }
 
 template <class T>
-Image<T>::~Image() {
-    FreeImage_Unload(m_image);
+std::vector<Rect> Image<T>::diff(Image const& other, int tileSize) const {
+    return diffTiles(tileHashes(tileSize), other.tileHashes(tileSize));
 }
 
+template <class T>
+Image<T>::~Image() { }
+
 template <class T>
 int Image<T>::width() const {
     return m_width;
@@ -93,6 +414,24 @@ int Image<T>::height() const {
     return m_height;
 }
 
+template <class T>
+T Image<T>::getPixel(int x, int y) const {
+    if(static_cast<unsigned>(x) >= static_cast<unsigned>(m_width) ||
+       static_cast<unsigned>(y) >= static_cast<unsigned>(m_height)) {
+        throw std::runtime_error("Cannot read pixel");
+    }
+    return rowUnchecked(y)[x];
+}
+
+template <class T>
+void Image<T>::setPixel(int x, int y, T pixel) {
+    if(static_cast<unsigned>(x) >= static_cast<unsigned>(m_width) ||
+       static_cast<unsigned>(y) >= static_cast<unsigned>(m_height)) {
+        throw std::runtime_error("Cannot set pixel value");
+    }
+    rowUnchecked(y)[x] = pixel;
+}
+
 template <class T>
 const T* Image<T>::getBits() const {
     return reinterpret_cast<const T*>(FreeImage_GetBits(m_image));
@@ -103,76 +442,1081 @@ const T* Image<T>::getScanline(int scanline) const {
     return reinterpret_cast<const T*>(FreeImage_GetScanLine(m_image, scanline));
 }
 
+template <class T>
+typename Image<T>::Row Image<T>::row(int y) {
+    if(y < 0 || y >= m_height) {
+        throw std::runtime_error("Scanline out of range");
+    }
+    return rowUnchecked(y);
+}
+
+template <class T>
+typename Image<T>::ConstRow Image<T>::row(int y) const {
+    if(y < 0 || y >= m_height) {
+        throw std::runtime_error("Scanline out of range");
+    }
+    return rowUnchecked(y);
+}
+
+template <class T>
+typename Image<T>::Row Image<T>::rowUnchecked(int y) {
+    detach();
+    return writableRow(y);
+}
+
+template <class T>
+typename Image<T>::Row Image<T>::writableRow(int y) {
+    return Row(reinterpret_cast<typename Row::pointer>(m_bits + static_cast<ptrdiff_t>(m_pitch) * y), m_width);
+}
+
+template <class T>
+typename Image<T>::ConstRow Image<T>::rowUnchecked(int y) const {
+    return ConstRow(reinterpret_cast<typename ConstRow::pointer>(m_bits + static_cast<ptrdiff_t>(m_pitch) * y),
+                    m_width);
+}
+
+template <class T>
+int Image<T>::pitch() const {
+    return m_pitch;
+}
+
 template <class T>
 Rect Image<T>::getAABB(T backgroundColor) const {
-    int xMin = m_width - 1, xMax = 0, yMin = m_height - 1, yMax = 0;
-    for(int y = 0 ; y != m_height ; ++y) {
-        for(int x = 0 ; x != m_width ; ++x) {
-            if(getPixel(x, y) != backgroundColor) {
-                xMin = (x < xMin) ? x : xMin;
-                xMax = (x > xMax) ? x : xMax;
-                yMin = (y < yMin) ? y : yMin;
-                yMax = (y > yMax) ? y : yMax;
+    return view().getAABB(backgroundColor);
+}
+
+template <class T>
+bool Image<T>::getAABB(T backgroundColor, Rect& aabb) const {
+    return view().getAABB(backgroundColor, aabb);
+}
+
+/* The pixels are detached before the bands are dispatched, so that the
+ * workers only read the use count of the bitmap */
+template <class T>
+template <class F>
+void Image<T>::transform(F f, ExecutionPolicy const& policy) {
+    detach();
+    forEachBand(m_height, m_pitch, policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            auto r = writableRow(y);
+            for(int x = 0 ; x != m_width ; ++x) {
+                r[x] = f(static_cast<T>(r[x]));
             }
         }
+    });
+}
+
+template <class T>
+template <class U, class F>
+void Image<T>::zip(Image<U> const& other, F f, ExecutionPolicy const& policy) {
+    if(other.width() != m_width || other.height() != m_height) {
+        throw std::runtime_error("Images have different sizes");
     }
-    return {xMin, yMin, xMax - xMin, yMax - yMin};
+    detach();
+    forEachBand(m_height, m_pitch, policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            auto r = writableRow(y);
+            auto o = other.rowUnchecked(y);
+            for(int x = 0 ; x != m_width ; ++x) {
+                r[x] = f(static_cast<T>(r[x]), static_cast<U>(o[x]));
+            }
+        }
+    });
+}
+
+template <class T>
+template <class U, class Op, class Combine>
+U Image<T>::reduce(U init, Op op, Combine combine, ExecutionPolicy const& policy) const {
+    std::mutex mutex;
+    std::vector<std::pair<int, U>> bands;
+    forEachBand(m_height, m_pitch, policy, [&](int yBegin, int yEnd) {
+        U acc = init;
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            auto r = rowUnchecked(y);
+            for(int x = 0 ; x != m_width ; ++x) {
+                acc = op(acc, static_cast<T>(r[x]));
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        bands.emplace_back(yBegin, std::move(acc));
+    });
+    if(bands.empty()) {
+        return init;
+    }
+    std::sort(bands.begin(), bands.end(), [](std::pair<int, U> const& a, std::pair<int, U> const& b) {
+        return a.first < b.first;
+    });
+    U result = std::move(bands[0].second);
+    for(size_t i = 1 ; i < bands.size() ; ++i) {
+        result = combine(result, bands[i].second);
+    }
+    return result;
 }
 
 template <class T>
 void Image<T>::flipX() {
+    IMAGE_SCOPE("flipX", static_cast<uint64_t>(m_width) * m_height);
+    detach();
     auto w = m_width / 2;
     for(int y = 0 ; y != m_height ; ++y) {
+        auto r = writableRow(y);
         for(int x = 0 ; x != w ; ++x) {
-            T t = getPixel(x, y);
             int xFlip = m_width - x - 1;
-            setPixel(x, y, getPixel(xFlip, y));
-            setPixel(xFlip, y, t);
+            T t = r[x];
+            r[x] = r[xFlip];
+            r[xFlip] = t;
         }
     }
 }
 
 template <class T>
 void Image<T>::flipY() {
+    IMAGE_SCOPE("flipY", static_cast<uint64_t>(m_width) * m_height);
+    detach();
     auto h = m_height / 2;
+    auto line = FreeImage_GetLine(m_image);
     for(int y = 0 ; y != h ; ++y) {
-        for(int x = 0 ; x != m_width ; ++x) {
-            T t = getPixel(x, y);
-            int yFlip = m_height - y - 1;
-            setPixel(x, y, getPixel(x, yFlip));
-            setPixel(x, yFlip, t);
-        }
+        BYTE* top = FreeImage_GetScanLine(m_image, y);
+        BYTE* bottom = FreeImage_GetScanLine(m_image, m_height - y - 1);
+        std::swap_ranges(top, top + line, bottom);
     }
 }
 
+/* Clip a blit of the region r of a srcWidth x srcHeight image to c in a
+ * dstWidth x dstHeight image, coordinates may be negative. On return, r is
+ * the region left to copy and c its destination. Return false if nothing is
+ * left to copy. */
+inline bool clipBlit(ImageCoords& c, Rect& r, int dstWidth, int dstHeight,
+                     int srcWidth, int srcHeight) {
+    int x0 = std::max({0, -c.x, -r.x}), y0 = std::max({0, -c.y, -r.y});
+    int x1 = std::min({r.width, dstWidth - c.x, srcWidth - r.x});
+    int y1 = std::min({r.height, dstHeight - c.y, srcHeight - r.y});
+    if(x1 <= x0 || y1 <= y0)
+        return false;
+    c = {c.x + x0, c.y + y0};
+    r = {r.x + x0, r.y + y0, x1 - x0, y1 - y0};
+    return true;
+}
+
 template <class T>
 void Image<T>::blit(ImageCoords c, Rect r, Image<T> const& other) {
-    int h = m_height - c.y;
-    int w = m_width - c.x;
-    h = (r.height > h) ? h : r.height;
-    w = (r.width > w) ? w : r.width;
+    if(!clipBlit(c, r, m_width, m_height, other.m_width, other.m_height))
+        return;
+    IMAGE_SCOPE("blit", static_cast<uint64_t>(r.width) * r.height);
+    detach();
+    blitRegion(c, r, other.view());
+}
 
-    for(int ix = 0 ; ix != w ; ++ix) {
-        for(int iy = 0 ; iy != h ; ++iy) {
-            setPixel(c.x + ix, c.y + iy, other.getPixel(r.x + ix, r.y + iy));
-        }
+template <class T>
+void Image<T>::blit(ImageCoords c, ImageView<T> const& source) {
+    Rect r{0, 0, source.width(), source.height()};
+    if(!clipBlit(c, r, m_width, m_height, r.width, r.height))
+        return;
+    IMAGE_SCOPE("blit", static_cast<uint64_t>(r.width) * r.height);
+    detach();
+    blitRegion(c, r, source);
+}
+
+template <class T>
+void Image<T>::blitRegion(ImageCoords c, Rect r, ImageView<T> const& source) {
+    // Go bottom up if the source comes before the destination in memory, in
+    // case they overlap
+    bool backwards = std::less<const void*>()(source.rowUnchecked(r.y).data() + r.x,
+                                              writableRow(c.y).data() + c.x);
+    for(int i = 0 ; i != r.height ; ++i) {
+        int iy = backwards ? r.height - i - 1 : i;
+        std::memmove(writableRow(c.y + iy).data() + c.x,
+                     source.rowUnchecked(r.y + iy).data() + r.x, r.width * sizeof(T));
     }
 }
 
+template <class T>
+ImageView<T> Image<T>::view() const {
+    return ImageView<T>(*this);
+}
+
+template <class T>
+ImageView<T> Image<T>::view(Rect r) const {
+    return ImageView<T>(*this, r);
+}
+
 template <class T>
 void Image<T>::crop(Rect r) {
+    IMAGE_SCOPE("crop", static_cast<uint64_t>(r.width) * r.height);
     FIBITMAP* croppedImg = FreeImage_Copy(m_image, r.x, r.y + r.height, r.x + r.width, r.y);
+    IMAGE_COUNT_BITMAP(croppedImg);
     m_width = r.width;
     m_height = r.height;
-    FreeImage_Unload(m_image);
+    m_bitmap = share(croppedImg, nullptr);
     m_image = croppedImg;
+    m_pyramid.reset();
+    updateLayout();
+}
+
+/* BmpRle is not a FreeImage format, but a flag of the BMP plugin */
+inline FREE_IMAGE_FORMAT freeImageFormat(ImageFormat f) {
+    return (f == ImageFormat::BmpRle) ? FIF_BMP : static_cast<FREE_IMAGE_FORMAT>(f);
+}
+
+/* Offset in bytes of pixel x in a scanline. Views of binary images start on
+ * whole bytes. */
+template <class T>
+size_t pixelOffset(int x) {
+    const int pixelsPerByte = PixelTraits<T>::pixelsPerByte;
+    if(pixelsPerByte == 0) {
+        return x * sizeof(T);
+    }
+    if(x % pixelsPerByte) {
+        throw std::runtime_error("Binary image views must start on a multiple of 8 pixels");
+    }
+    return x / pixelsPerByte;
+}
+
+template <class T>
+ImageView<T>::ImageView(pointer bits, int width, int height, int stride) :
+    m_bits(bits),
+    m_width(width),
+    m_height(height),
+    m_stride(stride)
+{ }
+
+template <class T>
+ImageView<T>::ImageView(Image<T> const& image) :
+    ImageView(image.height() ? image.rowUnchecked(0).data() : nullptr,
+              image.width(), image.height(), image.height() ? image.pitch() : 0)
+{ }
+
+template <class T>
+ImageView<T>::ImageView(Image<T> const& image, Rect r) :
+    ImageView(ImageView(image).view(r))
+{ }
+
+template <class T>
+int ImageView<T>::width() const {
+    return m_width;
+}
+
+template <class T>
+int ImageView<T>::height() const {
+    return m_height;
+}
+
+template <class T>
+int ImageView<T>::stride() const {
+    return m_stride;
+}
+
+template <class T>
+typename ImageView<T>::ConstRow ImageView<T>::row(int y) const {
+    if(y < 0 || y >= m_height) {
+        throw std::runtime_error("Scanline out of range");
+    }
+    return rowUnchecked(y);
+}
+
+template <class T>
+typename ImageView<T>::ConstRow ImageView<T>::rowUnchecked(int y) const {
+    auto bits = reinterpret_cast<const byte*>(m_bits) + static_cast<ptrdiff_t>(m_stride) * y;
+    return ConstRow(reinterpret_cast<pointer>(bits), m_width);
+}
+
+template <class T>
+ImageView<T> ImageView<T>::view(Rect r) const {
+    if(r.x < 0 || r.y < 0 || r.width < 0 || r.height < 0 ||
+       r.x + r.width > m_width || r.y + r.height > m_height) {
+        throw std::runtime_error("View out of image bounds");
+    }
+    auto bits = reinterpret_cast<const byte*>(rowUnchecked(r.y).data()) + pixelOffset<T>(r.x);
+    return ImageView(reinterpret_cast<pointer>(bits), r.width, r.height, m_stride);
+}
+
+template <class T>
+bool ImageView<T>::operator==(ImageView const& other) const {
+    if(m_width != other.m_width || m_height != other.m_height)
+        return false;
+    for(int y = 0 ; y != m_height ; ++y) {
+        if(!(rowUnchecked(y) == other.rowUnchecked(y)))
+            return false;
+    }
+    return true;
+}
+
+template <class T>
+Rect ImageView<T>::getAABB(T backgroundColor) const {
+    Rect aabb;
+    if(!getAABB(backgroundColor, aabb)) {
+        return {m_width - 1, m_height - 1, 1 - m_width, 1 - m_height};
+    }
+    return aabb;
+}
+
+template <class T>
+bool ImageView<T>::getAABB(T backgroundColor, Rect& aabb) const {
+    const size_t size = sizeof(T), rowSize = m_width * size;
+    const PixelPattern background(&backgroundColor, size);
+    auto bytes = [this](int y) {
+        return reinterpret_cast<const byte*>(rowUnchecked(y).data());
+    };
+    auto isBackground = [&](int y) {
+        return findFirstMismatch(bytes(y), 0, rowSize, background) == rowSize;
+    };
+    int yMin = 0, yMax = m_height - 1;
+    while(yMin != m_height && isBackground(yMin)) {
+        ++yMin;
+    }
+    if(yMin == m_height) {
+        return false;
+    }
+    while(isBackground(yMax)) {
+        --yMax;
+    }
+    // Only search the scanlines outside of the current box
+    int xMin = m_width, xMax = -1;
+    for(int y = yMin ; y <= yMax && (xMin != 0 || xMax != m_width - 1) ; ++y) {
+        const byte* r = bytes(y);
+        xMin = findFirstMismatch(r, 0, xMin * size, background) / size;
+        size_t last = findLastMismatch(r, (xMax + 1) * size, rowSize, background);
+        if(last != (xMax + 1) * size) {
+            xMax = (last - 1) / size;
+        }
+    }
+    aabb = {xMin, yMin, xMax - xMin, yMax - yMin};
+    return true;
+}
+
+/* The pixels are saved through an image wrapping them, which is never
+ * modified */
+template <class T>
+void ImageView<T>::save(std::string const& filename, ImageFormat f) const {
+    using I = typename PixelTraits<T>::image_type;
+    auto bits = const_cast<typename RowSpan<T>::pointer>(m_bits);
+    I::fromRawData(bits, m_width, m_height, m_stride).save(filename, f);
+}
+
+template <class T>
+void ImageView<T>::save(std::vector<byte>& buffer, ImageFormat f) const {
+    using I = typename PixelTraits<T>::image_type;
+    auto bits = const_cast<typename RowSpan<T>::pointer>(m_bits);
+    I::fromRawData(bits, m_width, m_height, m_stride).save(buffer, f);
+}
+
+/* Size of the next level of a pyramid */
+inline int pyramidSize(int size) {
+    return (size + 1) / 2;
+}
+
+/* Scanlines of pyramid levels start on 32 bytes boundaries */
+template <class T>
+size_t pyramidStride(int width) {
+    const int pixelsPerByte = PixelTraits<T>::pixelsPerByte;
+    size_t bytes = pixelsPerByte ? (width + pixelsPerByte - 1) / pixelsPerByte : width * sizeof(T);
+    return (bytes + 31) / 32 * 32;
+}
+
+/* Sums of pixels are computed in 32 bits for integer pixels */
+template <class T>
+using PyramidSum = typename std::conditional<std::is_floating_point<T>::value, T, uint32_t>::type;
+
+template <class T>
+T pyramidAverage(PyramidSum<T> sum, uint32_t weight) {
+    return std::is_floating_point<T>::value ? static_cast<T>(sum / weight) :
+                                              static_cast<T>((sum + weight / 2) / weight);
+}
+
+/* Compute scanline y of a level from the previous one, src, pixels outside of
+ * src being clamped to its edges */
+template <class T>
+void boxReduceRow(ImageView<T> const& src, int y, int width, T* out) {
+    auto a = src.rowUnchecked(std::min(2 * y, src.height() - 1));
+    auto b = src.rowUnchecked(std::min(2 * y + 1, src.height() - 1));
+    const int last = src.width() - 1;
+    for(int x = 0 ; x != width ; ++x) {
+        int x0 = 2 * x, x1 = std::min(2 * x + 1, last);
+        PyramidSum<T> sum = PyramidSum<T>(a[x0]) + a[x1] + b[x0] + b[x1];
+        out[x] = pyramidAverage<T>(sum, 4);
+    }
+}
+
+template <class T>
+void binomialReduceRow(ImageView<T> const& src, int y, int width, T* out) {
+    const int w = src.width(), h = src.height();
+    auto r0 = src.rowUnchecked(clamp(0, h - 1, 2 * y - 1));
+    auto r1 = src.rowUnchecked(std::min(2 * y, h - 1));
+    auto r2 = src.rowUnchecked(std::min(2 * y + 1, h - 1));
+    auto r3 = src.rowUnchecked(std::min(2 * y + 2, h - 1));
+    for(int x = 0 ; x != width ; ++x) {
+        PyramidSum<T> sum = 0;
+        for(int j = 0 ; j != 4 ; ++j) {
+            int c = clamp(0, w - 1, 2 * x - 1 + j);
+            PyramidSum<T> column = PyramidSum<T>(r0[c]) + 3 * (PyramidSum<T>(r1[c]) + r2[c]) + r3[c];
+            sum += (j == 0 || j == 3) ? column : 3 * column;
+        }
+        out[x] = pyramidAverage<T>(sum, 64);
+    }
+}
+
+template <class T>
+size_t ImagePyramid<T>::storageSize(int width, int height) {
+    size_t size = 0;
+    while((width > 1 || height > 1) && width > 0 && height > 0) {
+        width = pyramidSize(width);
+        height = pyramidSize(height);
+        size += pyramidStride<T>(width) * height;
+    }
+    return size;
+}
+
+template <class T>
+ImagePyramid<T>::ImagePyramid(ImageView<T> const& source, PyramidFilter filter,
+                              std::shared_ptr<void> owner) :
+    m_owner(std::move(owner)),
+    m_filter(filter),
+    m_pixels(storageSize(source.width(), source.height()))
+{
+    IMAGE_SCOPE("pyramid", static_cast<uint64_t>(source.width()) * source.height());
+    m_levels.push_back(source);
+    int width = source.width(), height = source.height();
+    byte* bits = m_pixels.data();
+    while((width > 1 || height > 1) && width > 0 && height > 0) {
+        width = pyramidSize(width);
+        height = pyramidSize(height);
+        size_t stride = pyramidStride<T>(width);
+        m_levels.emplace_back(reinterpret_cast<typename ImageView<T>::pointer>(bits), width, height,
+                              static_cast<int>(stride));
+        bits += stride * height;
+    }
+    m_produced.assign(m_levels.size(), 0);
+    for(int y = 0 ; y < source.height() ; ++y) {
+        cascade(0, y);
+    }
+}
+
+template <class T>
+int ImagePyramid<T>::levels() const {
+    return static_cast<int>(m_levels.size());
+}
+
+template <class T>
+ImageView<T> ImagePyramid<T>::level(int i) const {
+    if(i < 0 || i >= levels()) {
+        throw std::runtime_error("Pyramid level out of range");
+    }
+    return m_levels[i];
+}
+
+template <class T>
+PyramidFilter ImagePyramid<T>::filter() const {
+    return m_filter;
+}
+
+template <class T>
+typename RowSpan<T>::pointer ImagePyramid<T>::levelRow(int k, int y) {
+    return const_cast<typename RowSpan<T>::pointer>(m_levels[k].rowUnchecked(y).data());
+}
+
+template <class T>
+void ImagePyramid<T>::cascade(int k, int y) {
+    if(k + 1 == levels()) {
+        return;
+    }
+    // Last scanline of level k read by the binomial filter, relative to 2y
+    const int reach = (m_filter == PyramidFilter::Binomial && !PixelTraits<T>::pixelsPerByte) ? 2 : 1;
+    const int height = m_levels[k].height();
+    int& next = m_produced[k + 1];
+    while(next < m_levels[k + 1].height() && std::min(2 * next + reach, height - 1) <= y) {
+        int row = next++;
+        reduceRow(k + 1, row);
+        cascade(k + 1, row);
+    }
+}
+
+template <class T>
+void ImagePyramid<T>::reduceRow(int k, int y) {
+    if(m_filter == PyramidFilter::Binomial) {
+        binomialReduceRow(m_levels[k - 1], y, m_levels[k].width(), levelRow(k, y));
+    }
+    else {
+        boxReduceRow(m_levels[k - 1], y, m_levels[k].width(), levelRow(k, y));
+    }
+}
+
+/* Separable resampling weights of resize() along one axis, defined in
+ * image.cpp. Output pixel i reads counts[i] source pixels from starts[i],
+ * with the weights at weights[i * taps]. taps is a multiple of 4, the unused
+ * weights being zero. */
+struct ResizeAxis {
+    ResizeAxis(int inSize, int outSize, ResizeFilter filter);
+
+    int taps;
+    std::vector<int> starts;
+    std::vector<int> counts;
+    std::vector<float> weights;
+};
+
+/* Horizontal pass: out[x] is the weighted sum of the taps pixels of in at
+ * axis.starts[x]. in must be followed by axis.taps readable floats. */
+void resizeRow(const float* in, ResizeAxis const& axis, int width, float* out);
+
+/* Vertical pass: out[x] is the weighted sum of rows[k][x] */
+void resizeColumn(const float* const* rows, const float* weights, int count, int width, float* out);
+
+/* Conversion of scanlines from and to planar channels, of float or of the
+ * pixel channel type, planes being stride values apart */
+template <class P>
+void loadPlanes(RowSpan<const byte> row, int, P* planes) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        planes[x] = row[x];
+    }
+}
+
+template <class P>
+void loadPlanes(RowSpan<const uint16_t> row, int, P* planes) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        planes[x] = row[x];
+    }
+}
+
+template <class P>
+void loadPlanes(RowSpan<const float> row, int, P* planes) {
+    std::copy(row.begin(), row.end(), planes);
+}
+
+template <class P>
+void loadPlanes(RowSpan<const RGBTriple> row, int stride, P* planes) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        planes[x] = row[x].rgbtBlue;
+        planes[x + stride] = row[x].rgbtGreen;
+        planes[x + 2 * stride] = row[x].rgbtRed;
+    }
+}
+
+template <class U>
+U roundPixel(float v) {
+    const float high = static_cast<float>(std::numeric_limits<U>::max());
+    return static_cast<U>(std::min(high, std::max(0.f, v + 0.5f)));
+}
+
+template <class P>
+void storePlanes(const P* planes, int, RowSpan<byte> row) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        row[x] = roundPixel<byte>(planes[x]);
+    }
+}
+
+template <class P>
+void storePlanes(const P* planes, int, RowSpan<uint16_t> row) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        row[x] = roundPixel<uint16_t>(planes[x]);
+    }
+}
+
+template <class P>
+void storePlanes(const P* planes, int, RowSpan<float> row) {
+    std::copy(planes, planes + row.size(), row.begin());
+}
+
+template <class P>
+void storePlanes(const P* planes, int stride, RowSpan<RGBTriple> row) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        row[x].rgbtBlue = roundPixel<byte>(planes[x]);
+        row[x].rgbtGreen = roundPixel<byte>(planes[x + stride]);
+        row[x].rgbtRed = roundPixel<byte>(planes[x + 2 * stride]);
+    }
+}
+
+/* Scanlines already rounded to bytes by the 8 bit convolution */
+inline void storePlanes(const byte* planes, int, RowSpan<byte> row) {
+    std::copy(planes, planes + row.size(), row.begin());
+}
+
+inline void storePlanes(const byte* planes, int stride, RowSpan<RGBTriple> row) {
+    for(int x = 0 ; x != row.size() ; ++x) {
+        row[x].rgbtBlue = planes[x];
+        row[x].rgbtGreen = planes[x + stride];
+        row[x].rgbtRed = planes[x + 2 * stride];
+    }
+}
+
+/* Number of output scanlines resampled together */
+static const int RESIZE_TILE_ROWS = 32;
+
+template <class T, class I>
+void resizeFiltered(ImageView<T> const& src, I& out, ResizeFilter filter, ExecutionPolicy const& policy) {
+    const int channels = PixelTraits<T>::channels;
+    const int width = out.width(), height = out.height();
+    const ResizeAxis columns(src.width(), width, filter), rows(src.height(), height, filter);
+    const int lineStride = src.width() + columns.taps;
+    out.detach();
+    forEachBand(height, out.pitch(), policy, [&](int yBegin, int yEnd) {
+        // Planar source scanline, zero padded for the horizontal pass
+        std::vector<float> line(static_cast<size_t>(channels) * lineStride, 0.f);
+        std::vector<float> outLine(static_cast<size_t>(channels) * width);
+        std::vector<float> tile;
+        std::vector<const float*> taps(rows.taps);
+        for(int tileBegin = yBegin ; tileBegin < yEnd ; tileBegin += RESIZE_TILE_ROWS) {
+            int tileEnd = std::min(yEnd, tileBegin + RESIZE_TILE_ROWS);
+            int first = rows.starts[tileBegin], last = first;
+            for(int y = tileBegin ; y != tileEnd ; ++y) {
+                last = std::max(last, rows.starts[y] + rows.counts[y]);
+            }
+            // Horizontal pass of the source scanlines of the tile, planes
+            // of count scanlines each
+            const int count = last - first;
+            const size_t plane = static_cast<size_t>(count) * width;
+            tile.resize(channels * plane);
+            for(int r = 0 ; r != count ; ++r) {
+                loadPlanes(src.rowUnchecked(first + r), lineStride, line.data());
+                for(int c = 0 ; c != channels ; ++c) {
+                    resizeRow(line.data() + c * lineStride, columns, width,
+                              tile.data() + c * plane + static_cast<size_t>(r) * width);
+                }
+            }
+            for(int y = tileBegin ; y != tileEnd ; ++y) {
+                for(int c = 0 ; c != channels ; ++c) {
+                    for(int k = 0 ; k != rows.counts[y] ; ++k) {
+                        taps[k] = tile.data() + c * plane + static_cast<size_t>(rows.starts[y] - first + k) * width;
+                    }
+                    resizeColumn(taps.data(), rows.weights.data() + static_cast<size_t>(y) * rows.taps,
+                                 rows.counts[y], width, outLine.data() + c * width);
+                }
+                storePlanes(outLine.data(), width, out.writableRow(y));
+            }
+        }
+    });
+}
+
+inline void resizeFiltered(ImageView<bool> const&, BinaryImage&, ResizeFilter, ExecutionPolicy const&) {
+    throw std::runtime_error("Binary images only support nearest resizing");
+}
+
+template <class T>
+typename PixelTraits<T>::image_type resize(ImageView<T> const& image, int width, int height,
+                                           ResizeFilter filter, ExecutionPolicy const& policy) {
+    if(width <= 0 || height <= 0 || image.width() <= 0 || image.height() <= 0) {
+        throw std::runtime_error("Invalid image size");
+    }
+    IMAGE_SCOPE("resize", static_cast<uint64_t>(width) * height);
+    typename PixelTraits<T>::image_type out(width, height);
+    if(filter != ResizeFilter::Nearest) {
+        resizeFiltered(image, out, filter, policy);
+        return out;
+    }
+    std::vector<int> columns(width);
+    for(int x = 0 ; x != width ; ++x) {
+        columns[x] = static_cast<int>((2 * static_cast<long long>(x) + 1) * image.width() / (2 * width));
+    }
+    out.detach();
+    forEachBand(height, out.pitch(), policy, [&](int yBegin, int yEnd) {
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            auto in = image.rowUnchecked(static_cast<int>((2 * static_cast<long long>(y) + 1) *
+                                                          image.height() / (2 * height)));
+            auto o = out.writableRow(y);
+            for(int x = 0 ; x != width ; ++x) {
+                o[x] = in[columns[x]];
+            }
+        }
+    });
+    return out;
+}
+
+template <class T>
+typename PixelTraits<T>::image_type Image<T>::resize(int width, int height, ResizeFilter filter,
+                                                     ExecutionPolicy const& policy) const {
+    return ::resize(view(), width, height, filter, policy);
+}
+
+/* Index of the pixel read at index i of a line of n pixels extended
+ * according to border, -1 when the constant is read instead */
+inline int borderIndex(int i, int n, BorderMode border) {
+    if(i >= 0 && i < n) {
+        return i;
+    }
+    switch(border) {
+        case BorderMode::Clamp:
+            return i < 0 ? 0 : n - 1;
+        case BorderMode::Wrap:
+            return (i % n + n) % n;
+        case BorderMode::Mirror: {
+            if(n == 1) {
+                return 0;
+            }
+            const int period = 2 * n - 2;
+            i = (i % period + period) % period;
+            return i < n ? i : period - i;
+        }
+        default:
+            return -1;
+    }
+}
+
+/* Copy a line of width values to out + radius, extended by radius values
+ * on both sides */
+template <class P>
+void padLine(const P* in, int width, int radius, BorderMode border, P constant, P* out) {
+    std::copy(in, in + width, out + radius);
+    for(int x = 0 ; x != radius ; ++x) {
+        const int left = borderIndex(x - radius, width, border), right = borderIndex(width + x, width, border);
+        out[x] = left < 0 ? constant : in[left];
+        out[radius + width + x] = right < 0 ? constant : in[right];
+    }
+}
+
+/* Kernels of the 8 bit convolution, defined in image.cpp. Weights are in 14
+ * bit fixed point. The horizontal pass reads width + taps - 1 bytes of line
+ * and outputs values in 6 bit fixed point, which the vertical pass rounds
+ * back to bytes. quantizeKernel() returns an empty kernel when the sums
+ * could overflow 16 bits. */
+std::vector<int16_t> quantizeKernel(std::vector<float> const& kernel);
+void convolveRowFixed(const byte* line, const int16_t* weights, int taps, int width, int16_t* out);
+void convolveColumnFixed(const int16_t* const* rows, const int16_t* weights, int taps, int width, byte* out);
+
+/* Horizontal pass of the floating point convolution, the vertical pass
+ * being resizeColumn() */
+void convolveRow(const float* line, const float* weights, int taps, int width, float* out);
+
+/* Separable convolution of src into out. row(line, mid) filters a padded
+ * plane of Line values into Mid values, column(rows, line) combines the
+ * filtered planes of consecutive scanlines into an output plane. Each band
+ * keeps the filtered planes of the last vTaps source scanlines in a ring. */
+template <class T, class Line, class Mid, class Row, class Column>
+void convolveTiles(ImageView<T> const& src, typename PixelTraits<T>::image_type& out, int hTaps, int vTaps,
+                   BorderMode border, Line constant, ExecutionPolicy const& policy, Row row, Column column) {
+    const int channels = PixelTraits<T>::channels;
+    const int width = src.width(), height = src.height();
+    const int lineStride = width + hTaps - 1;
+    const size_t rowStride = static_cast<size_t>(channels) * width;
+    out.detach();
+    forEachBand(height, out.pitch(), policy, [&](int yBegin, int yEnd) {
+        std::vector<Line> source(rowStride), line(lineStride), outLine(rowStride);
+        std::vector<Mid> ring(vTaps * rowStride);
+        std::vector<const Mid*> taps(vTaps);
+        const int first = yBegin - vTaps / 2;
+        auto ringPlane = [&](int r, int c) {
+            return ring.data() + (r - first) % vTaps * rowStride + c * width;
+        };
+        // Horizontal pass of the source scanline r, which may be outside of
+        // the image
+        auto filter = [&](int r) {
+            const int y = borderIndex(r, height, border);
+            if(y < 0) {
+                std::fill(source.begin(), source.end(), constant);
+            }
+            else {
+                loadPlanes(src.rowUnchecked(y), width, source.data());
+            }
+            for(int c = 0 ; c != channels ; ++c) {
+                padLine(source.data() + c * width, width, hTaps / 2, border, constant, line.data());
+                row(line.data(), ringPlane(r, c));
+            }
+        };
+        for(int r = first ; r != first + vTaps - 1 ; ++r) {
+            filter(r);
+        }
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            filter(y + vTaps / 2);
+            for(int c = 0 ; c != channels ; ++c) {
+                for(int k = 0 ; k != vTaps ; ++k) {
+                    taps[k] = ringPlane(y - vTaps / 2 + k, c);
+                }
+                column(taps.data(), outLine.data() + c * width);
+            }
+            storePlanes(outLine.data(), width, out.writableRow(y));
+        }
+    });
+}
+
+inline void checkKernelSize(size_t size) {
+    if(size % 2 == 0) {
+        throw std::runtime_error("Invalid kernel size");
+    }
+}
+
+template <class T>
+typename PixelTraits<T>::image_type convolve(ImageView<T> const& image, std::vector<float> const& horizontal,
+                                             std::vector<float> const& vertical, BorderMode border,
+                                             float constant, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("convolve", static_cast<uint64_t>(image.width()) * image.height());
+    checkKernelSize(horizontal.size());
+    checkKernelSize(vertical.size());
+    typename PixelTraits<T>::image_type out(image.width(), image.height());
+    const int width = image.width();
+    const int hTaps = static_cast<int>(horizontal.size()), vTaps = static_cast<int>(vertical.size());
+    // Pixels made of bytes
+    if(PixelTraits<T>::bpp == 8 * PixelTraits<T>::channels) {
+        const std::vector<int16_t> h = quantizeKernel(horizontal), v = quantizeKernel(vertical);
+        if(!h.empty() && !v.empty()) {
+            convolveTiles<T, byte, int16_t>(image, out, hTaps, vTaps, border, roundPixel<byte>(constant), policy,
+                [&](const byte* line, int16_t* mid) {
+                    convolveRowFixed(line, h.data(), hTaps, width, mid);
+                },
+                [&](const int16_t* const* rows, byte* line) {
+                    convolveColumnFixed(rows, v.data(), vTaps, width, line);
+                });
+            return out;
+        }
+    }
+    convolveTiles<T, float, float>(image, out, hTaps, vTaps, border, constant, policy,
+        [&](const float* line, float* mid) {
+            convolveRow(line, horizontal.data(), hTaps, width, mid);
+        },
+        [&](const float* const* rows, float* line) {
+            resizeColumn(rows, vertical.data(), vTaps, width, line);
+        });
+    return out;
+}
+
+template <class T>
+typename PixelTraits<T>::image_type convolve2D(ImageView<T> const& image, std::vector<float> const& kernel,
+                                               int kernelWidth, BorderMode border, float constant,
+                                               ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("convolve2D", static_cast<uint64_t>(image.width()) * image.height());
+    if(kernelWidth <= 0 || kernel.size() % kernelWidth) {
+        throw std::runtime_error("Invalid kernel size");
+    }
+    checkKernelSize(kernelWidth);
+    checkKernelSize(kernel.size() / kernelWidth);
+    const int channels = PixelTraits<T>::channels;
+    const int width = image.width(), height = image.height();
+    const int kernelHeight = static_cast<int>(kernel.size()) / kernelWidth;
+    const int lineStride = width + kernelWidth - 1;
+    typename PixelTraits<T>::image_type out(width, height);
+    // Each kernel row filters its own source scanline, the filtered
+    // scanlines being summed
+    const std::vector<float> ones(kernelHeight, 1.f);
+    out.detach();
+    forEachBand(height, out.pitch(), policy, [&](int yBegin, int yEnd) {
+        const size_t plane = static_cast<size_t>(kernelHeight) * width;
+        std::vector<float> source(static_cast<size_t>(channels) * width), line(lineStride);
+        std::vector<float> filtered(channels * plane), outLine(static_cast<size_t>(channels) * width);
+        std::vector<const float*> rows(kernelHeight);
+        for(int y = yBegin ; y != yEnd ; ++y) {
+            for(int k = 0 ; k != kernelHeight ; ++k) {
+                const int sy = borderIndex(y - kernelHeight / 2 + k, height, border);
+                if(sy < 0) {
+                    std::fill(source.begin(), source.end(), constant);
+                }
+                else {
+                    loadPlanes(image.rowUnchecked(sy), width, source.data());
+                }
+                for(int c = 0 ; c != channels ; ++c) {
+                    padLine(source.data() + c * width, width, kernelWidth / 2, border, constant, line.data());
+                    convolveRow(line.data(), kernel.data() + static_cast<size_t>(k) * kernelWidth, kernelWidth,
+                                width, filtered.data() + c * plane + static_cast<size_t>(k) * width);
+                }
+            }
+            for(int c = 0 ; c != channels ; ++c) {
+                for(int k = 0 ; k != kernelHeight ; ++k) {
+                    rows[k] = filtered.data() + c * plane + static_cast<size_t>(k) * width;
+                }
+                resizeColumn(rows.data(), ones.data(), kernelHeight, width, outLine.data() + c * width);
+            }
+            storePlanes(outLine.data(), width, out.writableRow(y));
+        }
+    });
+    return out;
+}
+
+/* Running-sum box averages, defined in image.cpp. boxRows() filters count
+ * scanlines of width values in place, once per radius, pad holding
+ * BOX_LINES * (width + 2 * max(radii)) values. boxStep() outputs the sums of
+ * a vertical box to out, scaled, then slides it down by one scanline. */
+static const int BOX_LINES = 4;
+void boxRows(float* const* rows, int count, int width, std::vector<int> const& radii, BorderMode border,
+             float constant, float* pad);
+void boxStep(double* sums, const float* add, const float* sub, double scale, int count, float* out);
+
+/* Radii of the three box filters approximating a Gaussian, defined in
+ * image.cpp */
+std::vector<int> gaussianBoxRadii(float sigma);
+
+/* Chain of box filters of the given radii, streamed down bands of
+ * scanlines. Each scanline of a band and of its margins is loaded and
+ * filtered horizontally, then goes through the vertical passes, each of
+ * which keeps the 2 * radius + 1 scanlines of its box in a ring along with
+ * their running sums. Scanlines outside the image are taken from the border
+ * of the source, so that a band only needs its own scanlines and margins. */
+template <class T>
+typename PixelTraits<T>::image_type boxPasses(ImageView<T> const& image, std::vector<int> const& radii,
+                                              BorderMode border, float constant, ExecutionPolicy const& policy) {
+    const int channels = PixelTraits<T>::channels;
+    const int width = image.width(), height = image.height();
+    const int passes = static_cast<int>(radii.size());
+    const int maxRadius = *std::max_element(radii.begin(), radii.end());
+    const size_t rowStride = static_cast<size_t>(channels) * width;
+    // Ring of pass k from scanline ringStarts[k], margins[k] scanlines of its
+    // input being above and below the band
+    std::vector<size_t> ringStarts(passes + 1, 0);
+    std::vector<int> margins(passes + 1, 0);
+    for(int k = passes - 1 ; k >= 0 ; --k) {
+        margins[k] = margins[k + 1] + radii[k];
+    }
+    for(int k = 0 ; k != passes ; ++k) {
+        ringStarts[k + 1] = ringStarts[k] + 2 * radii[k] + 1;
+    }
+    typename PixelTraits<T>::image_type out(width, height);
+    out.detach();
+    forEachBand(height, out.pitch(), policy, [&](int yBegin, int yEnd) {
+        // The rings, then the output scanline
+        ScratchBuffer<float> rings((ringStarts[passes] + 1) * rowStride);
+        ScratchBuffer<double> sums(passes * rowStride);
+        std::fill(sums.data(), sums.data() + passes * rowStride, 0.);
+        std::vector<float> pad(BOX_LINES * (width + 2 * static_cast<size_t>(maxRadius)));
+        std::vector<float*> planes(channels);
+        float* line = rings.data() + ringStarts[passes] * rowStride;
+        auto ringRow = [&](int k, int y) {
+            const int first = yBegin - margins[k];
+            return rings.data() + (ringStarts[k] + (y - first) % (2 * radii[k] + 1)) * rowStride;
+        };
+        for(int y = yBegin - margins[0] ; y != yEnd + margins[0] ; ++y) {
+            float* row = ringRow(0, y);
+            const int source = borderIndex(y, height, border);
+            if(source < 0) {
+                std::fill(row, row + rowStride, constant);
+            }
+            else {
+                loadPlanes(image.rowUnchecked(source), width, row);
+                for(int c = 0 ; c != channels ; ++c) {
+                    planes[c] = row + c * width;
+                }
+                boxRows(planes.data(), channels, width, radii, border, constant, pad.data());
+            }
+            // Pass k outputs a scanline once its box is full, radii[k]
+            // scanlines behind its input
+            int input = y;
+            for(int k = 0 ; k != passes ; ++k) {
+                const int radius = radii[k];
+                const int filled = input - (yBegin - margins[k]);
+                double* s = sums.data() + k * rowStride;
+                const float* add = ringRow(k, input);
+                if(filled < 2 * radius) {
+                    for(size_t x = 0 ; x != rowStride ; ++x) {
+                        s[x] += add[x];
+                    }
+                    break;
+                }
+                input -= radius;
+                const bool last = k + 1 == passes;
+                float* o = last ? line : ringRow(k + 1, input);
+                boxStep(s, add, ringRow(k, input - radius), 1. / (2 * radius + 1), static_cast<int>(rowStride), o);
+                if(last) {
+                    storePlanes(o, width, out.writableRow(input));
+                }
+            }
+        }
+    });
+    return out;
+}
+
+template <class T>
+typename PixelTraits<T>::image_type boxFilter(ImageView<T> const& image, int radius, BorderMode border,
+                                              float constant, ExecutionPolicy const& policy) {
+    if(radius < 0) {
+        throw std::runtime_error("Invalid radius");
+    }
+    IMAGE_SCOPE("boxFilter", static_cast<uint64_t>(image.width()) * image.height());
+    return boxPasses(image, {radius}, border, constant, policy);
+}
+
+/* Deviation up to which gaussianBlur() convolves with the exact kernel */
+static const float GAUSSIAN_KERNEL_MAX_SIGMA = 5.f;
+
+template <class T>
+typename PixelTraits<T>::image_type gaussianBlur(ImageView<T> const& image, float sigma, BorderMode border,
+                                                 float constant, ExecutionPolicy const& policy) {
+    IMAGE_SCOPE("gaussianBlur", static_cast<uint64_t>(image.width()) * image.height());
+    if(sigma <= GAUSSIAN_KERNEL_MAX_SIGMA) {
+        const std::vector<float> kernel = gaussianKernel(sigma);
+        return convolve(image, kernel, kernel, border, constant, policy);
+    }
+    return boxPasses(image, gaussianBoxRadii(sigma), border, constant, policy);
+}
+
+template <class T>
+typename PixelTraits<T>::image_type Image<T>::convolve(std::vector<float> const& horizontal,
+                                                       std::vector<float> const& vertical, BorderMode border,
+                                                       float constant, ExecutionPolicy const& policy) const {
+    return ::convolve(view(), horizontal, vertical, border, constant, policy);
+}
+
+template <class T>
+typename PixelTraits<T>::image_type Image<T>::convolve2D(std::vector<float> const& kernel, int kernelWidth,
+                                                         BorderMode border, float constant,
+                                                         ExecutionPolicy const& policy) const {
+    return ::convolve2D(view(), kernel, kernelWidth, border, constant, policy);
+}
+
+template <class T>
+typename PixelTraits<T>::image_type Image<T>::boxFilter(int radius, BorderMode border, float constant,
+                                                        ExecutionPolicy const& policy) const {
+    return ::boxFilter(view(), radius, border, constant, policy);
+}
+
+template <class T>
+typename PixelTraits<T>::image_type Image<T>::gaussianBlur(float sigma, BorderMode border, float constant,
+                                                           ExecutionPolicy const& policy) const {
+    return ::gaussianBlur(view(), sigma, border, constant, policy);
 }
 
 template <class T>
 void Image<T>::save(std::string const& filename, ImageFormat f) const {
+    IMAGE_SCOPE("save", static_cast<uint64_t>(m_width) * m_height);
+    int flags = (f == ImageFormat::BmpRle) ? BMP_SAVE_RLE : 0;
+    if(!FreeImage_Save(freeImageFormat(f), m_image, filename.c_str(), flags)) {
+        throw std::runtime_error("Cannot save image");
+    }
+}
+
+template <class T>
+void Image<T>::save(std::vector<byte>& buffer, ImageFormat f) const {
+    IMAGE_SCOPE("save", static_cast<uint64_t>(m_width) * m_height);
     int flags = (f == ImageFormat::BmpRle) ? BMP_SAVE_RLE : 0;
-    if(!FreeImage_Save(static_cast<FREE_IMAGE_FORMAT>(f),
-                      m_image, filename.c_str(), flags)) {
+    FIMEMORY* stream = FreeImage_OpenMemory();
+    if(!stream) {
         throw std::runtime_error("Cannot save image");
     }
+    BYTE* data;
+    DWORD size;
+    if(!FreeImage_SaveToMemory(freeImageFormat(f), m_image, stream, flags) ||
+       !FreeImage_AcquireMemory(stream, &data, &size)) {
+        FreeImage_CloseMemory(stream);
+        throw std::runtime_error("Cannot save image");
+    }
+    buffer.assign(data, data + size);
+    FreeImage_CloseMemory(stream);
 }
+
+/* Binary images work on whole 64 pixel words rather than on single pixels.
+ * These specializations are defined in image.cpp. */
+template <>
+bool ImageView<bool>::getAABB(bool backgroundColor, Rect& aabb) const;
+
+template <>
+void Image<bool>::flipX();
+
+template <>
+void Image<bool>::blitRegion(ImageCoords c, Rect r, ImageView<bool> const& source);
+
+/* Vectorized box filter of greyscale pyramids and packed binary pyramids,
+ * defined in image.cpp */
+template <>
+void ImagePyramid<byte>::reduceRow(int k, int y);
+
+template <>
+void ImagePyramid<bool>::reduceRow(int k, int y);
+
+/* Vectorized scanline reversal of 8 and 24 bit images, defined in image.cpp */
+template <>
+void Image<byte>::flipX();
+
+template <>
+void Image<RGBTriple>::flipX();
+
+/* Connected component labelling with 16 and 32 bit labels, defined in
+ * image.cpp */
+template <>
+Components<uint16_t> labelComponents<uint16_t>(ImageView<bool> const& image, Connectivity connectivity,
+                                               ExecutionPolicy const& policy);
+
+template <>
+Components<uint32_t> labelComponents<uint32_t>(ImageView<bool> const& image, Connectivity connectivity,
+                                               ExecutionPolicy const& policy);
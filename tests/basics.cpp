@@ -1,5 +1,10 @@
 #include <catch.hpp>
 #include "image.h"
+#include "batchloader.h"
+#include <algorithm>
+#include <thread>
+#include <sstream>
+#include <cstdio>
 
 void fill16x16Img(GreyscaleImage& img) {
     byte c = 0;
@@ -27,6 +32,7 @@ TEST_CASE("Test save and load", "[load-save]") {
     fill16x16Img(img);
     img.save("test-save.bmp", ImageFormat::Bmp);
     auto img2 = GreyscaleImage::load("test-save.bmp");
+    std::remove("test-save.bmp");
     REQUIRE(img == img2);
 }
 
@@ -66,3 +72,954 @@ TEST_CASE("Test crop", "[crop]") {
         }
     }
 }
+
+TEST_CASE("Test scanline access", "[row]") {
+    GreyscaleImage img(16, 16);
+    fill16x16Img(img);
+    for(int y = 0 ; y != 16 ; ++y) {
+        auto row = img.row(y);
+        REQUIRE(row.size() == 16);
+        for(int x = 0 ; x != 16 ; ++x) {
+            REQUIRE(row[x] == img.getPixel(x, y));
+        }
+    }
+    img.row(3)[5] = 42;
+    REQUIRE(img.getPixel(5, 3) == 42);
+    REQUIRE_THROWS(img.row(16));
+    REQUIRE_THROWS(img.row(0).at(16));
+
+    BinaryImage bin(13, 3);
+    bin.row(1)[12] = true;
+    REQUIRE(bin.getPixel(12, 1));
+    REQUIRE(bin.getPixel(11, 1) == false);
+    BinaryImage const& cbin = bin;
+    REQUIRE(cbin.row(1)[12]);
+    REQUIRE_FALSE(cbin.row(0) == cbin.row(1));
+}
+
+TEST_CASE("Test 16-bit and floating point images", "[load-save]") {
+    Grey16Image grey(7, 5);
+    FloatImage fl(7, 5);
+    for(int y = 0 ; y != 5 ; ++y) {
+        for(int x = 0 ; x != 7 ; ++x) {
+            grey.setPixel(x, y, 1000 * y + x);
+            fl.setPixel(x, y, y - x * 0.25f);
+        }
+    }
+    grey.save("test-save-16.tif", ImageFormat::Tiff);
+    fl.save("test-save-float.tif", ImageFormat::Tiff);
+    auto grey2 = Grey16Image::load("test-save-16.tif");
+    auto fl2 = FloatImage::load("test-save-float.tif");
+    std::remove("test-save-16.tif");
+    std::remove("test-save-float.tif");
+    REQUIRE(grey2 == grey);
+    REQUIRE(fl2 == fl);
+    REQUIRE(fl2.getPixel(6, 4) == 2.5f);
+
+    Grey32Image labels(7, 5);
+    labels.setPixel(6, 4, 100000);
+    labels.save("test-save-32.tif", ImageFormat::Tiff);
+    auto labels2 = Grey32Image::load("test-save-32.tif");
+    std::remove("test-save-32.tif");
+    REQUIRE(labels2 == labels);
+
+    FloatImage moved(std::move(fl2));
+    FloatImage copy(1, 1);
+    copy = moved;
+    REQUIRE(copy == fl);
+    REQUIRE_THROWS(fl.getPixel(7, 0));
+}
+
+TEST_CASE("Test in-memory save and load", "[load-save]") {
+    GreyscaleImage img(16, 16);
+    fill16x16Img(img);
+    std::vector<byte> buffer;
+    img.save(buffer, ImageFormat::Png);
+    REQUIRE(!buffer.empty());
+    auto img2 = GreyscaleImage::load(buffer.data(), buffer.size());
+    REQUIRE(img == img2);
+    byte garbage[4] = {1, 2, 3, 4};
+    REQUIRE_THROWS(GreyscaleImage::load(garbage, sizeof(garbage)));
+}
+
+TEST_CASE("Test raw data adoption", "[raw]") {
+    std::vector<byte> pixels(6 * 4);
+    for(size_t i = 0 ; i != pixels.size() ; ++i) {
+        pixels[i] = i;
+    }
+    auto copied = GreyscaleImage::fromRawData(pixels, 6, 4);
+    auto flipped = GreyscaleImage::fromRawData(pixels, 6, 4, true);
+    const byte* storage = pixels.data();
+    auto adopted = GreyscaleImage::fromRawData(std::move(pixels), 6, 4);
+    REQUIRE(adopted.row(0).data() == storage);
+    REQUIRE(adopted == copied);
+    REQUIRE(flipped.getPixel(1, 3) == 1);
+    REQUIRE(adopted.getPixel(1, 3) == 19);
+
+    // Wrapped memory is shared with the caller, copies are not
+    std::vector<float> external(3 * 5, 1.f);
+    auto wrapped = FloatImage::fromRawData(external.data(), 3, 2, 5 * sizeof(float));
+    wrapped.setPixel(2, 1, 4.f);
+    REQUIRE(external[7] == 4.f);
+    auto copy(wrapped);
+    copy.setPixel(0, 0, 2.f);
+    REQUIRE(external[0] == 1.f);
+
+    byte bits[2 * 4] = {0x80, 0, 0, 0, 0x01, 0, 0, 0};
+    auto bin = BinaryImage::fromRawData(bits, 8, 2, 4);
+    REQUIRE(bin.getPixel(0, 0));
+    REQUIRE(bin.getPixel(7, 1));
+    REQUIRE(bin.count() == 2);
+}
+
+TEST_CASE("Test batch loading", "[load-save]") {
+    std::vector<std::string> files;
+    for(int i = 0 ; i != 6 ; ++i) {
+        GreyscaleImage img(4, 4);
+        img.setPixel(0, 0, i);
+        files.push_back("test-save-batch" + std::to_string(i) + ".bmp");
+        img.save(files.back(), ImageFormat::Bmp);
+    }
+    files.insert(files.begin() + 2, "does-not-exist.bmp");
+
+    BatchLoader<GreyscaleImage> inOrder(files, BatchOrder::Input, 3, 2);
+    LoadResult<GreyscaleImage> result;
+    for(size_t i = 0 ; i != files.size() ; ++i) {
+        REQUIRE(inOrder.next(result));
+        REQUIRE(result.index == i);
+        if(i == 2) {
+            REQUIRE(!result.image);
+            REQUIRE(!result.error.empty());
+        }
+        else {
+            REQUIRE(result.image->getPixel(0, 0) == ((i < 2) ? i : i - 1));
+        }
+    }
+    REQUIRE(!inOrder.next(result));
+
+    BatchLoader<GreyscaleImage> anyOrder(files, BatchOrder::Completion, 4, 1);
+    std::vector<bool> seen(files.size());
+    while(anyOrder.next(result)) {
+        REQUIRE(!seen[result.index]);
+        seen[result.index] = true;
+        REQUIRE(result.filename == files[result.index]);
+    }
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == static_cast<long>(files.size()));
+    for(auto const& file : files) {
+        std::remove(file.c_str());
+    }
+}
+
+TEST_CASE("Test vectorized flips", "[flip]") {
+    auto level = simdLevel();
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Ssse3, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        for(int width : {1, 2, 5, 11, 15, 16, 31, 33, 64, 100, 129}) {
+            GreyscaleImage grey(width, 3);
+            RGBImage rgb(width, 3);
+            for(int y = 0 ; y != 3 ; ++y) {
+                for(int x = 0 ; x != width ; ++x) {
+                    grey.setPixel(x, y, x + 7 * y);
+                    rgb.setPixel(x, y, {static_cast<byte>(x), static_cast<byte>(y), static_cast<byte>(x + 128)});
+                }
+            }
+            auto grey2(grey);
+            auto rgb2(rgb);
+            grey2.flipX();
+            rgb2.flipX();
+            for(int y = 0 ; y != 3 ; ++y) {
+                for(int x = 0 ; x != width ; ++x) {
+                    REQUIRE(grey2.getPixel(width - x - 1, y) == grey.getPixel(x, y));
+                    RGBTriple a = rgb2.getPixel(width - x - 1, y), b = rgb.getPixel(x, y);
+                    REQUIRE(a.rgbtBlue == b.rgbtBlue);
+                    REQUIRE(a.rgbtGreen == b.rgbtGreen);
+                    REQUIRE(a.rgbtRed == b.rgbtRed);
+                }
+            }
+        }
+    }
+    setSimdLevel(level);
+    REQUIRE(simdLevel() == level);
+}
+
+TEST_CASE("Test blit", "[blit]") {
+    GreyscaleImage src(8, 8);
+    BinaryImage binSrc(21, 8);
+    for(int y = 0 ; y != 8 ; ++y) {
+        for(int x = 0 ; x != 8 ; ++x) {
+            src.setPixel(x, y, 10 * y + x);
+        }
+        for(int x = 0 ; x != 21 ; ++x) {
+            binSrc.setPixel(x, y, (x * y) % 3 == 1);
+        }
+    }
+    // Destination partially outside, on every side
+    for(ImageCoords c : {ImageCoords{-3, -2}, ImageCoords{4, 5}, ImageCoords{1, 0}}) {
+        GreyscaleImage dst(6, 6);
+        BinaryImage binDst(19, 6);
+        dst.blit(c, {1, 1, 6, 6}, src);
+        binDst.blit(c, {2, 1, 17, 6}, binSrc);
+        for(int y = 0 ; y != 6 ; ++y) {
+            for(int x = 0 ; x != 6 ; ++x) {
+                int sx = x - c.x + 1, sy = y - c.y + 1;
+                bool inside = sx >= 1 && sx < 7 && sy >= 1 && sy < 7;
+                REQUIRE(dst.getPixel(x, y) == (inside ? src.getPixel(sx, sy) : 0));
+            }
+            for(int x = 0 ; x != 19 ; ++x) {
+                int sx = x - c.x + 2, sy = y - c.y + 1;
+                bool inside = sx >= 2 && sx < 19 && sy >= 1 && sy < 7;
+                REQUIRE(binDst.getPixel(x, y) == (inside && binSrc.getPixel(sx, sy)));
+            }
+        }
+    }
+    // Overlapping blit within the same image
+    auto shifted(src);
+    shifted.blit({1, 1}, {0, 0, 8, 8}, shifted);
+    for(int y = 1 ; y != 8 ; ++y) {
+        for(int x = 1 ; x != 8 ; ++x) {
+            REQUIRE(shifted.getPixel(x, y) == src.getPixel(x - 1, y - 1));
+        }
+    }
+    // Overlapping binary blits from views that start on another byte
+    for(ImageCoords c : {ImageCoords{10, 0}, ImageCoords{3, 0}, ImageCoords{13, 1}}) {
+        // Filled separately, so that the blit does not detach from a shared copy
+        BinaryImage bin(48, 8), expected(48, 8);
+        for(int y = 0 ; y != 8 ; ++y) {
+            for(int x = 0 ; x != 48 ; ++x) {
+                bin.setPixel(x, y, (x * 7 + y * 3) % 5 < 2);
+                expected.setPixel(x, y, (x * 7 + y * 3) % 5 < 2);
+            }
+        }
+        BinaryImage copy(expected);
+        expected.blit(c, copy.view({8, 0, 32, 7}));
+        bin.blit(c, bin.view({8, 0, 32, 7}));
+        REQUIRE(bin.hash() == expected.hash());
+    }
+}
+
+TEST_CASE("Test content hashing and diff", "[hash]") {
+    std::vector<byte> bytes(1000);
+    for(size_t i = 0 ; i != bytes.size() ; ++i) {
+        bytes[i] = static_cast<byte>(i * 31 + (i >> 3));
+    }
+    // Stable across SIMD levels and independent from how the input is split
+    auto level = simdLevel();
+    setSimdLevel(SimdLevel::Scalar);
+    ContentHasher reference;
+    reference.update(bytes.data(), bytes.size());
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        for(size_t split : {0, 1, 63, 64, 65, 500, 999}) {
+            ContentHasher hasher;
+            hasher.update(bytes.data(), split);
+            hasher.update(bytes.data() + split, bytes.size() - split);
+            REQUIRE(hasher.digest128() == reference.digest128());
+        }
+    }
+    setSimdLevel(level);
+    REQUIRE(reference.digest() == reference.digest128().low);
+    ContentHasher shorter;
+    shorter.update(bytes.data(), bytes.size() - 1);
+    REQUIRE(shorter.digest128() != reference.digest128());
+
+    GreyscaleImage a(100, 70);
+    for(int y = 0 ; y != 70 ; ++y) {
+        for(int x = 0 ; x != 100 ; ++x) {
+            a.setPixel(x, y, x ^ y);
+        }
+    }
+    auto b(a);
+    REQUIRE(a.hash() == b.hash());
+    REQUIRE(a.diff(b, 16).empty());
+    b.setPixel(5, 3, 0xFF);
+    b.setPixel(20, 3, 0xFF);
+    b.setPixel(99, 69, 0);
+    REQUIRE(a.hash() != b.hash());
+    auto regions = a.diff(b, 16);
+    REQUIRE(regions.size() == 2);
+    REQUIRE(regions[0] == (Rect{0, 0, 32, 16}));
+    REQUIRE(regions[1] == (Rect{96, 64, 4, 6}));
+    REQUIRE(a.diff(GreyscaleImage(100, 71), 16) == std::vector<Rect>{{0, 0, 100, 71}});
+
+    // Padding bits of binary images do not take part in the hash
+    BinaryImage c(13, 5), d(13, 5);
+    d.row(2).data()[1] |= 0x01;
+    REQUIRE(c.hash() == d.hash());
+    REQUIRE(c.diff(d).empty());
+    d.setPixel(12, 4, true);
+    REQUIRE(c.hash() != d.hash());
+    REQUIRE(c.diff(d, 4) == std::vector<Rect>{{8, 0, 5, 5}});
+}
+
+TEST_CASE("Test bounding box", "[aabb]") {
+    auto level = simdLevel();
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        for(int width : {1, 7, 33, 100}) {
+            GreyscaleImage grey(width, 40);
+            RGBImage rgb(width, 40);
+            BinaryImage binary(width, 40);
+            Rect aabb;
+            INFO("level " << static_cast<int>(l) << " width " << width);
+            REQUIRE(!grey.getAABB(0, aabb));
+            REQUIRE(!rgb.getAABB({0, 0, 0}, aabb));
+            REQUIRE(!binary.getAABB(false, aabb));
+            REQUIRE(binary.getAABB(true, aabb));
+            REQUIRE(aabb == (Rect{0, 0, width - 1, 39}));
+            REQUIRE(grey.getAABB(0) == (Rect{width - 1, 39, 1 - width, -39}));
+
+            // Scattered pixels, the box is checked after each one
+            int xMin = width, xMax = -1, yMin = 40, yMax = -1;
+            for(int i = 0 ; i != 6 ; ++i) {
+                int x = (i * 37 + 11) % width, y = (i * 13 + 17) % 40;
+                grey.setPixel(x, y, 1);
+                rgb.setPixel(x, y, {0, 0, 9});
+                binary.setPixel(x, y, true);
+                xMin = std::min(xMin, x);
+                xMax = std::max(xMax, x);
+                yMin = std::min(yMin, y);
+                yMax = std::max(yMax, y);
+                Rect expected{xMin, yMin, xMax - xMin, yMax - yMin};
+                REQUIRE(grey.getAABB(0) == expected);
+                REQUIRE(rgb.getAABB({0, 0, 0}) == expected);
+                REQUIRE(binary.getAABB(false) == expected);
+                REQUIRE(rgb.getAABB({0, 0, 9}, aabb));
+                REQUIRE(aabb == (Rect{0, 0, width - 1, 39}));
+            }
+        }
+    }
+    setSimdLevel(level);
+}
+
+TEST_CASE("Test image pool", "[pool]") {
+    auto& pool = ImagePool::instance();
+    REQUIRE(!pool.enabled());
+    pool.setEnabled(true);
+    pool.resetStats();
+    {
+        GreyscaleImage a(33, 20);
+        fill16x16Img(a);
+    }
+    auto stats = pool.stats();
+    REQUIRE(stats.hits == 0);
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.idle == 1);
+    {
+        // The recycled bitmap is cleared, and copies are pooled too
+        GreyscaleImage a(33, 20);
+        REQUIRE(a == GreyscaleImage(33, 20));
+        fill16x16Img(a);
+        GreyscaleImage b(a);
+        b.setPixel(0, 0, 42);
+        REQUIRE(b.getPixel(1, 0) == a.getPixel(1, 0));
+        RGBImage c(33, 20);
+        byte raw[4 * 20] = {};
+        GreyscaleImage wrapped = GreyscaleImage::fromRawData(raw, 3, 20, 4);
+        GreyscaleImage wrappedCopy(wrapped);
+        wrappedCopy.setPixel(1, 1, 42);
+        REQUIRE(raw[4 + 1] == 0);
+    }
+    stats = pool.stats();
+    REQUIRE(stats.hits == 2);
+    REQUIRE(stats.misses == 4);
+    REQUIRE(stats.idle == 4);
+
+    BinaryImage shape(40, 30);
+    shape.setPixel(20, 15, true);
+    auto first = shape.distanceTransform(false, 1);
+    REQUIRE(shape.distanceTransform(false, 1) == first);
+    pool.resetStats();
+    REQUIRE(shape.distanceTransform(false, 1) == first);
+    REQUIRE(pool.stats().scratchHits == 1);
+    REQUIRE(pool.stats().hits == 1);
+    REQUIRE(pool.stats().misses == 0);
+
+    pool.trim(0);
+    REQUIRE(pool.stats().idle == 0);
+    REQUIRE(pool.stats().idleBytes == 0);
+    pool.setEnabled(false);
+    {
+        GreyscaleImage a(33, 20);
+    }
+    REQUIRE(pool.stats().idle == 0);
+}
+
+/* Sink keeping the names of the operations, prefixed with + when they begin
+ * and - when they end */
+struct RecordingSink : TraceSink {
+    std::mutex mutex;
+    std::vector<std::string> events;
+
+    void begin(const char* operation, int, uint64_t) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(std::string("+") + operation);
+    }
+
+    void end(const char* operation, int, uint64_t, uint64_t) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(std::string("-") + operation);
+    }
+};
+
+TEST_CASE("Test instrumentation", "[instrumentation]") {
+    auto& instrumentation = Instrumentation::instance();
+    auto sink = std::make_shared<RecordingSink>();
+    instrumentation.setSink(sink);
+    instrumentation.reset();
+    GreyscaleImage a(32, 16);
+    fill16x16Img(a);
+    GreyscaleImage b(a);
+    // The blit copies the pixels shared with a first
+    b.blit({4, 4}, {0, 0, 8, 4}, a);
+    GreyscaleImage blurred = a.gaussianBlur(1.f);
+    {
+        IMAGE_SCOPE("frame", 0);
+        IMAGE_SCOPE_PIXELS(7);
+    }
+    std::vector<std::thread> threads;
+    for(int i = 0 ; i != 4 ; ++i) {
+        threads.emplace_back([&a]() {
+            a.hash();
+        });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+    auto snapshot = instrumentation.snapshot();
+    instrumentation.setSink(nullptr);
+#ifdef IMAGE_INSTRUMENTATION
+    REQUIRE(snapshot.operations.at("blit").calls == 1);
+    REQUIRE(snapshot.operations.at("blit").pixels == 32);
+    REQUIRE(snapshot.operations.at("blit").bytes == 16u * b.pitch());
+    REQUIRE(snapshot.operations.at("gaussianBlur").calls == 1);
+    REQUIRE(snapshot.operations.at("convolve").calls == 1);
+    REQUIRE(snapshot.operations.at("gaussianBlur").nanoseconds >=
+            snapshot.operations.at("convolve").nanoseconds);
+    REQUIRE(snapshot.operations.at("frame").pixels == 7);
+    REQUIRE(snapshot.operations.at("hash").calls == 4);
+    REQUIRE(snapshot.operations.at("hash").pixels == 4 * 32 * 16);
+    REQUIRE(snapshot.bitmapAllocations == 3);
+    REQUIRE(snapshot.bitmapClones == 1);
+    REQUIRE(snapshot.bytes >= 16u * (a.pitch() + b.pitch() + blurred.pitch()));
+    const std::vector<std::string> events = {"+blit", "-blit", "+gaussianBlur", "+convolve",
+                                             "-convolve", "-gaussianBlur", "+frame", "-frame"};
+    REQUIRE(std::vector<std::string>(sink->events.begin(), sink->events.begin() + 8) == events);
+    REQUIRE(sink->events.size() == 16);
+    instrumentation.reset();
+    REQUIRE(instrumentation.snapshot().operations.empty());
+    REQUIRE(instrumentation.snapshot().bitmapAllocations == 0);
+#else
+    REQUIRE(snapshot.operations.empty());
+    REQUIRE(snapshot.bitmapAllocations == 0);
+    REQUIRE(snapshot.bytes == 0);
+    REQUIRE(sink->events.empty());
+#endif
+
+    std::ostringstream trace;
+    {
+        ChromeTraceWriter writer(trace);
+        writer.begin("blit", 0, 1500);
+        writer.end("blit", 0, 2000250, 32);
+        writer.begin("a \"b\"", 3, 0);
+    }
+    REQUIRE(trace.str() ==
+            "[\n"
+            "{\"name\":\"blit\",\"ph\":\"B\",\"pid\":1,\"tid\":0,\"ts\":1.500},\n"
+            "{\"name\":\"blit\",\"ph\":\"E\",\"pid\":1,\"tid\":0,\"ts\":2000.250,\"args\":{\"pixels\":32}},\n"
+            "{\"name\":\"a \\\"b\\\"\",\"ph\":\"B\",\"pid\":1,\"tid\":3,\"ts\":0.000}\n"
+            "]\n");
+}
+
+TEST_CASE("Test copy-on-write", "[basics]") {
+    GreyscaleImage a(16, 16);
+    fill16x16Img(a);
+    GreyscaleImage b(a);
+    // Copies share their pixels until one of them is modified
+    REQUIRE(b.getBits() == a.getBits());
+    GreyscaleImage c(16, 16);
+    c = a;
+    REQUIRE(c.getBits() == a.getBits());
+    b.setPixel(3, 4, 200);
+    REQUIRE(b.getBits() != a.getBits());
+    REQUIRE(a.getPixel(3, 4) == 4 * 16 + 3);
+    REQUIRE(b.getPixel(3, 4) == 200);
+    c.flipY();
+    REQUIRE(a.getPixel(0, 0) == 0);
+    REQUIRE(c.getPixel(0, 15) == 0);
+    // The last owner modifies the pixels in place
+    auto bits = c.getBits();
+    c.flipX();
+    REQUIRE(c.getBits() == bits);
+
+    BinaryImage d(20, 10), e(d);
+    e.blit({0, 0}, {0, 0, 20, 10}, BinaryImage::fromRawData(std::vector<bool>(200, true), 20, 10));
+    REQUIRE(d.count() == 0);
+    REQUIRE(e.count() == 200);
+    auto f(e);
+    f.crop({2, 2, 5, 5});
+    REQUIRE(e.width() == 20);
+    REQUIRE(f.count() == 25);
+
+    // Moves leave the source empty without copying
+    bits = a.getBits();
+    GreyscaleImage g(std::move(a));
+    REQUIRE(g.getBits() == bits);
+    REQUIRE(a.width() == 0);
+    a = std::move(g);
+    REQUIRE(a.getBits() == bits);
+
+    // Concurrent readers of copies
+    std::vector<std::thread> readers;
+    std::vector<uint64_t> hashes(4);
+    for(int i = 0 ; i != 4 ; ++i) {
+        readers.emplace_back([&a, &hashes, i]() {
+            GreyscaleImage copy(a);
+            hashes[i] = copy.hash();
+            copy.setPixel(i, 0, 255);
+        });
+    }
+    for(auto& t : readers) {
+        t.join();
+    }
+    for(auto h : hashes) {
+        REQUIRE(h == a.hash());
+    }
+}
+
+TEST_CASE("Test image views", "[view]") {
+    GreyscaleImage atlas(40, 30);
+    BinaryImage mask(40, 30);
+    for(int y = 0 ; y != 30 ; ++y) {
+        for(int x = 0 ; x != 40 ; ++x) {
+            atlas.setPixel(x, y, (x >= 12 && x < 20 && y >= 5 && y < 9) ? x * y : 0);
+            mask.setPixel(x, y, (x - 25) * (x - 25) + (y - 12) * (y - 12) < 30);
+        }
+    }
+    Rect cell{8, 4, 16, 10};
+    auto view = atlas.view(cell);
+    // crop() counts y from the top of the image
+    auto cropped(atlas);
+    cropped.crop({cell.x, 30 - cell.y - cell.height, cell.width, cell.height});
+    REQUIRE(view.width() == 16);
+    REQUIRE(view.height() == 10);
+    REQUIRE(view == cropped.view());
+    REQUIRE(view.row(2)[5] == cropped.getPixel(5, 2));
+    REQUIRE(view.getAABB(0) == cropped.getAABB(0));
+    REQUIRE(view.getAABB(0) == (Rect{4, 1, 7, 3}));
+    REQUIRE(view.view({4, 1, 8, 4}) == atlas.view({12, 5, 8, 4}));
+    REQUIRE_THROWS(atlas.view({30, 0, 11, 1}));
+    REQUIRE_THROWS(view.row(10));
+
+    std::vector<byte> fromView;
+    view.save(fromView, ImageFormat::Bmp);
+    REQUIRE(GreyscaleImage::load(fromView.data(), fromView.size()) == cropped);
+
+    // Blit from a view, including an overlapping view of the same image
+    GreyscaleImage dst(16, 10);
+    dst.blit({0, 0}, view);
+    REQUIRE(dst == cropped);
+    auto shifted(atlas);
+    shifted.blit({1, 1}, shifted.view({0, 0, 39, 29}));
+    REQUIRE(shifted.view({1, 1, 39, 29}) == atlas.view({0, 0, 39, 29}));
+
+    // Binary views start on whole bytes
+    Rect maskCell{16, 2, 20, 20};
+    auto maskView = mask.view(maskCell);
+    auto maskCropped(mask);
+    maskCropped.crop({maskCell.x, 30 - maskCell.y - maskCell.height, maskCell.width, maskCell.height});
+    REQUIRE(maskView == maskCropped.view());
+    REQUIRE(maskView.getAABB(false) == maskCropped.getAABB(false));
+    REQUIRE(distanceTransform(maskView, true) == maskCropped.distanceTransform(true));
+    FloatImage exact(20, 20);
+    distanceTransform(maskView, exact);
+    REQUIRE(exact.getPixel(9, 10) > 0);
+    REQUIRE_THROWS(mask.view({3, 0, 8, 8}));
+    BinaryImage maskDst(20, 20);
+    maskDst.blit({0, 0}, maskView);
+    REQUIRE(maskDst == maskCropped);
+}
+
+TEST_CASE("Test pixel traits", "[traits]") {
+    static_assert(PixelTraits<byte>::bpp == 8, "");
+    static_assert(PixelTraits<RGBTriple>::channels == 3, "");
+    static_assert(PixelTraits<bool>::pixelsPerByte == 8, "");
+    static_assert(std::is_same<PixelTraits<float>::image_type, FloatImage>::value, "");
+
+    // Pixel access is resolved at compile time, also through the base class
+    RGBImage rgb(7, 5);
+    BinaryImage bin(13, 3);
+    Image<RGBTriple>& rgbBase = rgb;
+    Image<bool>& binBase = bin;
+    rgbBase.setPixel(6, 4, {1, 2, 3});
+    binBase.setPixel(12, 2, true);
+    REQUIRE(rgb.row(4)[6].rgbtGreen == 2);
+    REQUIRE(rgb.getPixel(6, 4).rgbtRed == 3);
+    REQUIRE(bin.row(2)[12]);
+    REQUIRE(binBase.getPixel(12, 2));
+    REQUIRE(bin.count() == 1);
+    REQUIRE(rgb.pitch() == 24);
+    REQUIRE_THROWS(rgb.getPixel(7, 0));
+    REQUIRE_THROWS(bin.getPixel(0, -1));
+    REQUIRE_THROWS(bin.setPixel(13, 0, true));
+
+    // Writes through setPixel do not affect copies
+    auto copy(bin);
+    bin.setPixel(0, 0, true);
+    REQUIRE(!copy.getPixel(0, 0));
+    REQUIRE(bin.getPixel(0, 0));
+}
+
+TEST_CASE("Test per-pixel algorithms", "[parallel]") {
+    const ExecutionPolicy policies[] = {
+        {},
+        {Execution::ThreadPool, 4},
+        {Execution::WorkStealing, 3, 5},
+        {Execution::WorkStealing}
+    };
+    for(auto const& policy : policies) {
+        GreyscaleImage grey(101, 77);
+        grey.transform([](byte) { return byte(3); }, policy);
+        REQUIRE(grey.getAABB(0) == (Rect{0, 0, 100, 76}));
+        REQUIRE(grey.reduce(0LL, [](long long acc, byte p) { return acc + p; },
+                            std::plus<long long>(), policy) == 3 * 101 * 77);
+
+        // Transformed copies leave the original untouched
+        auto copy(grey);
+        copy.transform([](byte p) { return byte(p * 2); }, policy);
+        REQUIRE(grey.getPixel(100, 76) == 3);
+        REQUIRE(copy.getPixel(100, 76) == 6);
+
+        BinaryImage mask(101, 77);
+        for(int y = 0 ; y != 77 ; ++y) {
+            mask.setPixel(y, y, true);
+        }
+        grey.zip(mask, [](byte p, bool m) { return m ? byte(200) : p; }, policy);
+        REQUIRE(grey.getPixel(10, 10) == 200);
+        REQUIRE(grey.getPixel(11, 10) == 3);
+        mask.transform([](bool p) { return !p; }, policy);
+        REQUIRE(mask.count() == 101 * 77 - 77);
+        REQUIRE(mask.reduce(0, [](int acc, bool p) { return acc + p; },
+                            [](int a, int b) { return a + b; }, policy) == 101 * 77 - 77);
+        REQUIRE_THROWS(grey.zip(GreyscaleImage(3, 3), [](byte p, byte) { return p; }, policy));
+
+        // Bands are folded in order whatever their scheduling
+        FloatImage ramp(64, 300);
+        ramp.transform([](float) { return 0.1f; }, policy);
+        float sequential = ramp.reduce(0.f, std::plus<float>(), std::plus<float>());
+        std::vector<int> rows;
+        std::mutex mutex;
+        forEachBand(300, ramp.pitch(), policy, [&](int yBegin, int yEnd) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(int y = yBegin ; y != yEnd ; ++y) {
+                rows.push_back(y);
+            }
+        });
+        std::sort(rows.begin(), rows.end());
+        REQUIRE(rows.size() == 300);
+        REQUIRE(rows.back() == 299);
+        REQUIRE(std::adjacent_find(rows.begin(), rows.end()) == rows.end());
+        REQUIRE(ramp.reduce(0.f, std::plus<float>(), std::plus<float>(), policy) ==
+                ramp.reduce(0.f, std::plus<float>(), std::plus<float>(), policy));
+        REQUIRE(std::abs(sequential - 64 * 300 * 0.1f) < 1);
+
+        // Nested calls and exceptions
+        std::atomic<int> nested(0);
+        forEachBand(40, 64, policy, [&](int yBegin, int yEnd) {
+            forEachBand(yEnd - yBegin, 64, policy, [&](int b, int e) { nested += e - b; });
+        });
+        REQUIRE(nested == 40);
+        REQUIRE_THROWS_AS(forEachBand(40, 64, policy, [](int, int) {
+            throw std::runtime_error("band");
+        }), std::runtime_error);
+    }
+}
+
+TEST_CASE("Test image pyramid", "[pyramid]") {
+    GreyscaleImage grey(77, 21);
+    BinaryImage mask(131, 9);
+    for(int y = 0 ; y != 21 ; ++y) {
+        for(int x = 0 ; x != 77 ; ++x) {
+            grey.setPixel(x, y, static_cast<byte>(x * 37 + y * y * 11));
+        }
+    }
+    for(int y = 0 ; y != 9 ; ++y) {
+        for(int x = 0 ; x != 131 ; ++x) {
+            mask.setPixel(x, y, (x * 7 + y * 3) % 5 < 2);
+        }
+    }
+
+    auto level = simdLevel();
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        ImagePyramid<byte> pyramid(grey.view());
+        // 77x21, 39x11, 20x6, 10x3, 5x2, 3x1, 2x1, 1x1
+        REQUIRE(pyramid.levels() == 8);
+        REQUIRE(pyramid.level(0) == grey.view());
+        REQUIRE(pyramid.level(3).width() == 10);
+        REQUIRE(pyramid.level(3).height() == 3);
+        REQUIRE(pyramid.level(7).width() == 1);
+        REQUIRE_THROWS(pyramid.level(8));
+        for(int k = 1 ; k != pyramid.levels() ; ++k) {
+            auto src = pyramid.level(k - 1), dst = pyramid.level(k);
+            for(int y = 0 ; y != dst.height() ; ++y) {
+                for(int x = 0 ; x != dst.width() ; ++x) {
+                    int x1 = std::min(2 * x + 1, src.width() - 1), y1 = std::min(2 * y + 1, src.height() - 1);
+                    int sum = src.row(2 * y)[2 * x] + src.row(2 * y)[x1] + src.row(y1)[2 * x] + src.row(y1)[x1];
+                    REQUIRE(dst.row(y)[x] == (sum + 2) / 4);
+                }
+            }
+        }
+        // Levels are stored one after the other
+        REQUIRE(pyramid.level(2).row(0).data() > pyramid.level(1).row(10).data());
+
+        ImagePyramid<bool> bits(mask.view());
+        REQUIRE(bits.levels() == 9);
+        for(int k = 1 ; k != bits.levels() ; ++k) {
+            auto src = bits.level(k - 1), dst = bits.level(k);
+            for(int y = 0 ; y != dst.height() ; ++y) {
+                for(int x = 0 ; x != dst.width() ; ++x) {
+                    int x1 = std::min(2 * x + 1, src.width() - 1), y1 = std::min(2 * y + 1, src.height() - 1);
+                    int sum = src.row(2 * y)[2 * x] + src.row(2 * y)[x1] + src.row(y1)[2 * x] + src.row(y1)[x1];
+                    REQUIRE(dst.row(y)[x] == (sum >= 2));
+                }
+            }
+        }
+    }
+    setSimdLevel(level);
+
+    // The binomial filter weights 4x4 blocks
+    GreyscaleImage flat(9, 9);
+    flat.transform([](byte) { return byte(90); });
+    flat.setPixel(4, 4, 218);
+    ImagePyramid<byte> smooth(flat.view(), PyramidFilter::Binomial);
+    REQUIRE(smooth.level(1).row(2)[2] == 90 + (128 * 9 + 32) / 64);
+    REQUIRE(smooth.level(1).row(1)[1] == 90 + (128 + 32) / 64);
+    REQUIRE(smooth.level(1).row(0)[0] == 90);
+    FloatImage ramp(6, 2);
+    ramp.transform([](float) { return 1.5f; });
+    REQUIRE(ImagePyramid<float>(ramp.view(), PyramidFilter::Binomial).level(1).row(0)[2] == 1.5f);
+
+    // Cached until the image is modified
+    auto cached = grey.pyramid();
+    REQUIRE(grey.pyramid() == cached);
+    auto copy(grey);
+    REQUIRE(copy.pyramid() == cached);
+    REQUIRE(grey.pyramid(PyramidFilter::Binomial) != cached);
+    cached = grey.pyramid();
+    grey.setPixel(0, 0, 0);
+    REQUIRE(grey.pyramid() != cached);
+    REQUIRE(cached->level(0) == copy.view());
+    REQUIRE(grey.pyramid()->level(7).row(0)[0] != 0);
+}
+
+TEST_CASE("Test integral image", "[integral]") {
+    unsigned seed = 5;
+    GreyscaleImage img(45, 31);
+    for(int y = 0 ; y != img.height() ; ++y) {
+        for(int x = 0 ; x != img.width() ; ++x) {
+            seed = seed * 1103515245 + 12345;
+            img.setPixel(x, y, static_cast<byte>((y % 7) ? seed >> 16 : 255));
+        }
+    }
+    auto check = [](IntegralImage const& table, GreyscaleImage const& image) {
+        for(int y = 0 ; y <= image.height() ; y += 3) {
+            for(int h = 0 ; y + h <= image.height() ; h += 5) {
+                for(int x = 0 ; x <= image.width() ; x += 2) {
+                    for(int w : {0, 1, 8, 17, 45}) {
+                        if(x + w > image.width()) {
+                            continue;
+                        }
+                        uint64_t sum = 0, squares = 0;
+                        for(int py = y ; py != y + h ; ++py) {
+                            for(int px = x ; px != x + w ; ++px) {
+                                sum += image.getPixel(px, py);
+                                squares += image.getPixel(px, py) * image.getPixel(px, py);
+                            }
+                        }
+                        REQUIRE(table.sum({x, y, w, h}) == sum);
+                        REQUIRE(table.sumOfSquares({x, y, w, h}) == squares);
+                        if(w && h) {
+                            double n = w * h, mean = sum / n;
+                            REQUIRE(table.mean({x, y, w, h}) == Approx(mean));
+                            REQUIRE(table.variance({x, y, w, h}) == Approx(squares / n - mean * mean).margin(1e-9));
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    SimdLevel level = simdLevel();
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        ExecutionPolicy policies[] = {{Execution::Sequential, 0, 0}, {Execution::ThreadPool, 3, 0},
+                                      {Execution::WorkStealing, 4, 2}};
+        for(ExecutionPolicy const& policy : policies) {
+            IntegralImage table(img, true, policy);
+            REQUIRE(table.width() == 45);
+            REQUIRE(table.hasSquares());
+            check(table, img);
+
+            // Only scanlines [9, 14) change
+            GreyscaleImage changed(img);
+            for(int y = 9 ; y != 14 ; ++y) {
+                for(int x = 0 ; x != changed.width() ; ++x) {
+                    changed.setPixel(x, y, static_cast<byte>(x * y));
+                }
+            }
+            table.update(changed, 9, 14, policy);
+            check(table, changed);
+            table.update(changed, 30, 31, policy);
+            check(table, changed);
+        }
+    }
+    setSimdLevel(level);
+
+    // Several bands of the minimum height, the last one shorter
+    GreyscaleImage tall(45, 300);
+    tall.transform([](byte) { return byte(201); });
+    tall.setPixel(44, 299, 7);
+    IntegralImage sequential(tall, true), stolen(tall, true, {Execution::WorkStealing, 4, 2});
+    for(int y = 0 ; y <= 300 ; ++y) {
+        for(int x = 0 ; x <= 45 ; ++x) {
+            REQUIRE(stolen.sum({0, 0, x, y}) == sequential.sum({0, 0, x, y}));
+            REQUIRE(stolen.sumOfSquares({0, 0, x, y}) == sequential.sumOfSquares({0, 0, x, y}));
+        }
+    }
+    REQUIRE(stolen.sum({0, 0, 45, 300}) == 201ull * (45 * 300 - 1) + 7);
+
+    IntegralImage region(img.view({3, 4, 20, 10}));
+    REQUIRE(region.sum({0, 0, 20, 10}) == IntegralImage(img).sum({3, 4, 20, 10}));
+    REQUIRE(!region.hasSquares());
+    REQUIRE_THROWS(region.sumOfSquares({0, 0, 1, 1}));
+    REQUIRE_THROWS(region.sum({0, 0, 21, 1}));
+    REQUIRE_THROWS(region.sum({-1, 0, 1, 1}));
+    REQUIRE_THROWS(region.update(img, 0, 1));
+    REQUIRE(std::isnan(region.mean({2, 2, 0, 3})));
+}
+
+TEST_CASE("Test image conversions", "[convert]") {
+    unsigned seed = 11;
+    RGBImage rgb(77, 23);
+    GreyscaleImage grey(77, 23);
+    for(int y = 0 ; y != rgb.height() ; ++y) {
+        for(int x = 0 ; x != rgb.width() ; ++x) {
+            seed = seed * 1103515245 + 12345;
+            RGBTriple p;
+            p.rgbtRed = static_cast<byte>(seed >> 8);
+            p.rgbtGreen = static_cast<byte>(seed >> 16);
+            p.rgbtBlue = static_cast<byte>(seed >> 24);
+            if(y == 3) {
+                p.rgbtRed = p.rgbtGreen = p.rgbtBlue = (x % 2) ? 255 : 0;
+            }
+            rgb.setPixel(x, y, p);
+            grey.setPixel(x, y, static_cast<byte>(seed >> 12));
+        }
+    }
+    BinaryImage binary = threshold(grey, 100);
+
+    SimdLevel level = simdLevel();
+    GreyscaleImage firstLuma(1, 1);
+    for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Ssse3, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        ExecutionPolicy policies[] = {{Execution::Sequential, 0, 0}, {Execution::WorkStealing, 3, 2}};
+        for(ExecutionPolicy const& policy : policies) {
+            GreyscaleImage luma = toGreyscale(rgb, policy);
+            for(int y = 0 ; y != rgb.height() ; ++y) {
+                for(int x = 0 ; x != rgb.width() ; ++x) {
+                    RGBTriple p = rgb.getPixel(x, y);
+                    double expected = 0.2126 * p.rgbtRed + 0.7152 * p.rgbtGreen + 0.0722 * p.rgbtBlue;
+                    REQUIRE(std::abs(luma.getPixel(x, y) - expected) <= 0.51);
+                }
+            }
+            if(l == SimdLevel::Scalar) {
+                firstLuma = luma;
+            }
+            REQUIRE(luma == firstLuma);
+            REQUIRE(threshold(rgb, 128, policy) == threshold(luma, 128));
+
+            for(int t : {-3, 0, 1, 100, 200, 255, 256, 1000}) {
+                BinaryImage b = threshold(grey, t, policy);
+                for(int y = 0 ; y != grey.height() ; ++y) {
+                    for(int x = 0 ; x != grey.width() ; ++x) {
+                        REQUIRE(b.getPixel(x, y) == (grey.getPixel(x, y) >= t));
+                    }
+                }
+            }
+
+            GreyscaleImage expanded = toGreyscale(binary, 20, 230, policy);
+            for(int y = 0 ; y != binary.height() ; ++y) {
+                for(int x = 0 ; x != binary.width() ; ++x) {
+                    REQUIRE(expanded.getPixel(x, y) == (binary.getPixel(x, y) ? 230 : 20));
+                }
+            }
+            REQUIRE(threshold(expanded, 128) == binary);
+            REQUIRE(histogram(grey, policy) == histogram(grey));
+        }
+    }
+    setSimdLevel(level);
+
+    // Regions
+    GreyscaleImage luma = toGreyscale(rgb), expanded = toGreyscale(binary);
+    REQUIRE(toGreyscale(rgb.view({5, 2, 40, 9})).view() == luma.view({5, 2, 40, 9}));
+    REQUIRE(threshold(grey.view({16, 1, 50, 7}), 100).view() == binary.view({16, 1, 50, 7}));
+    REQUIRE(toGreyscale(binary.view({8, 4, 60, 5})).view() == expanded.view({8, 4, 60, 5}));
+
+    // Histograms and Otsu
+    auto counts = histogram(grey);
+    uint64_t total = 0;
+    for(int i = 0 ; i != 256 ; ++i) {
+        total += counts[i];
+    }
+    REQUIRE(total == 77u * 23u);
+    REQUIRE(counts[grey.getPixel(5, 5)] > 0);
+    std::array<uint64_t, 256> bimodal = {};
+    bimodal[40] = 500;
+    bimodal[50] = 300;
+    bimodal[200] = 700;
+    bimodal[210] = 100;
+    REQUIRE(otsuThreshold(bimodal) == 51);
+    bimodal = {};
+    bimodal[90] = 10;
+    REQUIRE(otsuThreshold(bimodal) == 1);
+    GreyscaleImage twoLevels(20, 10);
+    for(int y = 0 ; y != twoLevels.height() ; ++y) {
+        for(int x = 0 ; x != twoLevels.width() ; ++x) {
+            twoLevels.setPixel(x, y, x < 7 ? 60 : 180);
+        }
+    }
+    BinaryImage split = threshold(twoLevels, otsuThreshold(histogram(twoLevels)));
+    REQUIRE(split.getPixel(6, 4) == false);
+    REQUIRE(split.getPixel(7, 4) == true);
+
+    // Conversions on load
+    std::vector<byte> buffer;
+    rgb.save(buffer, ImageFormat::Bmp);
+    REQUIRE(GreyscaleImage::load(buffer.data(), buffer.size()) == toGreyscale(rgb));
+    REQUIRE(BinaryImage::load(buffer.data(), buffer.size()) == threshold(rgb, 128));
+    REQUIRE(BinaryImage::load(buffer.data(), buffer.size(), 90) == threshold(rgb, 90));
+    grey.save(buffer, ImageFormat::Bmp);
+    REQUIRE(BinaryImage::load(buffer.data(), buffer.size(), 100) == binary);
+
+    // 8 bit bitmaps with a colour palette are converted through the palette.
+    // The palette of the saved bitmap follows its 54 byte header.
+    RGBImage colours(grey.width(), grey.height());
+    for(int i = 0 ; i != 256 ; ++i) {
+        byte* entry = &buffer[54 + 4 * i];
+        entry[0] = static_cast<byte>(255 - i);
+        entry[1] = static_cast<byte>(i / 2);
+        entry[2] = static_cast<byte>(i);
+    }
+    for(int y = 0 ; y != grey.height() ; ++y) {
+        for(int x = 0 ; x != grey.width() ; ++x) {
+            const byte i = grey.getPixel(x, y);
+            RGBTriple p;
+            p.rgbtBlue = static_cast<byte>(255 - i);
+            p.rgbtGreen = static_cast<byte>(i / 2);
+            p.rgbtRed = i;
+            colours.setPixel(x, y, p);
+        }
+    }
+    REQUIRE(GreyscaleImage::load(buffer.data(), buffer.size()) == toGreyscale(colours));
+    REQUIRE(BinaryImage::load(buffer.data(), buffer.size()) == threshold(colours, 128));
+}
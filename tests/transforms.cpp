@@ -1,6 +1,7 @@
 #include <catch.hpp>
 #include "image.h"
 #include <iostream>
+#include <cstdio>
 
 TEST_CASE("Dead reckoning signed distance transform 3x3", "[]") {
     auto testImg = BinaryImage::load("test-deadreckoning.bmp");
@@ -17,4 +18,701 @@ TEST_CASE("Dead reckoning signed distance transform 3x3", "[]") {
         }
     }
     transformed.save("test-deadreckoning-result.png", ImageFormat::Png);
+    std::remove("test-deadreckoning-result.png");
+    // A region gives the same result as a copy of its pixels
+    auto region = testImg.view({8, 3, testImg.width() - 16, testImg.height() - 5});
+    BinaryImage copy(region.width(), region.height());
+    copy.blit({0, 0}, region);
+    REQUIRE(deadReckoning3x3(region, true) == copy.deadReckoning3x3(true));
+}
+
+TEST_CASE("Exact signed distance transform", "[]") {
+    BinaryImage img(37, 23);
+    unsigned seed = 12345;
+    for(int y = 0 ; y != img.height() ; ++y) {
+        for(int x = 0 ; x != img.width() ; ++x) {
+            seed = seed * 1103515245 + 12345;
+            img.setPixel(x, y, ((seed >> 16) % 7) == 0 || (x > 10 && x < 20 && y > 5 && y < 15));
+        }
+    }
+    for(bool symmetry : {false, true}) {
+        auto transformed = img.distanceTransform(symmetry, 1);
+        REQUIRE(transformed == img.distanceTransform(symmetry, 4));
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != img.width() ; ++x) {
+                // Brute force distance to the nearest seed
+                float best = 1e9f;
+                for(int sy = 0 ; sy != img.height() ; ++sy) {
+                    for(int sx = 0 ; sx != img.width() ; ++sx) {
+                        if(img.isImmediateInterior(sx, sy) || (symmetry && img.isImmediateExterior(sx, sy))) {
+                            float dx = x - sx, dy = y - sy;
+                            best = std::min(best, std::sqrt(dx*dx + dy*dy));
+                        }
+                    }
+                }
+                int expected = img.getPixel(x, y) ? 128 + std::lround(std::min(best, 127.f))
+                                                  : 128 - std::lround(std::min(best, 128.f));
+                REQUIRE(transformed.getPixel(x, y) == expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("Floating point signed distance transforms", "[]") {
+    auto testImg = BinaryImage::load("test-deadreckoning.bmp");
+    FloatImage exact(testImg.width(), testImg.height());
+    FloatImage reckoned(testImg.width(), testImg.height());
+    testImg.distanceTransform(exact, true);
+    testImg.deadReckoning3x3(reckoned, true);
+    auto exactBytes = testImg.distanceTransform(true);
+    for(int y = 0 ; y != testImg.height() ; ++y) {
+        for(int x = 0 ; x != testImg.width() ; ++x) {
+            float d = exact.getPixel(x, y);
+            REQUIRE((testImg.getPixel(x, y) ? d >= 0 : d <= 0));
+            REQUIRE(exactBytes.getPixel(x, y) == 128 + std::lround(clamp(-128.f, 127.f, d)));
+            // Dead reckoning never underestimates the distance to the boundary
+            float r = reckoned.getPixel(x, y);
+            if(std::isfinite(r)) {
+                REQUIRE(std::abs(r) + 1e-4f >= std::abs(d));
+            }
+        }
+    }
+    // An output sharing its pixels with a copy is detached once, before the
+    // threads write into it
+    FloatImage sequential(testImg.width(), testImg.height());
+    testImg.distanceTransform(sequential, true, 1);
+    for(int i = 0 ; i != 20 ; ++i) {
+        FloatImage shared(testImg.width(), testImg.height());
+        FloatImage keep(shared);
+        testImg.distanceTransform(shared, true, 8);
+        REQUIRE(shared == sequential);
+        REQUIRE(keep.getPixel(0, 0) == 0.f);
+    }
+    FloatImage wrongSize(1, 1);
+    REQUIRE_THROWS(testImg.distanceTransform(wrongSize));
+}
+
+TEST_CASE("Packed binary image kernels", "[binary]") {
+    unsigned seed = 42;
+    for(int width : {1, 7, 63, 64, 65, 130}) {
+        BinaryImage img(width, 9);
+        long long expectedCount = 0;
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != width ; ++x) {
+                seed = seed * 1103515245 + 12345;
+                bool pixel = ((seed >> 16) % 3) == 0 && y > 1;
+                img.setPixel(x, y, pixel);
+                expectedCount += pixel;
+            }
+        }
+        REQUIRE(img.count() == expectedCount);
+
+        auto interior = img.immediateInterior();
+        auto exterior = img.immediateExterior();
+        int xMin = width - 1, xMax = 0, yMin = img.height() - 1, yMax = 0;
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != width ; ++x) {
+                REQUIRE(interior.getPixel(x, y) == img.isImmediateInterior(x, y));
+                REQUIRE(exterior.getPixel(x, y) == img.isImmediateExterior(x, y));
+                if(img.getPixel(x, y)) {
+                    xMin = std::min(xMin, x);
+                    xMax = std::max(xMax, x);
+                    yMin = std::min(yMin, y);
+                    yMax = std::max(yMax, y);
+                }
+            }
+        }
+        REQUIRE(img.getAABB(false) == Rect({xMin, yMin, xMax - xMin, yMax - yMin}));
+
+        auto flipped(img);
+        flipped.flipX();
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != width ; ++x) {
+                REQUIRE(flipped.getPixel(width - x - 1, y) == img.getPixel(x, y));
+            }
+        }
+        flipped.flipX();
+        REQUIRE(flipped == img);
+    }
+}
+
+TEST_CASE("Tiled out-of-core distance transform", "[]") {
+    // Shapes further apart than the margin of the tiles, and a shape larger
+    // than the clamped output range
+    BinaryImage img(421, 390);
+    for(int y = 0 ; y != img.height() ; ++y) {
+        for(int x = 0 ; x != img.width() ; ++x) {
+            long long dx = x - 60, dy = y - 70;
+            bool disc = dx * dx + dy * dy < 400;
+            bool block = x > 150 && x < 415 && y > 100 && y < 389;
+            img.setPixel(x, y, disc || (block && (x * 7 + y * 3) % 97 != 0));
+        }
+    }
+    img.save("test-tiled-input.bmp", ImageFormat::Bmp);
+    for(bool symmetry : {false, true}) {
+        for(int tileSize : {64, 1024}) {
+            BinaryImage::distanceTransformFile("test-tiled-input.bmp", "test-tiled-result.bmp",
+                                               symmetry, tileSize, 3);
+            REQUIRE(GreyscaleImage::load("test-tiled-result.bmp") == img.distanceTransform(symmetry));
+        }
+    }
+    REQUIRE_THROWS(BinaryImage::distanceTransformFile("test-tiled-result.bmp", "test-tiled-error.bmp"));
+    for(const char* name : {"test-tiled-input.bmp", "test-tiled-result.bmp", "test-tiled-error.bmp"}) {
+        std::remove(name);
+    }
+}
+
+TEST_CASE("Separable resize", "[resize]") {
+    GreyscaleImage grey(50, 37);
+    RGBImage rgb(23, 41);
+    for(int y = 0 ; y != grey.height() ; ++y) {
+        for(int x = 0 ; x != grey.width() ; ++x) {
+            grey.setPixel(x, y, static_cast<byte>((x * 13 + y * 7) % 256));
+        }
+    }
+    for(int y = 0 ; y != rgb.height() ; ++y) {
+        for(int x = 0 ; x != rgb.width() ; ++x) {
+            rgb.setPixel(x, y, {static_cast<byte>(x * 11), static_cast<byte>(y * 5), 77});
+        }
+    }
+
+    // Uniform images stay uniform whatever the filter and the scale
+    for(auto filter : {ResizeFilter::Nearest, ResizeFilter::Bilinear, ResizeFilter::Lanczos3}) {
+        for(auto size : {std::make_pair(1, 1), std::make_pair(7, 300), std::make_pair(200, 9)}) {
+            auto constant = grey;
+            constant.transform([](byte) { return byte(201); });
+            auto resized = constant.resize(size.first, size.second, filter);
+            REQUIRE(resized.width() == size.first);
+            REQUIRE(resized.height() == size.second);
+            Rect box;
+            REQUIRE(!resized.getAABB(201, box));
+            auto blue = rgb.resize(size.first, size.second, filter);
+            for(int x = 0 ; x != size.first ; ++x) {
+                REQUIRE(blue.getPixel(x, size.second - 1).rgbtRed == 77);
+            }
+        }
+    }
+
+    // Halving with the stretched triangle filter weights 4x4 blocks with
+    // [1 3 3 1] / 8, like the binomial pyramid filter away from the edges
+    auto even = grey.view({0, 0, 50, 36});
+    auto half = resize(even, 25, 18);
+    ImagePyramid<byte> pyramid(even, PyramidFilter::Binomial);
+    for(int y = 1 ; y != 17 ; ++y) {
+        for(int x = 1 ; x != 24 ; ++x) {
+            REQUIRE(std::abs(half.getPixel(x, y) - pyramid.level(1).row(y)[x]) <= 1);
+        }
+    }
+
+    // Nearest upsampling by an integer factor is undone by nearest downsampling
+    auto big = grey.resize(200, 148, ResizeFilter::Nearest);
+    REQUIRE(big.getPixel(7, 9) == grey.getPixel(1, 2));
+    REQUIRE(big.resize(50, 37, ResizeFilter::Nearest) == grey);
+    BinaryImage mask(30, 20);
+    mask.setPixel(3, 4, true);
+    auto bigMask = mask.resize(90, 60, ResizeFilter::Nearest);
+    REQUIRE(bigMask.count() == 9);
+    REQUIRE(bigMask.getPixel(10, 13));
+    REQUIRE_THROWS(mask.resize(10, 10));
+    REQUIRE_THROWS(grey.resize(0, 10));
+
+    // Same results on every SIMD level and execution policy, up to rounding
+    FloatImage ramp(64, 3);
+    ramp.transform([](float) { return 0.f; });
+    for(int x = 0 ; x != 64 ; ++x) {
+        ramp.setPixel(x, 1, x * 0.5f);
+    }
+    auto level = simdLevel();
+    setSimdLevel(SimdLevel::Scalar);
+    auto reference = grey.resize(133, 11, ResizeFilter::Lanczos3);
+    auto rampReference = ramp.resize(256, 3, ResizeFilter::Lanczos3);
+    for(auto l : {SimdLevel::Sse2, SimdLevel::Avx2}) {
+        setSimdLevel(l);
+        const ExecutionPolicy policies[] = {{}, {Execution::ThreadPool, 3}, {Execution::WorkStealing, 2, 1}};
+        for(auto const& policy : policies) {
+            auto resized = grey.resize(133, 11, ResizeFilter::Lanczos3, policy);
+            for(int y = 0 ; y != 11 ; ++y) {
+                for(int x = 0 ; x != 133 ; ++x) {
+                    REQUIRE(std::abs(resized.getPixel(x, y) - reference.getPixel(x, y)) <= 1);
+                }
+            }
+            auto rampResized = ramp.resize(256, 3, ResizeFilter::Lanczos3, policy);
+            for(int x = 0 ; x != 256 ; ++x) {
+                REQUIRE(std::abs(rampResized.getPixel(x, 1) - rampReference.getPixel(x, 1)) < 1e-3f);
+            }
+        }
+    }
+    setSimdLevel(level);
+    // Lanczos reproduces linear ramps away from the edges
+    for(int x = 24 ; x != 232 ; ++x) {
+        REQUIRE(std::abs(rampReference.getPixel(x, 1) - (x + 0.5f) / 4 * 0.5f + 0.25f) < 0.01f);
+    }
+}
+
+TEST_CASE("Glyph atlas", "[atlas]") {
+    unsigned seed = 7;
+    auto next = [&seed](int n) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) % n);
+    };
+    std::vector<BinaryImage> glyphs;
+    for(int i = 0 ; i != 40 ; ++i) {
+        BinaryImage glyph(1 + next(40), 1 + next(30));
+        for(int y = 0 ; y != glyph.height() ; ++y) {
+            for(int x = 0 ; x != glyph.width() ; ++x) {
+                int dx = 2 * x - glyph.width(), dy = 2 * y - glyph.height();
+                glyph.setPixel(x, y, dx * dx + dy * dy < glyph.width() * glyph.height() / 2 || next(9) == 0);
+            }
+        }
+        glyphs.push_back(glyph);
+    }
+    // A glyph taken from a region of a larger image
+    BinaryImage sheet(64, 32);
+    for(int y = 0 ; y != sheet.height() ; ++y) {
+        for(int x = 0 ; x != sheet.width() ; ++x) {
+            sheet.setPixel(x, y, (x / 5 + y / 3) % 2 == 0);
+        }
+    }
+    BinaryImage region(21, 13);
+    for(int y = 0 ; y != region.height() ; ++y) {
+        for(int x = 0 ; x != region.width() ; ++x) {
+            region.setPixel(x, y, sheet.getPixel(16 + x, 5 + y));
+        }
+    }
+    std::vector<ImageView<bool>> views(glyphs.begin(), glyphs.end());
+    views.push_back(sheet.view({16, 5, 21, 13}));
+    glyphs.push_back(region);
+
+    for(int padding : {0, 2}) {
+        std::vector<Rect> rects;
+        for(auto const& glyph : glyphs) {
+            rects.push_back({-1, -1, glyph.width(), glyph.height()});
+        }
+        int height = packRects(rects, 100, padding);
+        int top = 0;
+        for(size_t i = 0 ; i != rects.size() ; ++i) {
+            REQUIRE(rects[i].width == glyphs[i].width());
+            REQUIRE(rects[i].x >= 0);
+            REQUIRE(rects[i].y >= 0);
+            REQUIRE(rects[i].x + rects[i].width <= 100);
+            top = std::max(top, rects[i].y + rects[i].height);
+            for(size_t j = 0 ; j != i ; ++j) {
+                Rect const& a = rects[i];
+                Rect const& b = rects[j];
+                REQUIRE((a.x + a.width + padding <= b.x || b.x + b.width + padding <= a.x ||
+                         a.y + a.height + padding <= b.y || b.y + b.height + padding <= a.y));
+            }
+        }
+        REQUIRE(height == top);
+    }
+    std::vector<Rect> empty{{0, 0, 0, 5}};
+    REQUIRE(packRects(empty, 10) == 0);
+    std::vector<Rect> tooWide{{0, 0, 11, 5}};
+    REQUIRE_THROWS(packRects(tooWide, 10));
+
+    AtlasOptions options;
+    options.width = 128;
+    options.symmetry = true;
+    GlyphAtlas atlas = buildGlyphAtlas(views, options);
+    REQUIRE(atlas.image.width() == 128);
+    REQUIRE(atlas.placements.size() == glyphs.size());
+    BinaryImage covered(atlas.image.width(), atlas.image.height());
+    for(size_t i = 0 ; i != glyphs.size() ; ++i) {
+        Rect const& r = atlas.placements[i];
+        REQUIRE(atlas.image.view(r) == glyphs[i].deadReckoning3x3(true).view());
+        for(int y = r.y ; y != r.y + r.height ; ++y) {
+            for(int x = r.x ; x != r.x + r.width ; ++x) {
+                covered.setPixel(x, y, true);
+            }
+        }
+    }
+    for(int y = 0 ; y != atlas.image.height() ; ++y) {
+        for(int x = 0 ; x != atlas.image.width() ; ++x) {
+            if(!covered.getPixel(x, y)) {
+                REQUIRE(atlas.image.getPixel(x, y) == 0);
+            }
+        }
+    }
+    for(Execution mode : {Execution::Sequential, Execution::ThreadPool}) {
+        options.policy = {mode, 3, 0};
+        GlyphAtlas other = buildGlyphAtlas(views, options);
+        REQUIRE(other.placements == atlas.placements);
+        REQUIRE(other.image == atlas.image);
+    }
+    options.width = 16;
+    REQUIRE_THROWS(buildGlyphAtlas(views, options));
+}
+
+TEST_CASE("Binary morphology", "[morphology]") {
+    unsigned seed = 99;
+    BinaryImage img(130, 41);
+    for(int y = 0 ; y != img.height() ; ++y) {
+        for(int x = 0 ; x != img.width() ; ++x) {
+            seed = seed * 1103515245 + 12345;
+            int dx = x - 90, dy = y - 20;
+            img.setPixel(x, y, ((seed >> 16) % 5) == 0 || dx * dx + dy * dy < 300 || (x > 10 && x < 40 && y > 8));
+        }
+    }
+    // Pixels outside of the image are set for erosion and unset for dilation
+    auto reference = [&img](int radius, StructuringElement element, bool erode) {
+        BinaryImage out(img.width(), img.height());
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != img.width() ; ++x) {
+                bool found = false;
+                for(int dy = -radius ; dy <= radius && !found ; ++dy) {
+                    for(int dx = -radius ; dx <= radius && !found ; ++dx) {
+                        int sx = x + dx, sy = y + dy;
+                        if((element == StructuringElement::Disc && dx * dx + dy * dy > radius * radius) ||
+                           sx < 0 || sy < 0 || sx >= img.width() || sy >= img.height()) {
+                            continue;
+                        }
+                        found = img.getPixel(sx, sy) != erode;
+                    }
+                }
+                out.setPixel(x, y, found != erode);
+            }
+        }
+        return out;
+    };
+    for(StructuringElement element : {StructuringElement::Square, StructuringElement::Disc}) {
+        for(int radius : {0, 1, 2, 5, 32, 33, 70}) {
+            BinaryImage eroded = img.erode(radius, element);
+            BinaryImage dilated = img.dilate(radius, element);
+            REQUIRE(eroded == reference(radius, element, true));
+            REQUIRE(dilated == reference(radius, element, false));
+            for(Execution mode : {Execution::ThreadPool, Execution::WorkStealing}) {
+                ExecutionPolicy policy{mode, 3, 4};
+                REQUIRE(img.erode(radius, element, policy) == eroded);
+                REQUIRE(img.dilate(radius, element, policy) == dilated);
+            }
+            BinaryImage opened = img.open(radius, element);
+            BinaryImage closed = img.close(radius, element);
+            REQUIRE(opened == eroded.dilate(radius, element));
+            REQUIRE(closed == dilated.erode(radius, element));
+            for(int y = 0 ; y != img.height() ; ++y) {
+                for(int x = 0 ; x != img.width() ; ++x) {
+                    REQUIRE((!opened.getPixel(x, y) || img.getPixel(x, y)));
+                    REQUIRE((!img.getPixel(x, y) || closed.getPixel(x, y)));
+                }
+            }
+        }
+    }
+    REQUIRE_THROWS(img.erode(-1));
+}
+
+TEST_CASE("Connected component labelling", "[components]") {
+    unsigned seed = 2024;
+    BinaryImage img(150, 70);
+    for(int y = 0 ; y != img.height() ; ++y) {
+        for(int x = 0 ; x != img.width() ; ++x) {
+            seed = seed * 1103515245 + 12345;
+            int dx = x - 100, dy = y - 35;
+            bool ring = dx * dx + dy * dy < 900 && dx * dx + dy * dy > 400;
+            img.setPixel(x, y, ring || ((seed >> 16) % 3) == 0);
+        }
+    }
+    for(Connectivity connectivity : {Connectivity::Four, Connectivity::Eight}) {
+        // Flood fill from the first unlabelled pixel, in scanline order
+        std::vector<uint32_t> expected(img.width() * img.height(), 0);
+        std::vector<ComponentStats> expectedStats;
+        for(int y = 0 ; y != img.height() ; ++y) {
+            for(int x = 0 ; x != img.width() ; ++x) {
+                if(!img.getPixel(x, y) || expected[y * img.width() + x]) {
+                    continue;
+                }
+                uint32_t label = static_cast<uint32_t>(expectedStats.size() + 1);
+                ComponentStats stats{{x, y, 1, 1}, 0, 0, 0};
+                int x1 = x + 1, y1 = y + 1;
+                std::vector<ImageCoords> stack{{x, y}};
+                expected[y * img.width() + x] = label;
+                while(!stack.empty()) {
+                    ImageCoords p = stack.back();
+                    stack.pop_back();
+                    ++stats.count;
+                    stats.centroidX += p.x;
+                    stats.centroidY += p.y;
+                    stats.box.x = std::min(stats.box.x, p.x);
+                    stats.box.y = std::min(stats.box.y, p.y);
+                    x1 = std::max(x1, p.x + 1);
+                    y1 = std::max(y1, p.y + 1);
+                    for(int ny = p.y - 1 ; ny <= p.y + 1 ; ++ny) {
+                        for(int nx = p.x - 1 ; nx <= p.x + 1 ; ++nx) {
+                            bool diagonal = nx != p.x && ny != p.y;
+                            if(nx < 0 || ny < 0 || nx >= img.width() || ny >= img.height() ||
+                               (diagonal && connectivity == Connectivity::Four) ||
+                               !img.getPixel(nx, ny) || expected[ny * img.width() + nx]) {
+                                continue;
+                            }
+                            expected[ny * img.width() + nx] = label;
+                            stack.push_back({nx, ny});
+                        }
+                    }
+                }
+                stats.box.width = x1 - stats.box.x;
+                stats.box.height = y1 - stats.box.y;
+                stats.centroidX /= stats.count;
+                stats.centroidY /= stats.count;
+                expectedStats.push_back(stats);
+            }
+        }
+        REQUIRE(expectedStats.size() > 100);
+
+        ExecutionPolicy policies[] = {{Execution::Sequential, 0, 0}, {Execution::ThreadPool, 3, 0},
+                                      {Execution::WorkStealing, 4, 1}, {Execution::WorkStealing, 2, 5}};
+        for(ExecutionPolicy const& policy : policies) {
+            auto components = labelComponents<uint32_t>(img, connectivity, policy);
+            auto components16 = labelComponents<uint16_t>(img, connectivity, policy);
+            REQUIRE(components.stats.size() == expectedStats.size());
+            for(size_t i = 0 ; i != expectedStats.size() ; ++i) {
+                REQUIRE(components.stats[i].box == expectedStats[i].box);
+                REQUIRE(components.stats[i].count == expectedStats[i].count);
+                REQUIRE(components.stats[i].centroidX == Approx(expectedStats[i].centroidX));
+                REQUIRE(components.stats[i].centroidY == Approx(expectedStats[i].centroidY));
+                REQUIRE(components16.stats[i].box == expectedStats[i].box);
+            }
+            for(int y = 0 ; y != img.height() ; ++y) {
+                for(int x = 0 ; x != img.width() ; ++x) {
+                    REQUIRE(components.labels.getPixel(x, y) == expected[y * img.width() + x]);
+                    REQUIRE(components16.labels.getPixel(x, y) == expected[y * img.width() + x]);
+                }
+            }
+        }
+    }
+
+    // Labels of the region of a view are relative to the view
+    auto region = labelComponents<uint32_t>(img.view({64, 10, 30, 20}));
+    REQUIRE(region.labels.width() == 30);
+    for(auto const& stats : region.stats) {
+        REQUIRE(stats.box.x >= 0);
+        REQUIRE(stats.box.y >= 0);
+        REQUIRE(stats.box.x + stats.box.width <= 30);
+        REQUIRE(stats.box.y + stats.box.height <= 20);
+    }
+
+    // 65536 isolated pixels do not fit 16 bit labels
+    BinaryImage dots(512, 512);
+    for(int y = 0 ; y < 512 ; y += 2) {
+        for(int x = 0 ; x < 512 ; x += 2) {
+            dots.setPixel(x, y, true);
+        }
+    }
+    REQUIRE(labelComponents<uint32_t>(dots).stats.size() == 65536);
+    REQUIRE_THROWS(labelComponents<uint16_t>(dots));
+}
+
+TEST_CASE("Convolution", "[convolve]") {
+    unsigned seed = 3;
+    GreyscaleImage grey(53, 29);
+    RGBImage rgb(37, 21);
+    FloatImage fl(41, 17);
+    auto next = [&]() {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<byte>(seed >> 16);
+    };
+    for(int y = 0 ; y != grey.height() ; ++y) {
+        for(int x = 0 ; x != grey.width() ; ++x) {
+            grey.setPixel(x, y, next());
+        }
+    }
+    for(int y = 0 ; y != rgb.height() ; ++y) {
+        for(int x = 0 ; x != rgb.width() ; ++x) {
+            RGBTriple p;
+            p.rgbtRed = next();
+            p.rgbtGreen = next();
+            p.rgbtBlue = next();
+            rgb.setPixel(x, y, p);
+        }
+    }
+    for(int y = 0 ; y != fl.height() ; ++y) {
+        for(int x = 0 ; x != fl.width() ; ++x) {
+            fl.setPixel(x, y, next() / 16.f - 4.f);
+        }
+    }
+
+    // Brute force reference, kernel rows applying to increasing scanlines
+    auto index = [](int i, int n, BorderMode border) {
+        while(i < 0 || i >= n) {
+            switch(border) {
+                case BorderMode::Clamp:
+                    i = i < 0 ? 0 : n - 1;
+                    break;
+                case BorderMode::Wrap:
+                    i = i < 0 ? i + n : i - n;
+                    break;
+                case BorderMode::Mirror:
+                    i = n == 1 ? 0 : i < 0 ? -i : 2 * n - 2 - i;
+                    break;
+                case BorderMode::Constant:
+                    return -1;
+            }
+        }
+        return i;
+    };
+    auto reference = [&](std::function<double(int, int)> pixel, int width, int height, int x, int y,
+                         std::vector<float> const& kernel, int kernelWidth, BorderMode border, double constant) {
+        const int kernelHeight = static_cast<int>(kernel.size()) / kernelWidth;
+        double sum = 0;
+        for(int ky = 0 ; ky != kernelHeight ; ++ky) {
+            for(int kx = 0 ; kx != kernelWidth ; ++kx) {
+                int sx = index(x + kx - kernelWidth / 2, width, border);
+                int sy = index(y + ky - kernelHeight / 2, height, border);
+                double v = (sx < 0 || sy < 0) ? constant : pixel(sx, sy);
+                sum += kernel[ky * kernelWidth + kx] * v;
+            }
+        }
+        return sum;
+    };
+    auto outer = [](std::vector<float> const& h, std::vector<float> const& v) {
+        std::vector<float> kernel;
+        for(float a : v) {
+            for(float b : h) {
+                kernel.push_back(a * b);
+            }
+        }
+        return kernel;
+    };
+    auto clampByte = [](double v) {
+        return std::min(255., std::max(0., v));
+    };
+
+    const std::vector<float> smooth = {0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f};
+    const std::vector<float> derivative = {-0.5f, 0.f, 0.5f};
+    const std::vector<float> sharpen = {-1.f, 3.f, -1.f};
+    const std::vector<float> wide = gaussianKernel(20.f);
+    const BorderMode borders[] = {BorderMode::Clamp, BorderMode::Wrap, BorderMode::Mirror, BorderMode::Constant};
+
+    SimdLevel level = simdLevel();
+    for(BorderMode border : borders) {
+        std::vector<std::pair<std::vector<float>, std::vector<float>>> kernels = {
+            {smooth, smooth}, {derivative, smooth}, {sharpen, sharpen}, {{1.f}, wide}, {wide, {1.f}}};
+        for(auto const& k : kernels) {
+            const std::vector<float> full = outer(k.first, k.second);
+            const int fullWidth = static_cast<int>(k.first.size());
+            GreyscaleImage greyFirst(1, 1);
+            for(auto l : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+                setSimdLevel(l);
+                ExecutionPolicy policies[] = {{Execution::Sequential, 0, 0}, {Execution::WorkStealing, 3, 2}};
+                for(ExecutionPolicy const& policy : policies) {
+                    GreyscaleImage g = convolve(grey.view(), k.first, k.second, border, 30.f, policy);
+                    if(l == SimdLevel::Scalar && policy.mode == Execution::Sequential) {
+                        greyFirst = g;
+                        for(int y = 0 ; y != grey.height() ; ++y) {
+                            for(int x = 0 ; x != grey.width() ; ++x) {
+                                double e = reference([&](int px, int py) { return grey.getPixel(px, py); },
+                                                     grey.width(), grey.height(), x, y, full, fullWidth, border, 30);
+                                REQUIRE(std::abs(g.getPixel(x, y) - clampByte(e)) <= 1);
+                            }
+                        }
+                    }
+                    REQUIRE(g == greyFirst);
+                }
+            }
+            setSimdLevel(level);
+
+            RGBImage c = rgb.convolve(k.first, k.second, border, 200.f);
+            for(int y = 0 ; y != rgb.height() ; ++y) {
+                for(int x = 0 ; x != rgb.width() ; ++x) {
+                    double e = reference([&](int px, int py) { return rgb.getPixel(px, py).rgbtGreen; },
+                                         rgb.width(), rgb.height(), x, y, full, fullWidth, border, 200);
+                    REQUIRE(std::abs(c.getPixel(x, y).rgbtGreen - clampByte(e)) <= 1);
+                }
+            }
+            FloatImage f = fl.convolve(k.first, k.second, border, -2.f, {Execution::ThreadPool, 2, 0});
+            for(int y = 0 ; y != fl.height() ; ++y) {
+                for(int x = 0 ; x != fl.width() ; ++x) {
+                    double e = reference([&](int px, int py) { return fl.getPixel(px, py); },
+                                         fl.width(), fl.height(), x, y, full, fullWidth, border, -2);
+                    REQUIRE(f.getPixel(x, y) == Approx(e).margin(1e-4));
+                }
+            }
+        }
+
+        // Non-separable kernel, of a size other than a square
+        const std::vector<float> kernel = {0.1f, -0.2f, 0.3f, 0.f, 0.5f, 0.25f, -0.1f, 0.2f, 0.05f, 0.1f,
+                                           0.f, 0.2f, 0.4f, -0.3f, 0.1f};
+        GreyscaleImage g = grey.convolve2D(kernel, 5, border, 10.f, {Execution::WorkStealing, 2, 3});
+        for(int y = 0 ; y != grey.height() ; ++y) {
+            for(int x = 0 ; x != grey.width() ; ++x) {
+                double e = reference([&](int px, int py) { return grey.getPixel(px, py); },
+                                     grey.width(), grey.height(), x, y, kernel, 5, border, 10);
+                REQUIRE(std::abs(g.getPixel(x, y) - clampByte(e)) <= 1);
+            }
+        }
+
+        // Box filters, radii larger than the image included
+        for(int radius : {0, 1, 4, 30}) {
+            const std::vector<float> box(2 * radius + 1, 1.f / (2 * radius + 1));
+            const std::vector<float> full = outer(box, box);
+            GreyscaleImage b = boxFilter(grey.view(), radius, border, 90.f, {Execution::ThreadPool, 3, 0});
+            for(int y = 0 ; y != grey.height() ; ++y) {
+                for(int x = 0 ; x != grey.width() ; ++x) {
+                    double e = reference([&](int px, int py) { return grey.getPixel(px, py); },
+                                         grey.width(), grey.height(), x, y, full, 2 * radius + 1, border, 90);
+                    REQUIRE(std::abs(b.getPixel(x, y) - e) <= 0.51);
+                }
+            }
+            FloatImage fb = fl.boxFilter(radius, border, 1.f);
+            for(int y = 0 ; y < fl.height() ; y += 3) {
+                for(int x = 0 ; x != fl.width() ; ++x) {
+                    double e = reference([&](int px, int py) { return fl.getPixel(px, py); },
+                                         fl.width(), fl.height(), x, y, full, 2 * radius + 1, border, 1);
+                    REQUIRE(fb.getPixel(x, y) == Approx(e).margin(1e-4));
+                }
+            }
+        }
+    }
+    setSimdLevel(level);
+
+    // Regions read their neighbours
+    GreyscaleImage whole = grey.convolve(smooth, smooth);
+    GreyscaleImage region = convolve(grey.view({10, 5, 20, 12}), smooth, smooth, BorderMode::Constant, 0.f);
+    REQUIRE(region.getPixel(0, 0) != whole.getPixel(10, 5));
+    REQUIRE(region.view({2, 2, 16, 8}) == whole.view({12, 7, 16, 8}));
+
+    // Gaussians: flat areas stay flat, and the box chain of large
+    // deviations has the variance of the Gaussian
+    GreyscaleImage flat(64, 48);
+    for(int y = 0 ; y != flat.height() ; ++y) {
+        for(int x = 0 ; x != flat.width() ; ++x) {
+            flat.setPixel(x, y, 77);
+        }
+    }
+    for(float sigma : {0.5f, 3.f, 7.5f, 12.f}) {
+        REQUIRE(flat.gaussianBlur(sigma) == flat);
+        REQUIRE(gaussianBlur(flat.view(), sigma, BorderMode::Constant, 77.f) == flat);
+    }
+    for(float sigma : {2.5f, 6.3f, 12.5f, 16.f}) {
+        FloatImage impulse(121, 121);
+        for(int y = 0 ; y != impulse.height() ; ++y) {
+            for(int x = 0 ; x != impulse.width() ; ++x) {
+                impulse.setPixel(x, y, (x == 60 && y == 60) ? 1.f : 0.f);
+            }
+        }
+        FloatImage blurred = impulse.gaussianBlur(sigma, BorderMode::Constant);
+        double sum = 0, varianceX = 0, varianceY = 0;
+        for(int y = 0 ; y != 121 ; ++y) {
+            for(int x = 0 ; x != 121 ; ++x) {
+                double v = blurred.getPixel(x, y);
+                sum += v;
+                varianceX += v * (x - 60) * (x - 60);
+                varianceY += v * (y - 60) * (y - 60);
+            }
+        }
+        REQUIRE(sum == Approx(1.).epsilon(1e-4));
+        REQUIRE(varianceX == Approx(sigma * sigma).epsilon(0.1));
+        REQUIRE(varianceY == Approx(sigma * sigma).epsilon(0.1));
+        REQUIRE(blurred.getPixel(60, 60) == Approx(1. / (2 * M_PI * sigma * sigma)).epsilon(0.15));
+    }
+    const std::vector<float> k = gaussianKernel(1.f);
+    REQUIRE(k.size() == 7u);
+    REQUIRE(k[3] > k[2]);
+    REQUIRE(k[2] == Approx(k[4]));
+
+    REQUIRE_THROWS(grey.convolve(std::vector<float>(2, 1.f), std::vector<float>(1, 1.f)));
+    REQUIRE_THROWS(grey.convolve({1.f}, std::vector<float>()));
+    REQUIRE_THROWS(grey.convolve2D(std::vector<float>(6, 1.f), 3));
+    REQUIRE_THROWS(grey.convolve2D(std::vector<float>(9, 1.f), 2));
+    REQUIRE_THROWS(grey.boxFilter(-1));
+    REQUIRE_THROWS(grey.gaussianBlur(0.f));
+    REQUIRE_THROWS(grey.gaussianBlur(-5.f));
 }